@@ -1,13 +1,137 @@
 #include "vk_engine.h"
 
-int main() {
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char *argv[]) {
     VulkanEngine engine;
+    bool transformBenchmark = false;
+
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc){
+            engine._framesInFlight = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--headless") == 0){
+            engine._headless = true;
+        } else if (strcmp(argv[i], "--images") == 0 && i + 1 < argc){
+            engine._headlessImageCount = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc){
+            const char *size = argv[++i];
+            if (sscanf(size, "%ux%u", &engine._windowExtent.width, &engine._windowExtent.height) != 2 ||
+                engine._windowExtent.width == 0 || engine._windowExtent.height == 0){
+                printf("INVALID SIZE %s, EXPECTED WIDTHxHEIGHT\n", size);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc){
+            engine._frameLimit = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc){
+            engine._benchmarkFrames = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--benchmark-seconds") == 0 && i + 1 < argc){
+            engine._benchmarkSeconds = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--benchmark-out") == 0 && i + 1 < argc){
+            engine._benchmarkOutput = argv[++i];
+        } else if (strcmp(argv[i], "--pipeline-cache") == 0 && i + 1 < argc){
+            engine._pipelineCachePath = argv[++i];
+        } else if (strcmp(argv[i], "--no-pipeline-cache") == 0){
+            engine._pipelineCachePath.clear();
+        } else if (strcmp(argv[i], "--pipeline-threads") == 0 && i + 1 < argc){
+            engine._pipelineThreads = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc){
+            engine._scene = argv[++i];
+        } else if (strcmp(argv[i], "--camera") == 0){
+            engine._cameraTransforms = true;
+        } else if (strcmp(argv[i], "--depth-prepass") == 0){
+            engine._depthPrepass = true;
+        } else if (strcmp(argv[i], "--transform-kernel") == 0 && i + 1 < argc){
+            const char *kernel = argv[++i];
+            if (strcmp(kernel, "scalar") == 0){
+                engine._transformKernel = vkmath::TransformKernel::Scalar;
+            } else if (strcmp(kernel, "sse") == 0){
+                engine._transformKernel = vkmath::TransformKernel::SSE;
+            } else if (strcmp(kernel, "avx2") == 0){
+                engine._transformKernel = vkmath::TransformKernel::AVX2;
+            } else if (strcmp(kernel, "neon") == 0){
+                engine._transformKernel = vkmath::TransformKernel::NEON;
+            } else {
+                printf("UNKNOWN TRANSFORM KERNEL %s, EXPECTED scalar, sse, avx2 OR neon\n", kernel);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--transform-benchmark") == 0){
+            transformBenchmark = true;
+        } else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc){
+            engine._meshPath = argv[++i];
+        } else if (strcmp(argv[i], "--textures") == 0 && i + 1 < argc){
+            engine._textureDir = argv[++i];
+        } else if (strcmp(argv[i], "--texture-budget") == 0 && i + 1 < argc){
+            engine._textureBudget = (VkDeviceSize)atoi(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--objects") == 0 && i + 1 < argc){
+            engine._sceneObjectCount = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--record-threads") == 0 && i + 1 < argc){
+            engine._recordThreads = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc){
+            engine._capturePath = argv[++i];
+        } else if (strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc){
+            const char *format = argv[++i];
+            if (!FrameCapture::parse_format(format, &engine._captureFormat)){
+                printf("UNKNOWN CAPTURE FORMAT %s, EXPECTED raw, png, y4m OR ffmpeg\n", format);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--software") == 0){
+            engine._softwareDevice = true;
+        } else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc){
+            engine._goldenPath = argv[++i];
+        } else if (strcmp(argv[i], "--update-golden") == 0){
+            engine._goldenUpdate = true;
+        } else if (strcmp(argv[i], "--golden-tolerance") == 0 && i + 1 < argc){
+            engine._goldenTolerance = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--golden-max-mismatch") == 0 && i + 1 < argc){
+            engine._goldenMaxMismatch = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--max-frame-ms") == 0 && i + 1 < argc){
+            engine._maxFrameMs = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--max-gpu-ms") == 0 && i + 1 < argc){
+            engine._maxGpuMs = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--bindless") == 0){
+            engine._bindlessDescriptors = true;
+        } else if (strcmp(argv[i], "--gpu-cull") == 0){
+            engine._gpuCulling = true;
+        } else if (strcmp(argv[i], "--hot-reload") == 0){
+            engine._shaderHotReload = true;
+        } else if (strcmp(argv[i], "--shader-compiler") == 0 && i + 1 < argc){
+            engine._shaderCompiler = argv[++i];
+        } else if (strcmp(argv[i], "--present-mode") == 0 && i + 1 < argc){
+            const char *mode = argv[++i];
+            if (strcmp(mode, "mailbox") == 0){
+                engine._presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+            } else if (strcmp(mode, "immediate") == 0){
+                engine._presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+            } else if (strcmp(mode, "fifo") == 0){
+                engine._presentMode = VK_PRESENT_MODE_FIFO_KHR;
+            } else {
+                printf("UNKNOWN PRESENT MODE %s, EXPECTED fifo, mailbox OR immediate\n", mode);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--fps-cap") == 0 && i + 1 < argc){
+            engine._pacer._targetFps = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--low-latency") == 0){
+            engine._pacer._lowLatency = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc){
+            engine._tracePath = argv[++i];
+        }
+    }
+
+    // CPU only, never brings up Vulkan
+    if (transformBenchmark){
+        return run_transform_benchmark(engine._benchmarkOutput) ? 0 : 1;
+    }
 
     engine.init();
 
     engine.run();
 
+    // Non-zero exit so scripts and CI notice a golden or frame time regression
+    bool passed = engine.check_regressions();
+
     engine.cleanup();
 
-    return 0;
+    return passed ? 0 : 1;
 }
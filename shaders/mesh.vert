@@ -0,0 +1,32 @@
+#version 450
+
+// PackedVertex, the formats do the unpacking
+layout (location = 0) in vec4 inPosition;
+// Octahedral
+layout (location = 1) in vec2 inNormal;
+layout (location = 2) in vec4 inColor;
+
+// xyz offset, w uniform scale
+layout (location = 3) in vec4 inInstance;
+
+layout (location = 0) out vec3 outVert;
+
+// The pre-pass and the main pass test EQUAL against each other, the position has to match bit for bit
+invariant gl_Position;
+
+vec3 decode_octahedral(vec2 e){
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    if (n.z < 0.0f){
+        n.xy = (1.0f - abs(n.yx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return normalize(n);
+}
+
+void main(){
+    // Lit from the viewer, so flat meshes facing the screen keep their color as is
+    vec3 normal = decode_octahedral(inNormal);
+    float light = 0.25f + 0.75f * max(dot(normal, vec3(0.0f, 0.0f, -1.0f)), 0.0f);
+    outVert = inColor.rgb * light;
+
+    gl_Position = vec4(inPosition.xyz * inInstance.w + inInstance.xyz, 1.0f);
+}
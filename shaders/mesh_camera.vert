@@ -0,0 +1,32 @@
+#version 450
+
+// PackedVertex, the formats do the unpacking
+layout (location = 0) in vec4 inPosition;
+// Octahedral
+layout (location = 1) in vec2 inNormal;
+layout (location = 2) in vec4 inColor;
+
+// Model-view-projection, computed per object on the CPU every frame
+layout (location = 3) in mat4 inTransform;
+
+layout (location = 0) out vec3 outVert;
+
+// The pre-pass and the main pass test EQUAL against each other, the position has to match bit for bit
+invariant gl_Position;
+
+vec3 decode_octahedral(vec2 e){
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    if (n.z < 0.0f){
+        n.xy = (1.0f - abs(n.yx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return normalize(n);
+}
+
+void main(){
+    // Lit from the front like mesh.vert, the camera only moves what's on screen
+    vec3 normal = decode_octahedral(inNormal);
+    float light = 0.25f + 0.75f * max(dot(normal, vec3(0.0f, 0.0f, -1.0f)), 0.0f);
+    outVert = inColor.rgb * light;
+
+    gl_Position = inTransform * vec4(inPosition.xyz, 1.0f);
+}
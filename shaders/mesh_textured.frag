@@ -0,0 +1,35 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout (location = 0) out vec4 FragColor;
+
+layout (location = 0) in vec3 vertColor;
+layout (location = 1) in vec2 inUV;
+layout (location = 2) flat in uint inTexture;
+
+// BindlessHeap
+layout (set = 0, binding = 0) uniform sampler2D textures[];
+layout (std430, set = 0, binding = 1) buffer Words { uint words[]; } buffers[];
+
+layout (push_constant) uniform Constants {
+    uint slotTable;
+    uint feedback;
+    uint textureCount;
+} constants;
+
+void main(){
+    // Bindless slot and the file level the bound image starts at, ~0u while it's the fallback
+    uint slot = buffers[constants.slotTable].words[inTexture * 2];
+    uint residentLevel = buffers[constants.slotTable].words[inTexture * 2 + 1];
+
+    vec4 texel = texture(textures[nonuniformEXT(slot)], inUV);
+
+    // One pixel in 64 reports the level it would like, relative to the full chain in the file
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    if (residentLevel != ~0u && (pixel.x & 7) == 0 && (pixel.y & 7) == 0){
+        float lod = textureQueryLod(textures[nonuniformEXT(slot)], inUV).y;
+        atomicMin(buffers[constants.feedback].words[inTexture], residentLevel + uint(max(floor(lod), 0.0f)));
+    }
+
+    FragColor = vec4(vertColor * texel.rgb, 1.0f);
+}
@@ -0,0 +1,43 @@
+#version 450
+
+// mesh.vert plus texture coordinates and which texture the instance uses
+
+layout (location = 0) in vec4 inPosition;
+layout (location = 1) in vec2 inNormal;
+layout (location = 2) in vec4 inColor;
+
+layout (location = 3) in vec4 inInstance;
+
+layout (location = 0) out vec3 outVert;
+layout (location = 1) out vec2 outUV;
+layout (location = 2) flat out uint outTexture;
+
+// TexturePushConstants
+layout (push_constant) uniform Constants {
+    uint slotTable;
+    uint feedback;
+    uint textureCount;
+} constants;
+
+// The pre-pass and the main pass test EQUAL against each other, the position has to match bit for bit
+invariant gl_Position;
+
+vec3 decode_octahedral(vec2 e){
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    if (n.z < 0.0f){
+        n.xy = (1.0f - abs(n.yx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return normalize(n);
+}
+
+void main(){
+    vec3 normal = decode_octahedral(inNormal);
+    float light = 0.25f + 0.75f * max(dot(normal, vec3(0.0f, 0.0f, -1.0f)), 0.0f);
+    outVert = inColor.rgb * light;
+
+    // Meshes are normalized into [-1, 1], good enough for a planar mapping
+    outUV = inPosition.xy * 0.5f + 0.5f;
+    outTexture = uint(gl_InstanceIndex) % max(constants.textureCount, 1u);
+
+    gl_Position = vec4(inPosition.xyz * inInstance.w + inInstance.xyz, 1.0f);
+}
@@ -0,0 +1,434 @@
+//
+// Created by simon on 4/10/23.
+//
+
+// Offline mesh converter: reads an OBJ, reorders it for the post-transform cache, quantizes the
+// vertices into PackedVertex and writes a file MeshPool::add_file() can map and upload as is.
+//
+//   meshbake <input.obj> <output.vmesh>
+
+#include "vk_mesh_format.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct SourceVertex {
+    float position[3];
+    float normal[3];
+    float color[3];
+    // Smooth normals still have to be made up for it
+    bool hasNormal;
+};
+
+struct SourceMesh {
+    std::vector<SourceVertex> vertices;
+    std::vector<uint32_t> indices;
+};
+
+// OBJ indices are 1 based, negative ones count back from the end
+static bool resolve_index(const char *token, size_t count, int32_t *out) {
+    char *end;
+    long index = strtol(token, &end, 10);
+    if (end == token || index == 0){
+        return false;
+    }
+
+    index = index > 0 ? index - 1 : (long)count + index;
+    if (index < 0 || (size_t)index >= count){
+        return false;
+    }
+    *out = (int32_t)index;
+    return true;
+}
+
+static bool load_obj(const char *path, SourceMesh &mesh) {
+    FILE *file = fopen(path, "r");
+    if (!file){
+        printf("CAN'T OPEN %s\n", path);
+        return false;
+    }
+
+    std::vector<float> positions;
+    std::vector<float> colors;
+    std::vector<float> normals;
+    // position index << 32 | normal index + 1, so identical corners share a vertex
+    std::unordered_map<uint64_t, uint32_t> corners;
+
+    char line[1024];
+    uint32_t lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)){
+        lineNumber++;
+
+        if (strncmp(line, "v ", 2) == 0){
+            // x y z r g b is a common extension for colors. A lone fourth value is the standard
+            // homogeneous w, which gets dropped like anything else that isn't exactly a color.
+            float v[7] = {};
+            int read = sscanf(line + 2, "%f %f %f %f %f %f %f", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]);
+            if (read < 3){
+                printf("%s:%u: BAD VERTEX\n", path, lineNumber);
+                ok = false;
+            }
+            if (read != 6){
+                v[3] = v[4] = v[5] = 1.0f;
+            }
+            positions.insert(positions.end(), v, v + 3);
+            colors.insert(colors.end(), v + 3, v + 6);
+        } else if (strncmp(line, "vn ", 3) == 0){
+            float n[3];
+            if (sscanf(line + 3, "%f %f %f", &n[0], &n[1], &n[2]) != 3){
+                printf("%s:%u: BAD NORMAL\n", path, lineNumber);
+                ok = false;
+            }
+            normals.insert(normals.end(), n, n + 3);
+        } else if (strncmp(line, "f ", 2) == 0){
+            std::vector<uint32_t> polygon;
+            for (char *token = strtok(line + 2, " \t\r\n"); token; token = strtok(nullptr, " \t\r\n")){
+                // v, v/vt, v//vn or v/vt/vn, texture coordinates aren't kept
+                int32_t position;
+                int32_t normal = -1;
+                if (!resolve_index(token, positions.size() / 3, &position)){
+                    printf("%s:%u: BAD FACE INDEX %s\n", path, lineNumber, token);
+                    ok = false;
+                    break;
+                }
+                const char *slash = strchr(token, '/');
+                if (slash && (slash = strchr(slash + 1, '/')) && slash[1] != '\0'){
+                    if (!resolve_index(slash + 1, normals.size() / 3, &normal)){
+                        printf("%s:%u: BAD NORMAL INDEX %s\n", path, lineNumber, token);
+                        ok = false;
+                        break;
+                    }
+                }
+
+                uint64_t key = (uint64_t)position << 32 | (uint32_t)(normal + 1);
+                auto found = corners.find(key);
+                if (found == corners.end()){
+                    SourceVertex vertex;
+                    memcpy(vertex.position, &positions[position * 3], sizeof(vertex.position));
+                    memcpy(vertex.color, &colors[position * 3], sizeof(vertex.color));
+                    vertex.hasNormal = normal >= 0;
+                    if (vertex.hasNormal){
+                        memcpy(vertex.normal, &normals[normal * 3], sizeof(vertex.normal));
+                    } else {
+                        memset(vertex.normal, 0, sizeof(vertex.normal));
+                    }
+                    found = corners.emplace(key, (uint32_t)mesh.vertices.size()).first;
+                    mesh.vertices.push_back(vertex);
+                }
+                polygon.push_back(found->second);
+            }
+
+            // Fan, fine for the convex polygons exporters write
+            for (size_t i = 2; ok && i < polygon.size(); i++){
+                uint32_t a = polygon[0];
+                uint32_t b = polygon[i - 1];
+                uint32_t c = polygon[i];
+                if (a != b && b != c && c != a){
+                    mesh.indices.insert(mesh.indices.end(), {a, b, c});
+                }
+            }
+        }
+        // Everything else (vt, groups, materials, smoothing) doesn't end up in the file
+    }
+    fclose(file);
+
+    if (ok && mesh.indices.empty()){
+        printf("%s: NO TRIANGLES\n", path);
+        ok = false;
+    }
+    return ok;
+}
+
+// Area weighted face normals for every vertex the file didn't give one
+static void generate_normals(SourceMesh &mesh) {
+    for (size_t t = 0; t < mesh.indices.size(); t += 3){
+        SourceVertex *corners[3] = {&mesh.vertices[mesh.indices[t]], &mesh.vertices[mesh.indices[t + 1]],
+                                    &mesh.vertices[mesh.indices[t + 2]]};
+        float e1[3];
+        float e2[3];
+        for (int i = 0; i < 3; i++){
+            e1[i] = corners[1]->position[i] - corners[0]->position[i];
+            e2[i] = corners[2]->position[i] - corners[0]->position[i];
+        }
+        float face[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+
+        for (SourceVertex *corner : corners){
+            if (!corner->hasNormal){
+                for (int i = 0; i < 3; i++){
+                    corner->normal[i] += face[i];
+                }
+            }
+        }
+    }
+}
+
+// Tom Forsyth's "Linear-Speed Vertex Cache Optimisation". Greedily emits the triangle whose vertices score
+// highest, favouring vertices still in a modelled LRU cache and ones with few triangles left, so lone
+// triangles don't get stranded.
+namespace forsyth {
+    constexpr int CACHE_SIZE = 32;
+    constexpr float CACHE_DECAY_POWER = 1.5f;
+    constexpr float LAST_TRIANGLE_SCORE = 0.75f;
+    constexpr float VALENCE_BOOST_SCALE = 2.0f;
+    constexpr float VALENCE_BOOST_POWER = 0.5f;
+
+    static float vertex_score(int cachePosition, uint32_t remaining) {
+        if (remaining == 0){
+            return -1.0f;
+        }
+
+        float score = 0.0f;
+        if (cachePosition >= 0){
+            if (cachePosition < 3){
+                // Used by the last triangle, scored flat so it doesn't win just for being there
+                score = LAST_TRIANGLE_SCORE;
+            } else {
+                float scale = 1.0f / (float)(CACHE_SIZE - 3);
+                score = powf(1.0f - (float)(cachePosition - 3) * scale, CACHE_DECAY_POWER);
+            }
+        }
+        return score + VALENCE_BOOST_SCALE * powf((float)remaining, -VALENCE_BOOST_POWER);
+    }
+
+    static std::vector<uint32_t> optimize(const std::vector<uint32_t> &indices, uint32_t vertexCount) {
+        const uint32_t triangleCount = (uint32_t)indices.size() / 3;
+
+        std::vector<uint32_t> remaining(vertexCount, 0);
+        for (uint32_t index : indices){
+            remaining[index]++;
+        }
+
+        // Triangles using each vertex, the live ones are the first remaining[v] of its range
+        std::vector<uint32_t> adjacencyStart(vertexCount + 1, 0);
+        for (uint32_t v = 0; v < vertexCount; v++){
+            adjacencyStart[v + 1] = adjacencyStart[v] + remaining[v];
+        }
+        std::vector<uint32_t> adjacency(indices.size());
+        std::vector<uint32_t> filled(vertexCount, 0);
+        for (uint32_t t = 0; t < triangleCount; t++){
+            for (int c = 0; c < 3; c++){
+                uint32_t v = indices[t * 3 + c];
+                adjacency[adjacencyStart[v] + filled[v]++] = t;
+            }
+        }
+
+        std::vector<int> cachePosition(vertexCount, -1);
+        std::vector<float> vertexScores(vertexCount);
+        for (uint32_t v = 0; v < vertexCount; v++){
+            vertexScores[v] = vertex_score(-1, remaining[v]);
+        }
+
+        std::vector<float> triangleScores(triangleCount);
+        std::vector<bool> emitted(triangleCount, false);
+        for (uint32_t t = 0; t < triangleCount; t++){
+            triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] +
+                                vertexScores[indices[t * 3 + 2]];
+        }
+
+        std::vector<uint32_t> output;
+        output.reserve(indices.size());
+        std::vector<uint32_t> cache;
+        std::vector<uint32_t> nextCache;
+        uint32_t scanCursor = 0;
+        int64_t best = -1;
+
+        for (uint32_t emittedCount = 0; emittedCount < triangleCount; emittedCount++){
+            if (best < 0){
+                // Nothing near the cache left, take the best of the rest. Rare, so a full scan is fine.
+                float bestScore = -1.0f;
+                for (uint32_t t = scanCursor; t < triangleCount; t++){
+                    if (!emitted[t] && triangleScores[t] > bestScore){
+                        bestScore = triangleScores[t];
+                        best = t;
+                    }
+                }
+            }
+
+            uint32_t triangle = (uint32_t)best;
+            emitted[triangle] = true;
+            while (scanCursor < triangleCount && emitted[scanCursor]){
+                scanCursor++;
+            }
+
+            // Emit it, drop it from its vertices' adjacency and move its vertices to the front of the cache
+            nextCache.clear();
+            for (int c = 0; c < 3; c++){
+                uint32_t v = indices[triangle * 3 + c];
+                output.push_back(v);
+
+                uint32_t *begin = &adjacency[adjacencyStart[v]];
+                for (uint32_t i = 0; i < remaining[v]; i++){
+                    if (begin[i] == triangle){
+                        begin[i] = begin[remaining[v] - 1];
+                        break;
+                    }
+                }
+                remaining[v]--;
+                nextCache.push_back(v);
+            }
+            for (uint32_t v : cache){
+                if (v != nextCache[0] && v != nextCache[1] && v != nextCache[2]){
+                    nextCache.push_back(v);
+                }
+            }
+
+            // Rescore everything that moved, including what just fell out
+            for (size_t i = 0; i < nextCache.size(); i++){
+                uint32_t v = nextCache[i];
+                cachePosition[v] = i < (size_t)CACHE_SIZE ? (int)i : -1;
+                vertexScores[v] = vertex_score(cachePosition[v], remaining[v]);
+            }
+            if (nextCache.size() > (size_t)CACHE_SIZE){
+                nextCache.resize(CACHE_SIZE);
+            }
+            cache.swap(nextCache);
+
+            // Only triangles touching the cache changed score, the next pick comes from them
+            best = -1;
+            float bestScore = -1.0f;
+            for (uint32_t v : cache){
+                for (uint32_t i = 0; i < remaining[v]; i++){
+                    uint32_t t = adjacency[adjacencyStart[v] + i];
+                    float score = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] +
+                                  vertexScores[indices[t * 3 + 2]];
+                    triangleScores[t] = score;
+                    if (score > bestScore){
+                        bestScore = score;
+                        best = t;
+                    }
+                }
+            }
+        }
+        return output;
+    }
+}
+
+// Average vertices transformed per triangle with a FIFO cache, what the reordering is meant to bring down
+static float average_cache_miss_ratio(const std::vector<uint32_t> &indices, uint32_t vertexCount, uint32_t cacheSize) {
+    std::vector<uint32_t> insertedAt(vertexCount, 0);
+    uint32_t clock = cacheSize + 1;
+    uint32_t misses = 0;
+    for (uint32_t index : indices){
+        if (clock - insertedAt[index] > cacheSize){
+            insertedAt[index] = clock++;
+            misses++;
+        }
+    }
+    return (float)misses / (float)(indices.size() / 3);
+}
+
+// Renumbers the vertices in the order the indices first touch them, so vertex fetch walks forward
+static void reorder_vertices(SourceMesh &mesh) {
+    std::vector<uint32_t> remap(mesh.vertices.size(), ~0u);
+    std::vector<SourceVertex> vertices;
+    vertices.reserve(mesh.vertices.size());
+
+    for (uint32_t &index : mesh.indices){
+        if (remap[index] == ~0u){
+            remap[index] = (uint32_t)vertices.size();
+            vertices.push_back(mesh.vertices[index]);
+        }
+        index = remap[index];
+    }
+    // Anything no triangle uses is dropped
+    mesh.vertices.swap(vertices);
+}
+
+static bool write_padding(FILE *file, uint64_t offset) {
+    static const uint8_t zeros[MESH_FILE_ALIGNMENT] = {};
+    long position = ftell(file);
+    return position >= 0 && (uint64_t)position <= offset &&
+           fwrite(zeros, 1, offset - (uint64_t)position, file) == offset - (uint64_t)position;
+}
+
+static bool write_mesh(const char *path, const SourceMesh &mesh) {
+    MeshFileHeader header = {};
+    header._magic = MESH_FILE_MAGIC;
+    header._version = MESH_FILE_VERSION;
+    header._vertexCount = (uint32_t)mesh.vertices.size();
+    header._indexCount = (uint32_t)mesh.indices.size();
+    header._vertexOffset = vkmesh::align_offset(sizeof(MeshFileHeader));
+    header._indexOffset = vkmesh::align_offset(header._vertexOffset + mesh.vertices.size() * sizeof(PackedVertex));
+
+    // Centered on the bounds and scaled by the largest half extent, so the longest axis spans [-1, 1]
+    float minimum[3] = {INFINITY, INFINITY, INFINITY};
+    float maximum[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (const SourceVertex &vertex : mesh.vertices){
+        for (int i = 0; i < 3; i++){
+            minimum[i] = std::min(minimum[i], vertex.position[i]);
+            maximum[i] = std::max(maximum[i], vertex.position[i]);
+        }
+    }
+    header._scale = 0.0f;
+    for (int i = 0; i < 3; i++){
+        header._center[i] = (minimum[i] + maximum[i]) * 0.5f;
+        header._scale = std::max(header._scale, (maximum[i] - minimum[i]) * 0.5f);
+    }
+    if (header._scale == 0.0f){
+        header._scale = 1.0f;
+    }
+
+    std::vector<PackedVertex> packed;
+    packed.reserve(mesh.vertices.size());
+    header._radius = 0.0f;
+    for (const SourceVertex &vertex : mesh.vertices){
+        float position[3];
+        for (int i = 0; i < 3; i++){
+            position[i] = (vertex.position[i] - header._center[i]) / header._scale;
+        }
+        header._radius = std::max(header._radius, sqrtf(position[0] * position[0] + position[1] * position[1] +
+                                                        position[2] * position[2]));
+        packed.push_back(vkmesh::pack_vertex(position, vertex.normal, vertex.color));
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file){
+        printf("CAN'T WRITE %s\n", path);
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              write_padding(file, header._vertexOffset) &&
+              fwrite(packed.data(), sizeof(PackedVertex), packed.size(), file) == packed.size() &&
+              write_padding(file, header._indexOffset) &&
+              fwrite(mesh.indices.data(), sizeof(uint32_t), mesh.indices.size(), file) == mesh.indices.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok){
+        printf("FAILED WRITING %s\n", path);
+        remove(path);
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3){
+        printf("usage: meshbake <input.obj> <output.vmesh>\n");
+        return 1;
+    }
+
+    SourceMesh mesh;
+    if (!load_obj(argv[1], mesh)){
+        return 1;
+    }
+    generate_normals(mesh);
+
+    const uint32_t vertexCount = (uint32_t)mesh.vertices.size();
+    float before = average_cache_miss_ratio(mesh.indices, vertexCount, 16);
+    mesh.indices = forsyth::optimize(mesh.indices, vertexCount);
+    float after = average_cache_miss_ratio(mesh.indices, vertexCount, 16);
+    reorder_vertices(mesh);
+
+    if (!write_mesh(argv[2], mesh)){
+        return 1;
+    }
+
+    printf("MESHBAKE %s: %zu vertices, %zu triangles, ACMR %.3f -> %.3f (16 entry FIFO)\n",
+           argv[2], mesh.vertices.size(), mesh.indices.size() / 3, before, after);
+    return 0;
+}
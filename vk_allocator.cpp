@@ -0,0 +1,348 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_allocator.h"
+#include "vk_math.h"
+
+#include <algorithm>
+#include <cstdio>
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+    return alignment > 1 ? (value + alignment - 1) / alignment * alignment : value;
+}
+
+void GpuAllocator::init(VkDevice device, VkPhysicalDevice physicalDevice) {
+    _device = device;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &_memoryProperties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    _limits = properties.limits;
+
+    // Mixing buffers and optimal images in one block would need padding to the granularity between them,
+    // giving each kind its own blocks is simpler and wastes less
+    _separateLinear = _limits.bufferImageGranularity > 1;
+}
+
+void GpuAllocator::destroy() {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (uint32_t i = 0; i < _blocks.size(); i++){
+        if (_blocks[i]._allocations != 0){
+            printf("GPU ALLOCATOR: block %u destroyed with %u live allocations\n", i, _blocks[i]._allocations);
+        }
+        release_block(i);
+    }
+    _blocks.clear();
+}
+
+uint32_t GpuAllocator::find_memory_type(uint32_t typeBits, VkMemoryPropertyFlags properties) const {
+    for (uint32_t i = 0; i < _memoryProperties.memoryTypeCount; i++){
+        if ((typeBits & (1u << i)) && (_memoryProperties.memoryTypes[i].propertyFlags & properties) == properties){
+            return i;
+        }
+    }
+    return ~0u;
+}
+
+bool GpuAllocator::allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags required, bool linear, Allocation *out) {
+    uint32_t memoryType = find_memory_type(requirements.memoryTypeBits, required);
+    if (memoryType == ~0u){
+        printf("GPU ALLOCATOR: no memory type with flags %x for type bits %x\n", required, requirements.memoryTypeBits);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    bool blockKind = _separateLinear ? linear : true;
+
+    VkDeviceSize heapSize = _memoryProperties.memoryHeaps[_memoryProperties.memoryTypes[memoryType].heapIndex].size;
+    VkDeviceSize blockSize = std::min(_blockSize, std::max<VkDeviceSize>(heapSize / 8, 1024 * 1024));
+
+    uint32_t blockIndex;
+
+    // Large resources would eat most of a shared block anyway, give them one of their own
+    if (requirements.size > blockSize / 2){
+        if (!create_block(memoryType, requirements.size, blockKind, true, &blockIndex)){
+            return false;
+        }
+        return allocate_from_block(blockIndex, requirements, out);
+    }
+
+    for (uint32_t i = 0; i < _blocks.size(); i++){
+        const Block &block = _blocks[i];
+        if (block._memory == VK_NULL_HANDLE || block._dedicated || block._memoryType != memoryType || block._linear != blockKind){
+            continue;
+        }
+        if (allocate_from_block(i, requirements, out)){
+            return true;
+        }
+    }
+
+    if (!create_block(memoryType, blockSize, blockKind, false, &blockIndex)){
+        return false;
+    }
+    return allocate_from_block(blockIndex, requirements, out);
+}
+
+bool GpuAllocator::allocate_from_block(uint32_t blockIndex, const VkMemoryRequirements &requirements, Allocation *out) {
+    Block &block = _blocks[blockIndex];
+
+    // Mapped allocations get written with streaming stores, start them on a cache line so those can't fault
+    VkDeviceSize alignment = requirements.alignment;
+    if (_memoryProperties.memoryTypes[block._memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT){
+        alignment = std::max(alignment, (VkDeviceSize)CACHE_LINE_SIZE);
+    }
+
+    // First fit, the free list is short and sorted so this stays cheap
+    for (size_t i = 0; i < block._free.size(); i++){
+        FreeRange range = block._free[i];
+
+        VkDeviceSize offset = align_up(range._offset, alignment);
+        VkDeviceSize padding = offset - range._offset;
+        if (range._size < padding + requirements.size){
+            continue;
+        }
+
+        VkDeviceSize end = offset + requirements.size;
+        VkDeviceSize rangeEnd = range._offset + range._size;
+
+        // Whatever is left on either side stays on the free list, so the padding isn't lost
+        block._free.erase(block._free.begin() + (long)i);
+        if (rangeEnd > end){
+            block._free.insert(block._free.begin() + (long)i, {end, rangeEnd - end});
+        }
+        if (padding > 0){
+            block._free.insert(block._free.begin() + (long)i, {range._offset, padding});
+        }
+
+        block._used += requirements.size;
+        block._allocations++;
+
+        out->_memory = block._memory;
+        out->_offset = offset;
+        out->_size = requirements.size;
+        out->_mapped = block._mapped ? (char *)block._mapped + offset : nullptr;
+        out->_block = blockIndex;
+        return true;
+    }
+    return false;
+}
+
+bool GpuAllocator::create_block(uint32_t memoryType, VkDeviceSize size, bool linear, bool dedicated, uint32_t *outIndex) {
+    if (_deviceAllocations >= _limits.maxMemoryAllocationCount){
+        printf("GPU ALLOCATOR: hit maxMemoryAllocationCount (%u)\n", _limits.maxMemoryAllocationCount);
+        return false;
+    }
+
+    VkMemoryAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.pNext = nullptr;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memoryType;
+
+    Block block;
+    if (vkAllocateMemory(_device, &allocInfo, nullptr, &block._memory) != VK_SUCCESS){
+        printf("GPU ALLOCATOR: failed to allocate %llu bytes of memory type %u\n", (unsigned long long)size, memoryType);
+        return false;
+    }
+    _deviceAllocations++;
+
+    block._size = size;
+    block._memoryType = memoryType;
+    block._linear = linear;
+    block._dedicated = dedicated;
+    block._free.push_back({0, size});
+
+    // Host visible blocks stay mapped for their whole life, allocations just point into the mapping
+    if (_memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT){
+        if (vkMapMemory(_device, block._memory, 0, VK_WHOLE_SIZE, 0, &block._mapped) != VK_SUCCESS){
+            block._mapped = nullptr;
+        }
+    }
+
+    // Reuse a released slot so Allocation::_block indices stay valid
+    for (uint32_t i = 0; i < _blocks.size(); i++){
+        if (_blocks[i]._memory == VK_NULL_HANDLE){
+            _blocks[i] = std::move(block);
+            *outIndex = i;
+            return true;
+        }
+    }
+    _blocks.push_back(std::move(block));
+    *outIndex = (uint32_t)_blocks.size() - 1;
+    return true;
+}
+
+void GpuAllocator::release_block(uint32_t blockIndex) {
+    Block &block = _blocks[blockIndex];
+    if (block._memory == VK_NULL_HANDLE){
+        return;
+    }
+    if (block._mapped){
+        vkUnmapMemory(_device, block._memory);
+    }
+    vkFreeMemory(_device, block._memory, nullptr);
+    _deviceAllocations--;
+    block = Block{};
+}
+
+void GpuAllocator::free(Allocation &allocation) {
+    if (allocation._block == ~0u){
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    Block &block = _blocks[allocation._block];
+
+    FreeRange range = {allocation._offset, allocation._size};
+    auto next = std::lower_bound(block._free.begin(), block._free.end(), range,
+                                 [](const FreeRange &a, const FreeRange &b){ return a._offset < b._offset; });
+    size_t index = (size_t)(next - block._free.begin());
+    block._free.insert(next, range);
+
+    // Merge with the following range, then with the preceding one
+    if (index + 1 < block._free.size() && block._free[index]._offset + block._free[index]._size == block._free[index + 1]._offset){
+        block._free[index]._size += block._free[index + 1]._size;
+        block._free.erase(block._free.begin() + (long)index + 1);
+    }
+    if (index > 0 && block._free[index - 1]._offset + block._free[index - 1]._size == block._free[index]._offset){
+        block._free[index - 1]._size += block._free[index]._size;
+        block._free.erase(block._free.begin() + (long)index);
+    }
+
+    block._used -= allocation._size;
+    block._allocations--;
+
+    // Shared blocks are kept around for the next resource, dedicated ones have no further use
+    if (block._dedicated && block._allocations == 0){
+        release_block(allocation._block);
+    }
+
+    allocation = Allocation{};
+}
+
+bool GpuAllocator::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryFlags, AllocatedBuffer *out) {
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.pNext = nullptr;
+    bufferInfo.size = size;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    if (vkCreateBuffer(_device, &bufferInfo, nullptr, &out->_buffer) != VK_SUCCESS){
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(_device, out->_buffer, &requirements);
+
+    if (!allocate(requirements, memoryFlags, true, &out->_allocation)){
+        vkDestroyBuffer(_device, out->_buffer, nullptr);
+        out->_buffer = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VK_CHECK(vkBindBufferMemory(_device, out->_buffer, out->_allocation._memory, out->_allocation._offset));
+    return true;
+}
+
+void GpuAllocator::destroy_buffer(AllocatedBuffer &buffer) {
+    if (buffer._buffer != VK_NULL_HANDLE){
+        vkDestroyBuffer(_device, buffer._buffer, nullptr);
+    }
+    free(buffer._allocation);
+    buffer._buffer = VK_NULL_HANDLE;
+}
+
+bool GpuAllocator::create_image(const VkImageCreateInfo &imageInfo, VkMemoryPropertyFlags memoryFlags, AllocatedImage *out) {
+    if (vkCreateImage(_device, &imageInfo, nullptr, &out->_image) != VK_SUCCESS){
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(_device, out->_image, &requirements);
+
+    if (!allocate(requirements, memoryFlags, imageInfo.tiling == VK_IMAGE_TILING_LINEAR, &out->_allocation)){
+        vkDestroyImage(_device, out->_image, nullptr);
+        out->_image = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VK_CHECK(vkBindImageMemory(_device, out->_image, out->_allocation._memory, out->_allocation._offset));
+    return true;
+}
+
+void GpuAllocator::destroy_image(AllocatedImage &image) {
+    if (image._image != VK_NULL_HANDLE){
+        vkDestroyImage(_device, image._image, nullptr);
+    }
+    free(image._allocation);
+    image._image = VK_NULL_HANDLE;
+}
+
+AllocatorStats GpuAllocator::stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    AllocatorStats stats;
+    VkDeviceSize totalFree = 0;
+    VkDeviceSize largestFree = 0;
+
+    for (const Block &block : _blocks){
+        if (block._memory == VK_NULL_HANDLE){
+            continue;
+        }
+        stats._blockCount++;
+        stats._bytesAllocated += block._size;
+        stats._bytesUsed += block._used;
+        stats._allocationCount += block._allocations;
+        for (const FreeRange &range : block._free){
+            totalFree += range._size;
+            largestFree = std::max(largestFree, range._size);
+        }
+    }
+
+    stats._fragmentation = totalFree > 0 ? 1.0f - (float)largestFree / (float)totalFree : 0.0f;
+    return stats;
+}
+
+void GpuAllocator::print_stats() const {
+    AllocatorStats current = stats();
+    printf("GPU MEMORY: %.2f MB used of %.2f MB in %u blocks, %u allocations, %.1f%% fragmented\n",
+           (double)current._bytesUsed / (1024.0 * 1024.0), (double)current._bytesAllocated / (1024.0 * 1024.0),
+           current._blockCount, current._allocationCount, current._fragmentation * 100.0f);
+}
+
+bool FrameRingBuffer::init(GpuAllocator &allocator, VkDeviceSize frameSize, uint32_t frameCount, VkBufferUsageFlags usage) {
+    // Keep every region start aligned for any kind of descriptor or copy offset
+    _frameSize = align_up(frameSize, 256);
+    _frameBase = 0;
+    _head = 0;
+    return allocator.create_buffer(_frameSize * frameCount, usage,
+                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &_buffer);
+}
+
+void FrameRingBuffer::destroy(GpuAllocator &allocator) {
+    allocator.destroy_buffer(_buffer);
+}
+
+void FrameRingBuffer::begin_frame(uint32_t frameIndex) {
+    _frameBase = _frameSize * frameIndex;
+    _head = 0;
+}
+
+bool FrameRingBuffer::allocate(VkDeviceSize size, VkDeviceSize alignment, TransientAllocation *out) {
+    VkDeviceSize offset = align_up(_head, alignment);
+    if (offset + size > _frameSize){
+        return false;
+    }
+    _head = offset + size;
+    _peak = std::max(_peak, _head);
+
+    out->_buffer = _buffer._buffer;
+    out->_offset = _frameBase + offset;
+    out->_mapped = (char *)_buffer._allocation._mapped + _frameBase + offset;
+    return true;
+}
@@ -0,0 +1,121 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_ALLOCATOR_H
+#define VKENGINE_VK_ALLOCATOR_H
+
+#include "vk_types.h"
+#include <mutex>
+#include <vector>
+
+struct AllocatorStats {
+    // Device memory actually held from the driver
+    VkDeviceSize _bytesAllocated {0};
+    // Bytes handed out to resources, including alignment padding
+    VkDeviceSize _bytesUsed {0};
+    uint32_t _blockCount {0};
+    uint32_t _allocationCount {0};
+    // 1 - largest free range / total free, 0 means all free space is in one piece
+    float _fragmentation {0.0f};
+};
+
+// Suballocates resources out of large VkDeviceMemory blocks, one list of blocks per memory type.
+// Keeps the vkAllocateMemory count in the tens regardless of how many buffers and images exist.
+class GpuAllocator {
+public:
+    // Regular blocks are this big (capped at 1/8th of the heap), bigger requests get a block of their own
+    VkDeviceSize _blockSize {64ull * 1024 * 1024};
+
+    void init(VkDevice device, VkPhysicalDevice physicalDevice);
+
+    void destroy();
+
+    // linear is true for buffers and linear images, see bufferImageGranularity
+    bool allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags required, bool linear, Allocation *out);
+
+    void free(Allocation &allocation);
+
+    bool create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryFlags, AllocatedBuffer *out);
+
+    void destroy_buffer(AllocatedBuffer &buffer);
+
+    bool create_image(const VkImageCreateInfo &imageInfo, VkMemoryPropertyFlags memoryFlags, AllocatedImage *out);
+
+    void destroy_image(AllocatedImage &image);
+
+    uint32_t find_memory_type(uint32_t typeBits, VkMemoryPropertyFlags properties) const;
+
+    AllocatorStats stats() const;
+
+    void print_stats() const;
+
+    VkDevice _device {VK_NULL_HANDLE};
+    VkPhysicalDeviceMemoryProperties _memoryProperties;
+
+private:
+    struct FreeRange {
+        VkDeviceSize _offset;
+        VkDeviceSize _size;
+    };
+
+    struct Block {
+        VkDeviceMemory _memory {VK_NULL_HANDLE};
+        VkDeviceSize _size {0};
+        uint32_t _memoryType {0};
+        bool _linear {true};
+        bool _dedicated {false};
+        void *_mapped {nullptr};
+        // Sorted by offset so neighbours can be merged on free
+        std::vector<FreeRange> _free;
+        VkDeviceSize _used {0};
+        uint32_t _allocations {0};
+    };
+
+    bool allocate_from_block(uint32_t blockIndex, const VkMemoryRequirements &requirements, Allocation *out);
+
+    bool create_block(uint32_t memoryType, VkDeviceSize size, bool linear, bool dedicated, uint32_t *outIndex);
+
+    void release_block(uint32_t blockIndex);
+
+    VkPhysicalDeviceLimits _limits;
+    // Buffers and optimal images only share a block when the granularity doesn't force padding between them
+    bool _separateLinear {false};
+    uint32_t _deviceAllocations {0};
+
+    std::vector<Block> _blocks;
+    mutable std::mutex _mutex;
+};
+
+struct TransientAllocation {
+    VkBuffer _buffer;
+    VkDeviceSize _offset;
+    void *_mapped;
+};
+
+// Linear allocator over one host visible buffer cut into one region per frame in flight.
+// Each frame bumps through its own region and starts over once that frame has retired.
+class FrameRingBuffer {
+public:
+    AllocatedBuffer _buffer;
+    VkDeviceSize _frameSize {0};
+    // Most bytes any single frame used, handy for sizing _frameSize
+    VkDeviceSize _peak {0};
+
+    bool init(GpuAllocator &allocator, VkDeviceSize frameSize, uint32_t frameCount, VkBufferUsageFlags usage);
+
+    void destroy(GpuAllocator &allocator);
+
+    // Only call once the frame that last used this region has finished on the GPU
+    void begin_frame(uint32_t frameIndex);
+
+    // False when this frame's region is full
+    bool allocate(VkDeviceSize size, VkDeviceSize alignment, TransientAllocation *out);
+
+private:
+    VkDeviceSize _frameBase {0};
+    VkDeviceSize _head {0};
+};
+
+
+#endif //VKENGINE_VK_ALLOCATOR_H
@@ -0,0 +1,267 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_benchmark.h"
+#include "vk_math.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+static const char *phase_name(uint32_t phase) {
+    static const char *names[] = {"fence_wait", "acquire", "record", "submit", "present"};
+    return names[phase];
+}
+
+static double to_ms(FrameBenchmark::Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+// Nearest rank percentile over an already sorted sample set
+static double percentile(const std::vector<double> &sorted, double p) {
+    size_t rank = (size_t)(p / 100.0 * (double)(sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+static void write_stats(FILE *out, const char *name, std::vector<double> samples, const char *indent) {
+    fprintf(out, "%s\"%s\": ", indent, name);
+    if (samples.empty()){
+        fprintf(out, "null");
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+    for (double sample : samples) sum += sample;
+
+    fprintf(out, "{\"min\": %.4f, \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+            samples.front(), sum / (double)samples.size(),
+            percentile(samples, 50.0), percentile(samples, 95.0), percentile(samples, 99.0),
+            samples.back());
+}
+
+void FrameBenchmark::start() {
+    _enabled = true;
+    _hasLastFrame = false;
+    _frameTimes.clear();
+    _gpuTimes.clear();
+    _counters.clear();
+    for (auto &phase : _phaseTimes) phase.clear();
+    _benchmarkStart = Clock::now();
+}
+
+void FrameBenchmark::begin_frame() {
+    if (!_enabled) return;
+
+    _frameStart = Clock::now();
+    _phaseStart = _frameStart;
+    std::fill(std::begin(_currentPhases), std::end(_currentPhases), 0.0);
+
+    _previousFrameStart = _lastFrameStart;
+    _hadLastFrame = _hasLastFrame;
+
+    // Frame time is start-to-start so it includes whatever run() does between frames
+    if (_hasLastFrame){
+        _frameTimes.push_back(to_ms(_frameStart - _lastFrameStart));
+    }
+    _lastFrameStart = _frameStart;
+    _hasLastFrame = true;
+}
+
+void FrameBenchmark::mark(FramePhase phase) {
+    if (!_enabled) return;
+
+    Clock::time_point now = Clock::now();
+    _currentPhases[(uint32_t)phase] += to_ms(now - _phaseStart);
+    _phaseStart = now;
+}
+
+void FrameBenchmark::end_frame() {
+    if (!_enabled) return;
+
+    for (uint32_t i = 0; i < (uint32_t)FramePhase::Count; i++){
+        _phaseTimes[i].push_back(_currentPhases[i]);
+    }
+}
+
+void FrameBenchmark::discard_frame() {
+    if (!_enabled) return;
+
+    if (_hadLastFrame){
+        _frameTimes.pop_back();
+    }
+    _lastFrameStart = _previousFrameStart;
+    _hasLastFrame = _hadLastFrame;
+}
+
+void FrameBenchmark::add_gpu_time(double ms) {
+    if (!_enabled) return;
+    _gpuTimes.push_back(ms);
+}
+
+void FrameBenchmark::add_counter(const char *name, double value) {
+    if (!_enabled) return;
+
+    // A handful of counters, a linear search is fine
+    for (auto &counter : _counters){
+        if (counter.first == name){
+            counter.second.push_back(value);
+            return;
+        }
+    }
+    _counters.emplace_back(name, std::vector<double>{value});
+}
+
+void FrameBenchmark::add_info(const char *key, const std::string &value) {
+    _info.emplace_back(key, value);
+}
+
+uint32_t FrameBenchmark::frame_count() const {
+    return (uint32_t)_phaseTimes[0].size();
+}
+
+double FrameBenchmark::elapsed_seconds() const {
+    return std::chrono::duration<double>(Clock::now() - _benchmarkStart).count();
+}
+
+double FrameBenchmark::frame_ms(double p) const {
+    if (_frameTimes.empty()) return 0.0;
+    std::vector<double> sorted = _frameTimes;
+    std::sort(sorted.begin(), sorted.end());
+    return percentile(sorted, p);
+}
+
+double FrameBenchmark::gpu_ms(double p) const {
+    if (_gpuTimes.empty()) return 0.0;
+    std::vector<double> sorted = _gpuTimes;
+    std::sort(sorted.begin(), sorted.end());
+    return percentile(sorted, p);
+}
+
+bool FrameBenchmark::write_json(const std::string &path) const {
+    FILE *out = path.empty() ? stdout : fopen(path.c_str(), "w");
+    if (!out){
+        printf("FAILED TO OPEN BENCHMARK OUTPUT %s!\n", path.c_str());
+        return false;
+    }
+
+    double duration = elapsed_seconds();
+
+    fprintf(out, "{\n");
+    for (const auto &info : _info){
+        fprintf(out, "  \"%s\": \"%s\",\n", info.first.c_str(), info.second.c_str());
+    }
+    fprintf(out, "  \"frames\": %u,\n", frame_count());
+    fprintf(out, "  \"duration_s\": %.4f,\n", duration);
+    fprintf(out, "  \"fps\": %.2f,\n", duration > 0.0 ? (double)frame_count() / duration : 0.0);
+    write_stats(out, "frame_ms", _frameTimes, "  ");
+    fprintf(out, ",\n");
+    write_stats(out, "gpu_ms", _gpuTimes, "  ");
+    fprintf(out, ",\n  \"cpu_ms\": {\n");
+    for (uint32_t i = 0; i < (uint32_t)FramePhase::Count; i++){
+        write_stats(out, phase_name(i), _phaseTimes[i], "    ");
+        fprintf(out, i + 1 < (uint32_t)FramePhase::Count ? ",\n" : "\n");
+    }
+    fprintf(out, "  },\n  \"counters\": {\n");
+    for (size_t i = 0; i < _counters.size(); i++){
+        write_stats(out, _counters[i].first.c_str(), _counters[i].second, "    ");
+        fprintf(out, i + 1 < _counters.size() ? ",\n" : "\n");
+    }
+    fprintf(out, "  }\n}\n");
+
+    if (out != stdout){
+        fclose(out);
+    }
+    return true;
+}
+
+bool run_transform_benchmark(const std::string &path) {
+    using vkmath::TransformKernel;
+    using Clock = FrameBenchmark::Clock;
+
+    FILE *out = path.empty() ? stdout : fopen(path.c_str(), "w");
+    if (!out){
+        printf("FAILED TO OPEN BENCHMARK OUTPUT %s!\n", path.c_str());
+        return false;
+    }
+
+    Camera camera;
+    camera._yaw = 0.3f;
+    camera._pitch = 0.2f;
+    const Mat4 viewProjection = camera.view_projection(16.0f / 9.0f);
+
+    const uint32_t counts[] = {10000, 100000};
+    const TransformKernel kernels[] = {TransformKernel::Scalar, TransformKernel::SSE, TransformKernel::AVX2, TransformKernel::NEON};
+
+    bool matched = true;
+    fprintf(out, "{\n  \"best_kernel\": \"%s\",\n  \"runs\": [\n",
+            vkmath::transform_kernel_name(vkmath::best_transform_kernel()));
+    for (uint32_t c = 0; c < 2; c++){
+        const uint32_t count = counts[c];
+
+        // Same grid the instances scene lays out
+        AlignedVector<float> x(count), y(count), z(count), scale(count);
+        uint32_t side = (uint32_t)ceil(sqrt((double)count));
+        float spacing = 2.0f / (float)side;
+        for (uint32_t i = 0; i < count; i++){
+            x[i] = -1.0f + spacing * ((float)(i % side) + 0.5f);
+            y[i] = -1.0f + spacing * ((float)(i / side) + 0.5f);
+            z[i] = 0.0f;
+            scale[i] = spacing * 0.8f;
+        }
+
+        AlignedVector<Mat4> reference(count);
+        AlignedVector<Mat4> result(count);
+        vkmath::compute_mvp(TransformKernel::Scalar, viewProjection, x.data(), y.data(), z.data(), scale.data(),
+                            count, reference.data());
+
+        double scalarMs = 0.0;
+        bool first = true;
+        fprintf(out, "    {\"objects\": %u, \"kernels\": {", count);
+        for (TransformKernel kernel : kernels){
+            if (!vkmath::transform_kernel_supported(kernel)){
+                continue;
+            }
+
+            // Enough calls to get past timer resolution and frequency ramp up, a few hundred milliseconds each
+            std::vector<double> samples;
+            Clock::time_point start = Clock::now();
+            while (samples.size() < 20 || (samples.size() < 2000 && Clock::now() - start < std::chrono::milliseconds(300))){
+                Clock::time_point callStart = Clock::now();
+                vkmath::compute_mvp(kernel, viewProjection, x.data(), y.data(), z.data(), scale.data(), count, result.data());
+                samples.push_back(to_ms(Clock::now() - callStart));
+            }
+            std::sort(samples.begin(), samples.end());
+            double p50 = percentile(samples, 50.0);
+            if (kernel == TransformKernel::Scalar){
+                scalarMs = p50;
+            }
+
+            // Kernels differ in rounding only (FMA, summation order)
+            float maxError = 0.0f;
+            for (uint32_t i = 0; i < count; i++){
+                for (int k = 0; k < 16; k++){
+                    maxError = std::max(maxError, fabsf(result[i].m[k] - reference[i].m[k]));
+                }
+            }
+            if (maxError > 1e-4f){
+                printf("TRANSFORM KERNEL %s DOESN'T MATCH SCALAR (max error %g)!\n", vkmath::transform_kernel_name(kernel), maxError);
+                matched = false;
+            }
+
+            fprintf(out, "%s\n      \"%s\": {\"calls\": %zu, \"p50_ms\": %.4f, \"min_ms\": %.4f, \"ns_per_object\": %.3f, "
+                         "\"speedup\": %.2f, \"max_error\": %g}",
+                    first ? "" : ",", vkmath::transform_kernel_name(kernel), samples.size(), p50, samples.front(),
+                    p50 * 1e6 / (double)count, p50 > 0.0 ? scalarMs / p50 : 0.0, maxError);
+            first = false;
+        }
+        fprintf(out, "\n    }}%s\n", c + 1 < 2 ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+
+    if (out != stdout){
+        fclose(out);
+    }
+    return matched;
+}
@@ -0,0 +1,86 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_BENCHMARK_H
+#define VKENGINE_VK_BENCHMARK_H
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+// CPU side phases of VulkanEngine::draw(), in the order they happen
+enum class FramePhase : uint32_t {
+    FenceWait,
+    Acquire,
+    Record,
+    Submit,
+    Present,
+    Count
+};
+
+class FrameBenchmark {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Everything below is a no-op until start() is called, so draw() can always call into it
+    bool _enabled {false};
+
+    void start();
+
+    void begin_frame();
+
+    // Closes the phase that started at the previous mark (or at begin_frame)
+    void mark(FramePhase phase);
+
+    void end_frame();
+
+    // Instead of end_frame() for a frame that gave up before submitting anything (swapchain out of date).
+    // Its time goes to the next frame started, the retry.
+    void discard_frame();
+
+    void add_gpu_time(double ms);
+
+    // One sample of a per-frame count, reported with the same stats as the times
+    void add_counter(const char *name, double value);
+
+    // Extra key/value pairs written at the top of the report
+    void add_info(const char *key, const std::string &value);
+
+    uint32_t frame_count() const;
+
+    double elapsed_seconds() const;
+
+    // p-th percentile of the frame and GPU times so far, 0 without samples
+    double frame_ms(double p) const;
+    double gpu_ms(double p) const;
+
+    // Writes min/mean/percentiles as JSON, to stdout when path is empty
+    bool write_json(const std::string &path) const;
+
+private:
+    Clock::time_point _benchmarkStart;
+    Clock::time_point _frameStart;
+    Clock::time_point _lastFrameStart;
+    Clock::time_point _phaseStart;
+    bool _hasLastFrame {false};
+    // What begin_frame() replaced, for discard_frame()
+    Clock::time_point _previousFrameStart;
+    bool _hadLastFrame {false};
+
+    double _currentPhases[(uint32_t)FramePhase::Count] {};
+
+    std::vector<double> _frameTimes;
+    std::vector<double> _phaseTimes[(uint32_t)FramePhase::Count];
+    std::vector<double> _gpuTimes;
+    std::vector<std::pair<std::string, std::vector<double>>> _counters;
+
+    std::vector<std::pair<std::string, std::string>> _info;
+};
+
+// Times every transform kernel this CPU supports against the scalar one at 10k and 100k objects and
+// writes per call times and speedups as JSON, to stdout when path is empty. No Vulkan needed.
+bool run_transform_benchmark(const std::string &path);
+
+#endif //VKENGINE_VK_BENCHMARK_H
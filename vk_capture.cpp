@@ -0,0 +1,356 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_capture.h"
+#include "vk_shaders.h"
+
+#include <algorithm>
+#include <cstring>
+
+static double to_seconds(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+}
+
+static uint32_t crc_table[256];
+
+static void init_crc_table() {
+    for (uint32_t n = 0; n < 256; n++){
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++){
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t update_crc(uint32_t crc, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++){
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void put_u32(std::vector<uint8_t> &out, uint32_t value) {
+    out.push_back((uint8_t)(value >> 24));
+    out.push_back((uint8_t)(value >> 16));
+    out.push_back((uint8_t)(value >> 8));
+    out.push_back((uint8_t)value);
+}
+
+// Appends a chunk with its length and CRC, data is the chunk body
+static void put_chunk(std::vector<uint8_t> &out, const char *type, const uint8_t *data, size_t size) {
+    put_u32(out, (uint32_t)size);
+    size_t typeOffset = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+
+    uint32_t crc = update_crc(0xFFFFFFFFu, out.data() + typeOffset, size + 4);
+    put_u32(out, crc ^ 0xFFFFFFFFu);
+}
+
+bool FrameCapture::parse_format(const char *name, CaptureFormat *out) {
+    if (strcmp(name, "raw") == 0){
+        *out = CaptureFormat::Raw;
+    } else if (strcmp(name, "png") == 0){
+        *out = CaptureFormat::Png;
+    } else if (strcmp(name, "y4m") == 0){
+        *out = CaptureFormat::Y4m;
+    } else if (strcmp(name, "ffmpeg") == 0){
+        *out = CaptureFormat::Ffmpeg;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool FrameCapture::init(CaptureFormat format, const std::string &path, bool bgra) {
+    if (path.empty()){
+        return false;
+    }
+
+    _format = format;
+    _path = path;
+    _bgra = bgra;
+    if (_maxQueued < 1) _maxQueued = 1;
+
+    init_crc_table();
+
+    _stop = false;
+    _running = true;
+    _start = Clock::now();
+    _writer = std::thread(&FrameCapture::writer_loop, this);
+    return true;
+}
+
+void FrameCapture::finish() {
+    if (!_running){
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _frameReady.notify_one();
+    _writer.join();
+    _running = false;
+
+    if (_stream){
+        if (_format == CaptureFormat::Ffmpeg){
+            if (pclose(_stream) != 0){
+                printf("CAPTURE: FFMPEG EXITED WITH AN ERROR\n");
+            }
+        } else {
+            fclose(_stream);
+        }
+        _stream = nullptr;
+    }
+    _end = Clock::now();
+}
+
+void FrameCapture::submit(const void *pixels, uint32_t width, uint32_t height, uint32_t frameIndex) {
+    if (!_running){
+        return;
+    }
+
+    Frame frame;
+    frame._width = width;
+    frame._height = height;
+    frame._frameIndex = frameIndex;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_queue.size() >= _maxQueued){
+            // The disk can't keep up, wait rather than lose frames of an offline render
+            Clock::time_point stallStart = Clock::now();
+            _frameDone.wait(lock, [this]{ return _queue.size() < _maxQueued; });
+            _stallMs += to_seconds(Clock::now() - stallStart) * 1000.0;
+        }
+        if (!_free.empty()){
+            frame._pixels = std::move(_free.back());
+            _free.pop_back();
+        }
+    }
+
+    size_t size = (size_t)width * height * 4;
+    frame._pixels.resize(size);
+    memcpy(frame._pixels.data(), pixels, size);
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(std::move(frame));
+    }
+    _frameReady.notify_one();
+}
+
+CaptureStats FrameCapture::stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    CaptureStats stats;
+    stats._framesWritten = _framesWritten;
+    stats._framesSkipped = _framesSkipped;
+    stats._bytesWritten = _bytesWritten;
+    stats._stallMs = _stallMs;
+    if (_busySeconds > 0.0){
+        stats._framesPerSecond = _framesWritten / _busySeconds;
+    }
+    double wallSeconds = to_seconds((_running ? Clock::now() : _end) - _start);
+    if (wallSeconds > 0.0){
+        stats._wallFramesPerSecond = _framesWritten / wallSeconds;
+    }
+    return stats;
+}
+
+void FrameCapture::writer_loop() {
+    while (true){
+        Frame frame;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _frameReady.wait(lock, [this]{ return _stop || !_queue.empty(); });
+            if (_queue.empty()){
+                return;
+            }
+            frame = std::move(_queue.front());
+            _queue.pop_front();
+        }
+
+        Clock::time_point writeStart = Clock::now();
+
+        if (_bgra){
+            // Swapchains are usually BGRA, everything we write wants RGBA
+            uint8_t *texel = frame._pixels.data();
+            for (size_t i = 0; i < frame._pixels.size(); i += 4){
+                std::swap(texel[i], texel[i + 2]);
+            }
+        }
+
+        size_t written = 0;
+        switch (_format){
+            case CaptureFormat::Raw: written = write_raw(frame); break;
+            case CaptureFormat::Png: written = write_png(frame); break;
+            case CaptureFormat::Y4m: written = write_y4m(frame); break;
+            case CaptureFormat::Ffmpeg: written = write_ffmpeg(frame); break;
+        }
+
+        double busy = to_seconds(Clock::now() - writeStart);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (written != 0){
+                _framesWritten++;
+                _bytesWritten += written;
+            } else {
+                _framesSkipped++;
+            }
+            _busySeconds += busy;
+            _free.push_back(std::move(frame._pixels));
+        }
+        _frameDone.notify_one();
+    }
+}
+
+size_t FrameCapture::write_raw(const Frame &frame) {
+    char name[1024];
+    snprintf(name, sizeof(name), "%s_%05u.rgba", _path.c_str(), frame._frameIndex);
+
+    FILE *file = fopen(name, "wb");
+    if (!file){
+        printf("CAPTURE: FAILED TO OPEN %s\n", name);
+        return 0;
+    }
+    size_t written = fwrite(frame._pixels.data(), 1, frame._pixels.size(), file);
+    fclose(file);
+    return written == frame._pixels.size() ? written : 0;
+}
+
+size_t FrameCapture::write_png(const Frame &frame) {
+    // Filter byte plus RGB per row, the zlib stream wraps it in stored deflate blocks.
+    // Compressing would make the writer the bottleneck, PNG here is about being readable everywhere.
+    size_t rowSize = 1 + (size_t)frame._width * 3;
+    size_t rawSize = rowSize * frame._height;
+
+    std::vector<uint8_t> &raw = _scratch;
+    raw.resize(rawSize);
+    for (uint32_t y = 0; y < frame._height; y++){
+        uint8_t *row = raw.data() + y * rowSize;
+        const uint8_t *texel = frame._pixels.data() + (size_t)y * frame._width * 4;
+        row[0] = 0;
+        for (uint32_t x = 0; x < frame._width; x++){
+            row[1 + x * 3 + 0] = texel[x * 4 + 0];
+            row[1 + x * 3 + 1] = texel[x * 4 + 1];
+            row[1 + x * 3 + 2] = texel[x * 4 + 2];
+        }
+    }
+
+    std::vector<uint8_t> zlib;
+    zlib.reserve(rawSize + rawSize / 65535 * 5 + 16);
+    // CMF/FLG for deflate with a 32K window and no preset dictionary
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+
+    uint32_t adlerA = 1, adlerB = 0;
+    for (size_t offset = 0; offset < rawSize || offset == 0; ){
+        size_t blockSize = std::min<size_t>(rawSize - offset, 65535);
+        bool last = offset + blockSize == rawSize;
+
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back((uint8_t)blockSize);
+        zlib.push_back((uint8_t)(blockSize >> 8));
+        zlib.push_back((uint8_t)~blockSize);
+        zlib.push_back((uint8_t)(~blockSize >> 8));
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + blockSize);
+
+        for (size_t i = offset; i < offset + blockSize; i++){
+            adlerA = (adlerA + raw[i]) % 65521;
+            adlerB = (adlerB + adlerA) % 65521;
+        }
+
+        offset += blockSize;
+        if (last) break;
+    }
+    put_u32(zlib, (adlerB << 16) | adlerA);
+
+    std::vector<uint8_t> png;
+    png.reserve(zlib.size() + 64);
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    png.insert(png.end(), signature, signature + 8);
+
+    std::vector<uint8_t> header;
+    put_u32(header, frame._width);
+    put_u32(header, frame._height);
+    // 8 bit RGB, default compression and filtering, not interlaced
+    header.insert(header.end(), {8, 2, 0, 0, 0});
+    put_chunk(png, "IHDR", header.data(), header.size());
+    put_chunk(png, "IDAT", zlib.data(), zlib.size());
+    put_chunk(png, "IEND", nullptr, 0);
+
+    char name[1024];
+    snprintf(name, sizeof(name), "%s_%05u.png", _path.c_str(), frame._frameIndex);
+
+    FILE *file = fopen(name, "wb");
+    if (!file){
+        printf("CAPTURE: FAILED TO OPEN %s\n", name);
+        return 0;
+    }
+    size_t written = fwrite(png.data(), 1, png.size(), file);
+    fclose(file);
+    return written == png.size() ? written : 0;
+}
+
+size_t FrameCapture::write_y4m(const Frame &frame) {
+    if (!_stream){
+        _stream = fopen(_path.c_str(), "wb");
+        if (!_stream){
+            printf("CAPTURE: FAILED TO OPEN %s\n", _path.c_str());
+            return 0;
+        }
+        _streamWidth = frame._width;
+        _streamHeight = frame._height;
+        fprintf(_stream, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", _streamWidth, _streamHeight, _fps);
+    }
+    if (frame._width != _streamWidth || frame._height != _streamHeight){
+        return 0;
+    }
+
+    // BT.601 limited range, what players assume when the header doesn't say
+    size_t planeSize = (size_t)frame._width * frame._height;
+    std::vector<uint8_t> &yuv = _scratch;
+    yuv.resize(planeSize * 3);
+    for (size_t i = 0; i < planeSize; i++){
+        int r = frame._pixels[i * 4 + 0];
+        int g = frame._pixels[i * 4 + 1];
+        int b = frame._pixels[i * 4 + 2];
+        yuv[i] = (uint8_t)(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+        yuv[planeSize + i] = (uint8_t)(128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+        yuv[planeSize * 2 + i] = (uint8_t)(128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
+    }
+
+    fputs("FRAME\n", _stream);
+    size_t written = fwrite(yuv.data(), 1, yuv.size(), _stream);
+    return written == yuv.size() ? written + 6 : 0;
+}
+
+size_t FrameCapture::write_ffmpeg(const Frame &frame) {
+    if (!_stream){
+        _streamWidth = frame._width;
+        _streamHeight = frame._height;
+
+        // yuv420p needs even dimensions, odd ones get a padding row or column
+        char command[256];
+        snprintf(command, sizeof(command),
+                 "ffmpeg -loglevel error -y -f rawvideo -pix_fmt rgba -s %ux%u -r %u -i - "
+                 "-vf 'pad=ceil(iw/2)*2:ceil(ih/2)*2' -pix_fmt yuv420p ",
+                 _streamWidth, _streamHeight, _fps);
+        _stream = popen((command + shell_quote(_path)).c_str(), "w");
+        if (!_stream){
+            printf("CAPTURE: FAILED TO START FFMPEG\n");
+            return 0;
+        }
+    }
+    if (frame._width != _streamWidth || frame._height != _streamHeight){
+        return 0;
+    }
+
+    size_t written = fwrite(frame._pixels.data(), 1, frame._pixels.size(), _stream);
+    return written == frame._pixels.size() ? written : 0;
+}
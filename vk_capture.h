@@ -0,0 +1,115 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_CAPTURE_H
+#define VKENGINE_VK_CAPTURE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class CaptureFormat {
+    // One <path>_NNNNN.rgba file per frame, tightly packed RGBA8
+    Raw,
+    // One <path>_NNNNN.png file per frame, RGB8 with stored (uncompressed) deflate blocks
+    Png,
+    // Every frame into the single YUV4MPEG2 stream at <path>, 4:4:4 so there's no chroma filtering to do
+    Y4m,
+    // Raw frames piped into ffmpeg, which encodes to <path> in whatever its extension says
+    Ffmpeg,
+};
+
+struct CaptureStats {
+    uint32_t _framesWritten {0};
+    // Y4M and ffmpeg streams can't change size, frames after a resize are dropped
+    uint32_t _framesSkipped {0};
+    uint64_t _bytesWritten {0};
+    // Over the time the writer was actually busy, and over the whole capture
+    double _framesPerSecond {0.0};
+    double _wallFramesPerSecond {0.0};
+    // Time submit() spent waiting because the writer fell _maxQueued frames behind
+    double _stallMs {0.0};
+};
+
+// Writes captured frames to disk from a background thread so the frame loop only pays for a memcpy
+class FrameCapture {
+public:
+    // Frames waiting for the writer before submit() starts blocking, the capture never drops frames
+    uint32_t _maxQueued {8};
+    // Only written into the stream headers
+    uint32_t _fps {60};
+
+    static bool parse_format(const char *name, CaptureFormat *out);
+
+    // bgra swaps the red and blue channel of every submitted frame
+    bool init(CaptureFormat format, const std::string &path, bool bgra);
+
+    // Writes out everything queued and closes the stream
+    void finish();
+
+    bool active() const { return _running; }
+
+    // pixels are width * height tightly packed 4 byte texels, copied before returning
+    void submit(const void *pixels, uint32_t width, uint32_t height, uint32_t frameIndex);
+
+    CaptureStats stats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Frame {
+        std::vector<uint8_t> _pixels;
+        uint32_t _width;
+        uint32_t _height;
+        uint32_t _frameIndex;
+    };
+
+    void writer_loop();
+
+    // Each returns the bytes written, 0 on failure
+    size_t write_raw(const Frame &frame);
+    size_t write_png(const Frame &frame);
+    size_t write_y4m(const Frame &frame);
+    size_t write_ffmpeg(const Frame &frame);
+
+    CaptureFormat _format {CaptureFormat::Png};
+    std::string _path;
+    bool _bgra {false};
+    bool _running {false};
+
+    // Y4M file or ffmpeg pipe, opened on the first frame once its size is known
+    FILE *_stream {nullptr};
+    uint32_t _streamWidth {0};
+    uint32_t _streamHeight {0};
+
+    // Writer thread scratch
+    std::vector<uint8_t> _scratch;
+
+    std::thread _writer;
+    mutable std::mutex _mutex;
+    std::condition_variable _frameReady;
+    std::condition_variable _frameDone;
+    std::deque<Frame> _queue;
+    // Pixel storage handed back by the writer, reused so capturing doesn't allocate every frame
+    std::vector<std::vector<uint8_t>> _free;
+    bool _stop {false};
+
+    // Guarded by _mutex
+    uint32_t _framesWritten {0};
+    uint32_t _framesSkipped {0};
+    uint64_t _bytesWritten {0};
+    double _busySeconds {0.0};
+    double _stallMs {0.0};
+    Clock::time_point _start;
+    Clock::time_point _end;
+};
+
+
+#endif //VKENGINE_VK_CAPTURE_H
@@ -0,0 +1,184 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_command_recorder.h"
+
+#include <algorithm>
+#include <cstring>
+
+const char *bind_kind_name(BindKind kind) {
+    static const char *names[] = {"pipeline", "descriptor_set", "vertex_buffer", "index_buffer",
+                                  "viewport", "scissor", "push_constants"};
+    return names[(uint32_t)kind];
+}
+
+uint32_t CommandStats::issued() const {
+    uint32_t total = 0;
+    for (uint32_t count : _issued) total += count;
+    return total;
+}
+
+uint32_t CommandStats::skipped() const {
+    uint32_t total = 0;
+    for (uint32_t count : _skipped) total += count;
+    return total;
+}
+
+void CommandStats::add(const CommandStats &other) {
+    for (uint32_t i = 0; i < (uint32_t)BindKind::Count; i++){
+        _issued[i] += other._issued[i];
+        _skipped[i] += other._skipped[i];
+    }
+    _draws += other._draws;
+    _triangles += other._triangles;
+}
+
+static uint32_t bind_point_index(VkPipelineBindPoint bindPoint) {
+    return bindPoint == VK_PIPELINE_BIND_POINT_COMPUTE ? 1 : 0;
+}
+
+void CommandRecorder::begin(VkCommandBuffer cmd) {
+    _cmd = cmd;
+    _stats = {};
+    invalidate();
+}
+
+void CommandRecorder::invalidate() {
+    for (BindPointState &state : _bindPoints){
+        state = {};
+    }
+    std::fill(std::begin(_vertexBuffers), std::end(_vertexBuffers), VkBuffer(VK_NULL_HANDLE));
+    _indexBuffer = VK_NULL_HANDLE;
+    _viewportSet = false;
+    _scissorSet = false;
+    _pushLayout = VK_NULL_HANDLE;
+}
+
+bool CommandRecorder::issue(BindKind kind, bool redundant) {
+    if (redundant){
+        _stats._skipped[(uint32_t)kind]++;
+        return false;
+    }
+    _stats._issued[(uint32_t)kind]++;
+    return true;
+}
+
+void CommandRecorder::bind_pipeline(VkPipelineBindPoint bindPoint, VkPipeline pipeline) {
+    BindPointState &state = _bindPoints[bind_point_index(bindPoint)];
+    if (!issue(BindKind::Pipeline, state._pipeline == pipeline)){
+        return;
+    }
+    state._pipeline = pipeline;
+    vkCmdBindPipeline(_cmd, bindPoint, pipeline);
+}
+
+void CommandRecorder::bind_descriptor_sets(VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t firstSet,
+                                           uint32_t setCount, const VkDescriptorSet *sets,
+                                           uint32_t dynamicOffsetCount, const uint32_t *dynamicOffsets) {
+    BindPointState &state = _bindPoints[bind_point_index(bindPoint)];
+
+    bool redundant = dynamicOffsetCount == 0 && state._layout == layout && firstSet + setCount <= MAX_SETS;
+    for (uint32_t i = 0; redundant && i < setCount; i++){
+        redundant = state._sets[firstSet + i] == sets[i];
+    }
+    if (!issue(BindKind::DescriptorSet, redundant)){
+        return;
+    }
+
+    // A different layout may disturb sets outside the range too, only what was just bound is known
+    if (state._layout != layout){
+        std::fill(std::begin(state._sets), std::end(state._sets), VkDescriptorSet(VK_NULL_HANDLE));
+        state._layout = layout;
+    }
+    for (uint32_t i = 0; i < setCount && firstSet + i < MAX_SETS; i++){
+        state._sets[firstSet + i] = dynamicOffsetCount == 0 ? sets[i] : VK_NULL_HANDLE;
+    }
+    vkCmdBindDescriptorSets(_cmd, bindPoint, layout, firstSet, setCount, sets, dynamicOffsetCount, dynamicOffsets);
+}
+
+void CommandRecorder::bind_vertex_buffers(uint32_t firstBinding, uint32_t bindingCount, const VkBuffer *buffers,
+                                          const VkDeviceSize *offsets) {
+    bool redundant = firstBinding + bindingCount <= MAX_VERTEX_BINDINGS;
+    for (uint32_t i = 0; redundant && i < bindingCount; i++){
+        redundant = _vertexBuffers[firstBinding + i] == buffers[i] && _vertexOffsets[firstBinding + i] == offsets[i];
+    }
+    if (!issue(BindKind::VertexBuffer, redundant)){
+        return;
+    }
+
+    for (uint32_t i = 0; i < bindingCount && firstBinding + i < MAX_VERTEX_BINDINGS; i++){
+        _vertexBuffers[firstBinding + i] = buffers[i];
+        _vertexOffsets[firstBinding + i] = offsets[i];
+    }
+    vkCmdBindVertexBuffers(_cmd, firstBinding, bindingCount, buffers, offsets);
+}
+
+void CommandRecorder::bind_index_buffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType indexType) {
+    bool redundant = _indexBuffer == buffer && _indexOffset == offset && _indexType == indexType;
+    if (!issue(BindKind::IndexBuffer, redundant)){
+        return;
+    }
+    _indexBuffer = buffer;
+    _indexOffset = offset;
+    _indexType = indexType;
+    vkCmdBindIndexBuffer(_cmd, buffer, offset, indexType);
+}
+
+void CommandRecorder::set_viewport(const VkViewport &viewport) {
+    bool redundant = _viewportSet && memcmp(&_viewport, &viewport, sizeof(viewport)) == 0;
+    if (!issue(BindKind::Viewport, redundant)){
+        return;
+    }
+    _viewportSet = true;
+    _viewport = viewport;
+    vkCmdSetViewport(_cmd, 0, 1, &viewport);
+}
+
+void CommandRecorder::set_scissor(const VkRect2D &scissor) {
+    bool redundant = _scissorSet && memcmp(&_scissor, &scissor, sizeof(scissor)) == 0;
+    if (!issue(BindKind::Scissor, redundant)){
+        return;
+    }
+    _scissorSet = true;
+    _scissor = scissor;
+    vkCmdSetScissor(_cmd, 0, 1, &scissor);
+}
+
+void CommandRecorder::push_constants(VkPipelineLayout layout, VkShaderStageFlags stages, uint32_t offset, uint32_t size,
+                                     const void *data) {
+    bool redundant = _pushLayout == layout && _pushStages == stages && _pushOffset == offset &&
+                     _pushData.size() == size && memcmp(_pushData.data(), data, size) == 0;
+    if (!issue(BindKind::PushConstants, redundant)){
+        return;
+    }
+    _pushLayout = layout;
+    _pushStages = stages;
+    _pushOffset = offset;
+    _pushData.assign((const uint8_t *)data, (const uint8_t *)data + size);
+    vkCmdPushConstants(_cmd, layout, stages, offset, size, data);
+}
+
+void CommandRecorder::draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex, uint32_t firstInstance) {
+    _stats._draws++;
+    _stats._triangles += (uint64_t)(vertexCount / 3) * instanceCount;
+    vkCmdDraw(_cmd, vertexCount, instanceCount, firstVertex, firstInstance);
+}
+
+void CommandRecorder::draw_indexed(uint32_t indexCount, uint32_t instanceCount, uint32_t firstIndex,
+                                   int32_t vertexOffset, uint32_t firstInstance) {
+    _stats._draws++;
+    _stats._triangles += (uint64_t)(indexCount / 3) * instanceCount;
+    vkCmdDrawIndexed(_cmd, indexCount, instanceCount, firstIndex, vertexOffset, firstInstance);
+}
+
+void CommandRecorder::draw_indexed_indirect(VkBuffer buffer, VkDeviceSize offset, uint32_t drawCount, uint32_t stride) {
+    _stats._draws++;
+    vkCmdDrawIndexedIndirect(_cmd, buffer, offset, drawCount, stride);
+}
+
+void CommandRecorder::draw_indexed_indirect_count(VkBuffer buffer, VkDeviceSize offset, VkBuffer countBuffer,
+                                                  VkDeviceSize countOffset, uint32_t maxDrawCount, uint32_t stride) {
+    _stats._draws++;
+    vkCmdDrawIndexedIndirectCount(_cmd, buffer, offset, countBuffer, countOffset, maxDrawCount, stride);
+}
@@ -0,0 +1,126 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_COMMAND_RECORDER_H
+#define VKENGINE_VK_COMMAND_RECORDER_H
+
+#include "vk_types.h"
+#include <vector>
+
+enum class BindKind : uint32_t {
+    Pipeline,
+    DescriptorSet,
+    VertexBuffer,
+    IndexBuffer,
+    Viewport,
+    Scissor,
+    PushConstants,
+    Count
+};
+
+const char *bind_kind_name(BindKind kind);
+
+struct CommandStats {
+    uint32_t _issued[(uint32_t)BindKind::Count] {};
+    uint32_t _skipped[(uint32_t)BindKind::Count] {};
+    uint32_t _draws {0};
+    // Triangle lists only, GPU written indirect counts aren't known here
+    uint64_t _triangles {0};
+
+    uint32_t issued() const;
+    uint32_t skipped() const;
+
+    void add(const CommandStats &other);
+};
+
+// Sits between the engine and the vkCmd* calls for one command buffer. Remembers what is bound and
+// drops binds that wouldn't change anything, so callers can simply bind what they need before each draw.
+// Every pipeline here keeps viewport and scissor dynamic, binding one never clobbers them.
+class CommandRecorder {
+public:
+    // Forgets all state, a fresh command buffer (secondaries included) starts with nothing bound
+    void begin(VkCommandBuffer cmd);
+
+    VkCommandBuffer cmd() const { return _cmd; }
+
+    // Something was recorded on cmd() behind the recorder's back, bind everything again
+    void invalidate();
+
+    void bind_pipeline(VkPipelineBindPoint bindPoint, VkPipeline pipeline);
+
+    // Sets bound with dynamic offsets are always issued
+    void bind_descriptor_sets(VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t firstSet,
+                              uint32_t setCount, const VkDescriptorSet *sets,
+                              uint32_t dynamicOffsetCount = 0, const uint32_t *dynamicOffsets = nullptr);
+
+    void bind_vertex_buffers(uint32_t firstBinding, uint32_t bindingCount, const VkBuffer *buffers,
+                             const VkDeviceSize *offsets);
+
+    void bind_index_buffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType indexType);
+
+    void set_viewport(const VkViewport &viewport);
+
+    void set_scissor(const VkRect2D &scissor);
+
+    void push_constants(VkPipelineLayout layout, VkShaderStageFlags stages, uint32_t offset, uint32_t size,
+                        const void *data);
+
+    void draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex, uint32_t firstInstance);
+
+    void draw_indexed(uint32_t indexCount, uint32_t instanceCount, uint32_t firstIndex, int32_t vertexOffset,
+                      uint32_t firstInstance);
+
+    void draw_indexed_indirect(VkBuffer buffer, VkDeviceSize offset, uint32_t drawCount, uint32_t stride);
+
+    void draw_indexed_indirect_count(VkBuffer buffer, VkDeviceSize offset, VkBuffer countBuffer,
+                                     VkDeviceSize countOffset, uint32_t maxDrawCount, uint32_t stride);
+
+    // For indirect draws whose commands the CPU wrote, direct draws count their own
+    void add_triangles(uint64_t triangles) { _stats._triangles += triangles; }
+
+    // Since begin()
+    const CommandStats &stats() const { return _stats; }
+
+private:
+    static constexpr uint32_t MAX_SETS = 8;
+    static constexpr uint32_t MAX_VERTEX_BINDINGS = 8;
+    // Graphics and compute, the only bind points used
+    static constexpr uint32_t BIND_POINTS = 2;
+
+    struct BindPointState {
+        VkPipeline _pipeline {VK_NULL_HANDLE};
+        // Sets are only known to be bound for this layout, another layout rebinds everything
+        VkPipelineLayout _layout {VK_NULL_HANDLE};
+        VkDescriptorSet _sets[MAX_SETS] {};
+    };
+
+    // Counts the bind and returns true when it has to be recorded
+    bool issue(BindKind kind, bool redundant);
+
+    VkCommandBuffer _cmd {VK_NULL_HANDLE};
+    CommandStats _stats;
+
+    BindPointState _bindPoints[BIND_POINTS];
+
+    VkBuffer _vertexBuffers[MAX_VERTEX_BINDINGS] {};
+    VkDeviceSize _vertexOffsets[MAX_VERTEX_BINDINGS] {};
+
+    VkBuffer _indexBuffer {VK_NULL_HANDLE};
+    VkDeviceSize _indexOffset {0};
+    VkIndexType _indexType {VK_INDEX_TYPE_UINT32};
+
+    bool _viewportSet {false};
+    VkViewport _viewport {};
+    bool _scissorSet {false};
+    VkRect2D _scissor {};
+
+    // Only the last push is remembered, enough for the one block every layout here has
+    VkPipelineLayout _pushLayout {VK_NULL_HANDLE};
+    VkShaderStageFlags _pushStages {0};
+    uint32_t _pushOffset {0};
+    std::vector<uint8_t> _pushData;
+};
+
+
+#endif //VKENGINE_VK_COMMAND_RECORDER_H
@@ -0,0 +1,213 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_culling.h"
+#include "vk_initalizers.h"
+
+#include <cstring>
+
+static constexpr uint32_t CULL_GROUP_SIZE = 256;
+
+static void memory_barrier(VkCommandBuffer cmd, VkPipelineStageFlags srcStages, VkAccessFlags srcAccess,
+                           VkPipelineStageFlags dstStages, VkAccessFlags dstAccess) {
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.pNext = nullptr;
+    barrier.srcAccessMask = srcAccess;
+    barrier.dstAccessMask = dstAccess;
+
+    vkCmdPipelineBarrier(cmd, srcStages, dstStages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+bool GpuCulling::init(VkDevice device, GpuAllocator &allocator, DescriptorLayoutCache &layoutCache, uint32_t frameCount) {
+    _device = device;
+    _allocator = &allocator;
+    _layoutCache = &layoutCache;
+    _frames.resize(frameCount);
+
+    // Has to match what record_cull() binds, the cache hands the same layout back there
+    VkDescriptorSetLayoutBinding bindings[5];
+    for (uint32_t i = 0; i < 5; i++){
+        bindings[i] = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, i);
+    }
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.pNext = nullptr;
+    layoutInfo.flags = 0;
+    layoutInfo.bindingCount = 5;
+    layoutInfo.pBindings = bindings;
+
+    _setLayout = _layoutCache->create_layout(layoutInfo);
+    return _setLayout != VK_NULL_HANDLE;
+}
+
+void GpuCulling::destroy() {
+    if (_device == VK_NULL_HANDLE){
+        return;
+    }
+
+    for (Frame &frame : _frames){
+        _allocator->destroy_buffer(frame._instances);
+        _allocator->destroy_buffer(frame._counts);
+        _allocator->destroy_buffer(frame._commands);
+    }
+    _frames.clear();
+    _allocator->destroy_buffer(_objects);
+    _allocator->destroy_buffer(_batches);
+    _device = VK_NULL_HANDLE;
+}
+
+bool GpuCulling::upload(StreamingUploader &uploader, const RenderObjectList &objects, const std::vector<DrawBatch> &batches,
+                        const std::vector<Mesh> &meshes, uint32_t materialCount, uint64_t orderedMaterials) {
+    _objectCount = objects.size();
+    _batchCount = (uint32_t)batches.size();
+    _materialCount = materialCount;
+
+    // Zero sized buffers aren't allowed
+    if (_objectCount == 0 || _batchCount == 0 || _materialCount == 0){
+        _objectCount = 0;
+        return true;
+    }
+
+    std::vector<uint8_t> objectData(_objectCount * sizeof(CullObject));
+    CullObject *cullObjects = (CullObject *)objectData.data();
+    std::vector<uint8_t> batchData(_batchCount * sizeof(CullBatch));
+    CullBatch *cullBatches = (CullBatch *)batchData.data();
+
+    // Batches are sorted by material, so each material's batches are numbered from the start of its run
+    uint32_t materialSlot = 0;
+    for (uint32_t b = 0; b < _batchCount; b++){
+        const DrawBatch &batch = batches[b];
+        const Mesh &mesh = meshes[batch._mesh];
+        materialSlot = b > 0 && batches[b - 1]._material == batch._material ? materialSlot + 1 : 0;
+        bool ordered = batch._material < 64 && (orderedMaterials >> batch._material) & 1;
+        cullBatches[b] = {mesh._indexCount, mesh._firstIndex, mesh._vertexOffset, batch._firstObject, batch._material,
+                          batch._count, materialSlot, ordered ? 1u : 0u};
+
+        for (uint32_t i = batch._firstObject; i < batch._firstObject + batch._count; i++){
+            CullObject &object = cullObjects[i];
+            object.position[0] = objects._positionX[i];
+            object.position[1] = objects._positionY[i];
+            object.position[2] = objects._positionZ[i];
+            object.scale = objects._scale[i];
+            object.radius = mesh._radius * objects._scale[i];
+            object.batch = b;
+            object.pad[0] = 0;
+            object.pad[1] = 0;
+        }
+    }
+
+    const VkBufferUsageFlags staticUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (!_allocator->create_buffer(objectData.size(), staticUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &_objects) ||
+        !_allocator->create_buffer(batchData.size(), staticUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &_batches)){
+        return false;
+    }
+
+    // Every frame in flight culls into its own outputs, so culling the next frame never waits on drawing this one
+    for (Frame &frame : _frames){
+        if (!_allocator->create_buffer(_objectCount * sizeof(InstanceData),
+                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame._instances) ||
+            !_allocator->create_buffer((_batchCount + _materialCount) * sizeof(uint32_t),
+                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame._counts) ||
+            !_allocator->create_buffer(_materialCount * _batchCount * sizeof(VkDrawIndexedIndirectCommand),
+                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame._commands)){
+            return false;
+        }
+    }
+
+    BufferUpload objectTarget;
+    objectTarget._buffer = _objects._buffer;
+    objectTarget._dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    objectTarget._dstAccess = VK_ACCESS_SHADER_READ_BIT;
+    uploader.upload_buffer(objectTarget, std::move(objectData));
+
+    BufferUpload batchTarget;
+    batchTarget._buffer = _batches._buffer;
+    batchTarget._dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    batchTarget._dstAccess = VK_ACCESS_SHADER_READ_BIT;
+    _uploadTicket = uploader.upload_buffer(batchTarget, std::move(batchData));
+    return true;
+}
+
+bool GpuCulling::record_cull(VkCommandBuffer cmd, uint32_t frameIndex, DescriptorAllocator &descriptors,
+                             VkPipeline pipeline, VkPipelineLayout layout) {
+    if (_objectCount == 0){
+        return true;
+    }
+    const Frame &frame = _frames[frameIndex];
+
+    // A fresh set every frame costs next to nothing out of the frame's pools, and never races an earlier frame
+    VkDescriptorSet set;
+    bool built = DescriptorBuilder::begin(*_layoutCache, descriptors)
+            .bind_buffer(0, {_objects._buffer, 0, VK_WHOLE_SIZE}, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+            .bind_buffer(1, {_batches._buffer, 0, VK_WHOLE_SIZE}, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+            .bind_buffer(2, {frame._instances._buffer, 0, VK_WHOLE_SIZE}, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+            .bind_buffer(3, {frame._counts._buffer, 0, VK_WHOLE_SIZE}, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+            .bind_buffer(4, {frame._commands._buffer, 0, VK_WHOLE_SIZE}, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT)
+            .build(&set);
+    if (!built){
+        return false;
+    }
+
+    // The last frame to use these outputs drew from them, don't reset the counts under it
+    memory_barrier(cmd, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+                   VK_PIPELINE_STAGE_TRANSFER_BIT, 0);
+    vkCmdFillBuffer(cmd, frame._counts._buffer, 0, VK_WHOLE_SIZE, 0);
+    memory_barrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, layout, 0, 1, &set, 0, nullptr);
+
+    CullPushConstants constants;
+    memcpy(constants.planes, _frustum, sizeof(_frustum));
+    constants.objectCount = _objectCount;
+    constants.batchCount = _batchCount;
+    constants.materialCount = _materialCount;
+
+    constants.phase = 0;
+    vkCmdPushConstants(cmd, layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(cmd, (_objectCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    // Batch counts have to be final before any batch becomes a draw
+    memory_barrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+    constants.phase = 1;
+    vkCmdPushConstants(cmd, layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkCmdDispatch(cmd, (_batchCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    memory_barrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                   VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                   VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+    return true;
+}
+
+VkBuffer GpuCulling::instance_buffer(uint32_t frameIndex) const {
+    return _frames[frameIndex]._instances._buffer;
+}
+
+VkBuffer GpuCulling::command_buffer(uint32_t frameIndex) const {
+    return _frames[frameIndex]._commands._buffer;
+}
+
+VkDeviceSize GpuCulling::command_offset(uint32_t material) const {
+    return (VkDeviceSize)material * _batchCount * sizeof(VkDrawIndexedIndirectCommand);
+}
+
+VkBuffer GpuCulling::count_buffer(uint32_t frameIndex) const {
+    return _frames[frameIndex]._counts._buffer;
+}
+
+VkDeviceSize GpuCulling::count_offset(uint32_t material) const {
+    return (VkDeviceSize)(_batchCount + material) * sizeof(uint32_t);
+}
+
+uint32_t GpuCulling::max_draws() const {
+    return _batchCount;
+}
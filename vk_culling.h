@@ -0,0 +1,121 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_CULLING_H
+#define VKENGINE_VK_CULLING_H
+
+#include "vk_types.h"
+#include "vk_allocator.h"
+#include "vk_descriptors.h"
+#include "vk_mesh.h"
+#include "vk_render_objects.h"
+#include "vk_upload.h"
+#include <vector>
+
+// What cull.comp reads per object, laid out to match std430
+struct CullObject {
+    float position[3];
+    float scale;
+    // Mesh radius times scale
+    float radius;
+    uint32_t batch;
+    uint32_t pad[2];
+};
+
+// One per DrawBatch, the draw it turns into when anything in it is visible
+struct CullBatch {
+    uint32_t indexCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+    uint32_t material;
+    uint32_t objectCount;
+    // Position among the material's batches
+    uint32_t materialSlot;
+    // Blended, the objects stay in their sorted order
+    uint32_t ordered;
+};
+
+struct CullPushConstants {
+    float planes[6][4];
+    uint32_t objectCount;
+    uint32_t batchCount;
+    uint32_t materialCount;
+    uint32_t phase;
+};
+
+// Frustum culling on the GPU. The first dispatch tests every object's bounding sphere and appends the
+// survivors to their batch's instance range, the second turns every batch with survivors into an indexed
+// draw in its material's command range. The draw pass then issues one vkCmdDrawIndexedIndirectCount per
+// material, so the CPU never looks at individual objects.
+class GpuCulling {
+public:
+    // Clip space planes, xyz normal and w distance. There's no camera yet and objects are placed
+    // straight in clip space, so this starts out as the clip volume itself.
+    float _frustum[6][4] {
+            {1.0f, 0.0f, 0.0f, 1.0f},
+            {-1.0f, 0.0f, 0.0f, 1.0f},
+            {0.0f, 1.0f, 0.0f, 1.0f},
+            {0.0f, -1.0f, 0.0f, 1.0f},
+            {0.0f, 0.0f, 1.0f, 0.0f},
+            {0.0f, 0.0f, -1.0f, 1.0f},
+    };
+
+    // Object bounds and batches, check it before culling
+    UploadTicket _uploadTicket {0};
+
+    // Storage buffers 0-4: objects, batches, instances, counts, commands. Owned by the layout cache.
+    VkDescriptorSetLayout _setLayout {VK_NULL_HANDLE};
+
+    // Only gets the set layout, pipelines need it before the scene exists
+    bool init(VkDevice device, GpuAllocator &allocator, DescriptorLayoutCache &layoutCache, uint32_t frameCount);
+
+    void destroy();
+
+    // objects must already be sorted into batches. Creates the buffers and streams the bounds in,
+    // the object list can change afterwards without affecting what gets culled. Bit n of orderedMaterials
+    // keeps material n's objects in their sorted order when culled (blended materials). Nothing to do
+    // for an empty scene, record_cull() then records nothing either.
+    bool upload(StreamingUploader &uploader, const RenderObjectList &objects, const std::vector<DrawBatch> &batches,
+                const std::vector<Mesh> &meshes, uint32_t materialCount, uint64_t orderedMaterials);
+
+    // Outside a render pass, once the frame that last used frameIndex has finished.
+    // The set comes out of descriptors, which has to be that frame's allocator.
+    bool record_cull(VkCommandBuffer cmd, uint32_t frameIndex, DescriptorAllocator &descriptors,
+                     VkPipeline pipeline, VkPipelineLayout layout);
+
+    // Bind as vertex binding 1, compacted per batch starting at the batch's first object
+    VkBuffer instance_buffer(uint32_t frameIndex) const;
+
+    VkBuffer command_buffer(uint32_t frameIndex) const;
+    VkDeviceSize command_offset(uint32_t material) const;
+
+    VkBuffer count_buffer(uint32_t frameIndex) const;
+    VkDeviceSize count_offset(uint32_t material) const;
+
+    // Most draws any one material can end up with
+    uint32_t max_draws() const;
+
+private:
+    struct Frame {
+        AllocatedBuffer _instances;
+        AllocatedBuffer _counts;
+        AllocatedBuffer _commands;
+    };
+
+    VkDevice _device {VK_NULL_HANDLE};
+    GpuAllocator *_allocator {nullptr};
+    DescriptorLayoutCache *_layoutCache {nullptr};
+
+    AllocatedBuffer _objects;
+    AllocatedBuffer _batches;
+    std::vector<Frame> _frames;
+
+    uint32_t _objectCount {0};
+    uint32_t _batchCount {0};
+    uint32_t _materialCount {0};
+};
+
+
+#endif //VKENGINE_VK_CULLING_H
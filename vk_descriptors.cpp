@@ -0,0 +1,367 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_descriptors.h"
+#include "vk_initalizers.h"
+
+#include <algorithm>
+
+void DescriptorAllocator::init(VkDevice device) {
+    _device = device;
+    _nextPoolSets = _setsPerPool;
+}
+
+void DescriptorAllocator::destroy() {
+    for (VkDescriptorPool pool : _usedPools){
+        vkDestroyDescriptorPool(_device, pool, nullptr);
+    }
+    for (VkDescriptorPool pool : _freePools){
+        vkDestroyDescriptorPool(_device, pool, nullptr);
+    }
+    _usedPools.clear();
+    _freePools.clear();
+    _currentPool = VK_NULL_HANDLE;
+}
+
+void DescriptorAllocator::reset() {
+    for (VkDescriptorPool pool : _usedPools){
+        vkResetDescriptorPool(_device, pool, 0);
+        _freePools.push_back(pool);
+    }
+    _usedPools.clear();
+    _currentPool = VK_NULL_HANDLE;
+}
+
+VkDescriptorPool DescriptorAllocator::create_pool() {
+    uint32_t sets = _nextPoolSets;
+    _nextPoolSets = std::min(_nextPoolSets * 2, _maxSetsPerPool);
+
+    std::vector<VkDescriptorPoolSize> sizes;
+    for (const std::pair<VkDescriptorType, float> &size : _poolSizes){
+        sizes.push_back({size.first, std::max(1u, (uint32_t)(size.second * sets))});
+    }
+
+    VkDescriptorPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.pNext = nullptr;
+    poolInfo.flags = 0;
+    poolInfo.maxSets = sets;
+    poolInfo.poolSizeCount = (uint32_t)sizes.size();
+    poolInfo.pPoolSizes = sizes.data();
+
+    VkDescriptorPool pool;
+    if (vkCreateDescriptorPool(_device, &poolInfo, nullptr, &pool) != VK_SUCCESS){
+        return VK_NULL_HANDLE;
+    }
+    return pool;
+}
+
+bool DescriptorAllocator::allocate(VkDescriptorSetLayout layout, VkDescriptorSet *set) {
+    if (_currentPool == VK_NULL_HANDLE){
+        // Pools from earlier frames come back through reset(), only grow when there are none left
+        if (!_freePools.empty()){
+            _currentPool = _freePools.back();
+            _freePools.pop_back();
+        } else {
+            _currentPool = create_pool();
+            if (_currentPool == VK_NULL_HANDLE){
+                return false;
+            }
+        }
+        _usedPools.push_back(_currentPool);
+    }
+
+    VkDescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.pNext = nullptr;
+    allocInfo.descriptorPool = _currentPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &layout;
+
+    VkResult result = vkAllocateDescriptorSets(_device, &allocInfo, set);
+    if (result == VK_SUCCESS){
+        return true;
+    }
+    if (result != VK_ERROR_FRAGMENTED_POOL && result != VK_ERROR_OUT_OF_POOL_MEMORY){
+        return false;
+    }
+
+    // This pool is full, retry once with a fresh one
+    _currentPool = create_pool();
+    if (_currentPool == VK_NULL_HANDLE){
+        return false;
+    }
+    _usedPools.push_back(_currentPool);
+
+    allocInfo.descriptorPool = _currentPool;
+    return vkAllocateDescriptorSets(_device, &allocInfo, set) == VK_SUCCESS;
+}
+
+uint32_t DescriptorAllocator::pool_count() const {
+    return (uint32_t)(_usedPools.size() + _freePools.size());
+}
+
+VkDevice DescriptorAllocator::device() const {
+    return _device;
+}
+
+void DescriptorLayoutCache::init(VkDevice device) {
+    _device = device;
+}
+
+void DescriptorLayoutCache::destroy() {
+    for (auto &layout : _layouts){
+        vkDestroyDescriptorSetLayout(_device, layout.second, nullptr);
+    }
+    _layouts.clear();
+}
+
+VkDescriptorSetLayout DescriptorLayoutCache::create_layout(const VkDescriptorSetLayoutCreateInfo &info) {
+    // Binding order in the create info doesn't matter to Vulkan, so it doesn't matter to the key either
+    std::vector<VkDescriptorSetLayoutBinding> bindings(info.pBindings, info.pBindings + info.bindingCount);
+    std::sort(bindings.begin(), bindings.end(), [](const VkDescriptorSetLayoutBinding &a, const VkDescriptorSetLayoutBinding &b){
+        return a.binding < b.binding;
+    });
+
+    std::vector<uint64_t> key;
+    key.push_back(info.flags);
+    for (const VkDescriptorSetLayoutBinding &binding : bindings){
+        key.push_back(binding.binding);
+        key.push_back(binding.descriptorType);
+        key.push_back(binding.descriptorCount);
+        key.push_back(binding.stageFlags);
+        key.push_back((uint64_t)(uintptr_t)binding.pImmutableSamplers);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _layouts.find(key);
+    if (found != _layouts.end()){
+        return found->second;
+    }
+
+    VkDescriptorSetLayout layout;
+    if (vkCreateDescriptorSetLayout(_device, &info, nullptr, &layout) != VK_SUCCESS){
+        return VK_NULL_HANDLE;
+    }
+    _layouts[key] = layout;
+    return layout;
+}
+
+uint32_t DescriptorLayoutCache::layout_count() const {
+    return (uint32_t)_layouts.size();
+}
+
+DescriptorBuilder DescriptorBuilder::begin(DescriptorLayoutCache &cache, DescriptorAllocator &allocator) {
+    DescriptorBuilder builder;
+    builder._cache = &cache;
+    builder._allocator = &allocator;
+    return builder;
+}
+
+DescriptorBuilder &DescriptorBuilder::bind_buffer(uint32_t binding, const VkDescriptorBufferInfo &bufferInfo,
+                                                  VkDescriptorType type, VkShaderStageFlags stageFlags) {
+    _bindings.push_back(vkinit::descriptorset_layout_binding(type, stageFlags, binding));
+    _types.push_back(type);
+    _bufferIndex.push_back((int32_t)_bufferInfos.size());
+    _imageIndex.push_back(-1);
+    _bufferInfos.push_back(bufferInfo);
+    return *this;
+}
+
+DescriptorBuilder &DescriptorBuilder::bind_image(uint32_t binding, const VkDescriptorImageInfo &imageInfo,
+                                                 VkDescriptorType type, VkShaderStageFlags stageFlags) {
+    _bindings.push_back(vkinit::descriptorset_layout_binding(type, stageFlags, binding));
+    _types.push_back(type);
+    _bufferIndex.push_back(-1);
+    _imageIndex.push_back((int32_t)_imageInfos.size());
+    _imageInfos.push_back(imageInfo);
+    return *this;
+}
+
+bool DescriptorBuilder::build(VkDescriptorSet *set, VkDescriptorSetLayout *layout) {
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.pNext = nullptr;
+    layoutInfo.flags = 0;
+    layoutInfo.bindingCount = (uint32_t)_bindings.size();
+    layoutInfo.pBindings = _bindings.data();
+
+    VkDescriptorSetLayout setLayout = _cache->create_layout(layoutInfo);
+    if (setLayout == VK_NULL_HANDLE || !_allocator->allocate(setLayout, set)){
+        return false;
+    }
+
+    std::vector<VkWriteDescriptorSet> writes;
+    for (size_t i = 0; i < _bindings.size(); i++){
+        if (_bufferIndex[i] >= 0){
+            writes.push_back(vkinit::write_descriptor_buffer(_types[i], *set, &_bufferInfos[_bufferIndex[i]], _bindings[i].binding));
+        } else {
+            writes.push_back(vkinit::write_descriptor_image(_types[i], *set, &_imageInfos[_imageIndex[i]], _bindings[i].binding));
+        }
+    }
+    vkUpdateDescriptorSets(_allocator->device(), (uint32_t)writes.size(), writes.data(), 0, nullptr);
+
+    if (layout){
+        *layout = setLayout;
+    }
+    return true;
+}
+
+bool BindlessHeap::init(VkDevice device) {
+    _device = device;
+
+    VkDescriptorSetLayoutBinding bindings[2] = {};
+    bindings[0].binding = 0;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[0].descriptorCount = _maxTextures;
+    bindings[0].stageFlags = VK_SHADER_STAGE_ALL;
+    bindings[0].pImmutableSamplers = nullptr;
+    bindings[1].binding = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[1].descriptorCount = _maxBuffers;
+    bindings[1].stageFlags = VK_SHADER_STAGE_ALL;
+    bindings[1].pImmutableSamplers = nullptr;
+
+    // Slots get written while earlier frames using other slots are still in flight, and most slots are empty
+    VkDescriptorBindingFlags bindingFlags[2];
+    bindingFlags[0] = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT |
+                      VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+    bindingFlags[1] = bindingFlags[0];
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo flagsInfo = {};
+    flagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+    flagsInfo.pNext = nullptr;
+    flagsInfo.bindingCount = 2;
+    flagsInfo.pBindingFlags = bindingFlags;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.pNext = &flagsInfo;
+    layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    layoutInfo.bindingCount = 2;
+    layoutInfo.pBindings = bindings;
+
+    if (vkCreateDescriptorSetLayout(_device, &layoutInfo, nullptr, &_setLayout) != VK_SUCCESS){
+        return false;
+    }
+
+    VkDescriptorPoolSize poolSizes[2] = {
+            {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _maxTextures},
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _maxBuffers},
+    };
+
+    VkDescriptorPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.pNext = nullptr;
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    poolInfo.maxSets = 1;
+    poolInfo.poolSizeCount = 2;
+    poolInfo.pPoolSizes = poolSizes;
+
+    if (vkCreateDescriptorPool(_device, &poolInfo, nullptr, &_pool) != VK_SUCCESS){
+        return false;
+    }
+
+    VkDescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.pNext = nullptr;
+    allocInfo.descriptorPool = _pool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &_setLayout;
+
+    return vkAllocateDescriptorSets(_device, &allocInfo, &_set) == VK_SUCCESS;
+}
+
+void BindlessHeap::destroy() {
+    if (_device == VK_NULL_HANDLE){
+        return;
+    }
+    if (_pool != VK_NULL_HANDLE){
+        vkDestroyDescriptorPool(_device, _pool, nullptr);
+    }
+    if (_setLayout != VK_NULL_HANDLE){
+        vkDestroyDescriptorSetLayout(_device, _setLayout, nullptr);
+    }
+    _pool = VK_NULL_HANDLE;
+    _setLayout = VK_NULL_HANDLE;
+    _set = VK_NULL_HANDLE;
+    _device = VK_NULL_HANDLE;
+}
+
+uint32_t BindlessHeap::add_texture(VkImageView view, VkSampler sampler, VkImageLayout layout) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    uint32_t index;
+    if (!_freeTextures.empty()){
+        index = _freeTextures.back();
+        _freeTextures.pop_back();
+    } else if (_nextTexture < _maxTextures){
+        index = _nextTexture++;
+    } else {
+        return ~0u;
+    }
+
+    VkDescriptorImageInfo imageInfo = {sampler, view, layout};
+    VkWriteDescriptorSet write = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _set, &imageInfo, 0);
+    write.dstArrayElement = index;
+    vkUpdateDescriptorSets(_device, 1, &write, 0, nullptr);
+    return index;
+}
+
+uint32_t BindlessHeap::add_buffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    uint32_t index;
+    if (!_freeBuffers.empty()){
+        index = _freeBuffers.back();
+        _freeBuffers.pop_back();
+    } else if (_nextBuffer < _maxBuffers){
+        index = _nextBuffer++;
+    } else {
+        return ~0u;
+    }
+
+    VkDescriptorBufferInfo bufferInfo = {buffer, offset, range};
+    VkWriteDescriptorSet write = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _set, &bufferInfo, 1);
+    write.dstArrayElement = index;
+    vkUpdateDescriptorSets(_device, 1, &write, 0, nullptr);
+    return index;
+}
+
+void BindlessHeap::remove_texture(uint32_t index, uint64_t retireValue) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _retired.push_back({index, true, retireValue});
+}
+
+void BindlessHeap::remove_buffer(uint32_t index, uint64_t retireValue) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _retired.push_back({index, false, retireValue});
+}
+
+void BindlessHeap::collect(uint64_t completed) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // The old descriptor stays in the slot until it's reused, partially bound means nobody looks at it
+    _retired.erase(std::remove_if(_retired.begin(), _retired.end(), [&](const Retired &retired){
+        if (retired._retireValue > completed){
+            return false;
+        }
+        (retired._texture ? _freeTextures : _freeBuffers).push_back(retired._index);
+        return true;
+    }), _retired.end());
+}
+
+void BindlessHeap::bind(VkCommandBuffer cmd, VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t setIndex) const {
+    vkCmdBindDescriptorSets(cmd, bindPoint, layout, setIndex, 1, &_set, 0, nullptr);
+}
+
+uint32_t BindlessHeap::texture_count() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _nextTexture - (uint32_t)_freeTextures.size();
+}
+
+uint32_t BindlessHeap::buffer_count() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _nextBuffer - (uint32_t)_freeBuffers.size();
+}
@@ -0,0 +1,155 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_DESCRIPTORS_H
+#define VKENGINE_VK_DESCRIPTORS_H
+
+#include "vk_types.h"
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Hands out descriptor sets from a list of pools, making a new (bigger) pool whenever the current
+// one runs out. Sets are never freed one by one, reset() recycles every pool at once, so one of
+// these per frame in flight gives each frame fresh sets without touching the others.
+class DescriptorAllocator {
+public:
+    // Descriptors of each type a pool gets per set it can hold
+    std::vector<std::pair<VkDescriptorType, float>> _poolSizes {
+            {VK_DESCRIPTOR_TYPE_SAMPLER, 0.5f},
+            {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4.0f},
+            {VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 4.0f},
+            {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1.0f},
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2.0f},
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4.0f},
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1.0f},
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 1.0f},
+    };
+    // Sets in the first pool, every new pool doubles it up to _maxSetsPerPool
+    uint32_t _setsPerPool {64};
+    uint32_t _maxSetsPerPool {4096};
+
+    void init(VkDevice device);
+
+    void destroy();
+
+    // Only once nothing recorded with sets from here is still pending
+    void reset();
+
+    bool allocate(VkDescriptorSetLayout layout, VkDescriptorSet *set);
+
+    uint32_t pool_count() const;
+
+    VkDevice device() const;
+
+private:
+    VkDescriptorPool create_pool();
+
+    VkDevice _device {VK_NULL_HANDLE};
+    VkDescriptorPool _currentPool {VK_NULL_HANDLE};
+    std::vector<VkDescriptorPool> _usedPools;
+    std::vector<VkDescriptorPool> _freePools;
+    uint32_t _nextPoolSets {0};
+};
+
+// Same bindings, same layout. Layouts are created once and live until destroy().
+class DescriptorLayoutCache {
+public:
+    void init(VkDevice device);
+
+    void destroy();
+
+    // pNext isn't looked at, layouts that need binding flags (bindless) are made directly
+    VkDescriptorSetLayout create_layout(const VkDescriptorSetLayoutCreateInfo &info);
+
+    uint32_t layout_count() const;
+
+private:
+    VkDevice _device {VK_NULL_HANDLE};
+    std::map<std::vector<uint64_t>, VkDescriptorSetLayout> _layouts;
+    std::mutex _mutex;
+};
+
+// Declares bindings and writes in one go, the layout comes out of the cache and the set out of the allocator
+class DescriptorBuilder {
+public:
+    static DescriptorBuilder begin(DescriptorLayoutCache &cache, DescriptorAllocator &allocator);
+
+    DescriptorBuilder &bind_buffer(uint32_t binding, const VkDescriptorBufferInfo &bufferInfo, VkDescriptorType type,
+                                   VkShaderStageFlags stageFlags);
+
+    DescriptorBuilder &bind_image(uint32_t binding, const VkDescriptorImageInfo &imageInfo, VkDescriptorType type,
+                                  VkShaderStageFlags stageFlags);
+
+    bool build(VkDescriptorSet *set, VkDescriptorSetLayout *layout = nullptr);
+
+private:
+    DescriptorLayoutCache *_cache {nullptr};
+    DescriptorAllocator *_allocator {nullptr};
+
+    std::vector<VkDescriptorSetLayoutBinding> _bindings;
+    // Infos are kept by value, the writes only point at them once build() knows they won't move
+    std::vector<VkDescriptorBufferInfo> _bufferInfos;
+    std::vector<VkDescriptorImageInfo> _imageInfos;
+    std::vector<VkDescriptorType> _types;
+    std::vector<int32_t> _bufferIndex;
+    std::vector<int32_t> _imageIndex;
+};
+
+// One update-after-bind set holding every texture (binding 0) and storage buffer (binding 1) in big
+// partially bound arrays. Shaders get indices through push constants, so draws never rebind descriptors.
+// Needs descriptorIndexing with update-after-bind, partially bound and runtime arrays.
+class BindlessHeap {
+public:
+    uint32_t _maxTextures {4096};
+    uint32_t _maxBuffers {1024};
+
+    VkDescriptorSetLayout _setLayout {VK_NULL_HANDLE};
+    VkDescriptorSet _set {VK_NULL_HANDLE};
+
+    bool init(VkDevice device);
+
+    void destroy();
+
+    // Index into the texture array, ~0u when it's full
+    uint32_t add_texture(VkImageView view, VkSampler sampler,
+                         VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    // Index into the buffer array, ~0u when it's full
+    uint32_t add_buffer(VkBuffer buffer, VkDeviceSize offset = 0, VkDeviceSize range = VK_WHOLE_SIZE);
+
+    // Frames up to retireValue may still read the slot, it's handed out again once collect() sees it done
+    void remove_texture(uint32_t index, uint64_t retireValue);
+    void remove_buffer(uint32_t index, uint64_t retireValue);
+
+    // Call once per frame with the timeline's current value
+    void collect(uint64_t completed);
+
+    void bind(VkCommandBuffer cmd, VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t setIndex) const;
+
+    uint32_t texture_count() const;
+    uint32_t buffer_count() const;
+
+private:
+    struct Retired {
+        uint32_t _index;
+        bool _texture;
+        uint64_t _retireValue;
+    };
+
+    VkDevice _device {VK_NULL_HANDLE};
+    VkDescriptorPool _pool {VK_NULL_HANDLE};
+
+    // Guards everything below and the writes into _set, textures may be added from loader threads
+    mutable std::mutex _mutex;
+    uint32_t _nextTexture {0};
+    uint32_t _nextBuffer {0};
+    std::vector<uint32_t> _freeTextures;
+    std::vector<uint32_t> _freeBuffers;
+    std::vector<Retired> _retired;
+};
+
+
+#endif //VKENGINE_VK_DESCRIPTORS_H
@@ -9,43 +9,96 @@
 
 #include "vk_types.h"
 #include "vk_initalizers.h"
+#include "vk_golden.h"
 
 #include <VkBootstrap.h>
 
 #include <iostream>
-#include <fstream>
-
-#define VK_CHECK(x) \
-    do              \
-    {               \
-        VkResult err = x; \
-        if (err){   \
-            std::cout << "Detected Vulkan Error: " << err << std::endl; \
-            abort();\
-            }       \
-    }  while (0)
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <dirent.h>
+
+static const char *present_mode_name(VkPresentModeKHR mode) {
+    switch (mode){
+        case VK_PRESENT_MODE_IMMEDIATE_KHR: return "immediate";
+        case VK_PRESENT_MODE_MAILBOX_KHR: return "mailbox";
+        case VK_PRESENT_MODE_FIFO_KHR: return "fifo";
+        default: return "other";
+    }
+}
 
 void VulkanEngine::init() {
-    SDL_Init(SDL_INIT_VIDEO);
+    if (!_tracePath.empty()){
+        vkprofile::start();
+    }
+    vkprofile::set_thread_name("main");
+    PROFILE_FUNCTION();
 
-    SDL_WindowFlags windowFlags = SDL_WINDOW_VULKAN;
+    auto initStart = std::chrono::steady_clock::now();
 
-    _window = SDL_CreateWindow(
-            "Engine",
-            SDL_WINDOWPOS_UNDEFINED,
-            SDL_WINDOWPOS_UNDEFINED,
-            _windowExtent.width,
-            _windowExtent.height,
-            windowFlags
-            );
+    if (_framesInFlight < 1) _framesInFlight = 1;
+    if (_framesInFlight > MAX_FRAMES_IN_FLIGHT) _framesInFlight = MAX_FRAMES_IN_FLIGHT;
+
+    if (_scene != "triangle" && _scene != "instances"){
+        printf("UNKNOWN SCENE %s, DRAWING THE TRIANGLE\n", _scene.c_str());
+        _scene = "triangle";
+    }
+    if (_gpuCulling && _scene != "instances"){
+        printf("NOTHING TO CULL IN THE %s SCENE, GPU CULLING OFF\n", _scene.c_str());
+        _gpuCulling = false;
+    }
+    if (_cameraTransforms && (_scene != "instances" || _gpuCulling)){
+        // The cull shader still writes clip space offsets, it has no matrices to pass on
+        printf("CAMERA NEEDS THE INSTANCES SCENE WITHOUT GPU CULLING, CAMERA OFF\n");
+        _cameraTransforms = false;
+    }
+    if (!_textureDir.empty() && (_scene != "instances" || _cameraTransforms)){
+        printf("TEXTURES NEED THE INSTANCES SCENE WITHOUT THE CAMERA, TEXTURES OFF\n");
+        _textureDir.clear();
+    }
+    // The streamer hands its textures and tables to the shaders through the bindless heap
+    if (!_textureDir.empty()){
+        _bindlessDescriptors = true;
+    }
+    if (!vkmath::transform_kernel_supported(_transformKernel)){
+        printf("TRANSFORM KERNEL %s NOT SUPPORTED HERE, USING %s\n", vkmath::transform_kernel_name(_transformKernel),
+               vkmath::transform_kernel_name(vkmath::best_transform_kernel()));
+        _transformKernel = vkmath::best_transform_kernel();
+    }
+
+    // Headless runs never touch SDL, there may not be a display to talk to
+    if (!_headless){
+        SDL_Init(SDL_INIT_VIDEO);
+
+        SDL_WindowFlags windowFlags = (SDL_WindowFlags)(SDL_WINDOW_VULKAN | SDL_WINDOW_RESIZABLE);
+
+        _window = SDL_CreateWindow(
+                "Engine",
+                SDL_WINDOWPOS_UNDEFINED,
+                SDL_WINDOWPOS_UNDEFINED,
+                _windowExtent.width,
+                _windowExtent.height,
+                windowFlags
+                );
+    }
 
     init_vulkan();
     init_swapchain();
+    init_readback();
     init_commands();
-    init_default_renderpass();
-    init_framebuffer();
+    init_render_graph();
     init_sync_structures();
+    init_descriptors();
     init_pipelines();
+    init_uploader();
+    init_textures();
+    init_scene();
+
+    _initMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - initStart).count();
+    printf("ENGINE INITIALIZED IN %.2f ms (pipeline cache %s, pipelines built in %.2f ms)\n",
+           _initMs, _pipelineCache._warm ? "warm" : "cold", _pipelineBuildMs);
 
     _isInitalized = true;
 }
@@ -53,86 +106,310 @@ void VulkanEngine::init() {
 void VulkanEngine::cleanup() {
     if (_isInitalized){
 
-        // Wait to ensure our command buffers are empty
-        VK_CHECK(vkWaitForFences(_device, 1, &_renderFence, true, 1000000000));
-        VK_CHECK(vkResetFences(_device, 1, &_renderFence));
+        // Wait to ensure every frame's command buffers are empty
+        wait_for_timeline(_frameTimelineValue);
+
+        _jobs.shutdown();
+
+        if (vkprofile::enabled()){
+            vkprofile::stop();
+            vkprofile::write_chrome_trace(_tracePath.empty() ? "trace.json" : _tracePath);
+        }
+        _gpuProfiler.destroy();
+
+        flush_readbacks();
+        if (_capture.active()){
+            _capture.finish();
+            CaptureStats captureStats = _capture.stats();
+            printf("CAPTURE: %u frames (%u skipped), %.2f MB, %.1f frames/s written, %.1f frames/s overall, %.2f ms stalled\n",
+                   captureStats._framesWritten, captureStats._framesSkipped, captureStats._bytesWritten / (1024.0 * 1024.0),
+                   captureStats._framesPerSecond, captureStats._wallFramesPerSecond, captureStats._stallMs);
+        }
+
+        UploadStats uploadStats = _uploader.stats();
+        printf("UPLOADS: %u done, %.2f MB at %.2f MB/s, latency %.2f ms mean %.2f ms max, queue %.2f ms mean\n",
+               uploadStats._uploadsCompleted, uploadStats._bytesUploaded / (1024.0 * 1024.0),
+               uploadStats._bytesPerSecond / (1024.0 * 1024.0), uploadStats._meanLatencyMs,
+               uploadStats._maxLatencyMs, uploadStats._meanQueueMs);
+        _uploader.destroy();
+
+        if (!_textureDir.empty()){
+            TextureStats textureStats = _textures.stats();
+            printf("TEXTURES: %u/%u resident, %.2f MB of %.2f MB budget, %u levels streamed, %u evicted, %u mip chains generated\n",
+                   textureStats._resident, textureStats._textures, textureStats._residentBytes / (1024.0 * 1024.0),
+                   textureStats._budget / (1024.0 * 1024.0), textureStats._levelsStreamed, textureStats._levelsEvicted,
+                   textureStats._mipChainsGenerated);
+        }
+        _textures.destroy();
+
+        if (_shaderHotReload){
+            printf("SHADER HOT RELOAD: %u reloads, %u failed\n", _shaderReload._reloads, _shaderReload._failures);
+        }
+        _shaderReload.destroy();
 
         vkDestroyPipeline(_device, _trianglePipeline, nullptr);
+        for (Material &material : _materials){
+            vkDestroyPipeline(_device, material._pipeline, nullptr);
+            if (material._depthPipeline != VK_NULL_HANDLE){
+                vkDestroyPipeline(_device, material._depthPipeline, nullptr);
+            }
+        }
+        if (_cullPipeline != VK_NULL_HANDLE){
+            vkDestroyPipeline(_device, _cullPipeline, nullptr);
+            vkDestroyPipelineLayout(_device, _cullPipelineLayout, nullptr);
+        }
 
-        vkDestroyPipelineLayout(_device, _trianglePipelineLayout, nullptr);
+        for (uint32_t i = 0; i < _framesInFlight; i++){
+            _frames[i]._descriptors.destroy();
+        }
+        _bindless.destroy();
+        _layoutCache.destroy();
 
-        // Destroy our semaphores
-        vkDestroySemaphore(_device, _renderSemaphore, nullptr);
-        vkDestroySemaphore(_device, _presentSemaphore, nullptr);
+        _pipelineCache.save();
+        _pipelineCache.destroy();
+
+        _shaderCache.destroy();
+
+        vkDestroyPipelineLayout(_device, _trianglePipelineLayout, nullptr);
+        if (_texturedPipelineLayout != VK_NULL_HANDLE){
+            vkDestroyPipelineLayout(_device, _texturedPipelineLayout, nullptr);
+        }
 
-        // Destroy our fence
-        vkDestroyFence(_device, _renderFence, nullptr);
+        for (VkSemaphore renderSemaphore : _renderSemaphores){
+            vkDestroySemaphore(_device, renderSemaphore, nullptr);
+        }
+        vkDestroySemaphore(_device, _frameTimeline, nullptr);
+
+        // Destroy the per-frame semaphores and command pools
+        for (uint32_t i = 0; i < _framesInFlight; i++){
+            vkDestroySemaphore(_device, _frames[i]._presentSemaphore, nullptr);
+            vkDestroyCommandPool(_device, _frames[i]._commandPool, nullptr);
+            for (WorkerCommands &worker : _frames[i]._workerCommands){
+                vkDestroyCommandPool(_device, worker._pool, nullptr);
+            }
+            if (_frames[i]._timestampPool != VK_NULL_HANDLE){
+                vkDestroyQueryPool(_device, _frames[i]._timestampPool, nullptr);
+            }
+        }
 
-        vkDestroyCommandPool(_device, _commandPool, nullptr);
+        if (_swapchain != VK_NULL_HANDLE){
+            vkDestroySwapchainKHR(_device, _swapchain, nullptr);
+        }
 
-        vkDestroySwapchainKHR(_device, _swapchain, nullptr);
+        _renderGraph.destroy();
 
-        vkDestroyRenderPass(_device, _renderPass, nullptr);
+        for (VkImageView view : _swapchainImageViews){
+            vkDestroyImageView(_device, view, nullptr);
+        }
 
-        for (uint i = 0; i < _framebuffers.size(); i++){
-            vkDestroyFramebuffer(_device, _framebuffers[i], nullptr);
-            vkDestroyImageView(_device, _swapchainImageViews[i], nullptr);
+        for (AllocatedImage &image : _offscreenImages){
+            _allocator.destroy_image(image);
         }
 
+        destroy_readback();
+
+        _meshPool.destroy(_allocator);
+        _instanceRing.destroy(_allocator);
+        _indirectRing.destroy(_allocator);
+        _culling.destroy();
+
+        _allocator.print_stats();
+        _allocator.destroy();
+
         vkDestroyDevice(_device, nullptr);
-        vkDestroySurfaceKHR(_instance, _surface, nullptr);
+        if (_surface != VK_NULL_HANDLE){
+            vkDestroySurfaceKHR(_instance, _surface, nullptr);
+        }
         vkb::destroy_debug_utils_messenger(_instance, _debug_messenger);
         vkDestroyInstance(_instance, nullptr);
-        SDL_DestroyWindow(_window);
+        if (_window){
+            SDL_DestroyWindow(_window);
+        }
+    }
+}
+
+FrameData &VulkanEngine::get_current_frame() {
+    return _frames[_frameNumber % _framesInFlight];
+}
+
+void VulkanEngine::set_present_mode(VkPresentModeKHR mode) {
+    // Offscreen targets are never presented
+    if (_headless || mode == _presentMode){
+        return;
     }
+
+    _presentMode = mode;
+    _swapchainDirty = true;
 }
 
 void VulkanEngine::draw() {
-    // 1000000000 = 1 second wut?
-    VK_CHECK(vkWaitForFences(_device, 1, &_renderFence, true, 1000000000));
-    VK_CHECK(vkResetFences(_device, 1, &_renderFence));
+    if (_swapchainDirty && !recreate_swapchain()){
+        return;
+    }
+
+    PROFILE_FUNCTION();
+    FrameData &frame = get_current_frame();
+
+    _benchmark.begin_frame();
+    ProfilePhases phases;
+
+    // Only wait for the frame that last used this slot, the others may still be in flight
+    wait_for_timeline(frame._timelineValue);
+    _benchmark.mark(FramePhase::FenceWait);
+    phases.mark("fence_wait");
+
+    collect_gpu_timestamps(frame);
+
+    uint64_t completed;
+    VK_CHECK(vkGetSemaphoreCounterValue(_device, _frameTimeline, &completed));
+    _pacer.gpu_completed(completed);
+    collect_presents(false);
+
+    // Rebuilt pipelines go in before anything is recorded, the replaced ones wait for the frames using them
+    if (_shaderHotReload){
+        _shaderReload.apply(_frameTimelineValue, completed, _shaderCache);
+    }
+
+    // Nothing still pending uses this slot's sets, and bindless slots other frames dropped may be free now
+    frame._descriptors.reset();
+    if (_bindlessDescriptors){
+        _bindless.collect(completed);
+    }
+
+    // The copy this slot made last time around is done, hand it over before it gets overwritten
+    if (frame._readbackPending){
+        _capture.submit(frame._readbackBuffer._allocation._mapped, frame._readbackExtent.width,
+                        frame._readbackExtent.height, frame._readbackFrame);
+        frame._readbackPending = false;
+    }
+
+    // This slot's frame has finished, its region of the per-frame rings is free again
+    uint32_t frameIndex = _frameNumber % _framesInFlight;
+    _instanceRing.begin_frame(frameIndex);
+    _indirectRing.begin_frame(frameIndex);
+    _frameInstancesReady = false;
+    _frameCommandStats = {};
 
     uint32_t swapchainImageIndex;
-    VK_CHECK(vkAcquireNextImageKHR(_device, _swapchain, 1000000000, _presentSemaphore, nullptr, &swapchainImageIndex));
+    if (_headless){
+        // No swapchain to ask, the offscreen targets are simply used round robin
+        swapchainImageIndex = _frameNumber % _swapchainImages.size();
+    } else {
+        VkResult acquireResult = vkAcquireNextImageKHR(_device, _swapchain, 1000000000, frame._presentSemaphore, nullptr, &swapchainImageIndex);
+        if (acquireResult == VK_ERROR_OUT_OF_DATE_KHR){
+            // Nothing was acquired or submitted, so the frame can simply be retried
+            _swapchainDirty = true;
+            phases.mark("acquire");
+            _benchmark.discard_frame();
+            return;
+        }
+        if (acquireResult == VK_SUBOPTIMAL_KHR){
+            // The image is still ours and the semaphore will signal, finish this frame and recreate after
+            _swapchainDirty = true;
+        } else {
+            VK_CHECK(acquireResult);
+        }
+    }
+
+    // The swapchain can hand back an image that an older frame slot is still rendering to
+    wait_for_timeline(_imagesInFlight[swapchainImageIndex]);
+
+    // Nothing to reset, the next submit just signals the next value
+    uint64_t signalValue = ++_frameTimelineValue;
+    frame._timelineValue = signalValue;
+    _imagesInFlight[swapchainImageIndex] = signalValue;
+    _benchmark.mark(FramePhase::Acquire);
+    phases.mark("acquire");
+
+    // Every wait of the frame is behind us, nothing but recording between the input and the submit
+    if (_pacer._lowLatency){
+        // With present wait, hold off until the previous frame is on screen so this one isn't queued behind it
+        collect_presents(true);
+        if (!_headless){
+            poll_events();
+        }
+        _pacer.input_sampled(signalValue);
+    }
 
-    VK_CHECK(vkResetCommandBuffer(_mainCommandBuffer, 0));
+    if (_cameraTransforms){
+        // Swings back and forth so the matrices really do change every frame
+        _camera._yaw = 0.5f * sinf((float)_frameNumber / 240.0f);
+        _camera._pitch = 0.25f * sinf((float)_frameNumber / 370.0f);
+        _viewProjection = _camera.view_projection((float)_windowExtent.width / (float)_windowExtent.height);
+    }
+
+    // Recycles every buffer allocated from this frame's pool in one go
+    VK_CHECK(vkResetCommandPool(_device, frame._commandPool, 0));
 
-    VkCommandBuffer cmd = _mainCommandBuffer;
+    VkCommandBuffer cmd = frame._mainCommandBuffer;
 
-    VkCommandBufferBeginInfo cmdBeginInfo = {};
-    cmdBeginInfo.pNext = nullptr;
-    cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    cmdBeginInfo.pInheritanceInfo = nullptr;
-    cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VkCommandBufferBeginInfo cmdBeginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
 
     VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
+    _recorder.begin(cmd);
+    _gpuProfiler.begin_frame(cmd, frameIndex);
+    uint32_t gpuFrameZone = _gpuProfiler.begin_zone(cmd, "frame");
+
+    // Uploads the transfer queue has finished become usable from here on
+    _uploader.process_completed(cmd);
+
+    // Levels that just arrived get copied into place and swapped in before anything samples them
+    if (!_textureDir.empty()){
+        _textures.update(cmd, frameIndex, signalValue, completed);
+    }
+
+    // Both the pre-pass and the main pass draw from the same order and instance data
+    prepare_objects();
+
+    bool writeTimestamps = _benchmark._enabled && frame._timestampPool != VK_NULL_HANDLE;
+    if (writeTimestamps){
+        vkCmdResetQueryPool(cmd, frame._timestampPool, 0, 2);
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame._timestampPool, 0);
+    }
 
     VkClearValue clearValue;
-    float flash = abs(sin(_frameNumber / 120.f));
+    float flash = abs(sin(_sceneFrames / 120.f));
     clearValue.color = {{0.0f, 0.0f, flash, 1.0f}};
 
-    VkRenderPassBeginInfo rpInfo = {};
-    rpInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    rpInfo.pNext = nullptr;
+    _renderGraph.set_imported_index(_swapchainTarget, swapchainImageIndex);
+    _renderGraph.set_clear_value(_mainPass, _swapchainTarget, clearValue);
 
-    rpInfo.renderPass = _renderPass;
-    rpInfo.renderArea.offset.x = 0;
-    rpInfo.renderArea.offset.y = 0;
-    rpInfo.renderArea.extent = _windowExtent;
-    rpInfo.framebuffer = _framebuffers[swapchainImageIndex];
+    // Worker-recorded secondaries can't be mixed with inline commands in the same subpass.
+    // Culled draws are a handful of commands, those are always recorded inline.
+    bool secondaries = objects_ready() && _jobs.worker_count() > 1 && !_gpuCulling;
+    _renderGraph.pass(_mainPass)._contents = secondaries ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+                                                         : VK_SUBPASS_CONTENTS_INLINE;
+    bool sceneComplete = _renderObjects.size() == 0 || objects_ready();
 
-    rpInfo.clearValueCount = 1;
-    rpInfo.pClearValues = &clearValue;
+    // Every pass, barrier and layout transition of the frame
+    _renderGraph.execute(cmd);
 
-    // Begin our render pass
-    vkCmdBeginRenderPass(cmd, &rpInfo, VK_SUBPASS_CONTENTS_INLINE);
+    if (!_textureDir.empty() && objects_ready()){
+        _textures.end_frame(cmd, frameIndex);
+    }
 
-    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _trianglePipeline);
-    vkCmdDraw(cmd, 3, 1, 0, 0);
+    if (writeTimestamps){
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame._timestampPool, 1);
+        frame._timestampsPending = true;
+    }
 
-    vkCmdEndRenderPass(cmd);
+    // Secondaries were added in by draw_objects()
+    _frameCommandStats.add(_recorder.stats());
+    _benchmark.add_counter("binds_issued", _frameCommandStats.issued());
+    _benchmark.add_counter("binds_skipped", _frameCommandStats.skipped());
+    _benchmark.add_counter("draw_calls", _frameCommandStats._draws);
+    if (vkprofile::enabled()){
+        vkprofile::counter("draws", _frameCommandStats._draws);
+        vkprofile::counter("triangles", (double)_frameCommandStats._triangles);
+        vkprofile::counter("binds_issued", _frameCommandStats.issued());
+        vkprofile::counter("binds_skipped", _frameCommandStats.skipped());
+        vkprofile::counter("upload_bytes", (double)_uploader.stats()._bytesUploaded);
+    }
 
+    _gpuProfiler.end_zone(cmd, gpuFrameZone);
     VK_CHECK(vkEndCommandBuffer(cmd));
+    _benchmark.mark(FramePhase::Record);
+    phases.mark("record");
 
     VkSubmitInfo submit = {};
     submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -142,57 +419,707 @@ void VulkanEngine::draw() {
 
     submit.pWaitDstStageMask = &waitState;
 
-    submit.waitSemaphoreCount = 1;
-    submit.pWaitSemaphores = &_presentSemaphore;
+    // Headless frames have no acquire to wait on and no present to signal, only the timeline
+    VkSemaphore signalSemaphores[2] = {_frameTimeline, _renderSemaphores[swapchainImageIndex]};
+    // The binary semaphore's value is ignored
+    uint64_t signalValues[2] = {signalValue, 0};
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.pNext = nullptr;
+    timelineInfo.waitSemaphoreValueCount = 0;
+    timelineInfo.pWaitSemaphoreValues = nullptr;
+    timelineInfo.signalSemaphoreValueCount = _headless ? 1 : 2;
+    timelineInfo.pSignalSemaphoreValues = signalValues;
 
-    submit.signalSemaphoreCount = 1;
-    submit.pSignalSemaphores = &_renderSemaphore;
+    submit.pNext = &timelineInfo;
+
+    submit.waitSemaphoreCount = _headless ? 0 : 1;
+    submit.pWaitSemaphores = &frame._presentSemaphore;
+
+    submit.signalSemaphoreCount = _headless ? 1 : 2;
+    submit.pSignalSemaphores = signalSemaphores;
 
     submit.commandBufferCount = 1;
     submit.pCommandBuffers = &cmd;
 
-    VK_CHECK(vkQueueSubmit(_graphicsQueue, 1, &submit, _renderFence));
+    {
+        std::lock_guard<std::mutex> queueLock(_graphicsQueueMutex);
+        VK_CHECK(vkQueueSubmit(_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
+    }
+    _pacer.submitted(signalValue);
+    _gpuProfiler.submitted(frameIndex);
+    _benchmark.mark(FramePhase::Submit);
+    phases.mark("submit");
+
+    // Headless frames have nothing to present
+    if (!_headless){
+        VkPresentInfoKHR presentInfo = {};
+        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presentInfo.pNext = nullptr;
+
+        presentInfo.pSwapchains = &_swapchain;
+        presentInfo.swapchainCount = 1;
+
+        presentInfo.waitSemaphoreCount = 1;
+        presentInfo.pWaitSemaphores = &_renderSemaphores[swapchainImageIndex];
+
+        presentInfo.pImageIndices = &swapchainImageIndex;
+
+        VkPresentIdKHR presentId = {};
+        presentId.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+        presentId.pNext = nullptr;
+        presentId.swapchainCount = 1;
+        presentId.pPresentIds = &signalValue;
+        if (_presentWait){
+            presentInfo.pNext = &presentId;
+        }
 
-    VkPresentInfoKHR presentInfo = {};
-    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    presentInfo.pNext = nullptr;
+        VkResult presentResult;
+        {
+            std::lock_guard<std::mutex> queueLock(_graphicsQueueMutex);
+            presentResult = vkQueuePresentKHR(_graphicsQueue, &presentInfo);
+        }
+        if (presentResult == VK_SUCCESS || presentResult == VK_SUBOPTIMAL_KHR){
+            _lastPresentId = signalValue;
+        }
+        if (presentResult == VK_ERROR_OUT_OF_DATE_KHR || presentResult == VK_SUBOPTIMAL_KHR){
+            _swapchainDirty = true;
+        } else {
+            VK_CHECK(presentResult);
+        }
+    }
+    _benchmark.mark(FramePhase::Present);
+    phases.mark("present");
 
-    presentInfo.pSwapchains = &_swapchain;
-    presentInfo.swapchainCount = 1;
+    std::vector<double> latencyMs;
+    std::vector<double> jitterMs;
+    _pacer.drain(latencyMs, jitterMs);
+    for (double ms : latencyMs) _benchmark.add_counter("motion_to_photon_ms", ms);
+    for (double ms : jitterMs) _benchmark.add_counter("frame_jitter_ms", ms);
+    _benchmark.end_frame();
 
-    presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = &_renderSemaphore;
+    _frameNumber++;
+    if (sceneComplete){
+        _sceneFrames++;
+    }
+}
 
-    presentInfo.pImageIndices = &swapchainImageIndex;
+uint64_t VulkanEngine::blended_materials() const {
+    uint64_t blended = 0;
+    for (uint32_t material = 0; material < _materials.size() && material < 64; material++){
+        if (_materials[material]._blended){
+            blended |= 1ull << material;
+        }
+    }
+    return blended;
+}
 
-    VK_CHECK(vkQueuePresentKHR(_graphicsQueue, &presentInfo));
+bool VulkanEngine::objects_ready() const {
+    return _renderObjects.size() != 0 && _uploader.is_complete(_meshPool._uploadTicket) &&
+           (!_gpuCulling || _uploader.is_complete(_culling._uploadTicket));
+}
 
-    _frameNumber++;
+CommandRecorder &VulkanEngine::pass_recorder(VkCommandBuffer cmd) {
+    if (_recorder.cmd() != cmd){
+        printf("RENDER GRAPH IS RECORDING INTO A COMMAND BUFFER THE RECORDER DOESN'T WRAP!\n");
+        abort();
+    }
+    return _recorder;
+}
+
+void VulkanEngine::draw_main_pass(CommandRecorder &recorder, VkFramebuffer framebuffer) {
+    if (objects_ready() && _gpuCulling){
+        draw_culled_objects(recorder);
+        return;
+    }
+    if (objects_ready()){
+        draw_objects(get_current_frame(), recorder, framebuffer);
+        return;
+    }
+
+    set_viewport_scissor(recorder);
+    recorder.bind_pipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, _trianglePipeline);
+    recorder.draw(3, 1, 0, 0);
+}
+
+void VulkanEngine::prepare_objects() {
+    PROFILE_FUNCTION();
+    if (!objects_ready() || _gpuCulling){
+        return;
+    }
+
+    // Objects only move relative to the view when the camera does
+    if (_renderObjects._dirty || _cameraTransforms){
+        // Depth along the view direction, the view matrix's third row. Without a camera z is the depth.
+        float plane[4] = {0.0f, 0.0f, 1.0f, 0.0f};
+        if (_cameraTransforms){
+            Mat4 view = _camera.view();
+            plane[0] = view.m[2];
+            plane[1] = view.m[6];
+            plane[2] = view.m[10];
+            plane[3] = view.m[14];
+        }
+        _renderObjects.sort_into_batches(_drawBatches, plane, blended_materials());
+    }
+
+    if (!_instanceRing.allocate(_renderObjects.size() * instance_size(), instance_size(), &_frameInstances)){
+        printf("FRAME RING FULL, SKIPPING OBJECTS\n");
+        return;
+    }
+    _frameInstancesReady = true;
+}
+
+void VulkanEngine::draw_depth_prepass(CommandRecorder &recorder) {
+    if (!objects_ready()){
+        return;
+    }
+    if (_gpuCulling){
+        draw_culled_objects(recorder, true);
+        return;
+    }
+    if (!_frameInstancesReady){
+        return;
+    }
+
+    // Always inline, it's only the opaque runs and no fragment shading
+    TransientAllocation commands;
+    if (!_indirectRing.allocate(_drawBatches.size() * sizeof(VkDrawIndexedIndirectCommand), sizeof(uint32_t), &commands)){
+        printf("FRAME RING FULL, SKIPPING DEPTH PREPASS\n");
+        return;
+    }
+    record_objects(recorder, 0, _renderObjects.size(), _frameInstances, commands, true);
+}
+
+void VulkanEngine::cull_objects(VkCommandBuffer cmd) {
+    if (!objects_ready()){
+        return;
+    }
+    if (!_culling.record_cull(cmd, _frameNumber % _framesInFlight, get_current_frame()._descriptors,
+                              _cullPipeline, _cullPipelineLayout)){
+        printf("FAILED TO ALLOCATE CULLING DESCRIPTORS!\n");
+        abort();
+    }
+    // Compute binds recorded straight on cmd
+    _recorder.invalidate();
+}
+
+void VulkanEngine::draw_culled_objects(CommandRecorder &recorder, bool depthOnly) {
+    uint32_t frameIndex = _frameNumber % _framesInFlight;
+
+    set_viewport_scissor(recorder);
+    bind_textures(recorder);
+
+    VkBuffer vertexBuffers[2] = {_meshPool._vertexBuffer._buffer, _culling.instance_buffer(frameIndex)};
+    VkDeviceSize vertexOffsets[2] = {0, 0};
+    recorder.bind_vertex_buffers(0, 2, vertexBuffers, vertexOffsets);
+    recorder.bind_index_buffer(_meshPool._indexBuffer._buffer, 0, VK_INDEX_TYPE_UINT32);
+
+    // The GPU decided how many draws each material gets, a material with nothing visible costs one empty call
+    for (uint32_t material = 0; material < _materials.size(); material++){
+        if (depthOnly && (_materials[material]._blended || _materials[material]._depthPipeline == VK_NULL_HANDLE)){
+            continue;
+        }
+        recorder.bind_pipeline(VK_PIPELINE_BIND_POINT_GRAPHICS,
+                               depthOnly ? _materials[material]._depthPipeline : _materials[material]._pipeline);
+        recorder.draw_indexed_indirect_count(_culling.command_buffer(frameIndex), _culling.command_offset(material),
+                                             _culling.count_buffer(frameIndex), _culling.count_offset(material),
+                                             _culling.max_draws(), sizeof(VkDrawIndexedIndirectCommand));
+    }
+}
+
+void VulkanEngine::copy_readback(VkCommandBuffer cmd) {
+    FrameData &frame = get_current_frame();
+
+    // The graph has the image in TRANSFER_SRC by now, pull it into this frame's readback buffer
+    VkBufferImageCopy copyRegion = {};
+    copyRegion.bufferOffset = 0;
+    copyRegion.bufferRowLength = 0;
+    copyRegion.bufferImageHeight = 0;
+    copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    copyRegion.imageSubresource.mipLevel = 0;
+    copyRegion.imageSubresource.baseArrayLayer = 0;
+    copyRegion.imageSubresource.layerCount = 1;
+    copyRegion.imageExtent = {_windowExtent.width, _windowExtent.height, 1};
+
+    vkCmdCopyImageToBuffer(cmd, _renderGraph.image(_swapchainTarget), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           frame._readbackBuffer._buffer, 1, &copyRegion);
+
+    // Make the copy visible to the host once the frame's timeline value is reached
+    VkBufferMemoryBarrier readbackBarrier = {};
+    readbackBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    readbackBarrier.pNext = nullptr;
+    readbackBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    readbackBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    readbackBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    readbackBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    readbackBarrier.buffer = frame._readbackBuffer._buffer;
+    readbackBarrier.offset = 0;
+    readbackBarrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         0, nullptr, 1, &readbackBarrier, 0, nullptr);
+
+    // Picked up once this slot's timeline value comes around, so the frame loop never waits on the copy
+    frame._readbackPending = _capture.active();
+    frame._readbackFrame = (uint32_t)_frameNumber;
+    frame._readbackExtent = _windowExtent;
+}
+
+void VulkanEngine::flush_readbacks() {
+    std::vector<FrameData *> pending;
+    for (uint32_t i = 0; i < _framesInFlight; i++){
+        if (_frames[i]._readbackPending){
+            pending.push_back(&_frames[i]);
+        }
+    }
+    std::sort(pending.begin(), pending.end(), [](FrameData *a, FrameData *b){
+        return a->_readbackFrame < b->_readbackFrame;
+    });
+
+    for (FrameData *frame : pending){
+        _capture.submit(frame->_readbackBuffer._allocation._mapped, frame->_readbackExtent.width,
+                        frame->_readbackExtent.height, frame->_readbackFrame);
+        frame->_readbackPending = false;
+    }
+}
+
+void VulkanEngine::draw_objects(FrameData &frame, CommandRecorder &recorder, VkFramebuffer framebuffer) {
+    PROFILE_FUNCTION();
+    // Sorted and reserved by prepare_objects()
+    if (!_frameInstancesReady){
+        return;
+    }
+
+    const uint32_t objectCount = _renderObjects.size();
+    const uint32_t batchCount = (uint32_t)_drawBatches.size();
+    const VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+
+    bool threaded = _jobs.worker_count() > 1;
+    uint32_t sliceCount = threaded ? std::min(_recordSlices, objectCount) : 1;
+
+    // A slice can touch every batch, so each one gets room for all of them
+    const TransientAllocation &instances = _frameInstances;
+    TransientAllocation commands;
+    if (!_indirectRing.allocate(sliceCount * batchCount * stride, sizeof(uint32_t), &commands)){
+        printf("FRAME RING FULL, SKIPPING OBJECTS\n");
+        return;
+    }
+
+    if (!threaded){
+        record_objects(recorder, 0, objectCount, instances, commands);
+        return;
+    }
+
+    // This slot's timeline value has been reached, so nothing recorded from these pools is still in use
+    for (WorkerCommands &worker : frame._workerCommands){
+        VK_CHECK(vkResetCommandPool(_device, worker._pool, 0));
+        worker._used = 0;
+    }
+
+    // Rounding the slice size up can leave the last few slices empty, drop those
+    uint32_t sliceSize = (objectCount + sliceCount - 1) / sliceCount;
+    sliceCount = (objectCount + sliceSize - 1) / sliceSize;
+    std::vector<VkCommandBuffer> secondaries(sliceCount);
+    std::vector<CommandStats> sliceStats(sliceCount);
+
+    for (uint32_t slice = 0; slice < sliceCount; slice++){
+        uint32_t begin = slice * sliceSize;
+        uint32_t end = std::min(begin + sliceSize, objectCount);
+
+        TransientAllocation sliceCommands = commands;
+        sliceCommands._offset += slice * batchCount * stride;
+        sliceCommands._mapped = (char *)commands._mapped + slice * batchCount * stride;
+
+        _jobs.submit([this, &frame, &secondaries, &sliceStats, framebuffer, slice, begin, end, instances, sliceCommands](uint32_t workerIndex){
+            WorkerCommands &worker = frame._workerCommands[workerIndex];
+            if (worker._used == worker._buffers.size()){
+                VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info(worker._pool, 1, VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+                VkCommandBuffer buffer;
+                VK_CHECK(vkAllocateCommandBuffers(_device, &allocInfo, &buffer));
+                worker._buffers.push_back(buffer);
+            }
+            VkCommandBuffer secondary = worker._buffers[worker._used++];
+
+            VkCommandBufferInheritanceInfo inheritance = vkinit::command_buffer_inheritance_info(_renderPass, 0, framebuffer);
+            VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(
+                    VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT, &inheritance);
+
+            VK_CHECK(vkBeginCommandBuffer(secondary, &beginInfo));
+            CommandRecorder sliceRecorder;
+            sliceRecorder.begin(secondary);
+            record_objects(sliceRecorder, begin, end, instances, sliceCommands);
+            VK_CHECK(vkEndCommandBuffer(secondary));
+
+            secondaries[slice] = secondary;
+            sliceStats[slice] = sliceRecorder.stats();
+        });
+    }
+    _jobs.wait();
+
+    for (const CommandStats &stats : sliceStats){
+        _frameCommandStats.add(stats);
+    }
+
+    // Slices run in object order, so the result matches what the inline path draws.
+    // Whatever the secondaries bound is undefined in the primary afterwards.
+    vkCmdExecuteCommands(recorder.cmd(), sliceCount, secondaries.data());
+    recorder.invalidate();
+}
+
+void VulkanEngine::set_viewport_scissor(CommandRecorder &recorder) {
+    VkViewport viewport = {};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float)_windowExtent.width;
+    viewport.height = (float)_windowExtent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+
+    VkRect2D scissor = {};
+    scissor.offset = {0, 0};
+    scissor.extent = _windowExtent;
+
+    recorder.set_viewport(viewport);
+    recorder.set_scissor(scissor);
+}
+
+VkDeviceSize VulkanEngine::instance_size() const {
+    return _cameraTransforms ? sizeof(Mat4) : sizeof(InstanceData);
+}
+
+void VulkanEngine::record_objects(CommandRecorder &recorder, uint32_t begin, uint32_t end,
+                                  const TransientAllocation &instances, const TransientAllocation &commands,
+                                  bool depthOnly) {
+    PROFILE_FUNCTION();
+    // Secondaries don't inherit dynamic state, so every range sets its own. Inline the recorder drops the repeats.
+    set_viewport_scissor(recorder);
+    bind_textures(recorder);
+
+    // Objects are sorted, so each batch's instances are a contiguous range starting at its first object.
+    // The pre-pass is recorded first but the main pass fills the same memory before anything is submitted.
+    if (!depthOnly){
+        if (_cameraTransforms){
+            _renderObjects.write_transforms(_transformKernel, _viewProjection, begin, end, (Mat4 *)instances._mapped);
+        } else {
+            _renderObjects.write_instances(begin, end, (InstanceData *)instances._mapped);
+        }
+    }
+
+    std::vector<uint32_t> materials(_drawBatches.size());
+    VkDrawIndexedIndirectCommand *drawCommands = (VkDrawIndexedIndirectCommand *)commands._mapped;
+    uint32_t drawCount = RenderObjectList::write_draw_commands(_drawBatches, _meshPool._meshes, begin, end,
+                                                               drawCommands, materials.data());
+
+    // Every mesh lives in the same buffers, so these are bound once for the whole range
+    VkBuffer vertexBuffers[2] = {_meshPool._vertexBuffer._buffer, instances._buffer};
+    VkDeviceSize vertexOffsets[2] = {0, instances._offset};
+    recorder.bind_vertex_buffers(0, 2, vertexBuffers, vertexOffsets);
+    recorder.bind_index_buffer(_meshPool._indexBuffer._buffer, 0, VK_INDEX_TYPE_UINT32);
+
+    const VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+
+    uint32_t first = 0;
+    while (first < drawCount){
+        // Batches are sorted by material first, so each material is one run of commands
+        uint32_t material = materials[first];
+        uint32_t last = first;
+        while (last < drawCount && materials[last] == material) last++;
+
+        if (depthOnly && (_materials[material]._blended || _materials[material]._depthPipeline == VK_NULL_HANDLE)){
+            first = last;
+            continue;
+        }
+        recorder.bind_pipeline(VK_PIPELINE_BIND_POINT_GRAPHICS,
+                               depthOnly ? _materials[material]._depthPipeline : _materials[material]._pipeline);
+
+        if (!_enabledFeatures.drawIndirectFirstInstance){
+            // Indirect draws can't offset into the instance data, direct draws always can
+            for (uint32_t i = first; i < last; i++){
+                const VkDrawIndexedIndirectCommand &draw = drawCommands[i];
+                recorder.draw_indexed(draw.indexCount, draw.instanceCount, draw.firstIndex, draw.vertexOffset, draw.firstInstance);
+            }
+        } else if (_enabledFeatures.multiDrawIndirect){
+            for (uint32_t i = first; i < last; i++){
+                recorder.add_triangles((uint64_t)(drawCommands[i].indexCount / 3) * drawCommands[i].instanceCount);
+            }
+            recorder.draw_indexed_indirect(commands._buffer, commands._offset + first * stride, last - first, stride);
+        } else {
+            for (uint32_t i = first; i < last; i++){
+                recorder.add_triangles((uint64_t)(drawCommands[i].indexCount / 3) * drawCommands[i].instanceCount);
+                recorder.draw_indexed_indirect(commands._buffer, commands._offset + i * stride, 1, stride);
+            }
+        }
+
+        first = last;
+    }
+}
+
+void VulkanEngine::bind_textures(CommandRecorder &recorder) {
+    if (_textureDir.empty()){
+        return;
+    }
+
+    // Both materials share the layout, so this survives their pipeline binds
+    recorder.bind_descriptor_sets(VK_PIPELINE_BIND_POINT_GRAPHICS, _texturedPipelineLayout, 0, 1, &_bindless._set);
+    TexturePushConstants constants = _textures.push_constants(_frameNumber % _framesInFlight);
+    recorder.push_constants(_texturedPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+                            0, sizeof(constants), &constants);
+}
+
+void VulkanEngine::collect_gpu_timestamps(FrameData &frame) {
+    if (!frame._timestampsPending){
+        return;
+    }
+    frame._timestampsPending = false;
+
+    // The frame's timeline value has already been reached, so the results are available without waiting
+    uint64_t timestamps[2];
+    VkResult result = vkGetQueryPoolResults(_device, frame._timestampPool, 0, 2, sizeof(timestamps), timestamps,
+                                            sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (result != VK_SUCCESS){
+        return;
+    }
+
+    uint64_t ticks = (timestamps[1] - timestamps[0]) & _timestampMask;
+    _benchmark.add_gpu_time((double)ticks * _timestampPeriod / 1000000.0);
+}
+
+void VulkanEngine::finish_benchmark() {
+    // Pick up the GPU times of the frames still in flight
+    wait_for_timeline(_frameTimelineValue);
+    for (uint32_t i = 0; i < _framesInFlight; i++){
+        collect_gpu_timestamps(_frames[i]);
+    }
+
+    _benchmark.add_info("device", _gpuProperties.deviceName);
+    _benchmark.add_info("mode", _headless ? "headless" : "windowed");
+    _benchmark.add_info("frames_in_flight", std::to_string(_framesInFlight));
+    _benchmark.add_info("present_mode", _headless ? "none" : present_mode_name(_presentMode));
+    _benchmark.add_info("extent", std::to_string(_windowExtent.width) + "x" + std::to_string(_windowExtent.height));
+    _benchmark.add_info("pipeline_cache", _pipelineCache._warm ? "warm" : "cold");
+    _benchmark.add_info("init_ms", std::to_string(_initMs));
+    _benchmark.add_info("pipeline_build_ms", std::to_string(_pipelineBuildMs));
+    _benchmark.add_info("fps_cap", std::to_string(_pacer._targetFps));
+    _benchmark.add_info("low_latency", _pacer._lowLatency ? "true" : "false");
+    // Without present wait the latency ends at GPU completion, scanout isn't included
+    _benchmark.add_info("latency_source", _presentWait ? "present_wait" : "gpu_complete");
+    _benchmark.add_info("scene", _scene);
+    _benchmark.add_info("objects", std::to_string(_renderObjects.size()));
+    _benchmark.add_info("draw_batches", std::to_string(_drawBatches.size()));
+    _benchmark.add_info("record_threads", std::to_string(std::max(1u, _jobs.worker_count())));
+    _benchmark.add_info("multi_draw_indirect", _enabledFeatures.multiDrawIndirect ? "true" : "false");
+
+    UploadStats uploadStats = _uploader.stats();
+    _benchmark.add_info("upload_queue", _uploader._separateQueue ? "transfer" : "graphics");
+    _benchmark.add_info("upload_bytes", std::to_string(uploadStats._bytesUploaded));
+    _benchmark.add_info("upload_bytes_per_s", std::to_string(uploadStats._bytesPerSecond));
+    _benchmark.add_info("upload_latency_mean_ms", std::to_string(uploadStats._meanLatencyMs));
+    _benchmark.add_info("upload_queue_mean_ms", std::to_string(uploadStats._meanQueueMs));
+
+    AllocatorStats memoryStats = _allocator.stats();
+    _benchmark.add_info("gpu_memory_blocks", std::to_string(memoryStats._blockCount));
+    _benchmark.add_info("gpu_memory_used_bytes", std::to_string(memoryStats._bytesUsed));
+    _benchmark.add_info("gpu_memory_allocated_bytes", std::to_string(memoryStats._bytesAllocated));
+
+    _benchmark.write_json(_benchmarkOutput);
 }
 
 
 
 void VulkanEngine::run() {
-    SDL_Event e;
-    bool bQuit = false;
+    _quitRequested = false;
+
+    bool benchmarking = _benchmarkFrames != 0 || _benchmarkSeconds > 0.0f;
+    if (benchmarking){
+        if (_timestampPeriod == 0.0f){
+            printf("GPU TIMESTAMPS NOT SUPPORTED, BENCHMARK WILL ONLY REPORT CPU TIMES\n");
+        }
+        _benchmark.start();
+    }
 
-    while (!bQuit){
-        while (SDL_PollEvent(&e) != 0){
-            if (e.type == SDL_QUIT) bQuit = true;
+    while (!_quitRequested){
+        // FPS cap, and in low latency mode a nap until the GPU is about to run dry
+        _pacer.wait([this](){
+            uint64_t completed;
+            VK_CHECK(vkGetSemaphoreCounterValue(_device, _frameTimeline, &completed));
+            return completed;
+        });
+
+        if (!_headless){
+            // Low latency mode samples input inside draw(), but a minimized window never gets that far
+            bool minimized = SDL_GetWindowFlags(_window) & SDL_WINDOW_MINIMIZED;
+            if (!_pacer._lowLatency || minimized){
+                poll_events();
+            }
+
+            // There's no swapchain extent to render at while minimized
+            if (SDL_GetWindowFlags(_window) & SDL_WINDOW_MINIMIZED){
+                SDL_Delay(50);
+                continue;
+            }
+        }
+        if (!_pacer._lowLatency){
+            _pacer.input_sampled(_frameTimelineValue + 1);
         }
         draw();
+
+        uint32_t framesDrawn = _goldenPath.empty() ? (uint32_t)_frameNumber : _sceneFrames;
+        if (_frameLimit != 0 && framesDrawn >= _frameLimit) _quitRequested = true;
+        if (_benchmarkFrames != 0 && _benchmark.frame_count() >= _benchmarkFrames) _quitRequested = true;
+        if (_benchmarkSeconds > 0.0f && _benchmark.elapsed_seconds() >= _benchmarkSeconds) _quitRequested = true;
+    }
+
+    if (benchmarking){
+        finish_benchmark();
+    }
+}
+
+void VulkanEngine::poll_events() {
+    SDL_Event e;
+    while (SDL_PollEvent(&e) != 0){
+        if (e.type == SDL_QUIT) _quitRequested = true;
+
+        // Not every platform reports OUT_OF_DATE on resize, so don't rely on it
+        if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED){
+            _swapchainDirty = true;
+        }
+
+        if (e.type == SDL_KEYDOWN){
+            if (e.key.keysym.sym == SDLK_F1) set_present_mode(VK_PRESENT_MODE_FIFO_KHR);
+            if (e.key.keysym.sym == SDLK_F2) set_present_mode(VK_PRESENT_MODE_MAILBOX_KHR);
+            if (e.key.keysym.sym == SDLK_F3) set_present_mode(VK_PRESENT_MODE_IMMEDIATE_KHR);
+            if (e.key.keysym.sym == SDLK_F4) toggle_trace();
+        }
+    }
+}
+
+void VulkanEngine::toggle_trace() {
+    if (!vkprofile::enabled()){
+        printf("TRACE: recording\n");
+        vkprofile::start();
+        return;
+    }
+    vkprofile::stop();
+    vkprofile::write_chrome_trace(_tracePath.empty() ? "trace.json" : _tracePath);
+}
+
+void VulkanEngine::collect_presents(bool block) {
+    if (!_presentWait || _presentConfirmed >= _lastPresentId){
+        return;
     }
+
+    // Waiting on an id returns once it or any later one is on screen, so blocking only needs the newest
+    uint64_t id = block ? _lastPresentId : _presentConfirmed + 1;
+    while (id <= _lastPresentId){
+        // 100ms, a frame that isn't up by then isn't worth holding the next one back for
+        VkResult result = _vkWaitForPresent(_device, _swapchain, id, block ? 100000000 : 0);
+        if (result == VK_TIMEOUT){
+            return;
+        }
+        if (result != VK_SUCCESS){
+            // Out of date or lost, these will never be reported
+            _pacer.discard(_lastPresentId);
+            _presentConfirmed = _lastPresentId;
+            return;
+        }
+        _pacer.presented(id);
+        _presentConfirmed = id;
+        id++;
+    }
+}
+
+bool VulkanEngine::check_regressions() {
+    bool passed = true;
+
+    if (!_goldenPath.empty()){
+        std::vector<uint8_t> pixels;
+        if (!read_frame(pixels)){
+            printf("GOLDEN: NO FRAME TO CHECK, GOLDEN IMAGES NEED --headless AND AT LEAST ONE FRAME\n");
+            passed = false;
+        } else if (_goldenUpdate){
+            if (vkgolden::write_ppm(_goldenPath, pixels.data(), _windowExtent.width, _windowExtent.height)){
+                printf("GOLDEN: WROTE %s, rendered on %s (driver version 0x%x)\n", _goldenPath.c_str(),
+                       _gpuProperties.deviceName, _gpuProperties.driverVersion);
+            } else {
+                printf("GOLDEN: FAILED TO WRITE %s\n", _goldenPath.c_str());
+                passed = false;
+            }
+        } else {
+            GoldenResult result = vkgolden::compare(_goldenPath, pixels.data(), _windowExtent.width,
+                                                    _windowExtent.height, _goldenTolerance);
+            if (!result._loaded){
+                printf("GOLDEN: FAILED TO READ %s\n", _goldenPath.c_str());
+                passed = false;
+            } else if (!result._sizeMatches){
+                printf("GOLDEN: %s IS NOT %ux%u\n", _goldenPath.c_str(), _windowExtent.width, _windowExtent.height);
+                passed = false;
+            } else {
+                float mismatch = (float)result._mismatched / (float)result._pixelCount;
+                bool matches = mismatch <= _goldenMaxMismatch;
+                printf("GOLDEN: %s, %u of %u pixels past tolerance %u (%.4f%%, %.4f%% allowed), max difference %u, mean %.3f\n",
+                       matches ? "PASS" : "FAIL", result._mismatched, result._pixelCount, _goldenTolerance,
+                       mismatch * 100.0f, _goldenMaxMismatch * 100.0f, result._maxDifference, result._meanDifference);
+                if (!matches){
+                    // Keep what we rendered next to the reference so the two can be diffed
+                    std::string actualPath = _goldenPath + ".actual.ppm";
+                    vkgolden::write_ppm(actualPath, pixels.data(), _windowExtent.width, _windowExtent.height);
+                    printf("GOLDEN: RENDERED FRAME WRITTEN TO %s\n", actualPath.c_str());
+                    passed = false;
+                }
+            }
+        }
+    }
+
+    if (_maxFrameMs > 0.0f || _maxGpuMs > 0.0f){
+        if (_benchmark.frame_count() == 0){
+            printf("PERF: NO FRAME TIMES, FRAME TIME LIMITS NEED --benchmark\n");
+            passed = false;
+        }
+        if (_maxFrameMs > 0.0f && _benchmark.frame_count() != 0){
+            double frameMs = _benchmark.frame_ms(50.0);
+            bool fast = frameMs <= _maxFrameMs;
+            printf("PERF: %s, median frame %.3f ms (limit %.3f ms)\n", fast ? "PASS" : "FAIL", frameMs, _maxFrameMs);
+            passed = passed && fast;
+        }
+        if (_maxGpuMs > 0.0f && _benchmark.frame_count() != 0){
+            double gpuMs = _benchmark.gpu_ms(50.0);
+            // No timestamps means nothing to hold against the limit, which shouldn't count as a pass
+            bool fast = gpuMs > 0.0 && gpuMs <= _maxGpuMs;
+            printf("PERF: %s, median GPU %.3f ms (limit %.3f ms)\n", fast ? "PASS" : "FAIL", gpuMs, _maxGpuMs);
+            passed = passed && fast;
+        }
+    }
+
+    return passed;
+}
+
+bool VulkanEngine::read_frame(std::vector<uint8_t> &pixels) {
+    if (!_headless || _frameNumber == 0){
+        return false;
+    }
+
+    FrameData &frame = _frames[(_frameNumber - 1) % _framesInFlight];
+    wait_for_timeline(frame._timelineValue);
+
+    size_t frameSize = (size_t)_windowExtent.width * _windowExtent.height * 4;
+    pixels.resize(frameSize);
+    // Readback memory is host coherent, no invalidate needed
+    memcpy(pixels.data(), frame._readbackBuffer._allocation._mapped, frameSize);
+    return true;
 }
 
 void VulkanEngine::init_vulkan() {
+    PROFILE_FUNCTION();
     // I have no idea what this does
     // but it generates an instance :)
     vkb::InstanceBuilder builder;
 
     auto inst_ret = builder.set_app_name("Vulkan Engine")
             .request_validation_layers(true)
-            .require_api_version(1,1,0)
+            .require_api_version(1,2,0)
             .use_default_debug_messenger()
+            .set_headless(_headless)
             .build();
 
     vkb::Instance vkb_inst = inst_ret.value();
@@ -200,33 +1127,193 @@ void VulkanEngine::init_vulkan() {
     _instance = vkb_inst.instance;
     _debug_messenger = vkb_inst.debug_messenger;
 
-    SDL_Vulkan_CreateSurface(_window, _instance, &_surface);
-
     vkb::PhysicalDeviceSelector selector {vkb_inst};
+    selector.set_minimum_version(1,2);
+
+    // Upload completion is tracked with a timeline semaphore
+    VkPhysicalDeviceVulkan12Features features12 = {};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    features12.timelineSemaphore = VK_TRUE;
+    // Culled draws take their count from a buffer the cull shader wrote
+    features12.drawIndirectCount = _gpuCulling ? VK_TRUE : VK_FALSE;
+    if (_bindlessDescriptors){
+        features12.descriptorIndexing = VK_TRUE;
+        features12.runtimeDescriptorArray = VK_TRUE;
+        features12.descriptorBindingPartiallyBound = VK_TRUE;
+        features12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+        features12.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+        features12.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+        features12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+    }
+    selector.set_required_features_12(features12);
+    // Optional, only used to report pipeline cache hits
+    selector.add_desired_extension(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+    if (!_headless){
+        // Optional, lets the frame pacer see when frames actually reach the screen
+        selector.add_desired_extension(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+        selector.add_desired_extension(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+    }
+
+    if (_softwareDevice){
+        selector.prefer_gpu_device_type(vkb::PreferredDeviceType::cpu);
+    }
+
+    if (_headless){
+        // No surface at all, any device with a graphics queue will do
+        selector.require_present(false);
+    } else {
+        SDL_Vulkan_CreateSurface(_window, _instance, &_surface);
+        selector.set_surface(_surface);
+    }
+
     vkb::PhysicalDevice physicalDevice = selector
-            .set_minimum_version(1,1)
-            .set_surface(_surface)
             .select()
             .value();
 
+    // The instanced path wants to issue a whole material's draws in one indirect call,
+    // but can fall back to fewer features so only enable what the device has
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(physicalDevice.physical_device, &supportedFeatures);
+    _enabledFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+    _enabledFeatures.drawIndirectFirstInstance = supportedFeatures.drawIndirectFirstInstance;
+    if (_gpuCulling && !supportedFeatures.drawIndirectFirstInstance){
+        // Culled instances sit at their batch's offset, which only firstInstance can reach
+        printf("NO drawIndirectFirstInstance, GPU CULLING OFF\n");
+        _gpuCulling = false;
+    }
+    if (!_textureDir.empty()){
+        // Sampled levels are reported back with atomics from the fragment shader
+        if (!supportedFeatures.fragmentStoresAndAtomics){
+            printf("NO fragmentStoresAndAtomics, TEXTURES OFF\n");
+            _textureDir.clear();
+        }
+        _enabledFeatures.fragmentStoresAndAtomics = supportedFeatures.fragmentStoresAndAtomics;
+        // Block compressed files are uploaded as they are, whatever the device can't sample gets skipped
+        _enabledFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+        _enabledFeatures.textureCompressionASTC_LDR = supportedFeatures.textureCompressionASTC_LDR;
+    }
+    // DeviceBuilder enables whatever is in the selected device's feature struct
+    physicalDevice.features = _enabledFeatures;
+
+    // Desired extensions are enabled when present, check whether this one made it
+    uint32_t extensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(physicalDevice.physical_device, nullptr, &extensionCount, nullptr);
+    std::vector<VkExtensionProperties> extensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(physicalDevice.physical_device, nullptr, &extensionCount, extensions.data());
+    bool hasPresentId = false;
+    bool hasPresentWait = false;
+    for (const VkExtensionProperties &extension : extensions){
+        if (strcmp(extension.extensionName, VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME) == 0){
+            _hasCreationFeedback = true;
+        }
+        if (strcmp(extension.extensionName, VK_KHR_PRESENT_ID_EXTENSION_NAME) == 0){
+            hasPresentId = true;
+        }
+        if (strcmp(extension.extensionName, VK_KHR_PRESENT_WAIT_EXTENSION_NAME) == 0){
+            hasPresentWait = true;
+        }
+    }
+
+    // The extensions alone aren't enough, both features have to be there and switched on
+    VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures = {};
+    presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures = {};
+    presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    if (!_headless && hasPresentId && hasPresentWait){
+        presentIdFeatures.pNext = &presentWaitFeatures;
+        VkPhysicalDeviceFeatures2 features2 = {};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &presentIdFeatures;
+        vkGetPhysicalDeviceFeatures2(physicalDevice.physical_device, &features2);
+        presentIdFeatures.pNext = nullptr;
+        _presentWait = presentIdFeatures.presentId && presentWaitFeatures.presentWait;
+    }
+
     vkb::DeviceBuilder deviceBuilder {physicalDevice};
+    if (_presentWait){
+        deviceBuilder.add_pNext(&presentIdFeatures);
+        deviceBuilder.add_pNext(&presentWaitFeatures);
+    }
     vkb::Device vkbDevice = deviceBuilder.build().value();
 
     _device = vkbDevice.device;
     _chosenGPU = physicalDevice.physical_device;
 
+    // Extension entry points don't come from the loader's exports
+    if (_presentWait){
+        _vkWaitForPresent = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(_device, "vkWaitForPresentKHR");
+        _presentWait = _vkWaitForPresent != nullptr;
+    }
+    _pacer._presentTracking = _presentWait;
+
+    // D32 nearly everywhere, the spec only promises one of D32 and X8_D24, and D16 always
+    for (VkFormat format : {VK_FORMAT_D32_SFLOAT, VK_FORMAT_X8_D24_UNORM_PACK32, VK_FORMAT_D16_UNORM}){
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(_chosenGPU, format, &properties);
+        if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT){
+            _depthFormat = format;
+            break;
+        }
+    }
+
     _graphicsQueue = vkbDevice.get_queue(vkb::QueueType::graphics).value();
     _graphicsQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::graphics).value();
 
+    // Prefer a transfer-only family (the copy engine on discrete GPUs), then any family other
+    // than graphics, and share the graphics queue as a last resort
+    auto dedicatedTransfer = vkbDevice.get_dedicated_queue(vkb::QueueType::transfer);
+    auto separateTransfer = vkbDevice.get_queue(vkb::QueueType::transfer);
+    if (dedicatedTransfer){
+        _uploadQueue = dedicatedTransfer.value();
+        _uploadQueueFamily = vkbDevice.get_dedicated_queue_index(vkb::QueueType::transfer).value();
+    } else if (separateTransfer){
+        _uploadQueue = separateTransfer.value();
+        _uploadQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::transfer).value();
+    } else {
+        _uploadQueue = _graphicsQueue;
+        _uploadQueueFamily = _graphicsQueueFamily;
+    }
+
+    vkGetPhysicalDeviceProperties(_chosenGPU, &_gpuProperties);
+
+    _allocator.init(_device, _chosenGPU);
+
+    // Timestamps are only usable if the graphics family reports valid bits
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(_chosenGPU, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(_chosenGPU, &queueFamilyCount, queueFamilies.data());
+
+    uint32_t validBits = queueFamilies[_graphicsQueueFamily].timestampValidBits;
+    if (validBits != 0){
+        _timestampPeriod = _gpuProperties.limits.timestampPeriod;
+        _timestampMask = validBits >= 64 ? ~0ull : ((1ull << validBits) - 1);
+    }
 }
 
 void VulkanEngine::init_swapchain() {
+    PROFILE_FUNCTION();
+    if (_headless){
+        init_offscreen_targets();
+        return;
+    }
+
+    // The window size is in screen coordinates, on high DPI displays the drawable can be bigger
+    int width, height;
+    SDL_Vulkan_GetDrawableSize(_window, &width, &height);
+
     vkb::SwapchainBuilder swapchainBuilder{_chosenGPU, _device, _surface};
 
     vkb::Swapchain vkbSwapChain = swapchainBuilder
             .use_default_format_selection()
-            .set_desired_present_mode(VK_PRESENT_MODE_FIFO_KHR)
-            .set_desired_extent(_windowExtent.width, _windowExtent.height)
+            .set_desired_present_mode(_presentMode)
+            // FIFO is the only mode every surface has to support
+            .add_fallback_present_mode(VK_PRESENT_MODE_FIFO_KHR)
+            .set_desired_extent(width, height)
+            // Lets the driver reuse the images of the swapchain being replaced, VK_NULL_HANDLE the first time
+            .set_old_swapchain(_swapchain)
+            // Captured frames are copied straight out of the swapchain image
+            .add_image_usage_flags(_capturePath.empty() ? 0 : VK_IMAGE_USAGE_TRANSFER_SRC_BIT)
             .build()
             .value();
 
@@ -235,136 +1322,339 @@ void VulkanEngine::init_swapchain() {
     _swapchainImageViews = vkbSwapChain.get_image_views().value();
 
     _swapchainImageFormat = vkbSwapChain.image_format;
+    _windowExtent = vkbSwapChain.extent;
 }
 
-void VulkanEngine::init_commands() {
-    VkCommandPoolCreateInfo commandPoolCreateInfo = vkinit::command_pool_create_info(_graphicsQueueFamily, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+bool VulkanEngine::recreate_swapchain() {
+    int width, height;
+    SDL_Vulkan_GetDrawableSize(_window, &width, &height);
+    if (width == 0 || height == 0){
+        return false;
+    }
+
+    // Resizes are rare, waiting for everything is simpler than tracking which frames still use the old images
+    VK_CHECK(vkDeviceWaitIdle(_device));
+
+    // Readback buffers are sized for the old extent, get their frames out first
+    flush_readbacks();
+    destroy_readback();
+
+    // The graph's framebuffers point at the old views, drop them first
+    _renderGraph.reset();
+    for (VkImageView view : _swapchainImageViews){
+        vkDestroyImageView(_device, view, nullptr);
+    }
+    for (VkSemaphore renderSemaphore : _renderSemaphores){
+        vkDestroySemaphore(_device, renderSemaphore, nullptr);
+    }
 
-    VK_CHECK(vkCreateCommandPool(_device, &commandPoolCreateInfo, nullptr, &_commandPool));
+    // Ids only mean something to the swapchain they were presented to
+    _pacer.discard(_lastPresentId);
+    _presentConfirmed = _lastPresentId;
 
-    VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(_commandPool, 1);
+    VkFormat oldFormat = _swapchainImageFormat;
+    VkSwapchainKHR oldSwapchain = _swapchain;
+    init_swapchain();
+    vkDestroySwapchainKHR(_device, oldSwapchain, nullptr);
+
+    // Every pipeline was made for the old format, same surface so this shouldn't happen
+    if (_swapchainImageFormat != oldFormat){
+        printf("SWAPCHAIN FORMAT CHANGED ON RECREATE!\n");
+        abort();
+    }
 
-    VK_CHECK(vkAllocateCommandBuffers(_device, &cmdAllocInfo, &_mainCommandBuffer));
+    init_readback();
+    init_render_graph();
+    init_image_sync_structures();
 
+    _swapchainDirty = false;
+    printf("SWAPCHAIN RECREATED: %ux%u, %zu images, %s requested\n", _windowExtent.width, _windowExtent.height,
+           _swapchainImages.size(), present_mode_name(_presentMode));
+    return true;
 }
 
-void VulkanEngine::init_default_renderpass() {
-    VkAttachmentDescription color_attackment = {};
+void VulkanEngine::init_offscreen_targets() {
+    PROFILE_FUNCTION();
+    if (_headlessImageCount < 1) _headlessImageCount = 1;
+
+    // There is no surface to pick a format for us, this one is renderable and trivial to read back
+    _swapchainImageFormat = VK_FORMAT_R8G8B8A8_SRGB;
 
-    // Format must match swapchain
-    color_attackment.format = _swapchainImageFormat;
-    // No MSAA, only 1 bit samples
-    color_attackment.samples = VK_SAMPLE_COUNT_1_BIT;
-    // Clear on load
-    color_attackment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    // Store on store
-    color_attackment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    VkExtent3D imageExtent = {_windowExtent.width, _windowExtent.height, 1};
+    VkImageCreateInfo imageInfo = vkinit::image_create_info(_swapchainImageFormat,
+                                                            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                                                            imageExtent);
 
-    // We aren't using stencils so we don't care about their load and store operations
-    color_attackment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    color_attackment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    _offscreenImages = std::vector<AllocatedImage>(_headlessImageCount);
+    _swapchainImages = std::vector<VkImage>(_headlessImageCount);
+    _swapchainImageViews = std::vector<VkImageView>(_headlessImageCount);
 
-    // The layout we don't care about when starting out
-    color_attackment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    for (uint32_t i = 0; i < _headlessImageCount; i++){
+        AllocatedImage &target = _offscreenImages[i];
+        if (!_allocator.create_image(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &target)){
+            printf("FAILED TO CREATE OFFSCREEN TARGET!\n");
+            abort();
+        }
 
-    // The color attachment must be ready to render to the screen when we're ready
-    color_attackment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        _swapchainImages[i] = target._image;
 
-    VkAttachmentReference color_attachment_ref = {};
-    // attachment number is the index of the pAttachments array in the parent render pass
-    color_attachment_ref.attachment = 0;
-    color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        VkImageViewCreateInfo viewInfo = vkinit::imageview_create_info(_swapchainImageFormat, target._image, VK_IMAGE_ASPECT_COLOR_BIT);
+        VK_CHECK(vkCreateImageView(_device, &viewInfo, nullptr, &_swapchainImageViews[i]));
+    }
+}
 
-    // Creating 1 subpass
-    VkSubpassDescription subpass = {};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &color_attachment_ref;
+void VulkanEngine::init_readback() {
+    PROFILE_FUNCTION();
+    if (!_capturePath.empty() && !_capture.active()){
+        // The writer wants RGBA, surfaces mostly hand out BGRA
+        bool bgra = _swapchainImageFormat == VK_FORMAT_B8G8R8A8_UNORM || _swapchainImageFormat == VK_FORMAT_B8G8R8A8_SRGB;
+        if (!_capture.init(_captureFormat, _capturePath, bgra)){
+            printf("FAILED TO START CAPTURE!\n");
+            abort();
+        }
+    }
 
-    VkRenderPassCreateInfo render_pass_info = {};
+    if (!_headless && !_capture.active()){
+        return;
+    }
 
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_info.attachmentCount = 1;
-    render_pass_info.pAttachments = &color_attackment;
+    // One readback buffer per frame in flight so copying frame N never waits on the CPU reading frame N-1
+    VkDeviceSize readbackSize = (VkDeviceSize)_windowExtent.width * _windowExtent.height * 4;
 
-    render_pass_info.subpassCount = 1;
-    render_pass_info.pSubpasses = &subpass;
+    for (uint32_t i = 0; i < _framesInFlight; i++){
+        if (!_allocator.create_buffer(readbackSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                      &_frames[i]._readbackBuffer)){
+            printf("FAILED TO CREATE READBACK BUFFER!\n");
+            abort();
+        }
+    }
+}
 
-    VK_CHECK(vkCreateRenderPass(_device, &render_pass_info, nullptr, &_renderPass));
+void VulkanEngine::destroy_readback() {
+    for (uint32_t i = 0; i < _framesInFlight; i++){
+        if (_frames[i]._readbackBuffer._buffer != VK_NULL_HANDLE){
+            _allocator.destroy_buffer(_frames[i]._readbackBuffer);
+        }
+    }
 }
 
-void VulkanEngine::init_framebuffer() {
-    VkFramebufferCreateInfo fb_info = {};
-    fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-    fb_info.pNext = nullptr;
+void VulkanEngine::init_commands() {
+    PROFILE_FUNCTION();
+    // Each frame gets its own pool so it can be reset as a whole once that frame has finished on the GPU
+    VkCommandPoolCreateInfo commandPoolCreateInfo = vkinit::command_pool_create_info(_graphicsQueueFamily, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+
+    for (uint32_t i = 0; i < _framesInFlight; i++){
+        VK_CHECK(vkCreateCommandPool(_device, &commandPoolCreateInfo, nullptr, &_frames[i]._commandPool));
 
-    fb_info.renderPass = _renderPass;
-    fb_info.attachmentCount = 1;
-    fb_info.width = _windowExtent.width;
-    fb_info.height = _windowExtent.height;
-    fb_info.layers = 1;
+        VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(_frames[i]._commandPool, 1);
 
-    const uint32_t swapchain_imagecount = _swapchainImages.size();
-    _framebuffers = std::vector<VkFramebuffer>(swapchain_imagecount);
+        VK_CHECK(vkAllocateCommandBuffers(_device, &cmdAllocInfo, &_frames[i]._mainCommandBuffer));
+    }
+
+    // Only the object list is worth recording in parallel, the triangle scene stays single threaded
+    uint32_t recordThreads = _recordThreads != 0 ? _recordThreads : std::max(1u, std::thread::hardware_concurrency());
+    if (_scene != "instances" || recordThreads < 2){
+        return;
+    }
 
-    for (uint i = 0; i < swapchain_imagecount; i++){
-        fb_info.pAttachments = &_swapchainImageViews[i];
-        VK_CHECK(vkCreateFramebuffer(_device, &fb_info, nullptr, &_framebuffers[i]));
+    _jobs.init(recordThreads);
+    _recordSlices = recordThreads * 4;
+
+    // Every worker gets its own pool per frame slot, so recording never needs a lock
+    // and a slot's pools can be reset as soon as its frame has finished
+    for (uint32_t i = 0; i < _framesInFlight; i++){
+        _frames[i]._workerCommands = std::vector<WorkerCommands>(recordThreads);
+        for (WorkerCommands &worker : _frames[i]._workerCommands){
+            VK_CHECK(vkCreateCommandPool(_device, &commandPoolCreateInfo, nullptr, &worker._pool));
+        }
     }
 
 }
 
-void VulkanEngine::init_sync_structures() {
-    VkFenceCreateInfo fenceCreateInfo = {};
-    fenceCreateInfo.pNext = nullptr;
-    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+void VulkanEngine::init_render_graph() {
+    PROFILE_FUNCTION();
+    _renderGraph.init(_device, _allocator);
+    _renderGraph.reset();
+    _renderGraph._profiler = &_gpuProfiler;
+
+    // Whoever used the image last (presentation or the readback copy) is done by the time we wait on it.
+    // Windowed images go back to the presentation engine, headless ones stay wherever the copy left them.
+    _swapchainTarget = _renderGraph.import_image("swapchain", _swapchainImages, _swapchainImageViews, _swapchainImageFormat,
+                                                 _windowExtent, VK_IMAGE_LAYOUT_UNDEFINED,
+                                                 _headless ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                                                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+    // Only lives for the frame, nothing after the main pass looks at it
+    _depthTarget = _renderGraph.create_image("depth", _depthFormat, _windowExtent);
+
+    VkClearValue clearValue = {};
+    VkClearValue depthClear = {};
+    depthClear.depthStencil = {1.0f, 0};
+
+    // Declared first so it runs first, the main pass only reads buffers the graph doesn't track
+    if (_gpuCulling){
+        GraphPassId cull = _renderGraph.add_pass("cull", false, [this](VkCommandBuffer cmd, VkFramebuffer){
+            cull_objects(cmd);
+        });
+        _renderGraph.set_side_effect(cull);
+    }
+
+    if (_depthPrepass){
+        _depthPass = _renderGraph.add_pass("depth prepass", true, [this](VkCommandBuffer cmd, VkFramebuffer){
+            draw_depth_prepass(pass_recorder(cmd));
+        });
+        _renderGraph.write_depth(_depthPass, _depthTarget, &depthClear);
+    }
+
+    _mainPass = _renderGraph.add_pass("main", true, [this](VkCommandBuffer cmd, VkFramebuffer framebuffer){
+        draw_main_pass(pass_recorder(cmd), framebuffer);
+    });
+    _renderGraph.write_color(_mainPass, _swapchainTarget, &clearValue);
+    if (_depthPrepass){
+        _renderGraph.read_depth(_mainPass, _depthTarget);
+    } else {
+        _renderGraph.write_depth(_mainPass, _depthTarget, &depthClear);
+    }
 
-    VK_CHECK(vkCreateFence(_device, &fenceCreateInfo, nullptr, &_renderFence));
+    if (_headless || _capture.active()){
+        GraphPassId readback = _renderGraph.add_pass("readback", false, [this](VkCommandBuffer cmd, VkFramebuffer){
+            copy_readback(cmd);
+        });
+        _renderGraph.transfer_read(readback, _swapchainTarget);
+        _renderGraph.set_side_effect(readback);
+    }
+
+    _renderGraph.compile();
+    _renderPass = _renderGraph.render_pass(_mainPass);
+    if (_depthPrepass){
+        _depthRenderPass = _renderGraph.render_pass(_depthPass);
+    }
 
+    RenderGraphStats stats = _renderGraph.stats();
+    printf("RENDER GRAPH: %u passes (%u culled), %u barriers, %u render pass dependencies, %u transient images in %.2f MB (%.2f MB unaliased)\n",
+           stats._passes, stats._culledPasses, stats._barriers, stats._renderPassDependencies, stats._transientImages,
+           stats._transientBytes / (1024.0 * 1024.0), stats._unaliasedBytes / (1024.0 * 1024.0));
+}
+
+void VulkanEngine::init_sync_structures() {
+    PROFILE_FUNCTION();
     VkSemaphoreCreateInfo semaphoreCreateInfo = {};
     semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
     semaphoreCreateInfo.pNext = nullptr;
     semaphoreCreateInfo.flags = 0;
 
-    VK_CHECK(vkCreateSemaphore(_device, &semaphoreCreateInfo, nullptr, &_presentSemaphore));
-    VK_CHECK(vkCreateSemaphore(_device, &semaphoreCreateInfo, nullptr, &_renderSemaphore));
+    for (uint32_t i = 0; i < _framesInFlight; i++){
+        VK_CHECK(vkCreateSemaphore(_device, &semaphoreCreateInfo, nullptr, &_frames[i]._presentSemaphore));
+        // Nothing submitted yet, value 0 is reached from the start
+        _frames[i]._timelineValue = 0;
+    }
 
-}
+    VkSemaphoreTypeCreateInfo timelineCreateInfo = {};
+    timelineCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timelineCreateInfo.pNext = nullptr;
+    timelineCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    timelineCreateInfo.initialValue = 0;
 
-bool VulkanEngine::load_shader_module(const char *file, VkShaderModule *out) {
-    std::ifstream spvFile(file, std::ios::ate | std::ios::binary);
+    VkSemaphoreCreateInfo timelineSemaphoreInfo = semaphoreCreateInfo;
+    timelineSemaphoreInfo.pNext = &timelineCreateInfo;
+    VK_CHECK(vkCreateSemaphore(_device, &timelineSemaphoreInfo, nullptr, &_frameTimeline));
 
-    if (!spvFile.is_open()){
-        return false;
+    init_image_sync_structures();
+
+    if (_timestampPeriod != 0.0f){
+        VkQueryPoolCreateInfo queryPoolInfo = {};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.pNext = nullptr;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2;
+
+        for (uint32_t i = 0; i < _framesInFlight; i++){
+            VK_CHECK(vkCreateQueryPool(_device, &queryPoolInfo, nullptr, &_frames[i]._timestampPool));
+        }
     }
+    _gpuProfiler.init(_device, _framesInFlight, _timestampPeriod, _timestampMask);
+}
 
-    size_t fileSize = (size_t)spvFile.tellg();
+void VulkanEngine::init_descriptors() {
+    PROFILE_FUNCTION();
+    _layoutCache.init(_device);
 
-    std::vector<uint32_t> buffer(fileSize / sizeof(uint32_t));
+    for (uint32_t i = 0; i < _framesInFlight; i++){
+        _frames[i]._descriptors.init(_device);
+    }
 
-    spvFile.seekg(0);
+    if (_bindlessDescriptors){
+        if (!_bindless.init(_device)){
+            printf("FAILED TO CREATE BINDLESS DESCRIPTOR HEAP!\n");
+            abort();
+        }
+        printf("BINDLESS DESCRIPTORS: %u textures, %u buffers\n", _bindless._maxTextures, _bindless._maxBuffers);
+    }
+}
 
-    spvFile.read((char*) buffer.data(), fileSize);
+void VulkanEngine::init_image_sync_structures() {
+    PROFILE_FUNCTION();
+    VkSemaphoreCreateInfo semaphoreCreateInfo = {};
+    semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreCreateInfo.pNext = nullptr;
+    semaphoreCreateInfo.flags = 0;
 
-    spvFile.close();
+    _renderSemaphores = std::vector<VkSemaphore>(_swapchainImages.size());
+    for (VkSemaphore &renderSemaphore : _renderSemaphores){
+        VK_CHECK(vkCreateSemaphore(_device, &semaphoreCreateInfo, nullptr, &renderSemaphore));
+    }
 
-    VkShaderModuleCreateInfo createInfo = {};
-    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    createInfo.pNext = nullptr;
-    createInfo.codeSize = buffer.size() * sizeof(uint32_t);
-    createInfo.pCode = buffer.data();
+    _imagesInFlight = std::vector<uint64_t>(_swapchainImages.size(), 0);
+}
 
-    // TO-DO: Personally, I think this approach is inefficient and wastes memory, fix this later...
-    VkShaderModule shaderModule;
-    if (vkCreateShaderModule(_device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS){
+void VulkanEngine::wait_for_timeline(uint64_t value) {
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.pNext = nullptr;
+    waitInfo.flags = 0;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &_frameTimeline;
+    waitInfo.pValues = &value;
+
+    // 1 second, anything longer means the GPU is hung
+    VK_CHECK(vkWaitSemaphores(_device, &waitInfo, 1000000000));
+}
+
+bool VulkanEngine::load_shader_module(const char *file, VkShaderModule *out) {
+    VkShaderModule shaderModule = _shaderCache.get(file);
+    if (shaderModule == VK_NULL_HANDLE){
         return false;
     }
     *out = shaderModule;
     return true;
 }
 
+void VulkanEngine::build_pipelines(PipelineBatch &batch) {
+    uint32_t threads = _pipelineThreads != 0 ? _pipelineThreads : std::max(1u, std::thread::hardware_concurrency());
+
+    batch._collectFeedback = _hasCreationFeedback;
+    if (!batch.build(_device, _pipelineCache._cache, threads)){
+        printf("FAILED TO CREATE PIPELINE!\n");
+        assert(0);
+    }
+
+    _pipelineBuildMs += batch._buildMs;
+    _pipelineCacheHits += batch._cacheHits;
+    _pipelineCacheMisses += batch._cacheMisses;
+
+    printf("PIPELINE BATCH: %u requested, %u unique, %u threads\n",
+           batch.requested_count(), batch.unique_count(), std::min(threads, batch.unique_count()));
+}
+
 void VulkanEngine::init_pipelines() {
+    PROFILE_FUNCTION();
+    _shaderCache.init(_device);
+
+    _pipelineCache.init(_device, _gpuProperties, _pipelineCachePath);
+    printf("PIPELINE CACHE %s: %zu bytes loaded in %.2f ms\n",
+           _pipelineCache._warm ? "WARM" : "COLD", _pipelineCache._loadedBytes, _pipelineCache._loadMs);
+
     VkShaderModule fragShader;
     VkShaderModule vertShader;
     if (!load_shader_module("shaders/triangle.frag.spv", &fragShader)){
@@ -404,70 +1694,367 @@ void VulkanEngine::init_pipelines() {
     pipelineBuilder._scissor.offset = {0,0};
     pipelineBuilder._scissor.extent = _windowExtent;
 
+    // The swapchain can be resized, keep these out of the pipeline so it never has to be rebuilt for it
+    pipelineBuilder._dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+
     pipelineBuilder._rasterizer = vkinit::rasterizationStateCreateInfo(VK_POLYGON_MODE_FILL);
 
     pipelineBuilder._multisampling = vkinit::multisampleStateCreateInfo();
 
     pipelineBuilder._colorBlendAttachment = vkinit::colorBlendAttachmentState();
 
+    // Equal depth passes, so objects drawn later at the same depth still land on top like before.
+    // Behind the pre-pass the main pass has depth read only.
+    pipelineBuilder._depthStencil = vkinit::depth_stencil_create_info(true, !_depthPrepass, VK_COMPARE_OP_LESS_OR_EQUAL);
+
     pipelineBuilder._pipelineLayout = _trianglePipelineLayout;
 
-    _trianglePipeline = pipelineBuilder.build_pipeline(_device, _renderPass);
+    // Everything gets described up front and created in one go
+    PipelineBatch batch;
+    uint32_t triangleSlot = batch.add(pipelineBuilder.describe(_renderPass));
+
+    // The camera path gets whole matrices per instance instead of an offset and scale
+    const bool textured = !_textureDir.empty();
+    const char *meshVertPath = textured ? "shaders/mesh_textured.vert.spv"
+                             : _cameraTransforms ? "shaders/mesh_camera.vert.spv" : "shaders/mesh.vert.spv";
+    const char *meshFragPath = textured ? "shaders/mesh_textured.frag.spv" : "shaders/triangle.frag.spv";
+
+    std::vector<uint32_t> materialSlots;
+    // Per material, ~0u for the ones without a depth pipeline
+    std::vector<uint32_t> depthSlots;
+    if (_scene == "instances"){
+        VkShaderModule meshVertShader;
+        if (!load_shader_module(meshVertPath, &meshVertShader)){
+            printf("FAILED TO LOAD MESH VERTEX SHADER!\n");
+            assert(0);
+        }
+
+        VertexInputDescription vertexDescription = get_mesh_vertex_description(_cameraTransforms);
+
+        pipelineBuilder._shaderStages[0] = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_VERTEX_BIT, meshVertShader);
+
+        if (textured){
+            VkShaderModule meshFragShader;
+            if (!load_shader_module(meshFragPath, &meshFragShader)){
+                printf("FAILED TO LOAD TEXTURED FRAGMENT SHADER!\n");
+                assert(0);
+            }
+            pipelineBuilder._shaderStages[1] = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_FRAGMENT_BIT, meshFragShader);
+
+            VkPushConstantRange pushConstants = {};
+            pushConstants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+            pushConstants.offset = 0;
+            pushConstants.size = sizeof(TexturePushConstants);
+
+            VkPipelineLayoutCreateInfo texturedLayoutInfo = vkinit::pipelineLayoutCreateInfo();
+            texturedLayoutInfo.setLayoutCount = 1;
+            texturedLayoutInfo.pSetLayouts = &_bindless._setLayout;
+            texturedLayoutInfo.pushConstantRangeCount = 1;
+            texturedLayoutInfo.pPushConstantRanges = &pushConstants;
+            VK_CHECK(vkCreatePipelineLayout(_device, &texturedLayoutInfo, nullptr, &_texturedPipelineLayout));
+            pipelineBuilder._pipelineLayout = _texturedPipelineLayout;
+        }
+
+        vertexDescription.apply(pipelineBuilder._vertexInputInfo);
 
+        // Opaque. Behind the pre-pass only the fragments that won the depth test get shaded.
+        if (_depthPrepass){
+            pipelineBuilder._depthStencil = vkinit::depth_stencil_create_info(true, false, VK_COMPARE_OP_EQUAL);
+        }
+        materialSlots.push_back(batch.add(pipelineBuilder.describe(_renderPass)));
+        depthSlots.push_back(~0u);
+
+        if (_depthPrepass){
+            // Same vertex shader so the depths match exactly, no fragment shader at all
+            PipelineBuilder depthBuilder = pipelineBuilder;
+            depthBuilder._shaderStages.resize(1);
+            depthBuilder._depthOnly = true;
+            depthBuilder._depthStencil = vkinit::depth_stencil_create_info(true, true, VK_COMPARE_OP_LESS_OR_EQUAL);
+            depthSlots.back() = batch.add(depthBuilder.describe(_depthRenderPass));
+        }
+
+        // Alpha blended, a second pipeline so the objects actually need sorting into runs.
+        // Tested against the opaques' depth but never writes it.
+        pipelineBuilder._depthStencil = vkinit::depth_stencil_create_info(true, false, VK_COMPARE_OP_LESS_OR_EQUAL);
+        pipelineBuilder._colorBlendAttachment.blendEnable = VK_TRUE;
+        pipelineBuilder._colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        pipelineBuilder._colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        pipelineBuilder._colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+        pipelineBuilder._colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        pipelineBuilder._colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+        pipelineBuilder._colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+        materialSlots.push_back(batch.add(pipelineBuilder.describe(_renderPass)));
+        depthSlots.push_back(~0u);
+    }
+
+    build_pipelines(batch);
 
-    vkDestroyShaderModule(_device, fragShader, nullptr);
-    vkDestroyShaderModule(_device, vertShader, nullptr);
+    _trianglePipeline = batch.get(triangleSlot);
 
+    if (_gpuCulling){
+        if (!_culling.init(_device, _allocator, _layoutCache, _framesInFlight)){
+            printf("FAILED TO CREATE CULLING DESCRIPTOR LAYOUT!\n");
+            abort();
+        }
 
+        VkShaderModule cullShader;
+        if (!load_shader_module("shaders/cull.comp.spv", &cullShader)){
+            printf("FAILED TO LOAD CULL COMPUTE SHADER!\n");
+            assert(0);
+        }
+
+        VkPushConstantRange pushConstants = {};
+        pushConstants.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstants.offset = 0;
+        pushConstants.size = sizeof(CullPushConstants);
+
+        VkPipelineLayoutCreateInfo cullLayoutInfo = vkinit::pipelineLayoutCreateInfo();
+        cullLayoutInfo.setLayoutCount = 1;
+        cullLayoutInfo.pSetLayouts = &_culling._setLayout;
+        cullLayoutInfo.pushConstantRangeCount = 1;
+        cullLayoutInfo.pPushConstantRanges = &pushConstants;
+        VK_CHECK(vkCreatePipelineLayout(_device, &cullLayoutInfo, nullptr, &_cullPipelineLayout));
+
+        ComputePipelineBuilder computeBuilder;
+        computeBuilder._shaderStage = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, cullShader);
+        computeBuilder._pipelineLayout = _cullPipelineLayout;
+        _cullPipeline = computeBuilder.build_pipeline(_device, _pipelineCache._cache);
+    }
+
+    for (size_t i = 0; i < materialSlots.size(); i++){
+        Material material;
+        material._pipeline = batch.get(materialSlots[i]);
+        material._layout = textured ? _texturedPipelineLayout : _trianglePipelineLayout;
+        material._depthPipeline = depthSlots[i] != ~0u ? batch.get(depthSlots[i]) : VK_NULL_HANDLE;
+        // The second material blends, see above
+        material._blended = i == 1;
+        _materials.push_back(material);
+    }
+
+    if (_shaderHotReload){
+        _shaderReload._compiler = _shaderCompiler;
+        if (_shaderReload.init(_device, _pipelineCache._cache, "shaders")){
+            // _materials doesn't change size after this, so pointing at its elements is fine
+            _shaderReload.track(&_trianglePipeline, batch.description(triangleSlot),
+                                {"shaders/triangle.vert.spv", "shaders/triangle.frag.spv"});
+            for (size_t i = 0; i < materialSlots.size(); i++){
+                _shaderReload.track(&_materials[i]._pipeline, batch.description(materialSlots[i]),
+                                    {meshVertPath, meshFragPath});
+                if (depthSlots[i] != ~0u){
+                    _shaderReload.track(&_materials[i]._depthPipeline, batch.description(depthSlots[i]), {meshVertPath});
+                }
+            }
+            printf("SHADER HOT RELOAD: WATCHING shaders/\n");
+        } else {
+            printf("SHADER HOT RELOAD UNAVAILABLE, CAN'T WATCH shaders/\n");
+            _shaderHotReload = false;
+        }
+    }
+
+    if (_hasCreationFeedback){
+        printf("PIPELINES BUILT IN %.2f ms: %u cache hits, %u misses\n", _pipelineBuildMs, _pipelineCacheHits, _pipelineCacheMisses);
+    } else {
+        printf("PIPELINES BUILT IN %.2f ms\n", _pipelineBuildMs);
+    }
+}
+
+void VulkanEngine::init_uploader() {
+    PROFILE_FUNCTION();
+    // Only share the lock when the uploader really submits to the graphics queue
+    std::mutex *queueMutex = _uploadQueue == _graphicsQueue ? &_graphicsQueueMutex : nullptr;
+
+    if (!_uploader.init(_device, _allocator, _uploadQueue, _uploadQueueFamily, _graphicsQueueFamily, queueMutex)){
+        printf("FAILED TO CREATE UPLOADER!\n");
+        abort();
+    }
+
+    printf("UPLOADS ON %s QUEUE (family %u)\n", _uploader._separateQueue ? "TRANSFER" : "GRAPHICS", _uploadQueueFamily);
+}
+
+void VulkanEngine::init_textures() {
+    PROFILE_FUNCTION();
+    if (_textureDir.empty()){
+        return;
+    }
+
+    _textures._budget = _textureBudget;
+    if (!_textures.init(_device, _chosenGPU, _allocator, _uploader, _bindless, _framesInFlight)){
+        printf("FAILED TO CREATE TEXTURE STREAMER!\n");
+        abort();
+    }
+
+    DIR *dir = opendir(_textureDir.c_str());
+    if (!dir){
+        printf("COULD NOT OPEN TEXTURE DIRECTORY %s, DRAWING UNTEXTURED\n", _textureDir.c_str());
+        return;
+    }
+    std::vector<std::string> paths;
+    while (dirent *entry = readdir(dir)){
+        std::string name = entry->d_name;
+        auto ends_with = [&](const char *suffix){
+            size_t length = strlen(suffix);
+            return name.size() > length && name.compare(name.size() - length, length, suffix) == 0;
+        };
+        if (ends_with(".ktx2") || ends_with(".dds")){
+            paths.push_back(_textureDir + "/" + name);
+        }
+    }
+    closedir(dir);
+
+    // readdir order is whatever the filesystem likes, sorting keeps instance to texture stable between runs
+    std::sort(paths.begin(), paths.end());
+    for (const std::string &path : paths){
+        _textures.add(path.c_str());
+    }
+    printf("TEXTURES: %u of %zu files in %s streaming, %.0f MB budget\n", _textures.texture_count(), paths.size(),
+           _textureDir.c_str(), _textures._budget / (1024.0 * 1024.0));
 }
 
-VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkRenderPass pass) {
-    // Setup our viewport state
-    VkPipelineViewportStateCreateInfo viewportState = {};
-    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewportState.pNext = nullptr;
+void VulkanEngine::init_scene() {
+    PROFILE_FUNCTION();
+    if (_scene != "instances"){
+        return;
+    }
+
+    std::vector<Vertex> triangleVertices = {
+            {{0.5f, 0.5f, 0.0f}, {0.5f, 0.0f, 0.0f}},
+            {{-0.5f, 0.5f, 0.0f}, {0.0f, 0.5f, 0.0f}},
+            {{0.0f, -0.5f, 0.0f}, {0.0f, 0.0f, 0.5f}},
+    };
+    uint32_t triangleMesh = _meshPool.add(triangleVertices, {0, 1, 2});
+
+    std::vector<Vertex> quadVertices = {
+            {{-0.5f, -0.5f, 0.0f}, {0.5f, 0.5f, 0.0f}},
+            {{0.5f, -0.5f, 0.0f}, {0.0f, 0.5f, 0.5f}},
+            {{0.5f, 0.5f, 0.0f}, {0.5f, 0.0f, 0.5f}},
+            {{-0.5f, 0.5f, 0.0f}, {0.5f, 0.5f, 0.5f}},
+    };
+    uint32_t quadMesh = _meshPool.add(quadVertices, {0, 1, 2, 2, 3, 0});
+
+    // A baked mesh takes the quads' place, it's normalized into [-1, 1] so it gets half their scale
+    float quadScale = 1.0f;
+    if (!_meshPath.empty()){
+        uint32_t fileMesh = _meshPool.add_file(_meshPath.c_str());
+        if (fileMesh == ~0u){
+            printf("FAILED TO LOAD MESH %s!\n", _meshPath.c_str());
+            abort();
+        }
+        quadMesh = fileMesh;
+        quadScale = 0.5f;
+    }
+
+    if (!_meshPool.upload(_allocator, _uploader)){
+        printf("FAILED TO UPLOAD MESHES!\n");
+        abort();
+    }
+
+    // Spread the objects over a grid covering the screen, meshes and materials interleaved
+    // so the list really does need sorting before it can be batched
+    uint32_t side = (uint32_t)ceil(sqrt((double)std::max(_sceneObjectCount, 1u)));
+    float spacing = 2.0f / (float)side;
+
+    for (uint32_t i = 0; i < _sceneObjectCount; i++){
+        float x = -1.0f + spacing * ((float)(i % side) + 0.5f);
+        float y = -1.0f + spacing * ((float)(i / side) + 0.5f);
+        bool triangle = i % 2 == 0;
+        uint32_t material = (i / 3) % (uint32_t)_materials.size();
+        _renderObjects.add(triangle ? triangleMesh : quadMesh, material, x, y, 0.0f,
+                           spacing * 0.8f * (triangle ? 1.0f : quadScale));
+    }
 
-    viewportState.viewportCount = 1;
-    viewportState.pViewports = &_viewport;
-    viewportState.scissorCount = 1;
-    viewportState.pScissors = &_scissor;
+    if (_gpuCulling){
+        // Batches are fixed from here on, the GPU only ever sees this order. There's no camera with
+        // GPU culling, so blended objects sorted back to front along z now stay that way.
+        _renderObjects.sort_into_batches(_drawBatches, nullptr, blended_materials());
+        if (!_culling.upload(_uploader, _renderObjects, _drawBatches, _meshPool._meshes, (uint32_t)_materials.size(),
+                             blended_materials())){
+            printf("FAILED TO CREATE CULLING BUFFERS!\n");
+            abort();
+        }
+        printf("GPU CULLING: %u objects in %zu batches\n", _renderObjects.size(), _drawBatches.size());
+    }
 
-    // Our config for blending colors
-    VkPipelineColorBlendStateCreateInfo colorBlending = {};
-    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlending.pNext = nullptr;
+    // Every recording slice gets room for a command per batch
+    uint32_t maxBatches = (uint32_t)(_materials.size() * _meshPool._meshes.size());
+    uint32_t maxCommands = maxBatches * (_jobs.worker_count() > 1 ? _recordSlices : 1);
+    if (_depthPrepass){
+        // The pre-pass records its own inline set
+        maxCommands += maxBatches;
+    }
+    if (!_instanceRing.init(_allocator, _sceneObjectCount * instance_size(), _framesInFlight, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT) ||
+        !_indirectRing.init(_allocator, maxCommands * sizeof(VkDrawIndexedIndirectCommand), _framesInFlight, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT)){
+        printf("FAILED TO CREATE FRAME RINGS!\n");
+        abort();
+    }
 
-    colorBlending.logicOpEnable = VK_FALSE;
-    colorBlending.logicOp = VK_LOGIC_OP_COPY;
-    colorBlending.attachmentCount = 1;
-    colorBlending.pAttachments = &_colorBlendAttachment;
+    printf("SCENE %s: %u objects, %zu meshes, %zu materials\n",
+           _scene.c_str(), _renderObjects.size(), _meshPool._meshes.size(), _materials.size());
+    if (_cameraTransforms){
+        printf("CAMERA: %s transform kernel\n", vkmath::transform_kernel_name(_transformKernel));
+    }
+}
 
+PipelineDescription PipelineBuilder::describe(VkRenderPass pass, uint32_t subpass) const {
+    PipelineDescription description;
 
-    VkGraphicsPipelineCreateInfo pipelineCreateInfo = {};
-    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineCreateInfo.pNext = nullptr;
+    for (const VkPipelineShaderStageCreateInfo &stage : _shaderStages){
+        description._stages.push_back({stage.stage, stage.module, stage.pName});
+    }
 
-    pipelineCreateInfo.stageCount = _shaderStages.size();
-    pipelineCreateInfo.pStages = _shaderStages.data();
-    pipelineCreateInfo.pVertexInputState = &_vertexInputInfo;
-    pipelineCreateInfo.pInputAssemblyState = &_inputAssembly;
-    pipelineCreateInfo.pViewportState = &viewportState;
-    pipelineCreateInfo.pRasterizationState = &_rasterizer;
-    pipelineCreateInfo.pMultisampleState = &_multisampling;
-    pipelineCreateInfo.pColorBlendState = &colorBlending;
-    pipelineCreateInfo.layout = _pipelineLayout;
-    pipelineCreateInfo.renderPass = pass;
-    pipelineCreateInfo.subpass = 0;
-    pipelineCreateInfo.basePipelineHandle = VK_NULL_HANDLE;
+    description._bindings.assign(_vertexInputInfo.pVertexBindingDescriptions,
+                                 _vertexInputInfo.pVertexBindingDescriptions + _vertexInputInfo.vertexBindingDescriptionCount);
+    description._attributes.assign(_vertexInputInfo.pVertexAttributeDescriptions,
+                                   _vertexInputInfo.pVertexAttributeDescriptions + _vertexInputInfo.vertexAttributeDescriptionCount);
+
+    description._inputAssembly = _inputAssembly;
+    description._viewport = _viewport;
+    description._scissor = _scissor;
+    description._rasterizer = _rasterizer;
+    description._colorBlendAttachment = _colorBlendAttachment;
+    description._multisampling = _multisampling;
+    description._depthStencil = _depthStencil;
+    description._depthOnly = _depthOnly;
+    description._dynamicStates = _dynamicStates;
+    description._pipelineLayout = _pipelineLayout;
+    description._renderPass = pass;
+    description._subpass = subpass;
+    return description;
+}
 
-    VkPipeline pipeline;
+VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkRenderPass pass, VkPipelineCache cache,
+                                           VkPipelineCreationFeedbackEXT *feedback) {
+    // A batch of one, so there's only one place that turns state into a create info
+    PipelineBatch batch;
+    batch._collectFeedback = feedback != nullptr;
+    batch.add(describe(pass));
 
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &pipeline) != VK_SUCCESS){
+    if (!batch.build(device, cache)){
         printf("FAILED TO CREATE PIPELINE!\n");
         assert(0);
-    } else {
-        return pipeline;
+        return VK_NULL_HANDLE;
     }
 
+    if (feedback){
+        *feedback = batch.feedback()[0];
+    }
+    return batch.get(0);
+}
 
+VkPipeline ComputePipelineBuilder::build_pipeline(VkDevice device, VkPipelineCache cache) {
+    VkComputePipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = nullptr;
+    pipelineInfo.flags = 0;
+    pipelineInfo.stage = _shaderStage;
+    pipelineInfo.layout = _pipelineLayout;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+    pipelineInfo.basePipelineIndex = -1;
+
+    VkPipeline newPipeline;
+    if (vkCreateComputePipelines(device, cache, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS){
+        printf("FAILED TO CREATE COMPUTE PIPELINE!\n");
+        assert(0);
+        return VK_NULL_HANDLE;
+    }
+    return newPipeline;
 }
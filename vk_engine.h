@@ -6,7 +6,76 @@
 #define VKENGINE_VK_ENGINE_H
 
 #include "vk_types.h"
+#include "vk_benchmark.h"
+#include "vk_pipeline_cache.h"
+#include "vk_pipeline_batch.h"
+#include "vk_shaders.h"
+#include "vk_allocator.h"
+#include "vk_math.h"
+#include "vk_mesh.h"
+#include "vk_render_objects.h"
+#include "vk_jobs.h"
+#include "vk_upload.h"
+#include "vk_render_graph.h"
+#include "vk_capture.h"
+#include "vk_hot_reload.h"
+#include "vk_culling.h"
+#include "vk_descriptors.h"
+#include "vk_textures.h"
+#include "vk_command_recorder.h"
+#include "vk_frame_pacer.h"
+#include "vk_profiler.h"
+#include <mutex>
 #include <vector>
+#include <string>
+
+// Upper bound on the per-frame resource ring, _framesInFlight picks the depth actually used
+constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 3;
+
+// One worker's command pool for one frame slot, pools can only be used from one thread at a time
+struct WorkerCommands {
+    VkCommandPool _pool {VK_NULL_HANDLE};
+    // Secondary buffers handed out this frame, reused once the pool is reset
+    std::vector<VkCommandBuffer> _buffers;
+    uint32_t _used {0};
+};
+
+struct FrameData {
+    // Signaled by the swapchain once the acquired image can be rendered to
+    VkSemaphore _presentSemaphore;
+    // _frameTimeline value this slot's last submit signals, the slot is free once the timeline reaches it
+    uint64_t _timelineValue {0};
+
+    VkCommandPool _commandPool;
+    VkCommandBuffer _mainCommandBuffer;
+
+    // Indexed by job system worker, empty when recording happens inline
+    std::vector<WorkerCommands> _workerCommands;
+
+    // Sets for this frame only, reset once the slot comes around again
+    DescriptorAllocator _descriptors;
+
+    // Headless or capturing: host visible copy of the image this frame rendered
+    AllocatedBuffer _readbackBuffer;
+    // Capturing: the copy above hasn't been handed to the writer yet, done once the slot comes around
+    bool _readbackPending {false};
+    uint32_t _readbackFrame {0};
+    VkExtent2D _readbackExtent {};
+
+    // Two timestamps around the render pass, only written while benchmarking
+    VkQueryPool _timestampPool {VK_NULL_HANDLE};
+    bool _timestampsPending {false};
+};
+
+// Everything needed to draw objects that share a pipeline
+struct Material {
+    VkPipeline _pipeline {VK_NULL_HANDLE};
+    VkPipelineLayout _layout {VK_NULL_HANDLE};
+    // Depth only twin for the pre-pass, opaque materials only
+    VkPipeline _depthPipeline {VK_NULL_HANDLE};
+    // Drawn back to front after the opaques and never written to depth
+    bool _blended {false};
+};
 
 class VulkanEngine {
 public:
@@ -14,8 +83,128 @@ public:
     bool _isInitalized{false};
     int _frameNumber {0};
 
+    // How many frames the CPU may record ahead of the GPU, clamped to [1, MAX_FRAMES_IN_FLIGHT]
+    uint32_t _framesInFlight {2};
+
+    // Initial window size, follows the swapchain extent once the window is resized
     VkExtent2D _windowExtent {1700,900};
 
+    // FIFO never tears and idles the GPU between vblanks, MAILBOX and IMMEDIATE trade power
+    // (and tearing, for IMMEDIATE) for latency. Falls back to FIFO when the surface lacks the mode.
+    VkPresentModeKHR _presentMode {VK_PRESENT_MODE_FIFO_KHR};
+
+    // Render into offscreen images instead of an SDL window and swapchain
+    bool _headless {false};
+    // Number of offscreen targets rendered round robin in headless mode
+    uint32_t _headlessImageCount {3};
+    // Stop run() after this many frames, 0 runs until the window is closed
+    uint32_t _frameLimit {0};
+
+    // Pick a CPU implementation (lavapipe, SwiftShader) over any GPU, for reproducible output
+    bool _softwareDevice {false};
+
+    // Regression check after run(): the last headless frame is compared against this PPM,
+    // or written to it when _goldenUpdate is set. _frameLimit then counts frames drawn with the
+    // complete scene, so uploads finishing a frame earlier or later don't change the image.
+    std::string _goldenPath;
+    bool _goldenUpdate {false};
+    // Per channel difference a pixel may have, and the fraction of pixels allowed past that
+    uint32_t _goldenTolerance {2};
+    float _goldenMaxMismatch {0.001f};
+
+    // Fail the regression check when the benchmark's median CPU frame or GPU time goes over these, 0 disables
+    float _maxFrameMs {0.0f};
+    float _maxGpuMs {0.0f};
+
+    // Frames drawn since every upload the scene needs had landed, drives the animation
+    uint32_t _sceneFrames {0};
+
+    // Benchmark mode runs for a fixed number of frames and/or seconds, then reports frame times
+    uint32_t _benchmarkFrames {0};
+    float _benchmarkSeconds {0.0f};
+    // Report destination, stdout when empty
+    std::string _benchmarkOutput;
+
+    FrameBenchmark _benchmark;
+
+    // Where the pipeline cache is kept between runs, empty disables it
+    std::string _pipelineCachePath {"pipeline_cache.bin"};
+    PipelineCache _pipelineCache;
+
+    // Startup cost, split out so cold and warm cache runs can be compared
+    double _initMs {0.0};
+    double _pipelineBuildMs {0.0};
+    uint32_t _pipelineCacheHits {0};
+    uint32_t _pipelineCacheMisses {0};
+
+    // Threads used to create a pipeline batch, 0 uses every hardware thread
+    uint32_t _pipelineThreads {0};
+
+    // "triangle" draws the single hard-coded triangle, "instances" draws _sceneObjectCount
+    // objects through the sorted, instanced indirect path
+    std::string _scene {"triangle"};
+    uint32_t _sceneObjectCount {100000};
+    // Instances scene only: a mesh baked by tools/meshbake, drawn in place of the quads
+    std::string _meshPath;
+
+    // Workers recording the object list into secondary command buffers,
+    // 0 uses every hardware thread and 1 records inline on the main thread
+    uint32_t _recordThreads {0};
+    JobSystem _jobs;
+    // Object list slices per frame, a few per worker so stealing can even out the load
+    uint32_t _recordSlices {1};
+
+    // Instances scene only: frustum cull on the GPU and draw with vkCmdDrawIndexedIndirectCount,
+    // the object list is never walked on the CPU after init. Needs drawIndirectCount.
+    bool _gpuCulling {false};
+
+    // Instances scene only: view the grid through an orbiting perspective camera. Every frame the CPU
+    // computes each object's MVP with _transformKernel into the instance ring, the shader just applies it.
+    bool _cameraTransforms {false};
+    Camera _camera;
+    vkmath::TransformKernel _transformKernel {vkmath::best_transform_kernel()};
+
+    // Writes every rendered frame under this path, empty disables capture.
+    // Raw and PNG add _NNNNN.<ext> per frame, Y4M and ffmpeg write one stream to the path itself.
+    std::string _capturePath;
+    CaptureFormat _captureFormat {CaptureFormat::Png};
+    FrameCapture _capture;
+
+    // Shader modules live until cleanup() so pipelines built later can reuse them
+    ShaderCache _shaderCache;
+
+    // Every descriptor set layout, shared by whoever asks for the same bindings
+    DescriptorLayoutCache _layoutCache;
+
+    // One update-after-bind set of every texture and buffer, indexed from push constants.
+    // Needs descriptor indexing, the device is required to have it when this is set.
+    bool _bindlessDescriptors {false};
+    BindlessHeap _bindless;
+
+    // Instances scene only: every .ktx2 and .dds in this directory is streamed in and mapped onto the
+    // objects, one texture per instance in turn. Turns on bindless descriptors, empty disables it.
+    std::string _textureDir;
+    // Device memory the streamed levels may take on top of the small always resident tails
+    VkDeviceSize _textureBudget {256ull * 1024 * 1024};
+    TextureStreamer _textures;
+
+    // Lay down the opaque objects' depth in a pass of its own first, the main pass then shades only
+    // what ends up visible (depth EQUAL, no writes). Worth it where fragments are expensive.
+    bool _depthPrepass {false};
+
+    // FPS cap and low latency mode (frames start just in time and input is sampled right before recording),
+    // set _targetFps and _lowLatency before run(). Latency and jitter land in the benchmark report.
+    FramePacer _pacer;
+
+    // Chrome trace of CPU zones, GPU passes and per-frame counters. Set to record from init() on and write
+    // the trace at cleanup, F4 starts and stops a capture either way (written here, or trace.json).
+    std::string _tracePath;
+
+    // Watch shaders/ and swap in rebuilt pipelines whenever a source changes
+    bool _shaderHotReload {false};
+    std::string _shaderCompiler {"glslangValidator"};
+    ShaderHotReload _shaderReload;
+
     struct SDL_Window* _window {nullptr };
 
     void init();
@@ -28,47 +217,231 @@ public:
 
     bool load_shader_module(const char *file, VkShaderModule *out);
 
+    FrameData& get_current_frame();
+
+    // Blocks until the graphics queue has finished everything up to value
+    void wait_for_timeline(uint64_t value);
+
+    // Takes effect at the start of the next frame, the swapchain gets recreated with the new mode
+    void set_present_mode(VkPresentModeKHR mode);
+
+    // Golden image and frame time checks, call between run() and cleanup(). False when any of them failed.
+    bool check_regressions();
+
+    // Headless only: copies the last submitted frame out of its readback buffer as tightly packed RGBA8
+    bool read_frame(std::vector<uint8_t> &pixels);
+
     VkInstance _instance;
     VkDebugUtilsMessengerEXT _debug_messenger;
     VkPhysicalDevice _chosenGPU;
     VkDevice _device;
-    VkSurfaceKHR _surface;
-
-    VkSwapchainKHR _swapchain;
+    VkSurfaceKHR _surface {VK_NULL_HANDLE};
+    GpuAllocator _allocator;
+    VkPhysicalDeviceProperties _gpuProperties;
+
+    // Nanoseconds per timestamp tick, 0 when the graphics queue can't write timestamps
+    float _timestampPeriod {0.0f};
+    uint64_t _timestampMask {0};
+
+    // VK_EXT_pipeline_creation_feedback tells us whether a pipeline came out of the cache
+    bool _hasCreationFeedback {false};
+
+    // VK_KHR_present_id and VK_KHR_present_wait, windowed only. Every present's id is its frame's timeline value.
+    bool _presentWait {false};
+    PFN_vkWaitForPresentKHR _vkWaitForPresent {nullptr};
+    // Newest id handed to the swapchain, and the newest known to be on screen
+    uint64_t _lastPresentId {0};
+    uint64_t _presentConfirmed {0};
+
+    // Window closed, run() stops after the current frame
+    bool _quitRequested {false};
+
+    VkSwapchainKHR _swapchain {VK_NULL_HANDLE};
+    // Set on resize, present mode changes and OUT_OF_DATE/SUBOPTIMAL, handled at the start of draw()
+    bool _swapchainDirty {false};
     VkFormat _swapchainImageFormat;
     std::vector<VkImage> _swapchainImages;
     std::vector<VkImageView> _swapchainImageViews;
 
+    // Headless only: backing for _swapchainImages when there is no swapchain
+    std::vector<AllocatedImage> _offscreenImages;
+
     VkQueue _graphicsQueue;
     uint32_t _graphicsQueueFamily;
-    VkCommandPool _commandPool;
-    VkCommandBuffer _mainCommandBuffer;
+    // Held around every submit and present, the uploader shares the graphics queue when there's no transfer queue
+    std::mutex _graphicsQueueMutex;
 
-    VkRenderPass _renderPass;
+    // A dedicated transfer queue when the device has one, otherwise the graphics queue
+    VkQueue _uploadQueue;
+    uint32_t _uploadQueueFamily;
+    StreamingUploader _uploader;
 
-    std::vector<VkFramebuffer> _framebuffers;
+    FrameData _frames[MAX_FRAMES_IN_FLIGHT];
 
-    VkSemaphore _presentSemaphore, _renderSemaphore;
-    VkFence _renderFence;
+    // Rebuilt along with the swapchain, the main pass keeps handing out the same _renderPass
+    RenderGraph _renderGraph;
+    GraphResource _swapchainTarget;
+    GraphPassId _mainPass;
+    // The graph's main pass render pass, pipelines and secondary buffers are made against it
+    VkRenderPass _renderPass;
+    // Transient, written by the pre-pass or the main pass, whichever comes first
+    VkFormat _depthFormat {VK_FORMAT_D32_SFLOAT};
+    GraphResource _depthTarget;
+    GraphPassId _depthPass;
+    VkRenderPass _depthRenderPass {VK_NULL_HANDLE};
+
+    // One render semaphore per swapchain image, presentation may still be reading it
+    // when the frame slot that signaled it comes around again
+    std::vector<VkSemaphore> _renderSemaphores;
+    // Timeline value of the frame currently rendering into each swapchain image (0 when none)
+    std::vector<uint64_t> _imagesInFlight;
+
+    // One counter for all graphics queue work, every frame submit signals the next value.
+    // Binary semaphores are only kept where acquire and present need them.
+    VkSemaphore _frameTimeline {VK_NULL_HANDLE};
+    uint64_t _frameTimelineValue {0};
 
     VkPipelineLayout _trianglePipelineLayout;
     VkPipeline _trianglePipeline;
+    // Bindless set 0 and TexturePushConstants, the materials use it when textures are on
+    VkPipelineLayout _texturedPipelineLayout {VK_NULL_HANDLE};
+
+    // Device features the draw path can use, multiDrawIndirect and drawIndirectFirstInstance when supported,
+    // plus what texture streaming needs when it's on
+    VkPhysicalDeviceFeatures _enabledFeatures {};
+
+    MeshPool _meshPool;
+    std::vector<Material> _materials;
+    RenderObjectList _renderObjects;
+    // Rebuilt whenever _renderObjects is dirty
+    std::vector<DrawBatch> _drawBatches;
+
+    // Per-frame instance data and indirect commands, written by the CPU every frame
+    FrameRingBuffer _instanceRing;
+    FrameRingBuffer _indirectRing;
+    // This frame's camera, only used with _cameraTransforms
+    Mat4 _viewProjection {};
+    // Instance data for every object this frame, reserved by prepare_objects() and filled by the main pass
+    TransientAllocation _frameInstances {};
+    bool _frameInstancesReady {false};
+
+    // Every pass of the frame records into the main command buffer through this, so binds carry across passes
+    CommandRecorder _recorder;
+    // Binds issued and skipped this frame, secondaries included
+    CommandStats _frameCommandStats;
+
+    // Timestamps around the frame and every render graph pass, only written while a trace is recording
+    GpuProfiler _gpuProfiler;
+
+    // GPU culling writes its own instances and commands, see _gpuCulling
+    GpuCulling _culling;
+    VkPipelineLayout _cullPipelineLayout {VK_NULL_HANDLE};
+    VkPipeline _cullPipeline {VK_NULL_HANDLE};
 
 protected:
     void init_vulkan();
 
     void init_swapchain();
 
+    // Rebuilds the swapchain, image views, render graph and per-image sync in place,
+    // false while the window is minimized
+    bool recreate_swapchain();
+
+    void init_offscreen_targets();
+
+    // Per-frame readback buffers at the current extent, when headless or capturing
+    void init_readback();
+
+    void destroy_readback();
+
     void init_commands();
 
-    void init_default_renderpass();
+    // Declares the frame's passes over the current swapchain images and compiles them
+    void init_render_graph();
+
+    // True once the object list's meshes are resident, until then the triangle stands in
+    bool objects_ready() const;
 
-    void init_framebuffer();
+    // Bit per material that draws back to front, the first 64 materials only
+    uint64_t blended_materials() const;
+
+    // _recorder, checked to wrap the command buffer the render graph handed a pass
+    CommandRecorder &pass_recorder(VkCommandBuffer cmd);
+
+    void draw_main_pass(CommandRecorder &recorder, VkFramebuffer framebuffer);
+
+    // Opaque objects with their depth only pipelines, only with _depthPrepass
+    void draw_depth_prepass(CommandRecorder &recorder);
+
+    // Sorts the objects for this frame and reserves their instance data, before any pass records draws
+    void prepare_objects();
+
+    // Runs the culling dispatches for this frame, before the main pass
+    void cull_objects(VkCommandBuffer cmd);
+
+    // One count-driven indirect draw per material out of what cull_objects() left behind,
+    // depthOnly draws just the opaque materials with their depth pipelines
+    void draw_culled_objects(CommandRecorder &recorder, bool depthOnly = false);
+
+    // Copies the rendered image into this frame's readback buffer
+    void copy_readback(VkCommandBuffer cmd);
+
+    // Hands every readback that's done but not yet captured to the writer, oldest first.
+    // Only call once the GPU is idle.
+    void flush_readbacks();
 
     void init_sync_structures();
 
+    // Layout cache, per-frame descriptor allocators and the bindless heap
+    void init_descriptors();
+
+    // Render semaphores and in-flight timeline values, one per swapchain image
+    void init_image_sync_structures();
+
+    // Viewport and scissor are dynamic state, every command buffer that draws has to set them
+    void set_viewport_scissor(CommandRecorder &recorder);
+
     void init_pipelines();
 
+    void init_uploader();
+
+    // Loads the tails of everything in _textureDir, the rest streams in as the shaders ask for it
+    void init_textures();
+
+    void init_scene();
+
+    // Records every render object, either inline through recorder or through secondary buffers recorded by the job system
+    void draw_objects(FrameData &frame, CommandRecorder &recorder, VkFramebuffer framebuffer);
+
+    // Writes instances and indirect commands for objects [begin, end) and records their draws,
+    // one indirect draw per material run. Safe to call from several workers at once on disjoint ranges.
+    // depthOnly leaves the instances to the main pass and draws only the opaque materials' depth pipelines.
+    void record_objects(CommandRecorder &recorder, uint32_t begin, uint32_t end,
+                        const TransientAllocation &instances, const TransientAllocation &commands,
+                        bool depthOnly = false);
+
+    // Bindless set and this frame's texture tables, nothing without _textureDir
+    void bind_textures(CommandRecorder &recorder);
+
+    // What the instance ring holds per object, an InstanceData or a whole matrix with _cameraTransforms
+    VkDeviceSize instance_size() const;
+
+    void collect_gpu_timestamps(FrameData &frame);
+
+    // Drains SDL's queue: quit, resizes and the present mode keys
+    void poll_events();
+
+    // Starts a trace capture, or stops the running one and writes it out
+    void toggle_trace();
+
+    // Tells the pacer which presents have reached the screen. block waits (briefly) for the newest one.
+    void collect_presents(bool block);
+
+    void finish_benchmark();
+
+    // Creates every pipeline in the batch through the pipeline cache and tallies the startup stats
+    void build_pipelines(PipelineBatch &batch);
+
 private:
 
 
@@ -85,9 +458,26 @@ public:
     VkPipelineRasterizationStateCreateInfo _rasterizer;
     VkPipelineColorBlendAttachmentState _colorBlendAttachment;
     VkPipelineMultisampleStateCreateInfo _multisampling;
+    VkPipelineDepthStencilStateCreateInfo _depthStencil;
+    bool _depthOnly {false};
+    std::vector<VkDynamicState> _dynamicStates;
+    VkPipelineLayout _pipelineLayout;
+
+    // Snapshot of the current state for a PipelineBatch, the builder can be reused right after
+    PipelineDescription describe(VkRenderPass pass, uint32_t subpass = 0) const;
+
+    // feedback is optional and needs VK_EXT_pipeline_creation_feedback
+    VkPipeline build_pipeline(VkDevice device, VkRenderPass pass, VkPipelineCache cache = VK_NULL_HANDLE,
+                              VkPipelineCreationFeedbackEXT *feedback = nullptr);
+};
+
+class ComputePipelineBuilder{
+public:
+
+    VkPipelineShaderStageCreateInfo _shaderStage;
     VkPipelineLayout _pipelineLayout;
 
-    VkPipeline build_pipeline(VkDevice device, VkRenderPass pass);
+    VkPipeline build_pipeline(VkDevice device, VkPipelineCache cache = VK_NULL_HANDLE);
 };
 
 
@@ -0,0 +1,178 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_frame_pacer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+// Weight of the newest sample in the smoothed times
+constexpr double SMOOTHING = 0.1;
+// Never hold a frame back longer than this, whatever the estimates say
+constexpr double MAX_WAIT_MS = 250.0;
+
+static double to_ms(FramePacer::Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+static FramePacer::Clock::duration from_ms(double ms) {
+    return std::chrono::duration_cast<FramePacer::Clock::duration>(std::chrono::duration<double, std::milli>(ms));
+}
+
+FramePacer::FrameTiming *FramePacer::timing(uint64_t frameValue) {
+    FrameTiming &frame = _timings[frameValue % TIMING_RING];
+    return frame._value == frameValue ? &frame : nullptr;
+}
+
+void FramePacer::wait(const std::function<uint64_t()> &completed) {
+    Clock::time_point now = Clock::now();
+    const Clock::time_point waitStart = now;
+
+    // The cap keeps a steady cadence, but a frame that fell behind doesn't get to catch up in a burst
+    Clock::time_point capDeadline = now;
+    if (_targetFps > 0.0f && _started){
+        Clock::duration period = from_ms(1000.0 / _targetFps);
+        if (_nextStart + period < now){
+            _nextStart = now;
+        }
+        capDeadline = _nextStart;
+    }
+
+    // Whatever is queued on the GPU runs back to back, so the newest frame finishes about a GPU frame
+    // per pending frame after the GPU last went quiet. Recording should end right about then.
+    Clock::time_point latencyDeadline = now;
+    if (_lowLatency && _lastSubmitted > _lastCompleted){
+        FrameTiming *oldest = timing(_lastCompleted + 1);
+        Clock::time_point gpuStart = oldest ? std::max(oldest->_submit, _lastCompletedTime) : now;
+        double pending = (double)(_lastSubmitted - _lastCompleted);
+        latencyDeadline = gpuStart + from_ms(_gpuMs * pending - _recordMs);
+    }
+
+    while (true){
+        now = Clock::now();
+        if (_lowLatency){
+            gpu_completed(completed());
+        }
+
+        // A GPU that finished early is idle, no point holding the frame back any longer
+        bool latencyWait = _lowLatency && _lastSubmitted > _lastCompleted && now < latencyDeadline;
+        Clock::time_point deadline = latencyWait ? std::max(capDeadline, latencyDeadline) : capDeadline;
+        if (now >= deadline || to_ms(now - waitStart) >= MAX_WAIT_MS){
+            break;
+        }
+
+        double remaining = to_ms(deadline - now);
+        if (remaining > _spinMs){
+            // Short naps while waiting on the GPU, so an early finish is noticed
+            double nap = remaining - _spinMs;
+            if (latencyWait) nap = std::min(nap, 0.5);
+            std::this_thread::sleep_for(from_ms(nap));
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    if (_started){
+        double interval = to_ms(now - _lastStart);
+        if (_lastInterval > 0.0){
+            _jitterSamples.push_back(fabs(interval - _lastInterval));
+        }
+        _lastInterval = interval;
+    }
+    _lastStart = now;
+    _started = true;
+    if (_targetFps > 0.0f){
+        _nextStart = std::max(_nextStart, capDeadline) + from_ms(1000.0 / _targetFps);
+    }
+}
+
+void FramePacer::input_sampled(uint64_t frameValue) {
+    // A frame that never got submitted gets its value handed out again, the newer sample wins
+    FrameTiming &frame = _timings[frameValue % TIMING_RING];
+    frame = {};
+    frame._value = frameValue;
+    frame._input = Clock::now();
+    frame._hasInput = true;
+}
+
+void FramePacer::submitted(uint64_t frameValue) {
+    FrameTiming *frame = timing(frameValue);
+    if (!frame){
+        frame = &_timings[frameValue % TIMING_RING];
+        *frame = {};
+        frame->_value = frameValue;
+    }
+    frame->_submit = Clock::now();
+    frame->_submitted = true;
+    if (frame->_hasInput){
+        double record = to_ms(frame->_submit - frame->_input);
+        _recordMs = _recordMs == 0.0 ? record : _recordMs + SMOOTHING * (record - _recordMs);
+    }
+    _lastSubmitted = frameValue;
+}
+
+void FramePacer::gpu_completed(uint64_t completed) {
+    completed = std::min(completed, _lastSubmitted);
+    if (completed <= _lastCompleted){
+        return;
+    }
+
+    // Only noticed now, so this is when they finished at the latest
+    Clock::time_point now = Clock::now();
+
+    // The GPU got to a frame once it was submitted and the one before it was done. With several
+    // finishing at once there's no telling where one ended and the next began, so skip those.
+    FrameTiming *single = completed == _lastCompleted + 1 ? timing(completed) : nullptr;
+    if (single && single->_submitted){
+        double gpu = std::max(to_ms(now - std::max(single->_submit, _lastCompletedTime)), 0.0);
+        _gpuMs = _gpuMs == 0.0 ? gpu : _gpuMs + SMOOTHING * (gpu - _gpuMs);
+    }
+
+    if (!_presentTracking){
+        // Anything older than the ring has been overwritten already
+        uint64_t first = std::max(_lastCompleted + 1, completed > TIMING_RING ? completed - TIMING_RING + 1 : 1);
+        for (uint64_t value = first; value <= completed; value++){
+            add_latency(value, now);
+        }
+    }
+    _lastCompleted = completed;
+    _lastCompletedTime = now;
+}
+
+void FramePacer::presented(uint64_t frameValue) {
+    if (frameValue <= _lastPresented){
+        return;
+    }
+    Clock::time_point now = Clock::now();
+    uint64_t first = std::max(_lastPresented + 1, frameValue > TIMING_RING ? frameValue - TIMING_RING + 1 : 1);
+    for (uint64_t value = first; value <= frameValue; value++){
+        add_latency(value, now);
+    }
+    _lastPresented = frameValue;
+}
+
+void FramePacer::discard(uint64_t frameValue) {
+    for (FrameTiming &frame : _timings){
+        if (frame._value <= frameValue){
+            frame._hasInput = false;
+        }
+    }
+    _lastPresented = std::max(_lastPresented, frameValue);
+}
+
+void FramePacer::add_latency(uint64_t frameValue, Clock::time_point shown) {
+    FrameTiming *frame = timing(frameValue);
+    if (frame && frame->_hasInput){
+        _latencySamples.push_back(to_ms(shown - frame->_input));
+        frame->_hasInput = false;
+    }
+}
+
+void FramePacer::drain(std::vector<double> &latencyMs, std::vector<double> &jitterMs) {
+    latencyMs.swap(_latencySamples);
+    jitterMs.swap(_jitterSamples);
+    _latencySamples.clear();
+    _jitterSamples.clear();
+}
@@ -0,0 +1,90 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_FRAME_PACER_H
+#define VKENGINE_VK_FRAME_PACER_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Decides when the main loop starts its next frame and measures how long input takes to reach the screen.
+// Frames are identified by the timeline value their submit signals.
+class FramePacer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Frames per second to cap at, 0 leaves pacing to the present mode and the frames in flight
+    float _targetFps {0.0f};
+    // Start each frame only just before the GPU runs out of work, from the measured GPU and recording
+    // times, so input is as fresh as possible when it's recorded. The engine also samples input late.
+    bool _lowLatency {false};
+    // Sleeps stop this far ahead of a deadline and the rest is spun, OS sleeps overshoot by about this much
+    double _spinMs {1.0};
+    // Set when presents are tracked (present wait), otherwise GPU completion stands in for the photons
+    bool _presentTracking {false};
+
+    // Blocks until the next frame should start, call at the top of the loop before input is sampled.
+    // completed reads the timeline so GPU completions are noticed while waiting.
+    void wait(const std::function<uint64_t()> &completed);
+
+    // Input for the frame that will signal frameValue was just sampled
+    void input_sampled(uint64_t frameValue);
+
+    void submitted(uint64_t frameValue);
+
+    // Everything up to completed is done, as far as we can tell right now
+    void gpu_completed(uint64_t completed);
+
+    // Everything up to frameValue is on screen
+    void presented(uint64_t frameValue);
+
+    // Frames up to frameValue will never be seen as presented (swapchain replaced), left out of the latency stats
+    void discard(uint64_t frameValue);
+
+    // Smoothed times the low latency wait is based on
+    double gpu_ms() const { return _gpuMs; }
+    double record_ms() const { return _recordMs; }
+
+    // Hands over the samples gathered since the last call: input to photons for every frame that got
+    // there, and the change in frame start interval for every frame started
+    void drain(std::vector<double> &latencyMs, std::vector<double> &jitterMs);
+
+private:
+    struct FrameTiming {
+        uint64_t _value {0};
+        Clock::time_point _input;
+        Clock::time_point _submit;
+        bool _hasInput {false};
+        bool _submitted {false};
+    };
+
+    static constexpr uint32_t TIMING_RING = 16;
+
+    // Only valid while the frame is still in the ring
+    FrameTiming *timing(uint64_t frameValue);
+
+    void add_latency(uint64_t frameValue, Clock::time_point shown);
+
+    FrameTiming _timings[TIMING_RING];
+    uint64_t _lastSubmitted {0};
+    uint64_t _lastCompleted {0};
+    uint64_t _lastPresented {0};
+    Clock::time_point _lastCompletedTime;
+
+    double _gpuMs {0.0};
+    double _recordMs {0.0};
+
+    Clock::time_point _nextStart;
+    Clock::time_point _lastStart;
+    double _lastInterval {0.0};
+    bool _started {false};
+
+    std::vector<double> _latencySamples;
+    std::vector<double> _jitterSamples;
+};
+
+
+#endif //VKENGINE_VK_FRAME_PACER_H
@@ -0,0 +1,85 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_golden.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+bool vkgolden::write_ppm(const std::string &path, const uint8_t *rgba, uint32_t width, uint32_t height) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file){
+        return false;
+    }
+
+    std::vector<uint8_t> rgb((size_t)width * height * 3);
+    for (size_t i = 0; i < (size_t)width * height; i++){
+        rgb[i * 3 + 0] = rgba[i * 4 + 0];
+        rgb[i * 3 + 1] = rgba[i * 4 + 1];
+        rgb[i * 3 + 2] = rgba[i * 4 + 2];
+    }
+
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+    bool written = fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    fclose(file);
+    return written;
+}
+
+bool vkgolden::read_ppm(const std::string &path, std::vector<uint8_t> &rgb, uint32_t *width, uint32_t *height) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file){
+        return false;
+    }
+
+    // Only what write_ppm produces, no comments in the header
+    unsigned w, h, maxValue;
+    if (fscanf(file, "P6 %u %u %u", &w, &h, &maxValue) != 3 || maxValue != 255 || fgetc(file) == EOF){
+        fclose(file);
+        return false;
+    }
+
+    rgb.resize((size_t)w * h * 3);
+    bool read = fread(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    fclose(file);
+
+    *width = w;
+    *height = h;
+    return read;
+}
+
+GoldenResult vkgolden::compare(const std::string &goldenPath, const uint8_t *rgba, uint32_t width, uint32_t height,
+                               uint32_t tolerance) {
+    GoldenResult result;
+
+    std::vector<uint8_t> golden;
+    uint32_t goldenWidth, goldenHeight;
+    if (!read_ppm(goldenPath, golden, &goldenWidth, &goldenHeight)){
+        return result;
+    }
+    result._loaded = true;
+    result._sizeMatches = goldenWidth == width && goldenHeight == height;
+    if (!result._sizeMatches){
+        return result;
+    }
+
+    result._pixelCount = width * height;
+    uint64_t totalDifference = 0;
+    for (size_t i = 0; i < result._pixelCount; i++){
+        uint32_t pixelDifference = 0;
+        for (int c = 0; c < 3; c++){
+            uint32_t difference = (uint32_t)abs((int)rgba[i * 4 + c] - (int)golden[i * 3 + c]);
+            pixelDifference = difference > pixelDifference ? difference : pixelDifference;
+            totalDifference += difference;
+        }
+
+        if (pixelDifference > tolerance){
+            result._mismatched++;
+        }
+        if (pixelDifference > result._maxDifference){
+            result._maxDifference = pixelDifference;
+        }
+    }
+    result._meanDifference = (double)totalDifference / ((double)result._pixelCount * 3.0);
+    return result;
+}
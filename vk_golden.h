@@ -0,0 +1,35 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_GOLDEN_H
+#define VKENGINE_VK_GOLDEN_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct GoldenResult {
+    bool _loaded {false};
+    bool _sizeMatches {false};
+    // Pixels where some channel differs by more than the tolerance
+    uint32_t _mismatched {0};
+    uint32_t _pixelCount {0};
+    uint32_t _maxDifference {0};
+    double _meanDifference {0.0};
+};
+
+// Reference images are binary PPMs, every image tool reads them and they diff byte for byte
+namespace vkgolden {
+
+    // rgba is tightly packed, alpha is dropped
+    bool write_ppm(const std::string &path, const uint8_t *rgba, uint32_t width, uint32_t height);
+
+    bool read_ppm(const std::string &path, std::vector<uint8_t> &rgb, uint32_t *width, uint32_t *height);
+
+    GoldenResult compare(const std::string &goldenPath, const uint8_t *rgba, uint32_t width, uint32_t height,
+                         uint32_t tolerance);
+}
+
+
+#endif //VKENGINE_VK_GOLDEN_H
@@ -0,0 +1,270 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_hot_reload.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+static bool is_shader_source(const std::string &name) {
+    static const char *extensions[] = {".vert", ".frag", ".comp"};
+    for (const char *extension : extensions){
+        size_t length = strlen(extension);
+        if (name.size() > length && name.compare(name.size() - length, length, extension) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ShaderHotReload::init(VkDevice device, VkPipelineCache cache, const std::string &sourceDir) {
+    _device = device;
+    _cache = cache;
+    _sourceDir = sourceDir;
+
+    _inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_inotify < 0){
+        return false;
+    }
+    // Editors either write in place or write a temp file and rename it over, catch both
+    if (inotify_add_watch(_inotify, _sourceDir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0 || pipe(_wakePipe) != 0){
+        close(_inotify);
+        _inotify = -1;
+        return false;
+    }
+
+    _watcher = std::thread(&ShaderHotReload::watch_loop, this);
+    return true;
+}
+
+void ShaderHotReload::destroy() {
+    if (_inotify >= 0){
+        char wake = 1;
+        if (write(_wakePipe[1], &wake, 1) != 1){
+            printf("HOT RELOAD: FAILED TO WAKE THE WATCHER\n");
+        }
+        _watcher.join();
+
+        close(_inotify);
+        close(_wakePipe[0]);
+        close(_wakePipe[1]);
+        _inotify = -1;
+    }
+
+    // Swapped in never, so never used. The modules belong to nobody yet either.
+    for (PendingSwap &swap : _swaps){
+        vkDestroyPipeline(_device, swap._pipeline, nullptr);
+    }
+    for (PendingModule &module : _modules){
+        vkDestroyShaderModule(_device, module._module, nullptr);
+    }
+    for (Retired &retired : _retired){
+        vkDestroyPipeline(_device, retired._pipeline, nullptr);
+    }
+    _swaps.clear();
+    _modules.clear();
+    _retired.clear();
+    _tracked.clear();
+}
+
+void ShaderHotReload::watch_loop() {
+    std::vector<char> events(16 * 1024);
+
+    while (true){
+        pollfd fds[2] = {{_inotify, POLLIN, 0}, {_wakePipe[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0 || (fds[1].revents & POLLIN)){
+            return;
+        }
+
+        // Saves tend to come as a burst of events, wait for it to settle and compile each file once
+        std::vector<std::string> changed;
+        do {
+            ssize_t length;
+            while ((length = read(_inotify, events.data(), events.size())) > 0){
+                for (ssize_t offset = 0; offset < length;){
+                    const inotify_event *event = (const inotify_event *)(events.data() + offset);
+                    if (event->len > 0 && is_shader_source(event->name)){
+                        std::string name = event->name;
+                        if (std::find(changed.begin(), changed.end(), name) == changed.end()){
+                            changed.push_back(name);
+                        }
+                    }
+                    offset += sizeof(inotify_event) + event->len;
+                }
+            }
+        } while (poll(fds, 1, 50) > 0);
+
+        for (const std::string &name : changed){
+            reload(_sourceDir + "/" + name);
+        }
+    }
+}
+
+#else
+
+bool ShaderHotReload::init(VkDevice, VkPipelineCache, const std::string &) {
+    // Only inotify is implemented
+    return false;
+}
+
+void ShaderHotReload::destroy() {
+}
+
+void ShaderHotReload::watch_loop() {
+}
+
+#endif
+
+void ShaderHotReload::track(VkPipeline *target, const PipelineDescription &description,
+                            const std::vector<std::string> &spvPaths) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    Tracked tracked;
+    tracked._target = target;
+    tracked._description = description;
+    tracked._spvPaths = spvPaths;
+    _tracked.push_back(std::move(tracked));
+}
+
+void ShaderHotReload::reload(const std::string &source) {
+    std::string spvPath = source + ".spv";
+    std::string tempPath = spvPath + ".tmp";
+
+    // Compile next to the real output and rename over it, so nothing ever sees half a module
+    std::string command = _compiler + " -V " + shell_quote(source) + " -o " + shell_quote(tempPath);
+    if (system(command.c_str()) != 0){
+        printf("HOT RELOAD: %s FAILED TO COMPILE, KEEPING THE OLD PIPELINES\n", source.c_str());
+        remove(tempPath.c_str());
+        _failures++;
+        return;
+    }
+    if (rename(tempPath.c_str(), spvPath.c_str()) != 0){
+        printf("HOT RELOAD: FAILED TO REPLACE %s\n", spvPath.c_str());
+        _failures++;
+        return;
+    }
+
+    MappedFile file;
+    VkShaderModule module;
+    if (!file.open(spvPath.c_str()) || !vkshader::create_shader_module(_device, file.data(), file.size(), &module)){
+        printf("HOT RELOAD: %s IS NOT A VALID SPIR-V MODULE\n", spvPath.c_str());
+        _failures++;
+        return;
+    }
+
+    // Only the watcher changes _tracked after init, so the copies stay current while we build
+    std::vector<uint32_t> dependents;
+    PipelineBatch batch;
+    std::vector<uint32_t> slots;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (uint32_t i = 0; i < _tracked.size(); i++){
+            PipelineDescription description = _tracked[i]._description;
+            bool uses = false;
+            for (size_t stage = 0; stage < _tracked[i]._spvPaths.size(); stage++){
+                if (_tracked[i]._spvPaths[stage] == spvPath){
+                    description._stages[stage]._module = module;
+                    uses = true;
+                }
+            }
+            if (uses){
+                dependents.push_back(i);
+                slots.push_back(batch.add(description));
+            }
+        }
+    }
+
+    if (!batch.build(_device, _cache)){
+        printf("HOT RELOAD: FAILED TO REBUILD THE PIPELINES USING %s\n", spvPath.c_str());
+        for (VkPipeline pipeline : batch.pipelines()){
+            if (pipeline != VK_NULL_HANDLE){
+                vkDestroyPipeline(_device, pipeline, nullptr);
+            }
+        }
+        vkDestroyShaderModule(_device, module, nullptr);
+        _failures++;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // Identical descriptions share one pipeline in the batch, the first target takes it and
+        // the rest get their own handle from the cache so every target can be retired on its own
+        std::vector<bool> handedOut(batch.unique_count(), false);
+        for (size_t i = 0; i < dependents.size(); i++){
+            Tracked &tracked = _tracked[dependents[i]];
+            const PipelineDescription &description = batch.description(slots[i]);
+
+            PendingSwap swap;
+            swap._target = tracked._target;
+            swap._pipeline = batch.get(slots[i]);
+
+            uint32_t unique = (uint32_t)(std::find(batch.pipelines().begin(), batch.pipelines().end(), swap._pipeline) -
+                                         batch.pipelines().begin());
+            if (handedOut[unique]){
+                PipelineBatch copy;
+                copy.add(description);
+                if (!copy.build(_device, _cache)){
+                    // The old pipeline stays, and so does the description it was built from
+                    continue;
+                }
+                swap._pipeline = copy.get(0);
+            }
+            handedOut[unique] = true;
+            tracked._description = description;
+            _swaps.push_back(swap);
+        }
+
+        PendingModule pending;
+        pending._spvPath = spvPath;
+        pending._module = module;
+        _modules.push_back(pending);
+    }
+
+    _reloads++;
+    printf("HOT RELOAD: %s RECOMPILED, %zu PIPELINES REBUILT IN %.2f ms\n", source.c_str(), dependents.size(), batch._buildMs);
+}
+
+void ShaderHotReload::apply(uint64_t lastSubmitted, uint64_t completed, ShaderCache &shaderCache) {
+    // Anything recorded from here on uses the new pipelines, anything already submitted may still use the old ones
+    {
+        std::unique_lock<std::mutex> lock(_mutex, std::try_to_lock);
+        // The watcher holds the lock only briefly, if it has it right now the swap waits for the next frame
+        if (lock.owns_lock()){
+            for (PendingSwap &swap : _swaps){
+                Retired retired;
+                retired._pipeline = *swap._target;
+                retired._retireValue = lastSubmitted;
+                _retired.push_back(retired);
+
+                *swap._target = swap._pipeline;
+            }
+            _swaps.clear();
+
+            // Pipelines keep working once their modules are gone, the old module can go right away
+            for (PendingModule &module : _modules){
+                VkShaderModule old = shaderCache.replace(module._spvPath, module._module);
+                if (old != VK_NULL_HANDLE){
+                    vkDestroyShaderModule(_device, old, nullptr);
+                }
+            }
+            _modules.clear();
+        }
+    }
+
+    _retired.erase(std::remove_if(_retired.begin(), _retired.end(), [&](const Retired &retired){
+        if (retired._retireValue > completed){
+            return false;
+        }
+        vkDestroyPipeline(_device, retired._pipeline, nullptr);
+        return true;
+    }), _retired.end());
+}
@@ -0,0 +1,88 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_HOT_RELOAD_H
+#define VKENGINE_VK_HOT_RELOAD_H
+
+#include "vk_types.h"
+#include "vk_pipeline_batch.h"
+#include "vk_shaders.h"
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Watches the shader sources, recompiles whatever changed on a background thread and rebuilds the
+// pipelines using it there too. The frame loop only swaps finished pipelines in at a frame boundary
+// and destroys the old ones once the frames that may still use them have retired.
+class ShaderHotReload {
+public:
+    // Run as <compiler> -V <source> -o <output>
+    std::string _compiler {"glslangValidator"};
+
+    uint32_t _reloads {0};
+    uint32_t _failures {0};
+
+    // sourceDir holds the GLSL, next to the .spv files the pipelines were loaded from
+    bool init(VkDevice device, VkPipelineCache cache, const std::string &sourceDir);
+
+    // Only call once the GPU is idle, every retired and unswapped pipeline is destroyed
+    void destroy();
+
+    // target gets the rebuilt pipeline on apply(), spvPaths[i] is where description._stages[i] came from
+    void track(VkPipeline *target, const PipelineDescription &description, const std::vector<std::string> &spvPaths);
+
+    // Call at the start of a frame before anything is recorded. lastSubmitted is the newest timeline value any
+    // frame using the current pipelines signals, completed is where the timeline is now.
+    void apply(uint64_t lastSubmitted, uint64_t completed, ShaderCache &shaderCache);
+
+private:
+    struct Tracked {
+        VkPipeline *_target;
+        PipelineDescription _description;
+        std::vector<std::string> _spvPaths;
+    };
+
+    struct PendingSwap {
+        VkPipeline *_target;
+        VkPipeline _pipeline;
+    };
+
+    struct PendingModule {
+        std::string _spvPath;
+        VkShaderModule _module;
+    };
+
+    struct Retired {
+        VkPipeline _pipeline;
+        uint64_t _retireValue;
+    };
+
+    void watch_loop();
+
+    // Compiles source and rebuilds everything depending on it, queues the results for apply()
+    void reload(const std::string &source);
+
+    VkDevice _device {VK_NULL_HANDLE};
+    VkPipelineCache _cache {VK_NULL_HANDLE};
+    std::string _sourceDir;
+
+    int _inotify {-1};
+    // Written to by destroy() to wake the watcher out of poll()
+    int _wakePipe[2] {-1, -1};
+    std::thread _watcher;
+
+    // Guards _tracked, _swaps and _modules, the watcher builds from _tracked and apply() drains the rest
+    std::mutex _mutex;
+    std::vector<Tracked> _tracked;
+    std::vector<PendingSwap> _swaps;
+    std::vector<PendingModule> _modules;
+
+    // Main thread only
+    std::vector<Retired> _retired;
+};
+
+
+#endif //VKENGINE_VK_HOT_RELOAD_H
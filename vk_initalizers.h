@@ -12,6 +12,10 @@ namespace vkinit {
 
     VkCommandBufferAllocateInfo command_buffer_allocate_info(VkCommandPool pool, uint32_t count = 1, VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
 
+    VkCommandBufferBeginInfo command_buffer_begin_info(VkCommandBufferUsageFlags flags = 0, const VkCommandBufferInheritanceInfo *inheritance = nullptr);
+
+    VkCommandBufferInheritanceInfo command_buffer_inheritance_info(VkRenderPass renderPass, uint32_t subpass, VkFramebuffer framebuffer);
+
     VkPipelineShaderStageCreateInfo pipeline_shader_stage_create_info(VkShaderStageFlagBits stage, VkShaderModule shaderModule);
 
     VkPipelineVertexInputStateCreateInfo vertex_input_state_create_info();
@@ -22,9 +26,23 @@ namespace vkinit {
 
     VkPipelineMultisampleStateCreateInfo multisampleStateCreateInfo();
 
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_create_info(bool depthTest, bool depthWrite, VkCompareOp compareOp);
+
     VkPipelineColorBlendAttachmentState colorBlendAttachmentState();
 
     VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo();
+
+    VkImageCreateInfo image_create_info(VkFormat format, VkImageUsageFlags usageFlags, VkExtent3D extent);
+
+    VkImageViewCreateInfo imageview_create_info(VkFormat format, VkImage image, VkImageAspectFlags aspectFlags);
+
+    VkSamplerCreateInfo sampler_create_info(VkFilter filter, VkSamplerAddressMode addressMode = VK_SAMPLER_ADDRESS_MODE_REPEAT);
+
+    VkDescriptorSetLayoutBinding descriptorset_layout_binding(VkDescriptorType type, VkShaderStageFlags stageFlags, uint32_t binding);
+
+    VkWriteDescriptorSet write_descriptor_buffer(VkDescriptorType type, VkDescriptorSet dstSet, const VkDescriptorBufferInfo *bufferInfo, uint32_t binding);
+
+    VkWriteDescriptorSet write_descriptor_image(VkDescriptorType type, VkDescriptorSet dstSet, const VkDescriptorImageInfo *imageInfo, uint32_t binding);
 }
 
 
@@ -0,0 +1,107 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_jobs.h"
+#include "vk_profiler.h"
+
+#include <string>
+
+void JobSystem::init(uint32_t workerCount) {
+    if (workerCount < 1) workerCount = 1;
+
+    _stop = false;
+    for (uint32_t i = 0; i < workerCount; i++){
+        _queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (uint32_t i = 0; i < workerCount; i++){
+        _threads.emplace_back(&JobSystem::worker_loop, this, i);
+    }
+}
+
+void JobSystem::shutdown() {
+    wait();
+
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+
+    for (std::thread &thread : _threads){
+        thread.join();
+    }
+    _threads.clear();
+    _queues.clear();
+}
+
+uint32_t JobSystem::worker_count() const {
+    return (uint32_t)_threads.size();
+}
+
+void JobSystem::submit(Job job) {
+    _pending++;
+
+    // Bumped under the wake mutex so a worker about to sleep can't miss it,
+    // and before the push so a steal can never take it below zero
+    {
+        std::lock_guard<std::mutex> lock(_wakeMutex);
+        _queued++;
+    }
+
+    WorkerQueue &queue = *_queues[_nextQueue.fetch_add(1, std::memory_order_relaxed) % _queues.size()];
+    {
+        std::lock_guard<std::mutex> lock(queue._mutex);
+        queue._jobs.push_back(std::move(job));
+    }
+    _wake.notify_one();
+}
+
+void JobSystem::wait() {
+    std::unique_lock<std::mutex> lock(_wakeMutex);
+    _done.wait(lock, [this]{ return _pending == 0; });
+}
+
+bool JobSystem::pop(uint32_t workerIndex, Job &out) {
+    const uint32_t queueCount = (uint32_t)_queues.size();
+    for (uint32_t i = 0; i < queueCount; i++){
+        WorkerQueue &queue = *_queues[(workerIndex + i) % queueCount];
+        std::lock_guard<std::mutex> lock(queue._mutex);
+        if (queue._jobs.empty()){
+            continue;
+        }
+
+        if (i == 0){
+            out = std::move(queue._jobs.front());
+            queue._jobs.pop_front();
+        } else {
+            out = std::move(queue._jobs.back());
+            queue._jobs.pop_back();
+        }
+        _queued--;
+        return true;
+    }
+    return false;
+}
+
+void JobSystem::worker_loop(uint32_t workerIndex) {
+    vkprofile::set_thread_name(("worker " + std::to_string(workerIndex)).c_str());
+    while (true){
+        Job job;
+        if (pop(workerIndex, job)){
+            job(workerIndex);
+
+            if (--_pending == 0){
+                std::lock_guard<std::mutex> lock(_wakeMutex);
+                _done.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(_wakeMutex);
+        _wake.wait(lock, [this]{ return _stop || _queued > 0; });
+        if (_stop && _queued == 0){
+            return;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_JOBS_H
+#define VKENGINE_VK_JOBS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed pool of worker threads, each with its own job queue. Idle workers steal from the back of
+// the others' queues, so uneven jobs still keep every core busy.
+class JobSystem {
+public:
+    // Jobs get the index of the worker running them, handy for per-worker resources like command pools
+    using Job = std::function<void(uint32_t workerIndex)>;
+
+    void init(uint32_t workerCount);
+
+    // Finishes whatever is queued, then joins the workers
+    void shutdown();
+
+    uint32_t worker_count() const;
+
+    // Queues are filled round robin, stealing evens out the rest
+    void submit(Job job);
+
+    // Blocks until every submitted job has run
+    void wait();
+
+private:
+    struct WorkerQueue {
+        std::mutex _mutex;
+        std::deque<Job> _jobs;
+    };
+
+    void worker_loop(uint32_t workerIndex);
+
+    // Own queue from the front, everyone else's from the back
+    bool pop(uint32_t workerIndex, Job &out);
+
+    std::vector<std::unique_ptr<WorkerQueue>> _queues;
+    std::vector<std::thread> _threads;
+
+    std::mutex _wakeMutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+
+    // Jobs sitting in a queue, and jobs not finished yet
+    std::atomic<uint32_t> _queued {0};
+    std::atomic<uint32_t> _pending {0};
+    // Round robin over the queues, submit() may be called from jobs too
+    std::atomic<uint32_t> _nextQueue {0};
+    bool _stop {false};
+};
+
+
+#endif //VKENGINE_VK_JOBS_H
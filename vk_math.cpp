@@ -0,0 +1,345 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_math.h"
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define VKMATH_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define VKMATH_NEON 1
+#include <arm_neon.h>
+#endif
+
+Mat4 vkmath::identity() {
+    Mat4 result = {};
+    result.m[0] = 1.0f;
+    result.m[5] = 1.0f;
+    result.m[10] = 1.0f;
+    result.m[15] = 1.0f;
+    return result;
+}
+
+Mat4 vkmath::multiply(const Mat4 &a, const Mat4 &b) {
+    Mat4 result;
+    for (int column = 0; column < 4; column++){
+        for (int row = 0; row < 4; row++){
+            float sum = 0.0f;
+            for (int k = 0; k < 4; k++){
+                sum += a.m[k * 4 + row] * b.m[column * 4 + k];
+            }
+            result.m[column * 4 + row] = sum;
+        }
+    }
+    return result;
+}
+
+Mat4 vkmath::perspective(float fovY, float aspect, float zNear, float zFar) {
+    float f = 1.0f / tanf(fovY * 0.5f);
+
+    Mat4 result = {};
+    result.m[0] = f / aspect;
+    result.m[5] = f;
+    result.m[10] = zFar / (zFar - zNear);
+    result.m[11] = 1.0f;
+    result.m[14] = -zNear * zFar / (zFar - zNear);
+    return result;
+}
+
+static void normalize3(float v[3]) {
+    float length = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    if (length > 0.0f){
+        v[0] /= length;
+        v[1] /= length;
+        v[2] /= length;
+    }
+}
+
+static void cross3(const float a[3], const float b[3], float out[3]) {
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+Mat4 vkmath::look_at(const float eye[3], const float target[3], const float up[3]) {
+    float forward[3] = {target[0] - eye[0], target[1] - eye[1], target[2] - eye[2]};
+    normalize3(forward);
+    float right[3];
+    cross3(forward, up, right);
+    normalize3(right);
+    float down[3];
+    cross3(forward, right, down);
+
+    const float *axes[3] = {right, down, forward};
+
+    Mat4 result = identity();
+    for (int row = 0; row < 3; row++){
+        const float *axis = axes[row];
+        result.m[0 * 4 + row] = axis[0];
+        result.m[1 * 4 + row] = axis[1];
+        result.m[2 * 4 + row] = axis[2];
+        result.m[3 * 4 + row] = -(axis[0] * eye[0] + axis[1] * eye[1] + axis[2] * eye[2]);
+    }
+    return result;
+}
+
+Mat4 Camera::view() const {
+    float forward[3] = {sinf(_yaw) * cosf(_pitch), sinf(_pitch), cosf(_yaw) * cosf(_pitch)};
+    float eye[3];
+    for (int i = 0; i < 3; i++){
+        eye[i] = _target[i] - forward[i] * _distance;
+    }
+
+    static const float up[3] = {0.0f, -1.0f, 0.0f};
+    return vkmath::look_at(eye, _target, up);
+}
+
+Mat4 Camera::projection(float aspect) const {
+    return vkmath::perspective(_fovY, aspect, _zNear, _zFar);
+}
+
+Mat4 Camera::view_projection(float aspect) const {
+    return vkmath::multiply(projection(aspect), view());
+}
+
+// The model matrix is only a translation and a uniform scale, so with c0-c3 the view projection's columns
+// every MVP is s * c0, s * c1, s * c2 and x * c0 + y * c1 + z * c2 + c3. The SIMD kernels compute the last
+// column one row per register across a group of objects and transpose it, the scaled columns are cheaper
+// as one broadcast per object. Output goes out with streaming stores, it's normally mapped GPU memory
+// nobody on the CPU reads back.
+
+static void compute_mvp_scalar(const Mat4 &viewProjection, const float *x, const float *y, const float *z,
+                               const float *scale, uint32_t count, Mat4 *out) {
+    const float *c = viewProjection.m;
+    for (uint32_t i = 0; i < count; i++){
+        float *o = out[i].m;
+        for (int row = 0; row < 4; row++){
+            o[row] = scale[i] * c[row];
+            o[4 + row] = scale[i] * c[4 + row];
+            o[8 + row] = scale[i] * c[8 + row];
+            o[12 + row] = x[i] * c[row] + y[i] * c[4 + row] + z[i] * c[8 + row] + c[12 + row];
+        }
+    }
+}
+
+#ifdef VKMATH_X86
+static void compute_mvp_sse(const Mat4 &viewProjection, const float *x, const float *y, const float *z,
+                            const float *scale, uint32_t count, Mat4 *out) {
+    __m128 columns[4];
+    __m128 c[16];
+    for (int i = 0; i < 4; i++){
+        columns[i] = _mm_loadu_ps(viewProjection.m + i * 4);
+    }
+    for (int i = 0; i < 16; i++){
+        c[i] = _mm_set1_ps(viewProjection.m[i]);
+    }
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4){
+        __m128 s = _mm_loadu_ps(scale + i);
+        __m128 px = _mm_loadu_ps(x + i);
+        __m128 py = _mm_loadu_ps(y + i);
+        __m128 pz = _mm_loadu_ps(z + i);
+
+        __m128 rows[4];
+        for (int row = 0; row < 4; row++){
+            rows[row] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, c[row]), _mm_mul_ps(py, c[4 + row])),
+                                   _mm_add_ps(_mm_mul_ps(pz, c[8 + row]), c[12 + row]));
+        }
+        _MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+
+        __m128 scales[4] = {
+                _mm_shuffle_ps(s, s, _MM_SHUFFLE(0, 0, 0, 0)),
+                _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)),
+                _mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 2, 2, 2)),
+                _mm_shuffle_ps(s, s, _MM_SHUFFLE(3, 3, 3, 3)),
+        };
+        for (int k = 0; k < 4; k++){
+            float *o = out[i + k].m;
+            _mm_stream_ps(o, _mm_mul_ps(scales[k], columns[0]));
+            _mm_stream_ps(o + 4, _mm_mul_ps(scales[k], columns[1]));
+            _mm_stream_ps(o + 8, _mm_mul_ps(scales[k], columns[2]));
+            _mm_stream_ps(o + 12, rows[k]);
+        }
+    }
+    // Streaming stores aren't ordered with the rest, make them visible before anyone reads the output
+    _mm_sfence();
+
+    compute_mvp_scalar(viewProjection, x + i, y + i, z + i, scale + i, count - i, out + i);
+}
+
+__attribute__((target("avx2,fma")))
+static void compute_mvp_avx2(const Mat4 &viewProjection, const float *x, const float *y, const float *z,
+                             const float *scale, uint32_t count, Mat4 *out) {
+    // Columns 0-1 side by side and column 2 in the low half, scaled with a multiply each
+    __m256 columns01 = _mm256_loadu_ps(viewProjection.m);
+    __m256 columns2 = _mm256_castps128_ps256(_mm_loadu_ps(viewProjection.m + 8));
+    __m256 c[16];
+    for (int i = 0; i < 16; i++){
+        c[i] = _mm256_set1_ps(viewProjection.m[i]);
+    }
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8){
+        __m256 s = _mm256_loadu_ps(scale + i);
+        __m256 px = _mm256_loadu_ps(x + i);
+        __m256 py = _mm256_loadu_ps(y + i);
+        __m256 pz = _mm256_loadu_ps(z + i);
+
+        __m256 rows[4];
+        for (int row = 0; row < 4; row++){
+            rows[row] = _mm256_fmadd_ps(px, c[row], _mm256_fmadd_ps(py, c[4 + row], _mm256_fmadd_ps(pz, c[8 + row], c[12 + row])));
+        }
+
+        // Transposes each 128 bit half on its own, the low half holds objects 0-3 and the high half 4-7
+        __m256 t0 = _mm256_unpacklo_ps(rows[0], rows[1]);
+        __m256 t1 = _mm256_unpackhi_ps(rows[0], rows[1]);
+        __m256 t2 = _mm256_unpacklo_ps(rows[2], rows[3]);
+        __m256 t3 = _mm256_unpackhi_ps(rows[2], rows[3]);
+        __m256 translations[4] = {
+                _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)),
+                _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2)),
+                _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)),
+                _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2)),
+        };
+
+        alignas(32) float scales[8];
+        _mm256_store_ps(scales, s);
+        for (int k = 0; k < 8; k++){
+            __m256 objectScale = _mm256_set1_ps(scales[k]);
+            __m128 translation = k < 4 ? _mm256_castps256_ps128(translations[k]) : _mm256_extractf128_ps(translations[k - 4], 1);
+
+            // Mat4 only guarantees 16 byte alignment, so everything goes out as 128 bit stores
+            float *o = out[i + k].m;
+            __m256 scaled01 = _mm256_mul_ps(objectScale, columns01);
+            __m256 scaled2 = _mm256_mul_ps(objectScale, columns2);
+            _mm_stream_ps(o, _mm256_castps256_ps128(scaled01));
+            _mm_stream_ps(o + 4, _mm256_extractf128_ps(scaled01, 1));
+            _mm_stream_ps(o + 8, _mm256_castps256_ps128(scaled2));
+            _mm_stream_ps(o + 12, translation);
+        }
+    }
+    _mm_sfence();
+
+    compute_mvp_scalar(viewProjection, x + i, y + i, z + i, scale + i, count - i, out + i);
+}
+#endif
+
+#ifdef VKMATH_NEON
+static void compute_mvp_neon(const Mat4 &viewProjection, const float *x, const float *y, const float *z,
+                             const float *scale, uint32_t count, Mat4 *out) {
+    float32x4_t columns[4];
+    float32x4_t c[16];
+    for (int i = 0; i < 4; i++){
+        columns[i] = vld1q_f32(viewProjection.m + i * 4);
+    }
+    for (int i = 0; i < 16; i++){
+        c[i] = vdupq_n_f32(viewProjection.m[i]);
+    }
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4){
+        float32x4_t px = vld1q_f32(x + i);
+        float32x4_t py = vld1q_f32(y + i);
+        float32x4_t pz = vld1q_f32(z + i);
+
+        float32x4_t rows[4];
+        for (int row = 0; row < 4; row++){
+            rows[row] = vmlaq_f32(vmlaq_f32(vmlaq_f32(c[12 + row], pz, c[8 + row]), py, c[4 + row]), px, c[row]);
+        }
+
+        float32x4x2_t t01 = vtrnq_f32(rows[0], rows[1]);
+        float32x4x2_t t23 = vtrnq_f32(rows[2], rows[3]);
+        float32x4_t translations[4] = {
+                vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0])),
+                vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1])),
+                vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0])),
+                vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1])),
+        };
+
+        // No streaming stores here, plain ones it is
+        for (int k = 0; k < 4; k++){
+            float *o = out[i + k].m;
+            vst1q_f32(o, vmulq_n_f32(columns[0], scale[i + k]));
+            vst1q_f32(o + 4, vmulq_n_f32(columns[1], scale[i + k]));
+            vst1q_f32(o + 8, vmulq_n_f32(columns[2], scale[i + k]));
+            vst1q_f32(o + 12, translations[k]);
+        }
+    }
+
+    compute_mvp_scalar(viewProjection, x + i, y + i, z + i, scale + i, count - i, out + i);
+}
+#endif
+
+bool vkmath::transform_kernel_supported(TransformKernel kernel) {
+    switch (kernel){
+        case TransformKernel::Scalar:
+            return true;
+#ifdef VKMATH_X86
+        case TransformKernel::SSE:
+            return true;
+        case TransformKernel::AVX2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+#ifdef VKMATH_NEON
+        case TransformKernel::NEON:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+vkmath::TransformKernel vkmath::best_transform_kernel() {
+    static const TransformKernel best = []{
+        for (TransformKernel kernel : {TransformKernel::AVX2, TransformKernel::NEON, TransformKernel::SSE}){
+            if (transform_kernel_supported(kernel)){
+                return kernel;
+            }
+        }
+        return TransformKernel::Scalar;
+    }();
+    return best;
+}
+
+const char *vkmath::transform_kernel_name(TransformKernel kernel) {
+    switch (kernel){
+        case TransformKernel::Scalar: return "scalar";
+        case TransformKernel::SSE: return "sse";
+        case TransformKernel::AVX2: return "avx2";
+        case TransformKernel::NEON: return "neon";
+    }
+    return "unknown";
+}
+
+void vkmath::compute_mvp(TransformKernel kernel, const Mat4 &viewProjection, const float *x, const float *y,
+                         const float *z, const float *scale, uint32_t count, Mat4 *out) {
+    // Mapped memory cast to Mat4 doesn't get the alignment for free, streaming stores would fault on it
+    if (((uintptr_t)out & 15) != 0){
+        kernel = TransformKernel::Scalar;
+    }
+    switch (kernel){
+#ifdef VKMATH_X86
+        case TransformKernel::SSE:
+            compute_mvp_sse(viewProjection, x, y, z, scale, count, out);
+            return;
+        case TransformKernel::AVX2:
+            compute_mvp_avx2(viewProjection, x, y, z, scale, count, out);
+            return;
+#endif
+#ifdef VKMATH_NEON
+        case TransformKernel::NEON:
+            compute_mvp_neon(viewProjection, x, y, z, scale, count, out);
+            return;
+#endif
+        default:
+            compute_mvp_scalar(viewProjection, x, y, z, scale, count, out);
+            return;
+    }
+}
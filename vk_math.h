@@ -0,0 +1,114 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_MATH_H
+#define VKENGINE_VK_MATH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+// Lets the SoA arrays start on a cache line, so SIMD loads never straddle one at the start of a run
+template<typename T, size_t Alignment = CACHE_LINE_SIZE>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template<typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+    T *allocate(size_t count) {
+        // aligned_alloc wants the size to be a multiple of the alignment
+        size_t bytes = (count * sizeof(T) + Alignment - 1) & ~(Alignment - 1);
+        void *memory = aligned_alloc(Alignment, bytes);
+        if (!memory){
+            throw std::bad_alloc();
+        }
+        return (T *)memory;
+    }
+
+    void deallocate(T *memory, size_t) {
+        free(memory);
+    }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Alignment> &) const { return true; }
+
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment> &) const { return false; }
+};
+
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// Column major like GLSL, m[column * 4 + row]
+struct alignas(16) Mat4 {
+    float m[16];
+};
+
+// Vulkan clip space throughout: x right, y down, depth 0 to 1. The world uses the same axes
+// (left handed, y down), so objects placed straight in clip space keep their layout under a camera.
+namespace vkmath {
+    Mat4 identity();
+
+    // a * b, so b applies first
+    Mat4 multiply(const Mat4 &a, const Mat4 &b);
+
+    // fovY in radians
+    Mat4 perspective(float fovY, float aspect, float zNear, float zFar);
+
+    // up is the world's up, (0, -1, 0) with y down
+    Mat4 look_at(const float eye[3], const float target[3], const float up[3]);
+
+    enum class TransformKernel : uint32_t {
+        Scalar,
+        SSE,
+        AVX2,
+        NEON,
+    };
+
+    // Widest kernel this CPU can run, checked once
+    TransformKernel best_transform_kernel();
+
+    bool transform_kernel_supported(TransformKernel kernel);
+
+    const char *transform_kernel_name(TransformKernel kernel);
+
+    // out[i] = viewProjection * translate(x, y, z) * scale(s) for count objects stored as separate arrays.
+    // Inputs don't need any alignment. The SSE and AVX2 kernels write out with streaming stores, a misaligned
+    // out falls back to the scalar kernel. The kernel has to be supported.
+    void compute_mvp(TransformKernel kernel, const Mat4 &viewProjection, const float *x, const float *y,
+                     const float *z, const float *scale, uint32_t count, Mat4 *out);
+}
+
+// Orbits a target point, enough to look at the instances grid from somewhere other than straight on
+struct Camera {
+    float _target[3] {0.0f, 0.0f, 0.0f};
+    float _distance {2.0f};
+    // Radians around the world's y axis, 0 looks down +z
+    float _yaw {0.0f};
+    float _pitch {0.0f};
+    float _fovY {1.0471976f};
+    float _zNear {0.05f};
+    float _zFar {100.0f};
+
+    Mat4 view() const;
+
+    Mat4 projection(float aspect) const;
+
+    Mat4 view_projection(float aspect) const;
+};
+
+
+#endif //VKENGINE_VK_MATH_H
@@ -0,0 +1,193 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_mesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+uint32_t VertexInputDescription::add_binding(uint32_t stride, VkVertexInputRate inputRate) {
+    VkVertexInputBindingDescription binding = {};
+    binding.binding = (uint32_t)bindings.size();
+    binding.stride = stride;
+    binding.inputRate = inputRate;
+
+    bindings.push_back(binding);
+    return binding.binding;
+}
+
+void VertexInputDescription::add_attribute(uint32_t binding, VkFormat format, uint32_t offset) {
+    VkVertexInputAttributeDescription attribute = {};
+    attribute.binding = binding;
+    attribute.location = (uint32_t)attributes.size();
+    attribute.format = format;
+    attribute.offset = offset;
+
+    attributes.push_back(attribute);
+}
+
+void VertexInputDescription::apply(VkPipelineVertexInputStateCreateInfo &info) const {
+    info.flags = flags;
+    info.vertexBindingDescriptionCount = (uint32_t)bindings.size();
+    info.pVertexBindingDescriptions = bindings.data();
+    info.vertexAttributeDescriptionCount = (uint32_t)attributes.size();
+    info.pVertexAttributeDescriptions = attributes.data();
+}
+
+VertexInputDescription get_mesh_vertex_description(bool instanceMatrix) {
+    VertexInputDescription description;
+
+    uint32_t vertexBinding = description.add_binding(sizeof(PackedVertex), VK_VERTEX_INPUT_RATE_VERTEX);
+    description.add_attribute(vertexBinding, VK_FORMAT_R16G16B16A16_SNORM, offsetof(PackedVertex, position));
+    description.add_attribute(vertexBinding, VK_FORMAT_R16G16_SNORM, offsetof(PackedVertex, normal));
+    description.add_attribute(vertexBinding, VK_FORMAT_R8G8B8A8_UNORM, offsetof(PackedVertex, color));
+
+    if (instanceMatrix){
+        // A mat4 takes one location per column
+        uint32_t instanceBinding = description.add_binding(16 * sizeof(float), VK_VERTEX_INPUT_RATE_INSTANCE);
+        for (uint32_t column = 0; column < 4; column++){
+            description.add_attribute(instanceBinding, VK_FORMAT_R32G32B32A32_SFLOAT, column * 4 * sizeof(float));
+        }
+        return description;
+    }
+
+    // xyz offset + uniform scale packed in one vec4
+    uint32_t instanceBinding = description.add_binding(sizeof(InstanceData), VK_VERTEX_INPUT_RATE_INSTANCE);
+    description.add_attribute(instanceBinding, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+    return description;
+}
+
+uint32_t MeshPool::add(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices) {
+    static const float facingNormal[3] = {0.0f, 0.0f, -1.0f};
+
+    Source source;
+    source._vertices.reserve(vertices.size());
+
+    Mesh mesh;
+    mesh._firstIndex = _indexCount;
+    mesh._indexCount = (uint32_t)indices.size();
+    mesh._vertexOffset = (int32_t)_vertexCount;
+    mesh._radius = 0.0f;
+    for (const Vertex &vertex : vertices){
+        float lengthSquared = vertex.position[0] * vertex.position[0] + vertex.position[1] * vertex.position[1] +
+                              vertex.position[2] * vertex.position[2];
+        mesh._radius = std::max(mesh._radius, sqrtf(lengthSquared));
+        source._vertices.push_back(vkmesh::pack_vertex(vertex.position, facingNormal, vertex.color));
+    }
+    source._indices = indices;
+
+    _vertexCount += (uint32_t)vertices.size();
+    _indexCount += (uint32_t)indices.size();
+    _sources.push_back(std::move(source));
+
+    _meshes.push_back(mesh);
+    return (uint32_t)_meshes.size() - 1;
+}
+
+uint32_t MeshPool::add_file(const char *path) {
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(path) || file->size() < sizeof(MeshFileHeader)){
+        printf("MESH %s: CAN'T MAP\n", path);
+        return ~0u;
+    }
+
+    // Only the header is looked at, the streams go to staging as they are
+    const MeshFileHeader *header = (const MeshFileHeader *)file->data();
+    if (header->_magic != MESH_FILE_MAGIC || header->_version != MESH_FILE_VERSION){
+        printf("MESH %s: NOT A VERSION %u MESH FILE\n", path, MESH_FILE_VERSION);
+        return ~0u;
+    }
+
+    // Offsets and counts come from the file, checked against what's left so nothing can wrap around
+    const uint64_t fileSize = file->size();
+    if (header->_vertexOffset % MESH_FILE_ALIGNMENT != 0 || header->_indexOffset % MESH_FILE_ALIGNMENT != 0 ||
+        header->_vertexOffset > fileSize || header->_indexOffset > fileSize ||
+        header->_vertexCount > (fileSize - header->_vertexOffset) / sizeof(PackedVertex) ||
+        header->_indexCount > (fileSize - header->_indexOffset) / sizeof(uint32_t)){
+        printf("MESH %s: TRUNCATED OR MISALIGNED\n", path);
+        return ~0u;
+    }
+
+    // Draws take the vertex offset as an int32, the index count has to fit the pool's uint32
+    if (header->_vertexCount > (uint32_t)INT32_MAX - _vertexCount || header->_indexCount > UINT32_MAX - _indexCount){
+        printf("MESH %s: TOO BIG FOR THE MESH POOL\n", path);
+        return ~0u;
+    }
+
+    Mesh mesh;
+    mesh._firstIndex = _indexCount;
+    mesh._indexCount = header->_indexCount;
+    mesh._vertexOffset = (int32_t)_vertexCount;
+    mesh._radius = header->_radius;
+
+    Source source;
+    source._fileVertices = (const uint8_t *)file->data() + header->_vertexOffset;
+    source._fileIndices = (const uint8_t *)file->data() + header->_indexOffset;
+    source._file = std::move(file);
+
+    _vertexCount += header->_vertexCount;
+    _indexCount += header->_indexCount;
+    _sources.push_back(std::move(source));
+
+    _meshes.push_back(mesh);
+    return (uint32_t)_meshes.size() - 1;
+}
+
+bool MeshPool::upload(GpuAllocator &allocator, StreamingUploader &uploader) {
+    VkDeviceSize vertexSize = (VkDeviceSize)_vertexCount * sizeof(PackedVertex);
+    VkDeviceSize indexSize = (VkDeviceSize)_indexCount * sizeof(uint32_t);
+
+    if (!allocator.create_buffer(vertexSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &_vertexBuffer)){
+        return false;
+    }
+    if (!allocator.create_buffer(indexSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &_indexBuffer)){
+        return false;
+    }
+
+    BufferUpload vertexTarget;
+    vertexTarget._buffer = _vertexBuffer._buffer;
+    vertexTarget._dstStage = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    vertexTarget._dstAccess = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+
+    BufferUpload indexTarget;
+    indexTarget._buffer = _indexBuffer._buffer;
+    indexTarget._dstStage = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    indexTarget._dstAccess = VK_ACCESS_INDEX_READ_BIT;
+
+    // Every mesh's streams land at its offsets, mapped files go from the mapping straight into staging
+    for (size_t i = 0; i < _sources.size(); i++){
+        Source &source = _sources[i];
+        const Mesh &mesh = _meshes[i];
+        vertexTarget._offset = (VkDeviceSize)mesh._vertexOffset * sizeof(PackedVertex);
+        indexTarget._offset = (VkDeviceSize)mesh._firstIndex * sizeof(uint32_t);
+
+        if (source._file){
+            const MeshFileHeader *header = (const MeshFileHeader *)source._file->data();
+            uploader.upload_buffer(vertexTarget, source._fileVertices, header->_vertexCount * sizeof(PackedVertex), source._file);
+            _uploadTicket = uploader.upload_buffer(indexTarget, source._fileIndices, header->_indexCount * sizeof(uint32_t),
+                                                   std::move(source._file));
+        } else {
+            std::vector<uint8_t> vertexData(source._vertices.size() * sizeof(PackedVertex));
+            memcpy(vertexData.data(), source._vertices.data(), vertexData.size());
+            std::vector<uint8_t> indexData(source._indices.size() * sizeof(uint32_t));
+            memcpy(indexData.data(), source._indices.data(), indexData.size());
+
+            uploader.upload_buffer(vertexTarget, std::move(vertexData));
+            _uploadTicket = uploader.upload_buffer(indexTarget, std::move(indexData));
+        }
+    }
+
+    _sources.clear();
+    return true;
+}
+
+void MeshPool::destroy(GpuAllocator &allocator) {
+    allocator.destroy_buffer(_vertexBuffer);
+    allocator.destroy_buffer(_indexBuffer);
+}
@@ -0,0 +1,95 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_MESH_H
+#define VKENGINE_VK_MESH_H
+
+#include "vk_types.h"
+#include "vk_allocator.h"
+#include "vk_upload.h"
+#include "vk_mesh_format.h"
+#include "vk_shaders.h"
+#include <memory>
+#include <vector>
+
+struct VertexInputDescription {
+    std::vector<VkVertexInputBindingDescription> bindings;
+    std::vector<VkVertexInputAttributeDescription> attributes;
+
+    VkPipelineVertexInputStateCreateFlags flags = 0;
+
+    // Returns the new binding's index
+    uint32_t add_binding(uint32_t stride, VkVertexInputRate inputRate);
+
+    // Locations are handed out in the order attributes are added
+    void add_attribute(uint32_t binding, VkFormat format, uint32_t offset);
+
+    // Points the vertex input state at this, so the description has to outlive the pipeline's creation
+    void apply(VkPipelineVertexInputStateCreateInfo &info) const;
+};
+
+// Binding 0 is one PackedVertex per vertex (locations 0-2: position, normal, color), binding 1 carries
+// one InstanceData per instance (location 3), or a column major mat4 (locations 3-6) with instanceMatrix
+VertexInputDescription get_mesh_vertex_description(bool instanceMatrix = false);
+
+// What meshes are written as in code, add() packs them. The normal faces the viewer.
+struct Vertex {
+    float position[3];
+    float color[3];
+};
+
+// What the instanced path feeds the vertex shader per object
+struct InstanceData {
+    float position[3];
+    float scale;
+};
+
+// A range of the shared vertex/index buffers, so every mesh can be drawn with one set of binds
+struct Mesh {
+    uint32_t _firstIndex;
+    uint32_t _indexCount;
+    int32_t _vertexOffset;
+    // Bounding sphere around the mesh origin, scaled per object for culling
+    float _radius;
+};
+
+// All meshes live in one vertex and one index buffer, as PackedVertex and uint32 indices
+class MeshPool {
+public:
+    AllocatedBuffer _vertexBuffer;
+    AllocatedBuffer _indexBuffer;
+    std::vector<Mesh> _meshes;
+
+    // Uploads complete in order, so once this one is complete both buffers are
+    UploadTicket _uploadTicket {0};
+
+    // Returns the mesh id, only valid until upload() is called. Positions have to be inside [-1, 1].
+    uint32_t add(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices);
+
+    // A mesh baked by meshbake. The file stays mapped until upload() has its streams copied into staging,
+    // nothing in it is parsed. Returns ~0u when it can't be mapped or isn't a valid mesh file.
+    uint32_t add_file(const char *path);
+
+    // Creates device local buffers and streams the data into them, check _uploadTicket before drawing
+    bool upload(GpuAllocator &allocator, StreamingUploader &uploader);
+
+    void destroy(GpuAllocator &allocator);
+
+private:
+    // Where one mesh's streams come from until upload(), packed here or pointing into a mapped file
+    struct Source {
+        std::vector<PackedVertex> _vertices;
+        std::vector<uint32_t> _indices;
+        std::shared_ptr<MappedFile> _file;
+        const void *_fileVertices {nullptr};
+        const void *_fileIndices {nullptr};
+    };
+
+    std::vector<Source> _sources;
+    uint32_t _vertexCount {0};
+    uint32_t _indexCount {0};
+};
+
+
+#endif //VKENGINE_VK_MESH_H
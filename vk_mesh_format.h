@@ -0,0 +1,98 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_MESH_FORMAT_H
+#define VKENGINE_VK_MESH_FORMAT_H
+
+// Shared between the engine and tools/meshbake, so nothing Vulkan in here
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// "VMSH" little endian
+constexpr uint32_t MESH_FILE_MAGIC = 0x48534D56;
+constexpr uint32_t MESH_FILE_VERSION = 1;
+// Sections start on this boundary, so they can be copied straight out of a mapping
+constexpr uint64_t MESH_FILE_ALIGNMENT = 256;
+
+// 16 bytes, exactly what mesh.vert reads per vertex
+struct PackedVertex {
+    // R16G16B16A16_SNORM, the mesh is normalized into [-1, 1] when it's baked. w is unused.
+    int16_t position[4];
+    // R16G16_SNORM octahedral
+    int16_t normal[2];
+    // R8G8B8A8_UNORM
+    uint8_t color[4];
+};
+static_assert(sizeof(PackedVertex) == 16, "PackedVertex is read straight from files");
+
+// Followed by the vertices and the uint32 indices, each at its offset. Everything is little endian.
+struct MeshFileHeader {
+    uint32_t _magic;
+    uint32_t _version;
+    uint32_t _vertexCount;
+    uint32_t _indexCount;
+    // From the start of the file, multiples of MESH_FILE_ALIGNMENT
+    uint64_t _vertexOffset;
+    uint64_t _indexOffset;
+    // Undoes the normalization, source position = position * _scale + _center
+    float _center[3];
+    float _scale;
+    // Bounding sphere around the origin, in normalized units
+    float _radius;
+    uint32_t _pad[3];
+};
+static_assert(sizeof(MeshFileHeader) == 64, "MeshFileHeader is read straight from files");
+
+namespace vkmesh {
+    inline uint64_t align_offset(uint64_t offset) {
+        return (offset + MESH_FILE_ALIGNMENT - 1) & ~(MESH_FILE_ALIGNMENT - 1);
+    }
+
+    inline int16_t quantize_snorm16(float value) {
+        return (int16_t)lroundf(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f);
+    }
+
+    inline uint8_t quantize_unorm8(float value) {
+        return (uint8_t)lroundf(std::min(std::max(value, 0.0f), 1.0f) * 255.0f);
+    }
+
+    // Folds the unit sphere onto an octahedron and that onto the [-1, 1] square, normal doesn't need to be unit length
+    inline void encode_octahedral(const float normal[3], int16_t out[2]) {
+        float length = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+        if (length == 0.0f){
+            out[0] = 0;
+            out[1] = 0;
+            return;
+        }
+
+        float x = normal[0] / length;
+        float y = normal[1] / length;
+        if (normal[2] < 0.0f){
+            float foldedX = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            float foldedY = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+            x = foldedX;
+            y = foldedY;
+        }
+        out[0] = quantize_snorm16(x);
+        out[1] = quantize_snorm16(y);
+    }
+
+    // Position already normalized, color in [0, 1]
+    inline PackedVertex pack_vertex(const float position[3], const float normal[3], const float color[3]) {
+        PackedVertex vertex;
+        for (int i = 0; i < 3; i++){
+            vertex.position[i] = quantize_snorm16(position[i]);
+            vertex.color[i] = quantize_unorm8(color[i]);
+        }
+        vertex.position[3] = 32767;
+        vertex.color[3] = 255;
+        encode_octahedral(normal, vertex.normal);
+        return vertex;
+    }
+}
+
+
+#endif //VKENGINE_VK_MESH_FORMAT_H
@@ -0,0 +1,294 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_pipeline_batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+static uint64_t float_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+std::vector<uint64_t> PipelineDescription::key() const {
+    std::vector<uint64_t> key;
+    key.reserve(64);
+
+    key.push_back(_stages.size());
+    for (const Stage &stage : _stages){
+        key.push_back(stage._stage);
+        key.push_back((uint64_t)(uintptr_t)stage._module);
+        // Entry points are short, pack them in directly so there's no chance of a hash collision
+        key.push_back(stage._entryPoint.size());
+        for (size_t i = 0; i < stage._entryPoint.size(); i += 8){
+            uint64_t word = 0;
+            memcpy(&word, stage._entryPoint.data() + i, std::min<size_t>(8, stage._entryPoint.size() - i));
+            key.push_back(word);
+        }
+    }
+
+    key.push_back(_bindings.size());
+    for (const VkVertexInputBindingDescription &binding : _bindings){
+        key.push_back(binding.binding);
+        key.push_back(binding.stride);
+        key.push_back(binding.inputRate);
+    }
+    key.push_back(_attributes.size());
+    for (const VkVertexInputAttributeDescription &attribute : _attributes){
+        key.push_back(attribute.location);
+        key.push_back(attribute.binding);
+        key.push_back(attribute.format);
+        key.push_back(attribute.offset);
+    }
+
+    key.push_back(_inputAssembly.topology);
+    key.push_back(_inputAssembly.primitiveRestartEnable);
+
+    key.push_back(float_bits(_viewport.x));
+    key.push_back(float_bits(_viewport.y));
+    key.push_back(float_bits(_viewport.width));
+    key.push_back(float_bits(_viewport.height));
+    key.push_back(float_bits(_viewport.minDepth));
+    key.push_back(float_bits(_viewport.maxDepth));
+    key.push_back((uint32_t)_scissor.offset.x);
+    key.push_back((uint32_t)_scissor.offset.y);
+    key.push_back(_scissor.extent.width);
+    key.push_back(_scissor.extent.height);
+
+    key.push_back(_rasterizer.depthClampEnable);
+    key.push_back(_rasterizer.rasterizerDiscardEnable);
+    key.push_back(_rasterizer.polygonMode);
+    key.push_back(_rasterizer.cullMode);
+    key.push_back(_rasterizer.frontFace);
+    key.push_back(_rasterizer.depthBiasEnable);
+    key.push_back(float_bits(_rasterizer.depthBiasConstantFactor));
+    key.push_back(float_bits(_rasterizer.depthBiasClamp));
+    key.push_back(float_bits(_rasterizer.depthBiasSlopeFactor));
+    key.push_back(float_bits(_rasterizer.lineWidth));
+
+    key.push_back(_colorBlendAttachment.blendEnable);
+    key.push_back(_colorBlendAttachment.srcColorBlendFactor);
+    key.push_back(_colorBlendAttachment.dstColorBlendFactor);
+    key.push_back(_colorBlendAttachment.colorBlendOp);
+    key.push_back(_colorBlendAttachment.srcAlphaBlendFactor);
+    key.push_back(_colorBlendAttachment.dstAlphaBlendFactor);
+    key.push_back(_colorBlendAttachment.alphaBlendOp);
+    key.push_back(_colorBlendAttachment.colorWriteMask);
+
+    key.push_back(_multisampling.rasterizationSamples);
+    key.push_back(_multisampling.sampleShadingEnable);
+    key.push_back(float_bits(_multisampling.minSampleShading));
+    key.push_back(_multisampling.alphaToCoverageEnable);
+    key.push_back(_multisampling.alphaToOneEnable);
+
+    key.push_back(_depthStencil.depthTestEnable);
+    key.push_back(_depthStencil.depthWriteEnable);
+    key.push_back(_depthStencil.depthCompareOp);
+    key.push_back(_depthStencil.depthBoundsTestEnable);
+    key.push_back(float_bits(_depthStencil.minDepthBounds));
+    key.push_back(float_bits(_depthStencil.maxDepthBounds));
+    // Stencil is never used, it stays off
+    key.push_back(_depthStencil.stencilTestEnable);
+    key.push_back(_depthOnly);
+
+    key.push_back(_dynamicStates.size());
+    for (VkDynamicState state : _dynamicStates){
+        key.push_back(state);
+    }
+
+    key.push_back((uint64_t)(uintptr_t)_pipelineLayout);
+    key.push_back((uint64_t)(uintptr_t)_renderPass);
+    key.push_back(_subpass);
+    return key;
+}
+
+uint32_t PipelineBatch::add(const PipelineDescription &description) {
+    _requested++;
+
+    std::vector<uint64_t> key = description.key();
+    auto found = _lookup.find(key);
+    if (found != _lookup.end()){
+        return found->second;
+    }
+
+    uint32_t slot = (uint32_t)_descriptions.size();
+    _descriptions.push_back(description);
+    _lookup.emplace(std::move(key), slot);
+    return slot;
+}
+
+namespace {
+    // Create info plus all the state structs it points at, must not move once filled in
+    struct BakedPipeline {
+        std::vector<VkPipelineShaderStageCreateInfo> _stages;
+        VkPipelineVertexInputStateCreateInfo _vertexInput;
+        VkPipelineViewportStateCreateInfo _viewportState;
+        VkPipelineColorBlendStateCreateInfo _colorBlending;
+        VkPipelineDynamicStateCreateInfo _dynamicState;
+        VkPipelineCreationFeedbackCreateInfoEXT _feedbackInfo;
+        VkGraphicsPipelineCreateInfo _info;
+    };
+
+    void bake(const PipelineDescription &description, BakedPipeline &baked, VkPipelineCreationFeedbackEXT *feedback) {
+        for (const PipelineDescription::Stage &stage : description._stages){
+            VkPipelineShaderStageCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+            info.pNext = nullptr;
+            info.stage = stage._stage;
+            info.module = stage._module;
+            info.pName = stage._entryPoint.c_str();
+            baked._stages.push_back(info);
+        }
+
+        baked._vertexInput = {};
+        baked._vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+        baked._vertexInput.pNext = nullptr;
+        baked._vertexInput.vertexBindingDescriptionCount = (uint32_t)description._bindings.size();
+        baked._vertexInput.pVertexBindingDescriptions = description._bindings.data();
+        baked._vertexInput.vertexAttributeDescriptionCount = (uint32_t)description._attributes.size();
+        baked._vertexInput.pVertexAttributeDescriptions = description._attributes.data();
+
+        baked._viewportState = {};
+        baked._viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        baked._viewportState.pNext = nullptr;
+        baked._viewportState.viewportCount = 1;
+        baked._viewportState.pViewports = &description._viewport;
+        baked._viewportState.scissorCount = 1;
+        baked._viewportState.pScissors = &description._scissor;
+
+        baked._colorBlending = {};
+        baked._colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+        baked._colorBlending.pNext = nullptr;
+        baked._colorBlending.logicOpEnable = VK_FALSE;
+        baked._colorBlending.logicOp = VK_LOGIC_OP_COPY;
+        baked._colorBlending.attachmentCount = description._depthOnly ? 0 : 1;
+        baked._colorBlending.pAttachments = &description._colorBlendAttachment;
+
+        baked._dynamicState = {};
+        baked._dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+        baked._dynamicState.pNext = nullptr;
+        baked._dynamicState.dynamicStateCount = (uint32_t)description._dynamicStates.size();
+        baked._dynamicState.pDynamicStates = description._dynamicStates.data();
+
+        VkGraphicsPipelineCreateInfo &info = baked._info;
+        info = {};
+        info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        info.pNext = nullptr;
+
+        info.stageCount = (uint32_t)baked._stages.size();
+        info.pStages = baked._stages.data();
+        info.pVertexInputState = &baked._vertexInput;
+        info.pInputAssemblyState = &description._inputAssembly;
+        info.pViewportState = &baked._viewportState;
+        info.pRasterizationState = &description._rasterizer;
+        info.pMultisampleState = &description._multisampling;
+        info.pDepthStencilState = &description._depthStencil;
+        info.pColorBlendState = &baked._colorBlending;
+        info.pDynamicState = description._dynamicStates.empty() ? nullptr : &baked._dynamicState;
+        info.layout = description._pipelineLayout;
+        info.renderPass = description._renderPass;
+        info.subpass = description._subpass;
+        info.basePipelineHandle = VK_NULL_HANDLE;
+        info.basePipelineIndex = -1;
+
+        if (feedback){
+            baked._feedbackInfo = {};
+            baked._feedbackInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT;
+            baked._feedbackInfo.pNext = nullptr;
+            baked._feedbackInfo.pPipelineCreationFeedback = feedback;
+            baked._feedbackInfo.pipelineStageCreationFeedbackCount = 0;
+            baked._feedbackInfo.pPipelineStageCreationFeedbacks = nullptr;
+            info.pNext = &baked._feedbackInfo;
+        }
+    }
+}
+
+bool PipelineBatch::build(VkDevice device, VkPipelineCache cache, uint32_t threadCount) {
+    auto start = std::chrono::steady_clock::now();
+
+    const uint32_t count = (uint32_t)_descriptions.size();
+    _pipelines = std::vector<VkPipeline>(count, VK_NULL_HANDLE);
+    _feedback = std::vector<VkPipelineCreationFeedbackEXT>(_collectFeedback ? count : 0, VkPipelineCreationFeedbackEXT{});
+
+    std::vector<BakedPipeline> baked(count);
+    std::vector<VkGraphicsPipelineCreateInfo> infos(count);
+    for (uint32_t i = 0; i < count; i++){
+        bake(_descriptions[i], baked[i], _collectFeedback ? &_feedback[i] : nullptr);
+        infos[i] = baked[i]._info;
+    }
+
+    // The driver compiles a single call's pipelines serially, so hand each thread its own contiguous chunk.
+    // Pipeline caches are internally synchronized, sharing one across threads is fine.
+    uint32_t chunks = std::max(1u, std::min(threadCount, count));
+    uint32_t chunkSize = count == 0 ? 0 : (count + chunks - 1) / chunks;
+    std::vector<VkResult> results(chunks, VK_SUCCESS);
+
+    auto build_chunk = [&](uint32_t chunk){
+        uint32_t first = chunk * chunkSize;
+        uint32_t last = std::min(count, first + chunkSize);
+        if (first >= last) return;
+        results[chunk] = vkCreateGraphicsPipelines(device, cache, last - first, infos.data() + first, nullptr,
+                                                   _pipelines.data() + first);
+    };
+
+    if (chunks == 1){
+        build_chunk(0);
+    } else {
+        std::vector<std::thread> workers;
+        for (uint32_t chunk = 1; chunk < chunks; chunk++){
+            workers.emplace_back(build_chunk, chunk);
+        }
+        build_chunk(0);
+        for (std::thread &worker : workers){
+            worker.join();
+        }
+    }
+
+    _buildMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    for (const VkPipelineCreationFeedbackEXT &feedback : _feedback){
+        if (feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT){
+            if (feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT){
+                _cacheHits++;
+            } else {
+                _cacheMisses++;
+            }
+        }
+    }
+
+    for (VkResult result : results){
+        if (result != VK_SUCCESS){
+            return false;
+        }
+    }
+    return true;
+}
+
+VkPipeline PipelineBatch::get(uint32_t slot) const {
+    return _pipelines[slot];
+}
+
+const std::vector<VkPipeline> &PipelineBatch::pipelines() const {
+    return _pipelines;
+}
+
+const PipelineDescription &PipelineBatch::description(uint32_t slot) const {
+    return _descriptions[slot];
+}
+
+uint32_t PipelineBatch::requested_count() const {
+    return _requested;
+}
+
+uint32_t PipelineBatch::unique_count() const {
+    return (uint32_t)_descriptions.size();
+}
+
+const std::vector<VkPipelineCreationFeedbackEXT> &PipelineBatch::feedback() const {
+    return _feedback;
+}
@@ -0,0 +1,84 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_PIPELINE_BATCH_H
+#define VKENGINE_VK_PIPELINE_BATCH_H
+
+#include "vk_types.h"
+#include <map>
+#include <string>
+#include <vector>
+
+// Self contained snapshot of a PipelineBuilder, owns every array the create info points at so it
+// can be stored, compared and built later. Never modified once described, make a new one instead.
+struct PipelineDescription {
+    struct Stage {
+        VkShaderStageFlagBits _stage;
+        VkShaderModule _module;
+        std::string _entryPoint;
+    };
+
+    std::vector<Stage> _stages;
+    std::vector<VkVertexInputBindingDescription> _bindings;
+    std::vector<VkVertexInputAttributeDescription> _attributes;
+    VkPipelineInputAssemblyStateCreateInfo _inputAssembly;
+    VkViewport _viewport;
+    VkRect2D _scissor;
+    VkPipelineRasterizationStateCreateInfo _rasterizer;
+    VkPipelineColorBlendAttachmentState _colorBlendAttachment;
+    VkPipelineMultisampleStateCreateInfo _multisampling;
+    VkPipelineDepthStencilStateCreateInfo _depthStencil;
+    // No color attachment at all, for depth only passes
+    bool _depthOnly {false};
+    // Anything listed here is set while recording, the matching baked-in state above is ignored
+    std::vector<VkDynamicState> _dynamicStates;
+    VkPipelineLayout _pipelineLayout;
+    VkRenderPass _renderPass;
+    uint32_t _subpass;
+
+    // Every piece of state above flattened into words, equal keys build identical pipelines
+    std::vector<uint64_t> key() const;
+};
+
+// Collects descriptions and creates all of them at once, either with a single
+// vkCreateGraphicsPipelines call or split across worker threads
+class PipelineBatch {
+public:
+    // Record VK_EXT_pipeline_creation_feedback for every pipeline, the extension must be enabled
+    bool _collectFeedback {false};
+
+    uint32_t _cacheHits {0};
+    uint32_t _cacheMisses {0};
+    double _buildMs {0.0};
+
+    // Returns the slot to fetch the pipeline from after build(), identical descriptions share a slot
+    uint32_t add(const PipelineDescription &description);
+
+    // threadCount 0 or 1 builds everything in one call on the calling thread
+    bool build(VkDevice device, VkPipelineCache cache, uint32_t threadCount = 1);
+
+    VkPipeline get(uint32_t slot) const;
+
+    // Every pipeline the batch created exactly once, whoever built the batch owns them
+    const std::vector<VkPipeline> &pipelines() const;
+
+    const PipelineDescription &description(uint32_t slot) const;
+
+    uint32_t requested_count() const;
+
+    uint32_t unique_count() const;
+
+    const std::vector<VkPipelineCreationFeedbackEXT> &feedback() const;
+
+private:
+    std::vector<PipelineDescription> _descriptions;
+    std::map<std::vector<uint64_t>, uint32_t> _lookup;
+    uint32_t _requested {0};
+
+    std::vector<VkPipeline> _pipelines;
+    std::vector<VkPipelineCreationFeedbackEXT> _feedback;
+};
+
+
+#endif //VKENGINE_VK_PIPELINE_BATCH_H
@@ -0,0 +1,125 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_pipeline_cache.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+// The header every driver must put at the start of its cache data (see VkPipelineCacheHeaderVersionOne)
+static bool header_matches(const std::vector<char> &data, const VkPhysicalDeviceProperties &properties) {
+    const size_t headerSize = 16 + VK_UUID_SIZE;
+    if (data.size() < headerSize){
+        return false;
+    }
+
+    uint32_t length, version, vendorID, deviceID;
+    memcpy(&length, data.data() + 0, sizeof(uint32_t));
+    memcpy(&version, data.data() + 4, sizeof(uint32_t));
+    memcpy(&vendorID, data.data() + 8, sizeof(uint32_t));
+    memcpy(&deviceID, data.data() + 12, sizeof(uint32_t));
+
+    if (length < headerSize || version != VK_PIPELINE_CACHE_HEADER_VERSION_ONE){
+        return false;
+    }
+    if (vendorID != properties.vendorID || deviceID != properties.deviceID){
+        return false;
+    }
+    // A driver update changes the UUID, old blobs would just be thrown away by the driver anyway
+    return memcmp(data.data() + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void PipelineCache::init(VkDevice device, const VkPhysicalDeviceProperties &properties, const std::string &path) {
+    _device = device;
+    _path = path;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<char> data;
+    if (!_path.empty()){
+        FILE *file = fopen(_path.c_str(), "rb");
+        if (file){
+            fseek(file, 0, SEEK_END);
+            long size = ftell(file);
+            fseek(file, 0, SEEK_SET);
+            if (size > 0){
+                data.resize((size_t)size);
+                if (fread(data.data(), 1, data.size(), file) != data.size()){
+                    data.clear();
+                }
+            }
+            fclose(file);
+        }
+    }
+
+    if (!data.empty() && !header_matches(data, properties)){
+        printf("PIPELINE CACHE %s DOES NOT MATCH THIS DEVICE, STARTING COLD\n", _path.c_str());
+        data.clear();
+    }
+
+    VkPipelineCacheCreateInfo cacheInfo = {};
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.pNext = nullptr;
+    cacheInfo.initialDataSize = data.size();
+    cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+    if (vkCreatePipelineCache(_device, &cacheInfo, nullptr, &_cache) != VK_SUCCESS){
+        // Don't let a bad blob stop us, just start over with an empty cache
+        cacheInfo.initialDataSize = 0;
+        cacheInfo.pInitialData = nullptr;
+        data.clear();
+        if (vkCreatePipelineCache(_device, &cacheInfo, nullptr, &_cache) != VK_SUCCESS){
+            _cache = VK_NULL_HANDLE;
+        }
+    }
+
+    _warm = !data.empty();
+    _loadedBytes = data.size();
+    _loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool PipelineCache::save() {
+    if (_cache == VK_NULL_HANDLE || _path.empty()){
+        return false;
+    }
+
+    size_t size = 0;
+    if (vkGetPipelineCacheData(_device, _cache, &size, nullptr) != VK_SUCCESS || size == 0){
+        return false;
+    }
+    std::vector<char> data(size);
+    if (vkGetPipelineCacheData(_device, _cache, &size, data.data()) != VK_SUCCESS){
+        return false;
+    }
+
+    std::string tempPath = _path + ".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if (!file){
+        printf("FAILED TO WRITE PIPELINE CACHE %s!\n", tempPath.c_str());
+        return false;
+    }
+
+    bool written = fwrite(data.data(), 1, size, file) == size;
+    // Make sure the data is on disk before the rename makes it visible
+    written = written && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    fclose(file);
+
+    if (!written || rename(tempPath.c_str(), _path.c_str()) != 0){
+        printf("FAILED TO WRITE PIPELINE CACHE %s!\n", _path.c_str());
+        remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+void PipelineCache::destroy() {
+    if (_cache != VK_NULL_HANDLE){
+        vkDestroyPipelineCache(_device, _cache, nullptr);
+        _cache = VK_NULL_HANDLE;
+    }
+}
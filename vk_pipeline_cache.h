@@ -0,0 +1,35 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_PIPELINE_CACHE_H
+#define VKENGINE_VK_PIPELINE_CACHE_H
+
+#include "vk_types.h"
+#include <string>
+
+// VkPipelineCache that survives between runs
+class PipelineCache {
+public:
+    VkPipelineCache _cache {VK_NULL_HANDLE};
+
+    // True when the file existed and matched this device, i.e. we're starting warm
+    bool _warm {false};
+    size_t _loadedBytes {0};
+    double _loadMs {0.0};
+
+    // Seeds the cache from path if its header matches the device, starts empty otherwise
+    void init(VkDevice device, const VkPhysicalDeviceProperties &properties, const std::string &path);
+
+    // Writes the cache to a temp file next to path and renames it over, so a crash never leaves half a cache
+    bool save();
+
+    void destroy();
+
+private:
+    VkDevice _device {VK_NULL_HANDLE};
+    std::string _path;
+};
+
+
+#endif //VKENGINE_VK_PIPELINE_CACHE_H
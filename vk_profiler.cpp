@@ -0,0 +1,294 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_profiler.h"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+namespace {
+    enum class EventType : uint8_t {
+        Zone,
+        GpuZone,
+        Counter,
+    };
+
+    struct Event {
+        const char *_name;
+        uint64_t _start;
+        uint64_t _end;
+        double _value;
+        EventType _type;
+    };
+
+    // A long capture shouldn't take the process down with it, past this a thread's events are dropped
+    constexpr size_t MAX_EVENTS_PER_THREAD = 1u << 20;
+
+    // Every recording thread appends to its own buffer, the lock is only ever contended by the writer
+    struct ThreadBuffer {
+        std::mutex _mutex;
+        std::vector<Event> _events;
+        uint32_t _tid;
+        std::string _name;
+        uint64_t _dropped {0};
+    };
+
+    std::mutex g_internMutex;
+    // Nodes don't move, so the c_str() pointers stay valid
+    std::unordered_set<std::string> g_interned;
+
+    std::mutex g_buffersMutex;
+    // Never freed, a thread may exit while its events still have to be written
+    std::vector<std::unique_ptr<ThreadBuffer>> g_buffers;
+    thread_local ThreadBuffer *t_buffer = nullptr;
+
+    const std::chrono::steady_clock::time_point g_epoch = std::chrono::steady_clock::now();
+
+    // The GPU track's tid, threads count up from 1
+    constexpr uint32_t GPU_TID = 0;
+
+    ThreadBuffer &thread_buffer() {
+        if (!t_buffer){
+            std::lock_guard<std::mutex> lock(g_buffersMutex);
+            g_buffers.push_back(std::make_unique<ThreadBuffer>());
+            t_buffer = g_buffers.back().get();
+            t_buffer->_tid = (uint32_t)g_buffers.size();
+        }
+        return *t_buffer;
+    }
+
+    void record(const Event &event) {
+        ThreadBuffer &buffer = thread_buffer();
+        std::lock_guard<std::mutex> lock(buffer._mutex);
+        if (buffer._events.size() >= MAX_EVENTS_PER_THREAD){
+            buffer._dropped++;
+            return;
+        }
+        buffer._events.push_back(event);
+    }
+
+    // Trace names come from literals and __func__, only quotes and backslashes would break the JSON
+    void write_name(FILE *out, const char *name) {
+        fputc('"', out);
+        for (const char *c = name; *c; c++){
+            if (*c == '"' || *c == '\\') fputc('\\', out);
+            fputc(*c, out);
+        }
+        fputc('"', out);
+    }
+}
+
+void vkprofile::start() {
+    {
+        std::lock_guard<std::mutex> lock(g_buffersMutex);
+        for (auto &buffer : g_buffers){
+            std::lock_guard<std::mutex> bufferLock(buffer->_mutex);
+            buffer->_events.clear();
+            buffer->_dropped = 0;
+        }
+    }
+    g_enabled.store(true, std::memory_order_relaxed);
+}
+
+void vkprofile::stop() {
+    g_enabled.store(false, std::memory_order_relaxed);
+}
+
+uint64_t vkprofile::now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_epoch).count();
+}
+
+void vkprofile::zone(const char *name, uint64_t startNs, uint64_t endNs) {
+    record({name, startNs, endNs, 0.0, EventType::Zone});
+}
+
+void vkprofile::gpu_zone(const char *name, uint64_t startNs, uint64_t endNs) {
+    if (!enabled()) return;
+    record({name, startNs, endNs, 0.0, EventType::GpuZone});
+}
+
+void vkprofile::counter(const char *name, double value) {
+    if (!enabled()) return;
+    uint64_t now = now_ns();
+    record({name, now, now, value, EventType::Counter});
+}
+
+void vkprofile::set_thread_name(const char *name) {
+    ThreadBuffer &buffer = thread_buffer();
+    std::lock_guard<std::mutex> lock(buffer._mutex);
+    buffer._name = name;
+}
+
+const char *vkprofile::intern(const std::string &name) {
+    std::lock_guard<std::mutex> lock(g_internMutex);
+    return g_interned.insert(name).first->c_str();
+}
+
+bool vkprofile::write_chrome_trace(const std::string &path) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out){
+        printf("FAILED TO OPEN TRACE OUTPUT %s!\n", path.c_str());
+        return false;
+    }
+
+    size_t eventCount = 0;
+    uint64_t dropped = 0;
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"GPU\"}}", GPU_TID);
+
+    std::lock_guard<std::mutex> lock(g_buffersMutex);
+    for (auto &buffer : g_buffers){
+        std::lock_guard<std::mutex> bufferLock(buffer->_mutex);
+        dropped += buffer->_dropped;
+
+        fprintf(out, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": ", buffer->_tid);
+        if (buffer->_name.empty()){
+            fprintf(out, "\"thread %u\"}}", buffer->_tid);
+        } else {
+            write_name(out, buffer->_name.c_str());
+            fprintf(out, "}}");
+        }
+
+        // Chrome wants microseconds, fractions keep the nanoseconds
+        for (const Event &event : buffer->_events){
+            fprintf(out, ",\n{\"name\": ");
+            write_name(out, event._name);
+            if (event._type == EventType::Counter){
+                fprintf(out, ", \"ph\": \"C\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"args\": {\"value\": %.17g}}",
+                        buffer->_tid, event._start / 1000.0, event._value);
+            } else {
+                fprintf(out, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}",
+                        event._type == EventType::GpuZone ? "gpu" : "cpu",
+                        event._type == EventType::GpuZone ? GPU_TID : buffer->_tid,
+                        event._start / 1000.0, (event._end - event._start) / 1000.0);
+            }
+            eventCount++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    printf("TRACE: %zu events written to %s", eventCount, path.c_str());
+    if (dropped != 0){
+        printf(", %llu dropped", (unsigned long long)dropped);
+    }
+    printf("\n");
+    return true;
+}
+
+void GpuProfiler::init(VkDevice device, uint32_t frameCount, float timestampPeriod, uint64_t timestampMask) {
+    _device = device;
+    _timestampPeriod = timestampPeriod;
+    _timestampMask = timestampMask;
+    if (timestampPeriod == 0.0f){
+        return;
+    }
+
+    VkQueryPoolCreateInfo queryPoolInfo = {};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.pNext = nullptr;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = _maxZones * 2;
+
+    _frames.resize(frameCount);
+    for (FrameQueries &frame : _frames){
+        VK_CHECK(vkCreateQueryPool(_device, &queryPoolInfo, nullptr, &frame._pool));
+        frame._names.resize(_maxZones);
+    }
+}
+
+void GpuProfiler::destroy() {
+    for (FrameQueries &frame : _frames){
+        vkDestroyQueryPool(_device, frame._pool, nullptr);
+    }
+    _frames.clear();
+    _current = nullptr;
+}
+
+void GpuProfiler::begin_frame(VkCommandBuffer cmd, uint32_t frameIndex) {
+    _current = nullptr;
+    if (_frames.empty()){
+        return;
+    }
+
+    FrameQueries &frame = _frames[frameIndex];
+    collect(frame);
+
+    // Checked once per frame so a capture starting or stopping mid frame can't leave a zone half written
+    if (!vkprofile::enabled()){
+        return;
+    }
+    vkCmdResetQueryPool(cmd, frame._pool, 0, _maxZones * 2);
+    frame._used = 0;
+    frame._recorded = true;
+    _current = &frame;
+}
+
+void GpuProfiler::submitted(uint32_t frameIndex) {
+    if (_current && _current == &_frames[frameIndex]){
+        _current->_submitNs = vkprofile::now_ns();
+    }
+    _current = nullptr;
+}
+
+uint32_t GpuProfiler::begin_zone(VkCommandBuffer cmd, const char *name) {
+    if (!_current || _current->_used == _maxZones){
+        return ~0u;
+    }
+    uint32_t zone = _current->_used++;
+    _current->_names[zone] = name;
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, _current->_pool, zone * 2);
+    return zone;
+}
+
+void GpuProfiler::end_zone(VkCommandBuffer cmd, uint32_t zone) {
+    if (zone == ~0u || !_current){
+        return;
+    }
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, _current->_pool, zone * 2 + 1);
+}
+
+void GpuProfiler::collect(FrameQueries &frame) {
+    if (!frame._recorded){
+        return;
+    }
+    frame._recorded = false;
+    if (frame._used == 0 || frame._submitNs == 0){
+        return;
+    }
+
+    // The slot's frame is done, so every timestamp it wrote is available
+    std::vector<uint64_t> timestamps(frame._used * 2);
+    VkResult result = vkGetQueryPoolResults(_device, frame._pool, 0, frame._used * 2,
+                                            timestamps.size() * sizeof(uint64_t), timestamps.data(),
+                                            sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (result != VK_SUCCESS){
+        return;
+    }
+
+    // No calibrated timestamps, so the GPU clock is lined up with the CPU's at submit. The GPU can't
+    // start a frame before it was submitted, an offset that says otherwise gets moved forward.
+    uint64_t first = timestamps[0] & _timestampMask;
+    for (uint32_t i = 0; i < frame._used; i++){
+        first = std::min(first, timestamps[i * 2] & _timestampMask);
+    }
+    double firstNs = (double)first * _timestampPeriod;
+    if (!_anchored || firstNs + _offsetNs < (double)frame._submitNs){
+        _offsetNs = (double)frame._submitNs - firstNs;
+        _anchored = true;
+    }
+
+    for (uint32_t i = 0; i < frame._used; i++){
+        uint64_t begin = timestamps[i * 2] & _timestampMask;
+        uint64_t end = timestamps[i * 2 + 1] & _timestampMask;
+        if (end < begin){
+            continue;
+        }
+        vkprofile::gpu_zone(frame._names[i], (uint64_t)((double)begin * _timestampPeriod + _offsetNs),
+                            (uint64_t)((double)end * _timestampPeriod + _offsetNs));
+    }
+}
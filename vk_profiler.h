@@ -0,0 +1,151 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_PROFILER_H
+#define VKENGINE_VK_PROFILER_H
+
+#include "vk_types.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// CPU zones, GPU zones and counters for the whole process, written out as Chrome trace events
+// (chrome://tracing, Perfetto). Names are kept as pointers, so they have to be string literals or __func__.
+namespace vkprofile {
+    // Checked first by everything below, a disabled zone is this one relaxed load
+    inline std::atomic<bool> g_enabled {false};
+
+    inline bool enabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+    // Drops whatever was recorded before and starts recording
+    void start();
+
+    // Keeps what was recorded so it can still be written
+    void stop();
+
+    // Nanoseconds on the trace's clock
+    uint64_t now_ns();
+
+    void zone(const char *name, uint64_t startNs, uint64_t endNs);
+
+    // Shown on a track of its own, times already converted to the trace's clock
+    void gpu_zone(const char *name, uint64_t startNs, uint64_t endNs);
+
+    void counter(const char *name, double value);
+
+    // Names the calling thread's track
+    void set_thread_name(const char *name);
+
+    // A copy of name that lives as long as the process, for names that aren't literals
+    const char *intern(const std::string &name);
+
+    // Every thread's events so far. Threads recording while this runs may or may not make it in.
+    bool write_chrome_trace(const std::string &path);
+}
+
+// Times its own scope
+class ProfileZone {
+public:
+    explicit ProfileZone(const char *name) : _name(vkprofile::enabled() ? name : nullptr) {
+        if (_name) _start = vkprofile::now_ns();
+    }
+
+    ~ProfileZone() {
+        if (_name) vkprofile::zone(_name, _start, vkprofile::now_ns());
+    }
+
+    ProfileZone(const ProfileZone &) = delete;
+    ProfileZone &operator=(const ProfileZone &) = delete;
+
+private:
+    const char *_name;
+    uint64_t _start {0};
+};
+
+// Back to back zones, each mark() closes the phase that ran since the last one
+class ProfilePhases {
+public:
+    ProfilePhases() : _start(vkprofile::enabled() ? vkprofile::now_ns() : 0) {}
+
+    void mark(const char *name) {
+        if (!vkprofile::enabled()) return;
+        uint64_t now = vkprofile::now_ns();
+        if (_start != 0) vkprofile::zone(name, _start, now);
+        _start = now;
+    }
+
+private:
+    uint64_t _start;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_ZONE(__func__)
+
+// GPU zones from timestamp queries, a pool per frame in flight. A slot's results are read back when the
+// slot comes around again, so they show up in the trace a few frames late. Does nothing without timestamps.
+class GpuProfiler {
+public:
+    // Zones per frame, anything past it is dropped
+    uint32_t _maxZones {64};
+
+    // timestampPeriod 0 means the queue can't write timestamps
+    void init(VkDevice device, uint32_t frameCount, float timestampPeriod, uint64_t timestampMask);
+
+    void destroy();
+
+    // Start of the frame's command buffer, outside any render pass. The frame that last used frameIndex has to be done.
+    void begin_frame(VkCommandBuffer cmd, uint32_t frameIndex);
+
+    // Right after the frame's submit, anchors its timestamps to the CPU clock
+    void submitted(uint32_t frameIndex);
+
+    // Index to hand to end_zone(), ~0u when the zone isn't recorded
+    uint32_t begin_zone(VkCommandBuffer cmd, const char *name);
+
+    void end_zone(VkCommandBuffer cmd, uint32_t zone);
+
+private:
+    struct FrameQueries {
+        VkQueryPool _pool {VK_NULL_HANDLE};
+        std::vector<const char *> _names;
+        uint32_t _used {0};
+        uint64_t _submitNs {0};
+        bool _recorded {false};
+    };
+
+    void collect(FrameQueries &frame);
+
+    VkDevice _device {VK_NULL_HANDLE};
+    float _timestampPeriod {0.0f};
+    uint64_t _timestampMask {0};
+    std::vector<FrameQueries> _frames;
+    FrameQueries *_current {nullptr};
+
+    // GPU ticks to trace nanoseconds, re-anchored whenever a frame would seem to start before its submit
+    double _offsetNs {0.0};
+    bool _anchored {false};
+};
+
+// Times its own scope on the GPU
+class GpuProfileZone {
+public:
+    GpuProfileZone(GpuProfiler &profiler, VkCommandBuffer cmd, const char *name)
+            : _profiler(profiler), _cmd(cmd), _zone(profiler.begin_zone(cmd, name)) {}
+
+    ~GpuProfileZone() { _profiler.end_zone(_cmd, _zone); }
+
+    GpuProfileZone(const GpuProfileZone &) = delete;
+    GpuProfileZone &operator=(const GpuProfileZone &) = delete;
+
+private:
+    GpuProfiler &_profiler;
+    VkCommandBuffer _cmd;
+    uint32_t _zone;
+};
+
+
+#endif //VKENGINE_VK_PROFILER_H
@@ -0,0 +1,855 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_render_graph.h"
+#include "vk_initalizers.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+struct AccessInfo {
+    VkImageLayout _layout;
+    VkPipelineStageFlags _stages;
+    VkAccessFlags _access;
+    bool _write;
+    bool _attachment;
+    VkImageUsageFlags _usage;
+};
+
+AccessInfo access_info(GraphAccess access) {
+    switch (access){
+        case GraphAccess::ColorWrite:
+            return {VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                    VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, true, true,
+                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT};
+        case GraphAccess::DepthWrite:
+            return {VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                    VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, true, true,
+                    VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT};
+        case GraphAccess::DepthRead:
+            return {VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+                    VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, false, true,
+                    VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT};
+        case GraphAccess::Sampled:
+            return {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                    VK_ACCESS_SHADER_READ_BIT, false, false, VK_IMAGE_USAGE_SAMPLED_BIT};
+        case GraphAccess::TransferRead:
+            return {VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_READ_BIT, false, false, VK_IMAGE_USAGE_TRANSFER_SRC_BIT};
+        case GraphAccess::TransferWrite:
+            return {VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_WRITE_BIT, true, false, VK_IMAGE_USAGE_TRANSFER_DST_BIT};
+    }
+    abort();
+}
+
+// Only writes need to be made available, reads have nothing to flush
+constexpr VkAccessFlags WRITE_ACCESS = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+                                       VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+VkImageAspectFlags format_aspect(VkFormat format) {
+    switch (format){
+        case VK_FORMAT_D16_UNORM:
+        case VK_FORMAT_X8_D24_UNORM_PACK32:
+        case VK_FORMAT_D32_SFLOAT:
+            return VK_IMAGE_ASPECT_DEPTH_BIT;
+        case VK_FORMAT_D24_UNORM_S8_UINT:
+        case VK_FORMAT_D32_SFLOAT_S8_UINT:
+            return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+        default:
+            return VK_IMAGE_ASPECT_COLOR_BIT;
+    }
+}
+
+}
+
+void RenderGraph::init(VkDevice device, GpuAllocator &allocator) {
+    _device = device;
+    _allocator = &allocator;
+}
+
+void RenderGraph::reset() {
+    for (auto &entry : _framebuffers){
+        vkDestroyFramebuffer(_device, entry.second, nullptr);
+    }
+    _framebuffers.clear();
+
+    for (Resource &resource : _resources){
+        if (resource._imported){
+            continue;
+        }
+        if (!resource._views.empty()){
+            vkDestroyImageView(_device, resource._views[0], nullptr);
+            vkDestroyImage(_device, resource._images[0], nullptr);
+        }
+    }
+    for (MemorySlot &slot : _memorySlots){
+        _allocator->free(slot._allocation);
+    }
+
+    _memorySlots.clear();
+    _resources.clear();
+    _passes.clear();
+    _order.clear();
+    _compiled.clear();
+    _stats = {};
+}
+
+void RenderGraph::destroy() {
+    reset();
+    for (auto &entry : _renderPasses){
+        vkDestroyRenderPass(_device, entry.second, nullptr);
+    }
+    _renderPasses.clear();
+}
+
+GraphResource RenderGraph::import_image(const char *name, const std::vector<VkImage> &images, const std::vector<VkImageView> &views,
+                                        VkFormat format, VkExtent2D extent, VkImageLayout initialLayout,
+                                        VkImageLayout finalLayout, VkPipelineStageFlags initialStages) {
+    Resource resource;
+    resource._name = name;
+    resource._imported = true;
+    resource._format = format;
+    resource._extent = extent;
+    resource._aspect = format_aspect(format);
+    resource._images = images;
+    resource._views = views;
+    resource._initialLayout = initialLayout;
+    resource._finalLayout = finalLayout;
+    resource._initialStages = initialStages;
+
+    _resources.push_back(std::move(resource));
+    return (GraphResource)_resources.size() - 1;
+}
+
+GraphResource RenderGraph::create_image(const char *name, VkFormat format, VkExtent2D extent) {
+    Resource resource;
+    resource._name = name;
+    resource._format = format;
+    resource._extent = extent;
+    resource._aspect = format_aspect(format);
+
+    _resources.push_back(std::move(resource));
+    return (GraphResource)_resources.size() - 1;
+}
+
+GraphPassId RenderGraph::add_pass(const char *name, bool graphics, GraphExecute execute) {
+    GraphPass pass;
+    pass._name = name;
+    pass._traceName = vkprofile::intern(pass._name);
+    pass._graphics = graphics;
+    pass._execute = std::move(execute);
+
+    _passes.push_back(std::move(pass));
+    return (GraphPassId)_passes.size() - 1;
+}
+
+void RenderGraph::add_use(GraphPassId pass, GraphResource resource, GraphAccess access, const VkClearValue *clear) {
+    // Attachments only make sense inside a render pass, everything else goes through barriers
+    if (access_info(access)._attachment && !_passes[pass]._graphics){
+        printf("RENDER GRAPH: %s USES %s AS AN ATTACHMENT OUTSIDE A GRAPHICS PASS!\n",
+               _passes[pass]._name.c_str(), _resources[resource]._name.c_str());
+        abort();
+    }
+
+    GraphUse use;
+    use._resource = resource;
+    use._access = access;
+    if (clear){
+        use._clear = true;
+        use._clearValue = *clear;
+    }
+    _passes[pass]._uses.push_back(use);
+}
+
+void RenderGraph::write_color(GraphPassId pass, GraphResource resource, const VkClearValue *clear) {
+    add_use(pass, resource, GraphAccess::ColorWrite, clear);
+}
+
+void RenderGraph::write_depth(GraphPassId pass, GraphResource resource, const VkClearValue *clear) {
+    add_use(pass, resource, GraphAccess::DepthWrite, clear);
+}
+
+void RenderGraph::read_depth(GraphPassId pass, GraphResource resource) {
+    add_use(pass, resource, GraphAccess::DepthRead, nullptr);
+}
+
+void RenderGraph::sample(GraphPassId pass, GraphResource resource) {
+    add_use(pass, resource, GraphAccess::Sampled, nullptr);
+}
+
+void RenderGraph::transfer_read(GraphPassId pass, GraphResource resource) {
+    add_use(pass, resource, GraphAccess::TransferRead, nullptr);
+}
+
+void RenderGraph::transfer_write(GraphPassId pass, GraphResource resource) {
+    add_use(pass, resource, GraphAccess::TransferWrite, nullptr);
+}
+
+void RenderGraph::set_side_effect(GraphPassId pass) {
+    _passes[pass]._sideEffect = true;
+}
+
+void RenderGraph::set_clear_value(GraphPassId pass, GraphResource resource, const VkClearValue &value) {
+    for (GraphUse &use : _passes[pass]._uses){
+        if (use._resource == resource){
+            use._clearValue = value;
+        }
+    }
+}
+
+void RenderGraph::compile() {
+    cull_passes();
+    order_passes();
+    allocate_transients();
+    compute_barriers();
+
+    _stats._passes = (uint32_t)_order.size();
+    _stats._culledPasses = (uint32_t)(_passes.size() - _order.size());
+}
+
+void RenderGraph::cull_passes() {
+    // Walk backwards from the passes whose output leaves the frame, anything they don't
+    // (transitively) read from is dead. A clear or full overwrite ends the need for older contents.
+    std::vector<bool> needed(_resources.size(), false);
+
+    for (size_t i = _passes.size(); i-- > 0;){
+        GraphPass &pass = _passes[i];
+
+        bool live = pass._sideEffect;
+        for (const GraphUse &use : pass._uses){
+            if (access_info(use._access)._write && (_resources[use._resource]._imported || needed[use._resource])){
+                live = true;
+            }
+        }
+
+        pass._culled = !live;
+        if (!live){
+            continue;
+        }
+
+        for (const GraphUse &use : pass._uses){
+            AccessInfo info = access_info(use._access);
+            bool overwrites = use._clear || use._access == GraphAccess::TransferWrite;
+            if (info._write && overwrites){
+                needed[use._resource] = false;
+            }
+        }
+        for (const GraphUse &use : pass._uses){
+            AccessInfo info = access_info(use._access);
+            bool overwrites = use._clear || use._access == GraphAccess::TransferWrite;
+            if (!info._write || !overwrites){
+                needed[use._resource] = true;
+            }
+        }
+    }
+}
+
+void RenderGraph::order_passes() {
+    // Read after write, write after read and write after write all make an edge to the earlier pass
+    std::vector<std::vector<GraphPassId>> dependencies(_passes.size());
+    std::vector<std::vector<GraphPassId>> dependents(_passes.size());
+    std::vector<int> lastWriter(_resources.size(), -1);
+    std::vector<std::vector<GraphPassId>> readers(_resources.size());
+
+    for (GraphPassId id = 0; id < _passes.size(); id++){
+        const GraphPass &pass = _passes[id];
+        if (pass._culled){
+            continue;
+        }
+
+        std::vector<GraphPassId> &deps = dependencies[id];
+        for (const GraphUse &use : pass._uses){
+            if (lastWriter[use._resource] >= 0){
+                deps.push_back((GraphPassId)lastWriter[use._resource]);
+            }
+            if (access_info(use._access)._write){
+                deps.insert(deps.end(), readers[use._resource].begin(), readers[use._resource].end());
+            }
+        }
+        std::sort(deps.begin(), deps.end());
+        deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+        deps.erase(std::remove(deps.begin(), deps.end(), id), deps.end());
+        for (GraphPassId dep : deps){
+            dependents[dep].push_back(id);
+        }
+
+        for (const GraphUse &use : pass._uses){
+            if (access_info(use._access)._write){
+                lastWriter[use._resource] = (int)id;
+                readers[use._resource].clear();
+            } else {
+                readers[use._resource].push_back(id);
+            }
+        }
+    }
+
+    // Topological sort that prefers running a pass right after what it consumes, which keeps
+    // transient lifetimes short and gives aliasing more room. Ties keep declaration order.
+    std::vector<uint32_t> waiting(_passes.size(), 0);
+    std::vector<int> position(_passes.size(), -1);
+    std::vector<GraphPassId> ready;
+    for (GraphPassId id = 0; id < _passes.size(); id++){
+        if (_passes[id]._culled){
+            continue;
+        }
+        waiting[id] = (uint32_t)dependencies[id].size();
+        if (waiting[id] == 0){
+            ready.push_back(id);
+        }
+    }
+
+    _order.clear();
+    while (!ready.empty()){
+        size_t best = 0;
+        int bestScore = -2;
+        for (size_t i = 0; i < ready.size(); i++){
+            int score = -1;
+            for (GraphPassId dep : dependencies[ready[i]]){
+                score = std::max(score, position[dep]);
+            }
+            if (score > bestScore || (score == bestScore && ready[i] < ready[best])){
+                best = i;
+                bestScore = score;
+            }
+        }
+
+        GraphPassId id = ready[best];
+        ready.erase(ready.begin() + best);
+        position[id] = (int)_order.size();
+        _order.push_back(id);
+
+        for (GraphPassId dependent : dependents[id]){
+            if (--waiting[dependent] == 0){
+                ready.push_back(dependent);
+            }
+        }
+    }
+}
+
+void RenderGraph::allocate_transients() {
+    for (uint32_t position = 0; position < _order.size(); position++){
+        for (const GraphUse &use : _passes[_order[position]]._uses){
+            Resource &resource = _resources[use._resource];
+            if (!resource._used){
+                resource._firstUse = position;
+            }
+            resource._used = true;
+            resource._lastUse = position;
+            resource._usage |= access_info(use._access)._usage;
+        }
+    }
+
+    std::vector<GraphResource> transients;
+    std::vector<VkMemoryRequirements> requirements(_resources.size());
+    for (GraphResource id = 0; id < _resources.size(); id++){
+        Resource &resource = _resources[id];
+        if (resource._imported || !resource._used){
+            continue;
+        }
+
+        VkExtent3D extent = {resource._extent.width, resource._extent.height, 1};
+        VkImageCreateInfo imageInfo = vkinit::image_create_info(resource._format, resource._usage, extent);
+
+        VkImage image;
+        VK_CHECK(vkCreateImage(_device, &imageInfo, nullptr, &image));
+        vkGetImageMemoryRequirements(_device, image, &requirements[id]);
+        resource._images = {image};
+
+        transients.push_back(id);
+        _stats._unaliasedBytes += requirements[id].size;
+    }
+    _stats._transientImages = (uint32_t)transients.size();
+
+    // Biggest first, so smaller images fill in around the ones that set a slot's size
+    std::sort(transients.begin(), transients.end(), [&](GraphResource a, GraphResource b){
+        return requirements[a].size > requirements[b].size;
+    });
+
+    for (GraphResource id : transients){
+        Resource &resource = _resources[id];
+
+        uint32_t slotIndex = (uint32_t)_memorySlots.size();
+        for (uint32_t i = 0; i < _memorySlots.size(); i++){
+            MemorySlot &slot = _memorySlots[i];
+            if ((slot._requirements.memoryTypeBits & requirements[id].memoryTypeBits) == 0){
+                continue;
+            }
+            bool overlaps = false;
+            for (GraphResource other : slot._resources){
+                const Resource &otherResource = _resources[other];
+                if (!(otherResource._lastUse < resource._firstUse || resource._lastUse < otherResource._firstUse)){
+                    overlaps = true;
+                    break;
+                }
+            }
+            if (!overlaps){
+                slotIndex = i;
+                break;
+            }
+        }
+
+        if (slotIndex == _memorySlots.size()){
+            MemorySlot slot;
+            slot._requirements = requirements[id];
+            _memorySlots.push_back(slot);
+        } else {
+            VkMemoryRequirements &slotRequirements = _memorySlots[slotIndex]._requirements;
+            slotRequirements.size = std::max(slotRequirements.size, requirements[id].size);
+            slotRequirements.alignment = std::max(slotRequirements.alignment, requirements[id].alignment);
+            slotRequirements.memoryTypeBits &= requirements[id].memoryTypeBits;
+        }
+
+        _memorySlots[slotIndex]._resources.push_back(id);
+        resource._memorySlot = slotIndex;
+    }
+
+    for (MemorySlot &slot : _memorySlots){
+        if (!_allocator->allocate(slot._requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, &slot._allocation)){
+            printf("FAILED TO ALLOCATE RENDER GRAPH MEMORY!\n");
+            abort();
+        }
+        _stats._transientBytes += slot._requirements.size;
+
+        // Lifetime order, each image inherits the hazards of the one that used the memory before it
+        std::sort(slot._resources.begin(), slot._resources.end(), [&](GraphResource a, GraphResource b){
+            return _resources[a]._firstUse < _resources[b]._firstUse;
+        });
+
+        for (GraphResource id : slot._resources){
+            Resource &resource = _resources[id];
+            VK_CHECK(vkBindImageMemory(_device, resource._images[0], slot._allocation._memory, slot._allocation._offset));
+
+            VkImageViewCreateInfo viewInfo = vkinit::imageview_create_info(resource._format, resource._images[0], resource._aspect);
+            VkImageView view;
+            VK_CHECK(vkCreateImageView(_device, &viewInfo, nullptr, &view));
+            resource._views = {view};
+        }
+    }
+}
+
+const GraphUse *RenderGraph::next_use(GraphResource resource, uint32_t position, const GraphPass **nextPass) const {
+    for (uint32_t i = position + 1; i < _order.size(); i++){
+        const GraphPass &pass = _passes[_order[i]];
+        for (const GraphUse &use : pass._uses){
+            if (use._resource == resource){
+                *nextPass = &pass;
+                return &use;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void RenderGraph::compute_barriers() {
+    std::vector<ResourceState> states(_resources.size());
+
+    for (GraphResource id = 0; id < _resources.size(); id++){
+        Resource &resource = _resources[id];
+        ResourceState &state = states[id];
+
+        if (resource._imported){
+            state._layout = resource._initialLayout;
+            state._writeStages = resource._initialStages;
+            state._hasContents = resource._initialLayout != VK_IMAGE_LAYOUT_UNDEFINED;
+            continue;
+        }
+        if (!resource._used){
+            continue;
+        }
+
+        // The memory was last touched by the previous image in the slot, or by the slot's last image
+        // in the previous frame. Its contents are garbage either way but the hazard is real.
+        const MemorySlot &slot = _memorySlots[resource._memorySlot];
+        auto it = std::find(slot._resources.begin(), slot._resources.end(), id);
+        GraphResource previous = it == slot._resources.begin() ? slot._resources.back() : *(it - 1);
+
+        const Resource &previousResource = _resources[previous];
+        for (const GraphUse &use : _passes[_order[previousResource._lastUse]]._uses){
+            if (use._resource == previous){
+                AccessInfo info = access_info(use._access);
+                state._writeStages |= info._stages;
+                state._writeAccess |= info._access & WRITE_ACCESS;
+            }
+        }
+    }
+
+    _compiled.clear();
+    for (uint32_t position = 0; position < _order.size(); position++){
+        GraphPass &pass = _passes[_order[position]];
+
+        CompiledPass compiled;
+        compiled._pass = _order[position];
+
+        // Uses outside a render pass, sync with a barrier recorded before the pass
+        for (const GraphUse &use : pass._uses){
+            AccessInfo info = access_info(use._access);
+            if (info._attachment){
+                continue;
+            }
+
+            ResourceState &state = states[use._resource];
+            VkPipelineStageFlags previousStages = state._writeStages | state._readStages;
+
+            bool synced;
+            if (info._write){
+                synced = previousStages == 0 ||
+                         (state._readStages == 0 && (state._visibleStages & info._stages) == info._stages);
+            } else {
+                synced = state._writeAccess == 0 || (state._visibleStages & info._stages) == info._stages;
+            }
+
+            if (state._layout != info._layout || !synced){
+                Barrier barrier;
+                barrier._resource = use._resource;
+                barrier._oldLayout = state._hasContents ? state._layout : VK_IMAGE_LAYOUT_UNDEFINED;
+                barrier._newLayout = info._layout;
+                barrier._srcAccess = state._writeAccess;
+                barrier._dstAccess = info._access;
+                compiled._barriers.push_back(barrier);
+
+                compiled._srcStages |= previousStages != 0 ? previousStages : (VkPipelineStageFlags)VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+                compiled._dstStages |= info._stages;
+                state._visibleStages |= info._stages;
+            }
+
+            state._layout = info._layout;
+            if (info._write){
+                state._writeStages = info._stages;
+                state._writeAccess = info._access & WRITE_ACCESS;
+                state._readStages = 0;
+                state._visibleStages = 0;
+                state._hasContents = true;
+            } else {
+                state._readStages |= info._stages;
+            }
+        }
+
+        if (!compiled._barriers.empty()){
+            _stats._barriers++;
+            _stats._imageBarriers += (uint32_t)compiled._barriers.size();
+        }
+
+        if (pass._graphics){
+            // Attachments, their transitions and the hazards on either side all go into the render pass
+            std::vector<VkAttachmentDescription> attachments;
+            std::vector<VkAttachmentReference> colorRefs;
+            VkAttachmentReference depthRef = {};
+            bool hasDepth = false;
+
+            VkSubpassDependency incoming = {};
+            incoming.srcSubpass = VK_SUBPASS_EXTERNAL;
+            incoming.dstSubpass = 0;
+            VkSubpassDependency outgoing = {};
+            outgoing.srcSubpass = 0;
+            outgoing.dstSubpass = VK_SUBPASS_EXTERNAL;
+
+            pass._attachments.clear();
+            for (uint32_t useIndex = 0; useIndex < pass._uses.size(); useIndex++){
+                const GraphUse &use = pass._uses[useIndex];
+                AccessInfo info = access_info(use._access);
+                if (!info._attachment){
+                    continue;
+                }
+
+                const Resource &resource = _resources[use._resource];
+                ResourceState &state = states[use._resource];
+
+                VkAttachmentDescription attachment = {};
+                attachment.format = resource._format;
+                attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+                if (use._clear){
+                    attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+                } else {
+                    attachment.loadOp = state._hasContents ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+                }
+                attachment.initialLayout = attachment.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD ? state._layout : VK_IMAGE_LAYOUT_UNDEFINED;
+
+                incoming.srcStageMask |= state._writeStages | state._readStages;
+                incoming.srcAccessMask |= state._writeAccess;
+                incoming.dstStageMask |= info._stages;
+                incoming.dstAccessMask |= info._access;
+
+                // The next use decides whether the contents survive and which layout the pass leaves behind.
+                // Handing the image over in the next user's layout saves that user a barrier.
+                const GraphPass *nextPass = nullptr;
+                const GraphUse *next = next_use(use._resource, position, &nextPass);
+                attachment.storeOp = next || resource._imported ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                attachment.finalLayout = info._layout;
+
+                VkPipelineStageFlags handedTo = 0;
+                if (next){
+                    AccessInfo nextInfo = access_info(next->_access);
+                    if (!nextInfo._attachment){
+                        attachment.finalLayout = nextInfo._layout;
+                        outgoing.srcStageMask |= info._stages;
+                        outgoing.srcAccessMask |= info._access & WRITE_ACCESS;
+                        outgoing.dstStageMask |= nextInfo._stages;
+                        outgoing.dstAccessMask |= nextInfo._access;
+                        handedTo = nextInfo._stages;
+                    }
+                } else if (resource._imported && resource._finalLayout != VK_IMAGE_LAYOUT_UNDEFINED){
+                    // Presentation waits on a semaphore, only the layout is left to do
+                    attachment.finalLayout = resource._finalLayout;
+                }
+
+                // Depth and stencil are kept or dropped together
+                attachment.stencilLoadOp = resource._aspect & VK_IMAGE_ASPECT_STENCIL_BIT ? attachment.loadOp : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+                attachment.stencilStoreOp = resource._aspect & VK_IMAGE_ASPECT_STENCIL_BIT ? attachment.storeOp : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+                VkAttachmentReference ref = {};
+                ref.attachment = (uint32_t)attachments.size();
+                ref.layout = info._layout;
+                if (use._access == GraphAccess::ColorWrite){
+                    colorRefs.push_back(ref);
+                } else {
+                    if (hasDepth){
+                        printf("RENDER GRAPH: %s HAS MORE THAN ONE DEPTH ATTACHMENT!\n", pass._name.c_str());
+                        abort();
+                    }
+                    depthRef = ref;
+                    hasDepth = true;
+                }
+                attachments.push_back(attachment);
+                pass._attachments.push_back(useIndex);
+
+                state._layout = attachment.finalLayout;
+                if (info._write){
+                    state._writeStages = info._stages;
+                    state._writeAccess = info._access & WRITE_ACCESS;
+                    state._readStages = 0;
+                    state._visibleStages = handedTo;
+                    state._hasContents = attachment.storeOp == VK_ATTACHMENT_STORE_OP_STORE;
+                } else {
+                    state._readStages |= info._stages;
+                    state._visibleStages |= handedTo;
+                }
+            }
+
+            VkSubpassDescription subpass = {};
+            subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+            subpass.colorAttachmentCount = (uint32_t)colorRefs.size();
+            subpass.pColorAttachments = colorRefs.data();
+            subpass.pDepthStencilAttachment = hasDepth ? &depthRef : nullptr;
+
+            // Nothing before or after to wait on means no dependency at all
+            VkSubpassDependency dependencies[2];
+            uint32_t dependencyCount = 0;
+            if (incoming.srcStageMask != 0){
+                dependencies[dependencyCount++] = incoming;
+            }
+            if (outgoing.dstStageMask != 0){
+                dependencies[dependencyCount++] = outgoing;
+            }
+            _stats._renderPassDependencies += dependencyCount;
+
+            VkRenderPassCreateInfo renderPassInfo = {};
+            renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+            renderPassInfo.attachmentCount = (uint32_t)attachments.size();
+            renderPassInfo.pAttachments = attachments.data();
+            renderPassInfo.subpassCount = 1;
+            renderPassInfo.pSubpasses = &subpass;
+            renderPassInfo.dependencyCount = dependencyCount;
+            renderPassInfo.pDependencies = dependencies;
+
+            pass._renderPass = get_render_pass(renderPassInfo);
+        }
+
+        _compiled.push_back(std::move(compiled));
+    }
+
+    // Imported images that a transfer pass used last still need to get to their final layout
+    CompiledPass tail;
+    tail._pass = (GraphPassId)_passes.size();
+    for (GraphResource id = 0; id < _resources.size(); id++){
+        const Resource &resource = _resources[id];
+        const ResourceState &state = states[id];
+        if (!resource._imported || resource._finalLayout == VK_IMAGE_LAYOUT_UNDEFINED || state._layout == resource._finalLayout){
+            continue;
+        }
+
+        Barrier barrier;
+        barrier._resource = id;
+        barrier._oldLayout = state._layout;
+        barrier._newLayout = resource._finalLayout;
+        barrier._srcAccess = state._writeAccess;
+        barrier._dstAccess = 0;
+        tail._barriers.push_back(barrier);
+
+        VkPipelineStageFlags previousStages = state._writeStages | state._readStages;
+        tail._srcStages |= previousStages != 0 ? previousStages : (VkPipelineStageFlags)VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        tail._dstStages |= VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    }
+    if (!tail._barriers.empty()){
+        _stats._barriers++;
+        _stats._imageBarriers += (uint32_t)tail._barriers.size();
+        _compiled.push_back(std::move(tail));
+    }
+}
+
+VkRenderPass RenderGraph::get_render_pass(const VkRenderPassCreateInfo &info) {
+    std::vector<uint32_t> key;
+    for (uint32_t i = 0; i < info.attachmentCount; i++){
+        const VkAttachmentDescription &attachment = info.pAttachments[i];
+        key.insert(key.end(), {(uint32_t)attachment.format, (uint32_t)attachment.samples, (uint32_t)attachment.loadOp,
+                               (uint32_t)attachment.storeOp, (uint32_t)attachment.stencilLoadOp,
+                               (uint32_t)attachment.stencilStoreOp, (uint32_t)attachment.initialLayout,
+                               (uint32_t)attachment.finalLayout});
+    }
+    const VkSubpassDescription &subpass = info.pSubpasses[0];
+    key.push_back(subpass.colorAttachmentCount);
+    for (uint32_t i = 0; i < subpass.colorAttachmentCount; i++){
+        key.insert(key.end(), {subpass.pColorAttachments[i].attachment, (uint32_t)subpass.pColorAttachments[i].layout});
+    }
+    if (subpass.pDepthStencilAttachment){
+        key.insert(key.end(), {subpass.pDepthStencilAttachment->attachment, (uint32_t)subpass.pDepthStencilAttachment->layout});
+    }
+    key.push_back(~0u);
+    for (uint32_t i = 0; i < info.dependencyCount; i++){
+        const VkSubpassDependency &dependency = info.pDependencies[i];
+        key.insert(key.end(), {dependency.srcSubpass, dependency.dstSubpass, dependency.srcStageMask,
+                               dependency.dstStageMask, dependency.srcAccessMask, dependency.dstAccessMask});
+    }
+
+    auto it = _renderPasses.find(key);
+    if (it != _renderPasses.end()){
+        return it->second;
+    }
+
+    VkRenderPass renderPass;
+    VK_CHECK(vkCreateRenderPass(_device, &info, nullptr, &renderPass));
+    _renderPasses[key] = renderPass;
+    return renderPass;
+}
+
+VkFramebuffer RenderGraph::get_framebuffer(const GraphPass &pass) {
+    const Resource &first = _resources[pass._uses[pass._attachments[0]]._resource];
+
+    std::vector<VkImageView> views;
+    std::vector<uint64_t> key = {(uint64_t)pass._renderPass};
+    for (uint32_t useIndex : pass._attachments){
+        VkImageView attachmentView = view(pass._uses[useIndex]._resource);
+        views.push_back(attachmentView);
+        key.push_back((uint64_t)attachmentView);
+    }
+
+    auto it = _framebuffers.find(key);
+    if (it != _framebuffers.end()){
+        return it->second;
+    }
+
+    VkFramebufferCreateInfo framebufferInfo = {};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.pNext = nullptr;
+    framebufferInfo.renderPass = pass._renderPass;
+    framebufferInfo.attachmentCount = (uint32_t)views.size();
+    framebufferInfo.pAttachments = views.data();
+    framebufferInfo.width = first._extent.width;
+    framebufferInfo.height = first._extent.height;
+    framebufferInfo.layers = 1;
+
+    VkFramebuffer framebuffer;
+    VK_CHECK(vkCreateFramebuffer(_device, &framebufferInfo, nullptr, &framebuffer));
+    _framebuffers[key] = framebuffer;
+    return framebuffer;
+}
+
+void RenderGraph::execute(VkCommandBuffer cmd) {
+    std::vector<VkImageMemoryBarrier> barriers;
+
+    for (const CompiledPass &compiled : _compiled){
+        if (!compiled._barriers.empty()){
+            barriers.clear();
+            for (const Barrier &barrier : compiled._barriers){
+                const Resource &resource = _resources[barrier._resource];
+
+                VkImageMemoryBarrier imageBarrier = {};
+                imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+                imageBarrier.pNext = nullptr;
+                imageBarrier.srcAccessMask = barrier._srcAccess;
+                imageBarrier.dstAccessMask = barrier._dstAccess;
+                imageBarrier.oldLayout = barrier._oldLayout;
+                imageBarrier.newLayout = barrier._newLayout;
+                imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                imageBarrier.image = image(barrier._resource);
+                imageBarrier.subresourceRange.aspectMask = resource._aspect;
+                imageBarrier.subresourceRange.baseMipLevel = 0;
+                imageBarrier.subresourceRange.levelCount = 1;
+                imageBarrier.subresourceRange.baseArrayLayer = 0;
+                imageBarrier.subresourceRange.layerCount = 1;
+                barriers.push_back(imageBarrier);
+            }
+
+            vkCmdPipelineBarrier(cmd, compiled._srcStages, compiled._dstStages, 0, 0, nullptr, 0, nullptr,
+                                 (uint32_t)barriers.size(), barriers.data());
+        }
+
+        // The tail only carries barriers
+        if (compiled._pass == _passes.size()){
+            continue;
+        }
+
+        GraphPass &pass = _passes[compiled._pass];
+        ProfileZone passZone(pass._traceName);
+        // Outside the render pass, a subpass recorded through secondaries can't take inline commands
+        uint32_t gpuZone = _profiler ? _profiler->begin_zone(cmd, pass._traceName) : ~0u;
+        if (!pass._graphics){
+            pass._execute(cmd, VK_NULL_HANDLE);
+            if (_profiler) _profiler->end_zone(cmd, gpuZone);
+            continue;
+        }
+
+        std::vector<VkClearValue> clearValues;
+        for (uint32_t useIndex : pass._attachments){
+            clearValues.push_back(pass._uses[useIndex]._clearValue);
+        }
+
+        VkRenderPassBeginInfo rpInfo = {};
+        rpInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        rpInfo.pNext = nullptr;
+        rpInfo.renderPass = pass._renderPass;
+        rpInfo.framebuffer = get_framebuffer(pass);
+        rpInfo.renderArea.offset = {0, 0};
+        rpInfo.renderArea.extent = _resources[pass._uses[pass._attachments[0]]._resource]._extent;
+        rpInfo.clearValueCount = (uint32_t)clearValues.size();
+        rpInfo.pClearValues = clearValues.data();
+
+        vkCmdBeginRenderPass(cmd, &rpInfo, pass._contents);
+        pass._execute(cmd, rpInfo.framebuffer);
+        vkCmdEndRenderPass(cmd);
+        if (_profiler) _profiler->end_zone(cmd, gpuZone);
+    }
+}
+
+void RenderGraph::set_imported_index(GraphResource resource, uint32_t index) {
+    _resources[resource]._current = index;
+}
+
+VkImage RenderGraph::image(GraphResource resource) const {
+    const Resource &r = _resources[resource];
+    return r._images[r._current];
+}
+
+VkImageView RenderGraph::view(GraphResource resource) const {
+    const Resource &r = _resources[resource];
+    return r._views[r._current];
+}
+
+GraphPass &RenderGraph::pass(GraphPassId pass) {
+    return _passes[pass];
+}
+
+VkRenderPass RenderGraph::render_pass(GraphPassId pass) const {
+    return _passes[pass]._renderPass;
+}
+
+RenderGraphStats RenderGraph::stats() const {
+    return _stats;
+}
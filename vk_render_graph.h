@@ -0,0 +1,226 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_RENDER_GRAPH_H
+#define VKENGINE_VK_RENDER_GRAPH_H
+
+#include "vk_types.h"
+#include "vk_allocator.h"
+#include "vk_profiler.h"
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+using GraphResource = uint32_t;
+using GraphPassId = uint32_t;
+
+// How a pass touches an image, picks the layout, stages and access the graph syncs against
+enum class GraphAccess {
+    ColorWrite,
+    DepthWrite,
+    // Depth test against a depth buffer an earlier pass wrote, without writing it
+    DepthRead,
+    Sampled,
+    TransferRead,
+    TransferWrite,
+};
+
+struct GraphUse {
+    GraphResource _resource;
+    GraphAccess _access;
+    bool _clear {false};
+    VkClearValue _clearValue {};
+};
+
+// Called between the graph's barriers, inside the render pass for graphics passes.
+// framebuffer is VK_NULL_HANDLE for transfer passes.
+using GraphExecute = std::function<void(VkCommandBuffer cmd, VkFramebuffer framebuffer)>;
+
+struct GraphPass {
+    std::string _name;
+    // Same name for the profiler, the trace can outlive the graph
+    const char *_traceName {nullptr};
+    // Graphics passes get a render pass built from their attachment uses, the others just barriers
+    bool _graphics {true};
+    // Never culled, for passes whose results leave the graph some other way (readback, buffers)
+    bool _sideEffect {false};
+    std::vector<GraphUse> _uses;
+    GraphExecute _execute;
+    // Can be changed every frame, SECONDARY when _execute only records vkCmdExecuteCommands
+    VkSubpassContents _contents {VK_SUBPASS_CONTENTS_INLINE};
+
+    // Filled in by compile()
+    bool _culled {false};
+    VkRenderPass _renderPass {VK_NULL_HANDLE};
+    // Attachment order of _renderPass, indices into _uses
+    std::vector<uint32_t> _attachments;
+};
+
+struct RenderGraphStats {
+    uint32_t _passes {0};
+    uint32_t _culledPasses {0};
+    // vkCmdPipelineBarrier calls per execute(), the rest is folded into render pass dependencies
+    uint32_t _barriers {0};
+    uint32_t _imageBarriers {0};
+    uint32_t _renderPassDependencies {0};
+    uint32_t _transientImages {0};
+    // Memory backing transient images, with aliasing and what one allocation each would have taken
+    VkDeviceSize _transientBytes {0};
+    VkDeviceSize _unaliasedBytes {0};
+};
+
+// Frame graph of passes over images. Passes declare what they read and write, compile() drops
+// passes nothing depends on, orders the rest, works out every layout transition and barrier,
+// lowers graphics passes to render passes and lets transient images whose lifetimes don't
+// overlap share memory. Built once and executed every frame, rebuilt when the targets change.
+class RenderGraph {
+public:
+    // Every executed pass gets a CPU zone, and a GPU zone around its render pass when this is set
+    GpuProfiler *_profiler {nullptr};
+
+    void init(VkDevice device, GpuAllocator &allocator);
+
+    // Drops passes, resources, transient images and framebuffers. Render passes are kept and handed out
+    // again when a rebuild asks for the same one, so pipelines made against them stay valid.
+    void reset();
+
+    void destroy();
+
+    // An image owned by someone else, one per swapchain image. It's in initialLayout with
+    // initialStages done when the frame starts and is left in finalLayout (UNDEFINED leaves it wherever it ends up).
+    GraphResource import_image(const char *name, const std::vector<VkImage> &images, const std::vector<VkImageView> &views,
+                               VkFormat format, VkExtent2D extent, VkImageLayout initialLayout,
+                               VkImageLayout finalLayout, VkPipelineStageFlags initialStages);
+
+    // Lives only inside the frame, memory may be shared with other transients
+    GraphResource create_image(const char *name, VkFormat format, VkExtent2D extent);
+
+    GraphPassId add_pass(const char *name, bool graphics, GraphExecute execute);
+
+    void write_color(GraphPassId pass, GraphResource resource, const VkClearValue *clear = nullptr);
+    void write_depth(GraphPassId pass, GraphResource resource, const VkClearValue *clear = nullptr);
+    void read_depth(GraphPassId pass, GraphResource resource);
+    void sample(GraphPassId pass, GraphResource resource);
+    void transfer_read(GraphPassId pass, GraphResource resource);
+    void transfer_write(GraphPassId pass, GraphResource resource);
+
+    void set_side_effect(GraphPassId pass);
+
+    // Clear values can change every frame, the render pass doesn't care
+    void set_clear_value(GraphPassId pass, GraphResource resource, const VkClearValue &value);
+
+    void compile();
+
+    // Records every pass that survived culling with its barriers, call outside a render pass
+    void execute(VkCommandBuffer cmd);
+
+    // Which of an imported resource's images this frame uses
+    void set_imported_index(GraphResource resource, uint32_t index);
+
+    VkImage image(GraphResource resource) const;
+
+    VkImageView view(GraphResource resource) const;
+
+    GraphPass &pass(GraphPassId pass);
+
+    VkRenderPass render_pass(GraphPassId pass) const;
+
+    RenderGraphStats stats() const;
+
+private:
+    struct Resource {
+        std::string _name;
+        bool _imported {false};
+        VkFormat _format;
+        VkExtent2D _extent;
+        VkImageAspectFlags _aspect;
+
+        std::vector<VkImage> _images;
+        std::vector<VkImageView> _views;
+        uint32_t _current {0};
+        VkImageLayout _initialLayout {VK_IMAGE_LAYOUT_UNDEFINED};
+        VkImageLayout _finalLayout {VK_IMAGE_LAYOUT_UNDEFINED};
+        VkPipelineStageFlags _initialStages {0};
+
+        // Transient only
+        VkImageUsageFlags _usage {0};
+        uint32_t _memorySlot {0};
+        // Positions in _order of the first and last pass using it
+        uint32_t _firstUse {0};
+        uint32_t _lastUse {0};
+        bool _used {false};
+    };
+
+    // A piece of memory shared by transients whose lifetimes don't overlap
+    struct MemorySlot {
+        VkMemoryRequirements _requirements;
+        std::vector<GraphResource> _resources;
+        Allocation _allocation;
+    };
+
+    struct Barrier {
+        GraphResource _resource;
+        VkImageLayout _oldLayout;
+        VkImageLayout _newLayout;
+        VkAccessFlags _srcAccess;
+        VkAccessFlags _dstAccess;
+    };
+
+    // Everything execute() records for one pass
+    struct CompiledPass {
+        GraphPassId _pass;
+        VkPipelineStageFlags _srcStages {0};
+        VkPipelineStageFlags _dstStages {0};
+        std::vector<Barrier> _barriers;
+    };
+
+    // Where a resource stands while compile() walks the passes in order
+    struct ResourceState {
+        VkImageLayout _layout {VK_IMAGE_LAYOUT_UNDEFINED};
+        VkPipelineStageFlags _writeStages {0};
+        VkAccessFlags _writeAccess {0};
+        // Stages that read it since the last write, a write has to wait for them
+        VkPipelineStageFlags _readStages {0};
+        // Stages the last write has already been made visible to
+        VkPipelineStageFlags _visibleStages {0};
+        bool _hasContents {false};
+    };
+
+    void add_use(GraphPassId pass, GraphResource resource, GraphAccess access, const VkClearValue *clear);
+
+    void cull_passes();
+
+    void order_passes();
+
+    void allocate_transients();
+
+    void compute_barriers();
+
+    // The use of resource by the first pass after position in _order, nullptr when nothing uses it again
+    const GraphUse *next_use(GraphResource resource, uint32_t position, const GraphPass **nextPass) const;
+
+    VkRenderPass get_render_pass(const VkRenderPassCreateInfo &info);
+
+    VkFramebuffer get_framebuffer(const GraphPass &pass);
+
+    VkDevice _device {VK_NULL_HANDLE};
+    GpuAllocator *_allocator {nullptr};
+
+    std::vector<Resource> _resources;
+    std::vector<GraphPass> _passes;
+    std::vector<GraphPassId> _order;
+    std::vector<CompiledPass> _compiled;
+    std::vector<MemorySlot> _memorySlots;
+    RenderGraphStats _stats;
+
+    // Keyed by everything that goes into the create info
+    std::map<std::vector<uint32_t>, VkRenderPass> _renderPasses;
+    // Keyed by render pass and attachment views, imported images make several per pass
+    std::map<std::vector<uint64_t>, VkFramebuffer> _framebuffers;
+};
+
+
+#endif //VKENGINE_VK_RENDER_GRAPH_H
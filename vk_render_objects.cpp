@@ -0,0 +1,175 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_render_objects.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+// Objects are sorted by material, then mesh, then depth quantized to this many bits
+constexpr uint32_t KEY_DEPTH_BITS = 24;
+
+template<typename Container>
+static void apply_permutation(Container &values, const std::vector<uint32_t> &order) {
+    Container sorted(values.size());
+    for (size_t i = 0; i < order.size(); i++){
+        sorted[i] = values[order[i]];
+    }
+    values.swap(sorted);
+}
+
+// LSD radix sort of order by the low keyBits of keys, a byte per pass. Stable, so sorting by a minor key
+// and then a major one orders by both. Bytes that are the same in every key (unused high bits, or depth
+// in a flat scene) cost one counting pass and no scatter.
+static void radix_sort(const std::vector<uint64_t> &keys, std::vector<uint32_t> &order, uint32_t keyBits) {
+    const size_t count = order.size();
+    std::vector<uint32_t> scratch(count);
+
+    for (uint32_t shift = 0; shift < keyBits; shift += 8){
+        size_t counts[256] = {};
+        for (uint32_t index : order){
+            counts[(keys[index] >> shift) & 0xFF]++;
+        }
+        if (counts[(keys[order[0]] >> shift) & 0xFF] == count){
+            continue;
+        }
+
+        size_t offsets[256];
+        size_t total = 0;
+        for (uint32_t digit = 0; digit < 256; digit++){
+            offsets[digit] = total;
+            total += counts[digit];
+        }
+        for (uint32_t index : order){
+            scratch[offsets[(keys[index] >> shift) & 0xFF]++] = index;
+        }
+        order.swap(scratch);
+    }
+}
+
+uint32_t RenderObjectList::add(uint32_t meshId, uint32_t materialId, float x, float y, float z, float scale) {
+    _positionX.push_back(x);
+    _positionY.push_back(y);
+    _positionZ.push_back(z);
+    _scale.push_back(scale);
+    _meshIds.push_back(meshId);
+    _materialIds.push_back(materialId);
+    _dirty = true;
+    return size() - 1;
+}
+
+uint32_t RenderObjectList::size() const {
+    return (uint32_t)_meshIds.size();
+}
+
+void RenderObjectList::clear() {
+    _positionX.clear();
+    _positionY.clear();
+    _positionZ.clear();
+    _scale.clear();
+    _meshIds.clear();
+    _materialIds.clear();
+    _dirty = true;
+}
+
+void RenderObjectList::sort_into_batches(std::vector<DrawBatch> &batches, const float *depthPlane,
+                                         uint64_t backToFrontMaterials) {
+    const uint32_t count = size();
+    if (count == 0){
+        batches.clear();
+        _dirty = false;
+        return;
+    }
+
+    static const float Z_PLANE[4] = {0.0f, 0.0f, 1.0f, 0.0f};
+    const float *plane = depthPlane ? depthPlane : Z_PLANE;
+
+    std::vector<float> depths(count);
+    float minDepth = INFINITY;
+    float maxDepth = -INFINITY;
+    for (uint32_t i = 0; i < count; i++){
+        depths[i] = plane[0] * _positionX[i] + plane[1] * _positionY[i] + plane[2] * _positionZ[i] + plane[3];
+        minDepth = std::min(minDepth, depths[i]);
+        maxDepth = std::max(maxDepth, depths[i]);
+    }
+
+    // Only the order matters, so depth is quantized over whatever range the scene covers right now
+    const float maxQuantized = (float)((1u << KEY_DEPTH_BITS) - 1);
+    const float depthScale = maxDepth > minDepth ? maxQuantized / (maxDepth - minDepth) : 0.0f;
+
+    // Full 32 bit ids, so any number of meshes and materials still end up in contiguous batches
+    std::vector<uint64_t> depthKeys(count);
+    std::vector<uint64_t> batchKeys(count);
+    for (uint32_t i = 0; i < count; i++){
+        uint64_t depth = (uint64_t)std::min((depths[i] - minDepth) * depthScale, maxQuantized);
+        if (_materialIds[i] < 64 && (backToFrontMaterials >> _materialIds[i]) & 1){
+            depth = (uint64_t)maxQuantized - depth;
+        }
+        depthKeys[i] = depth;
+        batchKeys[i] = ((uint64_t)_materialIds[i] << 32) | _meshIds[i];
+    }
+
+    std::vector<uint32_t> order(count);
+    std::iota(order.begin(), order.end(), 0u);
+    radix_sort(depthKeys, order, KEY_DEPTH_BITS);
+    radix_sort(batchKeys, order, 64);
+
+    apply_permutation(_positionX, order);
+    apply_permutation(_positionY, order);
+    apply_permutation(_positionZ, order);
+    apply_permutation(_scale, order);
+    apply_permutation(_meshIds, order);
+    apply_permutation(_materialIds, order);
+
+    batches.clear();
+    for (uint32_t i = 0; i < count; i++){
+        if (batches.empty() || batches.back()._material != _materialIds[i] || batches.back()._mesh != _meshIds[i]){
+            batches.push_back({_materialIds[i], _meshIds[i], i, 0});
+        }
+        batches.back()._count++;
+    }
+
+    _dirty = false;
+}
+
+void RenderObjectList::write_instances(uint32_t begin, uint32_t end, InstanceData *out) const {
+    for (uint32_t i = begin; i < end; i++){
+        out[i].position[0] = _positionX[i];
+        out[i].position[1] = _positionY[i];
+        out[i].position[2] = _positionZ[i];
+        out[i].scale = _scale[i];
+    }
+}
+
+void RenderObjectList::write_transforms(vkmath::TransformKernel kernel, const Mat4 &viewProjection, uint32_t begin,
+                                        uint32_t end, Mat4 *out) const {
+    vkmath::compute_mvp(kernel, viewProjection, _positionX.data() + begin, _positionY.data() + begin,
+                        _positionZ.data() + begin, _scale.data() + begin, end - begin, out + begin);
+}
+
+uint32_t RenderObjectList::write_draw_commands(const std::vector<DrawBatch> &batches, const std::vector<Mesh> &meshes,
+                                               uint32_t begin, uint32_t end,
+                                               VkDrawIndexedIndirectCommand *out, uint32_t *outMaterials) {
+    // Batches are in object order, skip straight to the first one that ends past begin
+    auto batch = std::upper_bound(batches.begin(), batches.end(), begin, [](uint32_t object, const DrawBatch &b){
+        return object < b._firstObject + b._count;
+    });
+
+    uint32_t count = 0;
+    for (; batch != batches.end() && batch->_firstObject < end; ++batch){
+        uint32_t first = std::max(batch->_firstObject, begin);
+        uint32_t last = std::min(batch->_firstObject + batch->_count, end);
+
+        const Mesh &mesh = meshes[batch->_mesh];
+        out[count].indexCount = mesh._indexCount;
+        out[count].instanceCount = last - first;
+        out[count].firstIndex = mesh._firstIndex;
+        out[count].vertexOffset = mesh._vertexOffset;
+        out[count].firstInstance = first;
+        outMaterials[count] = batch->_material;
+        count++;
+    }
+    return count;
+}
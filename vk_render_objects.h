@@ -0,0 +1,63 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_RENDER_OBJECTS_H
+#define VKENGINE_VK_RENDER_OBJECTS_H
+
+#include "vk_types.h"
+#include "vk_math.h"
+#include "vk_mesh.h"
+#include <vector>
+
+// Objects sharing a material (and so a pipeline) and a mesh, drawn as one instanced draw
+struct DrawBatch {
+    uint32_t _material;
+    uint32_t _mesh;
+    uint32_t _firstObject;
+    uint32_t _count;
+};
+
+// Every object in the scene, one array per attribute so per-frame passes only touch what they need.
+// The transform arrays start on a cache line so the SIMD kernels stream through them.
+class RenderObjectList {
+public:
+    AlignedVector<float> _positionX;
+    AlignedVector<float> _positionY;
+    AlignedVector<float> _positionZ;
+    AlignedVector<float> _scale;
+    std::vector<uint32_t> _meshIds;
+    std::vector<uint32_t> _materialIds;
+
+    // Set whenever objects are added, cleared by sort_into_batches()
+    bool _dirty {true};
+
+    uint32_t add(uint32_t meshId, uint32_t materialId, float x, float y, float z, float scale);
+
+    uint32_t size() const;
+
+    void clear();
+
+    // Reorders every array by a 64 bit key, material (so pipeline) then mesh then quantized depth, so each
+    // batch is a contiguous range of objects drawn front to back. depthPlane gives an object's depth as
+    // dot(plane.xyz, position) + plane.w, nullptr uses z. Materials with their bit set in backToFrontMaterials
+    // (the blended ones) are ordered back to front instead.
+    void sort_into_batches(std::vector<DrawBatch> &batches, const float *depthPlane = nullptr,
+                           uint64_t backToFrontMaterials = 0);
+
+    // One InstanceData per object in [begin, end), written at out[object] so a batch's instances start at its _firstObject
+    void write_instances(uint32_t begin, uint32_t end, InstanceData *out) const;
+
+    // Same, but one model-view-projection matrix per object instead
+    void write_transforms(vkmath::TransformKernel kernel, const Mat4 &viewProjection, uint32_t begin, uint32_t end,
+                          Mat4 *out) const;
+
+    // One command per batch overlapping [begin, end), clipped to that range. Writes each command's
+    // material to outMaterials and returns how many were written.
+    static uint32_t write_draw_commands(const std::vector<DrawBatch> &batches, const std::vector<Mesh> &meshes,
+                                        uint32_t begin, uint32_t end,
+                                        VkDrawIndexedIndirectCommand *out, uint32_t *outMaterials);
+};
+
+
+#endif //VKENGINE_VK_RENDER_OBJECTS_H
@@ -0,0 +1,123 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_shaders.h"
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint32_t SPIRV_MAGIC = 0x07230203;
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const char *path) {
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0){
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0){
+        ::close(fd);
+        return false;
+    }
+
+    void *mapping = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if (mapping == MAP_FAILED){
+        return false;
+    }
+
+    _data = mapping;
+    _size = (size_t)info.st_size;
+    return true;
+}
+
+void MappedFile::close() {
+    if (_data){
+        munmap(_data, _size);
+        _data = nullptr;
+        _size = 0;
+    }
+}
+
+std::string shell_quote(const std::string &arg) {
+    // A quote in arg ends the quoting, gets escaped and starts it again
+    std::string quoted = "'";
+    for (char c : arg){
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
+    }
+    quoted += "'";
+    return quoted;
+}
+
+bool vkshader::create_shader_module(VkDevice device, const void *code, size_t size, VkShaderModule *out) {
+    if (size < sizeof(uint32_t) * 5 || size % sizeof(uint32_t) != 0){
+        return false;
+    }
+    // Byte swapped magic means the module was written on a big endian host, don't bother with it
+    if (*(const uint32_t *)code != SPIRV_MAGIC){
+        return false;
+    }
+
+    VkShaderModuleCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    createInfo.pNext = nullptr;
+    createInfo.codeSize = size;
+    createInfo.pCode = (const uint32_t *)code;
+
+    return vkCreateShaderModule(device, &createInfo, nullptr, out) == VK_SUCCESS;
+}
+
+void ShaderCache::init(VkDevice device) {
+    _device = device;
+}
+
+VkShaderModule ShaderCache::get(const std::string &path) {
+    auto found = _modules.find(path);
+    if (found != _modules.end()){
+        _hits++;
+        return found->second;
+    }
+    _misses++;
+
+    // Pages are mapped straight into pCode, the driver copies what it needs so the mapping can go right after
+    MappedFile file;
+    if (!file.open(path.c_str())){
+        return VK_NULL_HANDLE;
+    }
+
+    VkShaderModule module;
+    if (!vkshader::create_shader_module(_device, file.data(), file.size(), &module)){
+        printf("%s IS NOT A VALID SPIR-V MODULE!\n", path.c_str());
+        return VK_NULL_HANDLE;
+    }
+
+    _modules.emplace(path, module);
+    return module;
+}
+
+VkShaderModule ShaderCache::replace(const std::string &path, VkShaderModule module) {
+    VkShaderModule &entry = _modules[path];
+    VkShaderModule old = entry;
+    entry = module;
+    return old;
+}
+
+void ShaderCache::destroy() {
+    for (auto &entry : _modules){
+        vkDestroyShaderModule(_device, entry.second, nullptr);
+    }
+    _modules.clear();
+}
@@ -0,0 +1,64 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_SHADERS_H
+#define VKENGINE_VK_SHADERS_H
+
+#include "vk_types.h"
+#include <string>
+#include <unordered_map>
+
+// Read only mmap of a whole file, unmapped when it goes out of scope
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const char *path);
+
+    void close();
+
+    const void *data() const { return _data; }
+
+    size_t size() const { return _size; }
+
+private:
+    void *_data {nullptr};
+    size_t _size {0};
+};
+
+// arg as one single quoted shell word for system() and popen(), nothing in it gets expanded
+std::string shell_quote(const std::string &arg);
+
+namespace vkshader {
+    // Checks size and magic before handing the words to the driver, code must be 4 byte aligned
+    bool create_shader_module(VkDevice device, const void *code, size_t size, VkShaderModule *out);
+}
+
+// Keeps every module around for the lifetime of the device so pipelines sharing a shader share the module
+class ShaderCache {
+public:
+    uint32_t _hits {0};
+    uint32_t _misses {0};
+
+    void init(VkDevice device);
+
+    // Maps and creates the module on first use, VK_NULL_HANDLE if the file is missing or isn't SPIR-V
+    VkShaderModule get(const std::string &path);
+
+    // Points path at a new module and hands back the one it replaces, which the caller now owns
+    VkShaderModule replace(const std::string &path, VkShaderModule module);
+
+    void destroy();
+
+private:
+    VkDevice _device {VK_NULL_HANDLE};
+    std::unordered_map<std::string, VkShaderModule> _modules;
+};
+
+
+#endif //VKENGINE_VK_SHADERS_H
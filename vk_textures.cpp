@@ -0,0 +1,871 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_textures.h"
+#include "vk_initalizers.h"
+
+#include <algorithm>
+#include <cstring>
+
+static uint32_t read_u32(const uint8_t *bytes, size_t offset) {
+    uint32_t value;
+    memcpy(&value, bytes + offset, sizeof(value));
+    return value;
+}
+
+static uint64_t read_u64(const uint8_t *bytes, size_t offset) {
+    uint64_t value;
+    memcpy(&value, bytes + offset, sizeof(value));
+    return value;
+}
+
+static constexpr uint32_t make_fourcc(char a, char b, char c, char d) {
+    return (uint32_t)(uint8_t)a | (uint32_t)(uint8_t)b << 8 | (uint32_t)(uint8_t)c << 16 | (uint32_t)(uint8_t)d << 24;
+}
+
+static uint32_t level_dimension(uint32_t size, uint32_t level) {
+    return std::max(size >> level, 1u);
+}
+
+static uint64_t level_bytes(uint32_t width, uint32_t height, uint32_t blockWidth, uint32_t blockHeight, uint32_t blockBytes) {
+    uint64_t blocksX = (width + blockWidth - 1) / blockWidth;
+    uint64_t blocksY = (height + blockHeight - 1) / blockHeight;
+    return blocksX * blocksY * blockBytes;
+}
+
+static VkImageMemoryBarrier image_barrier(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
+                                          VkAccessFlags srcAccess, VkAccessFlags dstAccess,
+                                          uint32_t baseLevel, uint32_t levelCount) {
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.pNext = nullptr;
+    barrier.srcAccessMask = srcAccess;
+    barrier.dstAccessMask = dstAccess;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = baseLevel;
+    barrier.subresourceRange.levelCount = levelCount;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    return barrier;
+}
+
+bool vktexture::format_block_info(VkFormat format, uint32_t *blockWidth, uint32_t *blockHeight, uint32_t *blockBytes) {
+    *blockWidth = 1;
+    *blockHeight = 1;
+
+    switch (format){
+        case VK_FORMAT_R8_UNORM:
+            *blockBytes = 1;
+            return true;
+        case VK_FORMAT_R8G8_UNORM:
+            *blockBytes = 2;
+            return true;
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+            *blockBytes = 4;
+            return true;
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+            *blockBytes = 8;
+            return true;
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+        case VK_FORMAT_BC4_UNORM_BLOCK:
+        case VK_FORMAT_BC4_SNORM_BLOCK:
+            *blockWidth = 4;
+            *blockHeight = 4;
+            *blockBytes = 8;
+            return true;
+        case VK_FORMAT_BC2_UNORM_BLOCK:
+        case VK_FORMAT_BC2_SRGB_BLOCK:
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+        case VK_FORMAT_BC3_SRGB_BLOCK:
+        case VK_FORMAT_BC5_UNORM_BLOCK:
+        case VK_FORMAT_BC5_SNORM_BLOCK:
+        case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+        case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+        case VK_FORMAT_BC7_UNORM_BLOCK:
+        case VK_FORMAT_BC7_SRGB_BLOCK:
+            *blockWidth = 4;
+            *blockHeight = 4;
+            *blockBytes = 16;
+            return true;
+        default:
+            break;
+    }
+
+    // The LDR ASTC formats come in UNORM/SRGB pairs, one pair per block size, all 16 bytes a block
+    if (format >= VK_FORMAT_ASTC_4x4_UNORM_BLOCK && format <= VK_FORMAT_ASTC_12x12_SRGB_BLOCK){
+        static const uint8_t ASTC_BLOCKS[14][2] = {
+            {4, 4}, {5, 4}, {5, 5}, {6, 5}, {6, 6}, {8, 5}, {8, 6},
+            {8, 8}, {10, 5}, {10, 6}, {10, 8}, {10, 10}, {12, 10}, {12, 12},
+        };
+        uint32_t pair = (uint32_t)(format - VK_FORMAT_ASTC_4x4_UNORM_BLOCK) / 2;
+        *blockWidth = ASTC_BLOCKS[pair][0];
+        *blockHeight = ASTC_BLOCKS[pair][1];
+        *blockBytes = 16;
+        return true;
+    }
+
+    return false;
+}
+
+bool vktexture::parse_ktx2(const void *data, size_t size, TextureFileInfo *out) {
+    static const uint8_t KTX2_IDENTIFIER[12] = {0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    // Identifier, the nine header words and the index up to the level index
+    if (size < 80 || memcmp(bytes, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0){
+        return false;
+    }
+
+    VkFormat format = (VkFormat)read_u32(bytes, 12);
+    uint32_t width = read_u32(bytes, 20);
+    uint32_t height = read_u32(bytes, 24);
+    uint32_t depth = read_u32(bytes, 28);
+    uint32_t layers = read_u32(bytes, 32);
+    uint32_t faces = read_u32(bytes, 36);
+    uint32_t levelCount = read_u32(bytes, 40);
+    uint32_t supercompression = read_u32(bytes, 44);
+
+    if (supercompression != 0){
+        printf("KTX2: SUPERCOMPRESSION SCHEME %u IS NOT SUPPORTED\n", supercompression);
+        return false;
+    }
+    // vkFormat 0 is Basis Universal and friends, they'd have to be transcoded
+    if (format == VK_FORMAT_UNDEFINED || width == 0 || height == 0 || depth > 1 || layers > 1 || faces != 1){
+        return false;
+    }
+
+    uint32_t blockWidth, blockHeight, blockBytes;
+    if (!vktexture::format_block_info(format, &blockWidth, &blockHeight, &blockBytes)){
+        printf("KTX2: VKFORMAT %u IS NOT SUPPORTED\n", (uint32_t)format);
+        return false;
+    }
+
+    // 0 asks the loader to generate the mips, the file then holds just the base level
+    uint32_t fileLevels = std::max(levelCount, 1u);
+    if (fileLevels > 32 || 80 + (size_t)fileLevels * 24 > size){
+        return false;
+    }
+
+    out->_format = format;
+    out->_width = width;
+    out->_height = height;
+    out->_levels.clear();
+    for (uint32_t level = 0; level < fileLevels; level++){
+        uint64_t offset = read_u64(bytes, 80 + level * 24);
+        uint64_t length = read_u64(bytes, 80 + level * 24 + 8);
+        uint64_t expected = level_bytes(level_dimension(width, level), level_dimension(height, level),
+                                        blockWidth, blockHeight, blockBytes);
+        if (offset > size || length > size - offset || length < expected){
+            return false;
+        }
+        out->_levels.push_back({offset, expected});
+    }
+    return true;
+}
+
+bool vktexture::parse_dds(const void *data, size_t size, TextureFileInfo *out) {
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    // Magic and the 124 byte header
+    if (size < 128 || read_u32(bytes, 0) != make_fourcc('D', 'D', 'S', ' ')){
+        return false;
+    }
+
+    uint32_t flags = read_u32(bytes, 8);
+    uint32_t height = read_u32(bytes, 12);
+    uint32_t width = read_u32(bytes, 16);
+    uint32_t mipCount = (flags & 0x20000) ? read_u32(bytes, 28) : 1;
+    uint32_t formatFlags = read_u32(bytes, 80);
+    uint32_t fourCC = read_u32(bytes, 84);
+    uint32_t bitCount = read_u32(bytes, 88);
+    uint32_t redMask = read_u32(bytes, 92);
+    uint32_t caps2 = read_u32(bytes, 112);
+
+    // Cube maps and volumes
+    if ((caps2 & (0x200 | 0x200000)) != 0 || width == 0 || height == 0){
+        return false;
+    }
+
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    size_t dataOffset = 128;
+
+    if ((formatFlags & 0x4) != 0 && fourCC == make_fourcc('D', 'X', '1', '0')){
+        if (size < 148){
+            return false;
+        }
+        uint32_t dxgiFormat = read_u32(bytes, 128);
+        uint32_t dimension = read_u32(bytes, 132);
+        uint32_t miscFlags = read_u32(bytes, 136);
+        uint32_t arraySize = read_u32(bytes, 140);
+        // Anything but a single plain 2D texture
+        if (dimension != 3 || (miscFlags & 0x4) != 0 || arraySize > 1){
+            return false;
+        }
+        dataOffset = 148;
+
+        switch (dxgiFormat){
+            case 28: format = VK_FORMAT_R8G8B8A8_UNORM; break;
+            case 29: format = VK_FORMAT_R8G8B8A8_SRGB; break;
+            case 71: format = VK_FORMAT_BC1_RGBA_UNORM_BLOCK; break;
+            case 72: format = VK_FORMAT_BC1_RGBA_SRGB_BLOCK; break;
+            case 74: format = VK_FORMAT_BC2_UNORM_BLOCK; break;
+            case 75: format = VK_FORMAT_BC2_SRGB_BLOCK; break;
+            case 77: format = VK_FORMAT_BC3_UNORM_BLOCK; break;
+            case 78: format = VK_FORMAT_BC3_SRGB_BLOCK; break;
+            case 80: format = VK_FORMAT_BC4_UNORM_BLOCK; break;
+            case 81: format = VK_FORMAT_BC4_SNORM_BLOCK; break;
+            case 83: format = VK_FORMAT_BC5_UNORM_BLOCK; break;
+            case 84: format = VK_FORMAT_BC5_SNORM_BLOCK; break;
+            case 87: format = VK_FORMAT_B8G8R8A8_UNORM; break;
+            case 91: format = VK_FORMAT_B8G8R8A8_SRGB; break;
+            case 95: format = VK_FORMAT_BC6H_UFLOAT_BLOCK; break;
+            case 96: format = VK_FORMAT_BC6H_SFLOAT_BLOCK; break;
+            case 98: format = VK_FORMAT_BC7_UNORM_BLOCK; break;
+            case 99: format = VK_FORMAT_BC7_SRGB_BLOCK; break;
+            default:
+                printf("DDS: DXGI FORMAT %u IS NOT SUPPORTED\n", dxgiFormat);
+                return false;
+        }
+    } else if ((formatFlags & 0x4) != 0){
+        if (fourCC == make_fourcc('D', 'X', 'T', '1')){
+            format = VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+        } else if (fourCC == make_fourcc('D', 'X', 'T', '3')){
+            format = VK_FORMAT_BC2_UNORM_BLOCK;
+        } else if (fourCC == make_fourcc('D', 'X', 'T', '5')){
+            format = VK_FORMAT_BC3_UNORM_BLOCK;
+        } else if (fourCC == make_fourcc('A', 'T', 'I', '1') || fourCC == make_fourcc('B', 'C', '4', 'U')){
+            format = VK_FORMAT_BC4_UNORM_BLOCK;
+        } else if (fourCC == make_fourcc('A', 'T', 'I', '2') || fourCC == make_fourcc('B', 'C', '5', 'U')){
+            format = VK_FORMAT_BC5_UNORM_BLOCK;
+        } else {
+            printf("DDS: FOURCC %.4s IS NOT SUPPORTED\n", (const char *)(bytes + 84));
+            return false;
+        }
+    } else if ((formatFlags & 0x40) != 0 && bitCount == 32){
+        // Uncompressed, only the two 8 bit channel orders anyone still writes
+        if (redMask == 0x000000FF){
+            format = VK_FORMAT_R8G8B8A8_UNORM;
+        } else if (redMask == 0x00FF0000){
+            format = VK_FORMAT_B8G8R8A8_UNORM;
+        }
+    }
+
+    uint32_t blockWidth, blockHeight, blockBytes;
+    if (format == VK_FORMAT_UNDEFINED || !vktexture::format_block_info(format, &blockWidth, &blockHeight, &blockBytes)){
+        return false;
+    }
+
+    // Levels follow each other with no padding, finest first
+    out->_format = format;
+    out->_width = width;
+    out->_height = height;
+    out->_levels.clear();
+    uint64_t offset = dataOffset;
+    for (uint32_t level = 0; level < std::min(std::max(mipCount, 1u), 32u); level++){
+        uint64_t length = level_bytes(level_dimension(width, level), level_dimension(height, level),
+                                      blockWidth, blockHeight, blockBytes);
+        if (length > size - offset){
+            return false;
+        }
+        out->_levels.push_back({offset, length});
+        offset += length;
+    }
+    return true;
+}
+
+bool vktexture::parse_texture_file(const void *data, size_t size, TextureFileInfo *out) {
+    if (size >= 4 && read_u32((const uint8_t *)data, 0) == make_fourcc('D', 'D', 'S', ' ')){
+        return parse_dds(data, size, out);
+    }
+    return parse_ktx2(data, size, out);
+}
+
+bool TextureStreamer::init(VkDevice device, VkPhysicalDevice physicalDevice, GpuAllocator &allocator,
+                           StreamingUploader &uploader, BindlessHeap &bindless, uint32_t frameCount) {
+    _device = device;
+    _physicalDevice = physicalDevice;
+    _allocator = &allocator;
+    _uploader = &uploader;
+    _bindless = &bindless;
+
+    VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_LINEAR);
+    VK_CHECK(vkCreateSampler(_device, &samplerInfo, nullptr, &_sampler));
+
+    // Cleared to white on the first update, before anything can sample it
+    VkImageCreateInfo fallbackInfo = vkinit::image_create_info(VK_FORMAT_R8G8B8A8_UNORM,
+                                                               VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                                                               {1, 1, 1});
+    if (!_allocator->create_image(fallbackInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &_fallbackImage)){
+        printf("TEXTURES: COULD NOT CREATE THE FALLBACK TEXTURE\n");
+        return false;
+    }
+    VkImageViewCreateInfo fallbackViewInfo = vkinit::imageview_create_info(VK_FORMAT_R8G8B8A8_UNORM, _fallbackImage._image,
+                                                                           VK_IMAGE_ASPECT_COLOR_BIT);
+    VK_CHECK(vkCreateImageView(_device, &fallbackViewInfo, nullptr, &_fallbackView));
+    _fallbackSlot = _bindless->add_texture(_fallbackView, _sampler);
+
+    _slotTables.resize(frameCount);
+    _feedback.resize(frameCount);
+    _slotTableSlots.resize(frameCount);
+    _feedbackSlots.resize(frameCount);
+    for (uint32_t i = 0; i < frameCount; i++){
+        VkMemoryPropertyFlags hostFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        if (!_allocator->create_buffer((VkDeviceSize)_maxTextures * 2 * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                       hostFlags, &_slotTables[i]) ||
+            !_allocator->create_buffer((VkDeviceSize)_maxTextures * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                       hostFlags, &_feedback[i])){
+            printf("TEXTURES: COULD NOT CREATE THE SLOT TABLES\n");
+            return false;
+        }
+        // ~0u is "not sampled"
+        memset(_feedback[i]._allocation._mapped, 0xFF, (size_t)_maxTextures * sizeof(uint32_t));
+        // Until update() writes them every entry points at the fallback
+        uint32_t *table = (uint32_t *)_slotTables[i]._allocation._mapped;
+        for (uint32_t texture = 0; texture < _maxTextures; texture++){
+            table[texture * 2] = _fallbackSlot;
+            table[texture * 2 + 1] = ~0u;
+        }
+        _slotTableSlots[i] = _bindless->add_buffer(_slotTables[i]._buffer);
+        _feedbackSlots[i] = _bindless->add_buffer(_feedback[i]._buffer);
+    }
+
+    if (_fallbackSlot == ~0u || _slotTableSlots.back() == ~0u || _feedbackSlots.back() == ~0u){
+        printf("TEXTURES: BINDLESS HEAP IS FULL\n");
+        return false;
+    }
+    return true;
+}
+
+void TextureStreamer::destroy() {
+    for (Texture &texture : _textures){
+        if (texture._view != VK_NULL_HANDLE){
+            vkDestroyImageView(_device, texture._view, nullptr);
+            _allocator->destroy_image(texture._image);
+        }
+        if (texture._nextView != VK_NULL_HANDLE){
+            vkDestroyImageView(_device, texture._nextView, nullptr);
+            _allocator->destroy_image(texture._nextImage);
+        }
+    }
+    for (Retired &retired : _retired){
+        vkDestroyImageView(_device, retired._view, nullptr);
+        _allocator->destroy_image(retired._image);
+    }
+    _textures.clear();
+    _retired.clear();
+    _residentBytes = 0;
+
+    for (size_t i = 0; i < _slotTables.size(); i++){
+        _allocator->destroy_buffer(_slotTables[i]);
+        _allocator->destroy_buffer(_feedback[i]);
+    }
+    _slotTables.clear();
+    _feedback.clear();
+
+    if (_fallbackView != VK_NULL_HANDLE){
+        vkDestroyImageView(_device, _fallbackView, nullptr);
+        _allocator->destroy_image(_fallbackImage);
+        _fallbackView = VK_NULL_HANDLE;
+    }
+    if (_sampler != VK_NULL_HANDLE){
+        vkDestroySampler(_device, _sampler, nullptr);
+        _sampler = VK_NULL_HANDLE;
+    }
+}
+
+uint32_t TextureStreamer::add(const char *path) {
+    if (_textures.size() >= _maxTextures){
+        printf("TEXTURES: MORE THAN %u TEXTURES, %s SKIPPED\n", _maxTextures, path);
+        return ~0u;
+    }
+
+    auto file = std::make_shared<MappedFile>();
+    if (!file->open(path)){
+        printf("TEXTURES: COULD NOT OPEN %s\n", path);
+        return ~0u;
+    }
+
+    Texture texture;
+    texture._path = path;
+    if (!vktexture::parse_texture_file(file->data(), file->size(), &texture._info)){
+        printf("TEXTURES: %s IS NOT A 2D KTX2 OR DDS FILE THAT CAN BE STREAMED\n", path);
+        return ~0u;
+    }
+    texture._file = file;
+    vktexture::format_block_info(texture._info._format, &texture._blockWidth, &texture._blockHeight, &texture._blockBytes);
+
+    // Compressed data goes to the GPU as it is, if the device can't sample the format the texture is skipped
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(_physicalDevice, texture._info._format, &properties);
+    if ((properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) == 0){
+        printf("TEXTURES: DEVICE CAN'T SAMPLE FORMAT %u, %s SKIPPED\n", (uint32_t)texture._info._format, path);
+        return ~0u;
+    }
+
+    uint32_t fullChain = 1;
+    while ((std::max(texture._info._width, texture._info._height) >> fullChain) != 0){
+        fullChain++;
+    }
+
+    texture._generateMips = false;
+    if (texture._info._levels.size() == 1 && fullChain > 1){
+        VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+                                    VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+        if (texture._blockWidth == 1 && (properties.optimalTilingFeatures & blit) == blit){
+            texture._generateMips = true;
+        } else {
+            printf("TEXTURES: %s HAS NO MIPS AND CAN'T BE BLITTED, LOADED AS ONE LEVEL\n", path);
+        }
+    }
+    texture._levelCount = texture._generateMips ? fullChain : (uint32_t)texture._info._levels.size();
+
+    texture._tailLevel = 0;
+    while (texture._tailLevel + 1 < texture._levelCount &&
+           std::max(level_dimension(texture._info._width, texture._tailLevel),
+                    level_dimension(texture._info._height, texture._tailLevel)) > _tailSize){
+        texture._tailLevel++;
+    }
+
+    // Nothing resident yet
+    texture._residentLevel = texture._levelCount;
+    texture._wantedLevel = texture._generateMips ? 0 : texture._tailLevel;
+
+    _textures.push_back(std::move(texture));
+    if (!begin_load(_textures.back(), _textures.back()._generateMips ? 0 : _textures.back()._tailLevel)){
+        _textures.pop_back();
+        return ~0u;
+    }
+    return (uint32_t)_textures.size() - 1;
+}
+
+VkExtent3D TextureStreamer::level_extent(const Texture &texture, uint32_t level) const {
+    return {level_dimension(texture._info._width, level), level_dimension(texture._info._height, level), 1};
+}
+
+VkDeviceSize TextureStreamer::image_bytes(const Texture &texture, uint32_t firstLevel) const {
+    VkDeviceSize bytes = 0;
+    for (uint32_t level = firstLevel; level < texture._levelCount; level++){
+        VkExtent3D extent = level_extent(texture, level);
+        bytes += level_bytes(extent.width, extent.height, texture._blockWidth, texture._blockHeight, texture._blockBytes);
+    }
+    return bytes;
+}
+
+bool TextureStreamer::create_image(Texture &texture, uint32_t firstLevel, AllocatedImage *image, VkImageView *view) {
+    VkImageCreateInfo imageInfo = vkinit::image_create_info(texture._info._format,
+                                                            VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                                                            VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                                                            level_extent(texture, firstLevel));
+    imageInfo.mipLevels = texture._levelCount - firstLevel;
+
+    if (!_allocator->create_image(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image)){
+        printf("TEXTURES: OUT OF DEVICE MEMORY FOR %s\n", texture._path.c_str());
+        return false;
+    }
+
+    VkImageViewCreateInfo viewInfo = vkinit::imageview_create_info(texture._info._format, image->_image, VK_IMAGE_ASPECT_COLOR_BIT);
+    viewInfo.subresourceRange.levelCount = imageInfo.mipLevels;
+    VK_CHECK(vkCreateImageView(_device, &viewInfo, nullptr, view));
+
+    _residentBytes += image->_allocation._size;
+    return true;
+}
+
+void TextureStreamer::upload_level(Texture &texture, VkImage image, uint32_t level, uint32_t imageLevel, bool blitSource) {
+    const TextureFileInfo::Level &fileLevel = texture._info._levels[level];
+    VkExtent3D extent = level_extent(texture, level);
+
+    ImageUpload target;
+    target._image = image;
+    target._extent = extent;
+    target._mipLevel = imageLevel;
+    target._arrayLayer = 0;
+    target._rowBytes = (extent.width + texture._blockWidth - 1) / texture._blockWidth * texture._blockBytes;
+    target._rowTexels = texture._blockHeight;
+    // Levels the GPU copies out of or blits from later on are read by transfers too
+    target._finalLayout = blitSource ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    target._dstStage = blitSource ? VK_PIPELINE_STAGE_TRANSFER_BIT
+                                  : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+    target._dstAccess = blitSource ? VK_ACCESS_TRANSFER_READ_BIT : VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+
+    // Straight out of the mapping, the uploader holds on to the file until the bytes are in staging
+    texture._ticket = _uploader->upload_image(target, (const uint8_t *)texture._file->data() + fileLevel._offset,
+                                              fileLevel._size, texture._file);
+}
+
+bool TextureStreamer::begin_load(Texture &texture, uint32_t firstLevel) {
+    if (!create_image(texture, firstLevel, &texture._nextImage, &texture._nextView)){
+        return false;
+    }
+    texture._nextLevel = firstLevel;
+    texture._pending = true;
+
+    if (texture._generateMips){
+        upload_level(texture, texture._nextImage._image, 0, 0, true);
+    } else if (texture._image._image == VK_NULL_HANDLE){
+        for (uint32_t level = firstLevel; level < texture._levelCount; level++){
+            upload_level(texture, texture._nextImage._image, level, level - firstLevel, false);
+        }
+    } else {
+        // The coarser levels are already on the GPU
+        upload_level(texture, texture._nextImage._image, firstLevel, 0, false);
+    }
+    return true;
+}
+
+void TextureStreamer::record_copy(VkCommandBuffer cmd, const Texture &texture, VkImage src, uint32_t srcFirst,
+                                  VkImage dst, uint32_t dstFirst, uint32_t fromLevel) {
+    uint32_t count = texture._levelCount - fromLevel;
+
+    // The source was last sampled by earlier frames on this queue, nothing after this frame reads it
+    VkImageMemoryBarrier before[2] = {
+        image_barrier(src, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                      0, VK_ACCESS_TRANSFER_READ_BIT, fromLevel - srcFirst, count),
+        image_barrier(dst, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                      0, VK_ACCESS_TRANSFER_WRITE_BIT, fromLevel - dstFirst, count),
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2, before);
+
+    std::vector<VkImageCopy> copies(count);
+    for (uint32_t i = 0; i < count; i++){
+        VkImageCopy &copy = copies[i];
+        copy.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, fromLevel + i - srcFirst, 0, 1};
+        copy.srcOffset = {0, 0, 0};
+        copy.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, fromLevel + i - dstFirst, 0, 1};
+        copy.dstOffset = {0, 0, 0};
+        copy.extent = level_extent(texture, fromLevel + i);
+    }
+    vkCmdCopyImage(cmd, src, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                   count, copies.data());
+
+    VkImageMemoryBarrier after = image_barrier(dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                               VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT,
+                                               fromLevel - dstFirst, count);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &after);
+}
+
+void TextureStreamer::record_generate_mips(VkCommandBuffer cmd, const Texture &texture, VkImage image, uint32_t firstLevel) {
+    // Each level is blitted from the one above it, which is already in TRANSFER_SRC
+    for (uint32_t level = firstLevel + 1; level < texture._levelCount; level++){
+        VkImageMemoryBarrier toDst = image_barrier(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                   0, VK_ACCESS_TRANSFER_WRITE_BIT, level - firstLevel, 1);
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0, 0, nullptr, 0, nullptr, 1, &toDst);
+
+        VkExtent3D srcExtent = level_extent(texture, level - 1);
+        VkExtent3D dstExtent = level_extent(texture, level);
+        VkImageBlit blit = {};
+        blit.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level - 1 - firstLevel, 0, 1};
+        blit.srcOffsets[0] = {0, 0, 0};
+        blit.srcOffsets[1] = {(int32_t)srcExtent.width, (int32_t)srcExtent.height, 1};
+        blit.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level - firstLevel, 0, 1};
+        blit.dstOffsets[0] = {0, 0, 0};
+        blit.dstOffsets[1] = {(int32_t)dstExtent.width, (int32_t)dstExtent.height, 1};
+        vkCmdBlitImage(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       1, &blit, VK_FILTER_LINEAR);
+
+        VkImageMemoryBarrier toSrc = image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                                   VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, level - firstLevel, 1);
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0, 0, nullptr, 0, nullptr, 1, &toSrc);
+    }
+
+    VkImageMemoryBarrier toRead = image_barrier(image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                                VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT,
+                                                0, texture._levelCount - firstLevel);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &toRead);
+}
+
+void TextureStreamer::retire(Texture &texture, uint64_t frameValue) {
+    if (texture._image._image == VK_NULL_HANDLE){
+        return;
+    }
+    // Earlier frames may still sample it
+    if (texture._slot != ~0u){
+        _bindless->remove_texture(texture._slot, frameValue);
+    }
+    _retired.push_back({texture._image, texture._view, frameValue});
+    texture._image = {};
+    texture._view = VK_NULL_HANDLE;
+    texture._slot = ~0u;
+}
+
+void TextureStreamer::finish_load(VkCommandBuffer cmd, Texture &texture, uint64_t frameValue) {
+    bool hadImage = texture._image._image != VK_NULL_HANDLE;
+
+    if (texture._generateMips){
+        record_generate_mips(cmd, texture, texture._nextImage._image, 0);
+        _mipChainsGenerated++;
+        _levelsStreamed++;
+    } else if (hadImage){
+        record_copy(cmd, texture, texture._image._image, texture._residentLevel,
+                    texture._nextImage._image, texture._nextLevel, texture._nextLevel + 1);
+        _levelsStreamed++;
+    } else {
+        _levelsStreamed += texture._levelCount - texture._nextLevel;
+    }
+
+    retire(texture, frameValue);
+
+    texture._image = texture._nextImage;
+    texture._view = texture._nextView;
+    texture._residentLevel = texture._nextLevel;
+    texture._slot = _bindless->add_texture(texture._view, _sampler);
+    if (texture._slot == ~0u){
+        printf("TEXTURES: BINDLESS HEAP IS FULL, %s STAYS ON THE FALLBACK\n", texture._path.c_str());
+    }
+
+    texture._nextImage = {};
+    texture._nextView = VK_NULL_HANDLE;
+    texture._pending = false;
+}
+
+bool TextureStreamer::shrink(VkCommandBuffer cmd, Texture &texture, uint64_t frameValue) {
+    uint32_t level = texture._residentLevel + 1;
+
+    AllocatedImage image;
+    VkImageView view;
+    if (!create_image(texture, level, &image, &view)){
+        return false;
+    }
+    record_copy(cmd, texture, texture._image._image, texture._residentLevel, image._image, level, level);
+
+    retire(texture, frameValue);
+    texture._image = image;
+    texture._view = view;
+    texture._residentLevel = level;
+    texture._slot = _bindless->add_texture(view, _sampler);
+    _levelsEvicted++;
+    return true;
+}
+
+void TextureStreamer::update(VkCommandBuffer cmd, uint32_t frameIndex, uint64_t frameValue, uint64_t completed) {
+    _frame++;
+
+    if (_fallbackView != VK_NULL_HANDLE && !_fallbackReady){
+        VkImageMemoryBarrier toDst = image_barrier(_fallbackImage._image, VK_IMAGE_LAYOUT_UNDEFINED,
+                                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT, 0, 1);
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0, 0, nullptr, 0, nullptr, 1, &toDst);
+
+        VkClearColorValue white = {{1.0f, 1.0f, 1.0f, 1.0f}};
+        VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+        vkCmdClearColorImage(cmd, _fallbackImage._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &white, 1, &range);
+
+        VkImageMemoryBarrier toRead = image_barrier(_fallbackImage._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT,
+                                                    VK_ACCESS_SHADER_READ_BIT, 0, 1);
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             0, 0, nullptr, 0, nullptr, 1, &toRead);
+        _fallbackReady = true;
+    }
+
+    _retired.erase(std::remove_if(_retired.begin(), _retired.end(), [&](Retired &retired){
+        if (retired._retireValue > completed){
+            return false;
+        }
+        _residentBytes -= retired._image._allocation._size;
+        vkDestroyImageView(_device, retired._view, nullptr);
+        _allocator->destroy_image(retired._image);
+        return true;
+    }), _retired.end());
+
+    if (_textures.empty()){
+        return;
+    }
+
+    // Written by the last frame that used this index, which has finished. Its end_frame() barrier made the
+    // writes visible to the host, coherent memory means no invalidate on top of the timeline wait.
+    uint32_t *feedback = (uint32_t *)_feedback[frameIndex]._allocation._mapped;
+    for (size_t i = 0; i < _textures.size(); i++){
+        if (feedback[i] == ~0u){
+            continue;
+        }
+        _textures[i]._wantedLevel = std::min(feedback[i], _textures[i]._levelCount - 1);
+        _textures[i]._lastUsed = _frame;
+    }
+    memset(feedback, 0xFF, _textures.size() * sizeof(uint32_t));
+
+    uint32_t inFlight = 0;
+    for (Texture &texture : _textures){
+        if (texture._pending && _uploader->is_complete(texture._ticket)){
+            finish_load(cmd, texture, frameValue);
+        }
+        inFlight += texture._pending ? 1 : 0;
+    }
+
+    // Only what's above the always resident tails counts against the budget
+    auto streamed_bytes = [&](const Texture &texture, uint32_t level){
+        return level < texture._tailLevel ? image_bytes(texture, level) - image_bytes(texture, texture._tailLevel) : 0;
+    };
+    VkDeviceSize streamed = 0;
+    for (const Texture &texture : _textures){
+        uint32_t level = texture._pending ? std::min(texture._nextLevel, texture._residentLevel) : texture._residentLevel;
+        streamed += streamed_bytes(texture, std::min(level, texture._levelCount));
+    }
+
+    // Textures that have more than they were sampled at go first, then the ones unused the longest.
+    // Anything sampled as recently as the texture wanting the memory is left alone, so two textures
+    // can't keep taking levels off each other.
+    auto pick_victim = [&](size_t exclude, uint64_t usedBefore) -> size_t {
+        size_t victim = _textures.size();
+        for (size_t i = 0; i < _textures.size(); i++){
+            const Texture &texture = _textures[i];
+            if (i == exclude || texture._pending || texture._image._image == VK_NULL_HANDLE ||
+                texture._residentLevel >= texture._tailLevel){
+                continue;
+            }
+            bool overResolved = texture._residentLevel < texture._wantedLevel;
+            if (!overResolved && texture._lastUsed >= usedBefore){
+                continue;
+            }
+            if (victim == _textures.size()){
+                victim = i;
+                continue;
+            }
+            const Texture &best = _textures[victim];
+            bool bestOverResolved = best._residentLevel < best._wantedLevel;
+            if (overResolved != bestOverResolved ? overResolved : texture._lastUsed < best._lastUsed){
+                victim = i;
+            }
+        }
+        return victim;
+    };
+
+    auto evict = [&](size_t victim){
+        Texture &texture = _textures[victim];
+        VkDeviceSize saved = streamed_bytes(texture, texture._residentLevel) - streamed_bytes(texture, texture._residentLevel + 1);
+        if (!shrink(cmd, texture, frameValue)){
+            return false;
+        }
+        streamed -= saved;
+        return true;
+    };
+
+    // Over budget without anything growing, a generated chain arriving whole for instance
+    uint32_t evictions = 0;
+    while (streamed > _budget && evictions < _maxInFlight){
+        size_t victim = pick_victim(_textures.size(), _frame + 1);
+        if (victim == _textures.size() || !evict(victim)){
+            break;
+        }
+        evictions++;
+    }
+
+    // Most recently sampled first, coarsest first among those
+    std::vector<uint32_t> growing;
+    for (uint32_t i = 0; i < (uint32_t)_textures.size(); i++){
+        const Texture &texture = _textures[i];
+        if (!texture._pending && texture._image._image != VK_NULL_HANDLE && texture._wantedLevel < texture._residentLevel){
+            growing.push_back(i);
+        }
+    }
+    std::sort(growing.begin(), growing.end(), [&](uint32_t a, uint32_t b){
+        if (_textures[a]._lastUsed != _textures[b]._lastUsed){
+            return _textures[a]._lastUsed > _textures[b]._lastUsed;
+        }
+        return _textures[a]._residentLevel > _textures[b]._residentLevel;
+    });
+
+    for (uint32_t index : growing){
+        if (inFlight >= _maxInFlight){
+            break;
+        }
+        Texture &texture = _textures[index];
+        // Generated chains can only be made from level 0, so they come back whole
+        uint32_t level = texture._generateMips ? 0 : texture._residentLevel - 1;
+        VkDeviceSize cost = streamed_bytes(texture, level) - streamed_bytes(texture, texture._residentLevel);
+
+        bool fits = true;
+        while (streamed + cost > _budget){
+            size_t victim = pick_victim(index, texture._lastUsed);
+            if (victim == _textures.size() || !evict(victim)){
+                fits = false;
+                break;
+            }
+        }
+        // Everything left is at least as recently used, nothing further down the list would fit either
+        if (!fits){
+            break;
+        }
+
+        if (begin_load(texture, level)){
+            streamed += cost;
+            inFlight++;
+        }
+    }
+
+    uint32_t *table = (uint32_t *)_slotTables[frameIndex]._allocation._mapped;
+    for (size_t i = 0; i < _textures.size(); i++){
+        const Texture &texture = _textures[i];
+        bool resident = texture._image._image != VK_NULL_HANDLE && texture._slot != ~0u;
+        // ~0u tells the shader not to report anything for the fallback
+        table[i * 2] = resident ? texture._slot : _fallbackSlot;
+        table[i * 2 + 1] = resident ? texture._residentLevel : ~0u;
+    }
+}
+
+void TextureStreamer::end_frame(VkCommandBuffer cmd, uint32_t frameIndex) {
+    if (_textures.empty()){
+        return;
+    }
+
+    // Shader atomics only reach the host through a dependency on HOST_READ, same as the readback copy
+    VkBufferMemoryBarrier feedbackBarrier = {};
+    feedbackBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    feedbackBarrier.pNext = nullptr;
+    feedbackBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    feedbackBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    feedbackBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    feedbackBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    feedbackBarrier.buffer = _feedback[frameIndex]._buffer;
+    feedbackBarrier.offset = 0;
+    feedbackBarrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         0, nullptr, 1, &feedbackBarrier, 0, nullptr);
+}
+
+TexturePushConstants TextureStreamer::push_constants(uint32_t frameIndex) const {
+    TexturePushConstants constants = {};
+    constants.slotTable = _slotTableSlots[frameIndex];
+    constants.feedback = _feedbackSlots[frameIndex];
+    constants.textureCount = (uint32_t)_textures.size();
+    constants.pad = 0;
+    return constants;
+}
+
+uint32_t TextureStreamer::texture_count() const {
+    return (uint32_t)_textures.size();
+}
+
+TextureStats TextureStreamer::stats() const {
+    TextureStats stats;
+    stats._textures = (uint32_t)_textures.size();
+    for (const Texture &texture : _textures){
+        stats._resident += texture._image._image != VK_NULL_HANDLE ? 1 : 0;
+    }
+    stats._residentBytes = _residentBytes;
+    stats._budget = _budget;
+    stats._levelsStreamed = _levelsStreamed;
+    stats._levelsEvicted = _levelsEvicted;
+    stats._mipChainsGenerated = _mipChainsGenerated;
+    return stats;
+}
@@ -0,0 +1,198 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_TEXTURES_H
+#define VKENGINE_VK_TEXTURES_H
+
+#include "vk_types.h"
+#include "vk_allocator.h"
+#include "vk_descriptors.h"
+#include "vk_shaders.h"
+#include "vk_upload.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Where a KTX2 or DDS file keeps its mip levels. Only the headers are read, level data stays in the file.
+struct TextureFileInfo {
+    VkFormat _format {VK_FORMAT_UNDEFINED};
+    uint32_t _width {0};
+    uint32_t _height {0};
+
+    struct Level {
+        uint64_t _offset;
+        uint64_t _size;
+    };
+    // Finest first, just level 0 when the file has no mips
+    std::vector<Level> _levels;
+};
+
+namespace vktexture {
+    // Texels per block and bytes per block, false for formats that can't be streamed as they are
+    bool format_block_info(VkFormat format, uint32_t *blockWidth, uint32_t *blockHeight, uint32_t *blockBytes);
+
+    // Supercompressed KTX2 (Basis, zstd) is rejected, it would need decoding on the CPU
+    bool parse_ktx2(const void *data, size_t size, TextureFileInfo *out);
+
+    bool parse_dds(const void *data, size_t size, TextureFileInfo *out);
+
+    // Picks the parser by magic
+    bool parse_texture_file(const void *data, size_t size, TextureFileInfo *out);
+}
+
+// What the textured shaders get per draw, buffer indices are bindless slots
+struct TexturePushConstants {
+    // uvec2 per texture: bindless texture slot and the file level the bound image starts at
+    uint32_t slotTable;
+    // One uint per texture, the finest file level any sampled pixel wanted this frame
+    uint32_t feedback;
+    uint32_t textureCount;
+    uint32_t pad;
+};
+
+struct TextureStats {
+    uint32_t _textures {0};
+    uint32_t _resident {0};
+    VkDeviceSize _residentBytes {0};
+    VkDeviceSize _budget {0};
+    uint32_t _levelsStreamed {0};
+    uint32_t _levelsEvicted {0};
+    uint32_t _mipChainsGenerated {0};
+};
+
+// Streams textures in coarse to fine and keeps them under a memory budget. Every texture's image holds
+// a contiguous run of its levels down to the coarsest. The small tail is loaded up front and never leaves.
+// Shaders report the finest level they sampled per texture, a texture that wants more than it has gets
+// a new image one level bigger: the new level is uploaded straight from the mapped file, the rest copied
+// over on the GPU. Over budget, the least recently sampled textures are shrunk a level at a time.
+class TextureStreamer {
+public:
+    // Device memory the streamed levels may use, the tails always fit on top of it
+    VkDeviceSize _budget {256ull * 1024 * 1024};
+    // Levels at most this many texels on their longer side are the always resident tail
+    uint32_t _tailSize {64};
+    // Textures waiting on an upload at once
+    uint32_t _maxInFlight {4};
+    uint32_t _maxTextures {1024};
+
+    bool init(VkDevice device, VkPhysicalDevice physicalDevice, GpuAllocator &allocator, StreamingUploader &uploader,
+              BindlessHeap &bindless, uint32_t frameCount);
+
+    // Nothing may still be using the textures
+    void destroy();
+
+    // Index the shaders use, ~0u when the file can't be used. Only the tail is queued here.
+    uint32_t add(const char *path);
+
+    // Once per frame after the uploader's process_completed(), outside a render pass. The frame that
+    // last used frameIndex has to be done, frameValue is the timeline value this frame will signal.
+    void update(VkCommandBuffer cmd, uint32_t frameIndex, uint64_t frameValue, uint64_t completed);
+
+    // After the frame's textured draws, outside a render pass. Makes the shaders' feedback writes
+    // visible to the host, update() reads them once the frame's timeline value is reached.
+    void end_frame(VkCommandBuffer cmd, uint32_t frameIndex);
+
+    TexturePushConstants push_constants(uint32_t frameIndex) const;
+
+    uint32_t texture_count() const;
+
+    TextureStats stats() const;
+
+private:
+    struct Texture {
+        std::string _path;
+        std::shared_ptr<MappedFile> _file;
+        TextureFileInfo _info;
+        uint32_t _blockWidth;
+        uint32_t _blockHeight;
+        uint32_t _blockBytes;
+        // The whole chain, generated levels included
+        uint32_t _levelCount;
+        uint32_t _tailLevel;
+        // The file only has level 0 and the format can be blitted, the GPU makes the rest
+        bool _generateMips;
+
+        // Holds levels [_residentLevel, _levelCount), nothing until the tail has arrived
+        AllocatedImage _image;
+        VkImageView _view {VK_NULL_HANDLE};
+        uint32_t _slot {~0u};
+        uint32_t _residentLevel;
+
+        // Being filled by the uploader, becomes _image once _ticket completes
+        AllocatedImage _nextImage;
+        VkImageView _nextView {VK_NULL_HANDLE};
+        uint32_t _nextLevel;
+        UploadTicket _ticket {0};
+        bool _pending {false};
+
+        uint32_t _wantedLevel;
+        uint64_t _lastUsed {0};
+    };
+
+    struct Retired {
+        AllocatedImage _image;
+        VkImageView _view;
+        uint64_t _retireValue;
+    };
+
+    VkExtent3D level_extent(const Texture &texture, uint32_t level) const;
+
+    VkDeviceSize image_bytes(const Texture &texture, uint32_t firstLevel) const;
+
+    bool create_image(Texture &texture, uint32_t firstLevel, AllocatedImage *image, VkImageView *view);
+
+    // Queues file level into level imageLevel of image, the last ticket lands in texture._ticket
+    void upload_level(Texture &texture, VkImage image, uint32_t level, uint32_t imageLevel, bool blitSource);
+
+    // Starts loading levels [firstLevel, _levelCount) into a new image
+    bool begin_load(Texture &texture, uint32_t firstLevel);
+
+    // The pending image is complete, copy or generate what the uploads didn't cover and swap it in
+    void finish_load(VkCommandBuffer cmd, Texture &texture, uint64_t frameValue);
+
+    // Drops the finest resident level
+    bool shrink(VkCommandBuffer cmd, Texture &texture, uint64_t frameValue);
+
+    void retire(Texture &texture, uint64_t frameValue);
+
+    // Copies file levels [fromLevel, _levelCount) between two images of the same texture, src starting at
+    // file level srcFirst and dst at dstFirst. Leaves dst readable by shaders.
+    void record_copy(VkCommandBuffer cmd, const Texture &texture, VkImage src, uint32_t srcFirst,
+                     VkImage dst, uint32_t dstFirst, uint32_t fromLevel);
+
+    void record_generate_mips(VkCommandBuffer cmd, const Texture &texture, VkImage image, uint32_t firstLevel);
+
+    VkDevice _device {VK_NULL_HANDLE};
+    VkPhysicalDevice _physicalDevice {VK_NULL_HANDLE};
+    GpuAllocator *_allocator {nullptr};
+    StreamingUploader *_uploader {nullptr};
+    BindlessHeap *_bindless {nullptr};
+
+    VkSampler _sampler {VK_NULL_HANDLE};
+    // 1x1 white, bound for textures whose tail hasn't arrived
+    AllocatedImage _fallbackImage;
+    VkImageView _fallbackView {VK_NULL_HANDLE};
+    uint32_t _fallbackSlot {~0u};
+    bool _fallbackReady {false};
+
+    // Host visible, one of each per frame in flight, registered in the bindless heap
+    std::vector<AllocatedBuffer> _slotTables;
+    std::vector<AllocatedBuffer> _feedback;
+    std::vector<uint32_t> _slotTableSlots;
+    std::vector<uint32_t> _feedbackSlots;
+
+    std::vector<Texture> _textures;
+    std::vector<Retired> _retired;
+    uint64_t _frame {0};
+    // Images currently held for textures, pending ones included but not retired ones
+    VkDeviceSize _residentBytes {0};
+    VkDeviceSize _tailBytes {0};
+
+    uint32_t _levelsStreamed {0};
+    uint32_t _levelsEvicted {0};
+    uint32_t _mipChainsGenerated {0};
+};
+
+
+#endif //VKENGINE_VK_TEXTURES_H
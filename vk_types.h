@@ -7,4 +7,37 @@
 
 #include <vulkan/vulkan.h>
 
+#include <iostream>
+#include <cstdlib>
+
+#define VK_CHECK(x) \
+    do              \
+    {               \
+        VkResult err = x; \
+        if (err){   \
+            std::cout << "Detected Vulkan Error: " << err << std::endl; \
+            abort();\
+            }       \
+    }  while (0)
+
+// A range of a VkDeviceMemory block handed out by GpuAllocator
+struct Allocation {
+    VkDeviceMemory _memory {VK_NULL_HANDLE};
+    VkDeviceSize _offset {0};
+    VkDeviceSize _size {0};
+    // Already offset into the block for host visible memory, nullptr otherwise
+    void* _mapped {nullptr};
+    uint32_t _block {~0u};
+};
+
+struct AllocatedBuffer {
+    VkBuffer _buffer {VK_NULL_HANDLE};
+    Allocation _allocation;
+};
+
+struct AllocatedImage {
+    VkImage _image {VK_NULL_HANDLE};
+    Allocation _allocation;
+};
+
 #endif //VKENGINE_VK_TYPES_H
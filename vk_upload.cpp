@@ -0,0 +1,535 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#include "vk_upload.h"
+
+#include "vk_initalizers.h"
+
+#include <algorithm>
+#include <cstring>
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static double to_ms(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+bool StreamingUploader::init(VkDevice device, GpuAllocator &allocator, VkQueue uploadQueue, uint32_t uploadFamily,
+                             uint32_t graphicsFamily, std::mutex *queueMutex) {
+    _device = device;
+    _allocator = &allocator;
+    _queue = uploadQueue;
+    _uploadFamily = uploadFamily;
+    _graphicsFamily = graphicsFamily;
+    _queueMutex = queueMutex;
+    _separateQueue = uploadFamily != graphicsFamily;
+
+    if (_slotCount < 2) _slotCount = 2;
+    // Image chunks need 16 byte aligned offsets, keep every slot start aligned for them
+    _slotSize = align_up(_stagingSize / _slotCount, 256);
+
+    if (!allocator.create_buffer(_slotSize * _slotCount, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &_staging)){
+        return false;
+    }
+
+    VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(_uploadFamily, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+
+    _slots = std::vector<Slot>(_slotCount);
+    for (uint32_t i = 0; i < _slotCount; i++){
+        VK_CHECK(vkCreateCommandPool(_device, &poolInfo, nullptr, &_slots[i]._pool));
+
+        VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info(_slots[i]._pool, 1);
+        VK_CHECK(vkAllocateCommandBuffers(_device, &allocInfo, &_slots[i]._cmd));
+
+        _slots[i]._base = _slotSize * i;
+    }
+
+    VkSemaphoreTypeCreateInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timelineInfo.pNext = nullptr;
+    timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    timelineInfo.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &timelineInfo;
+    semaphoreInfo.flags = 0;
+    VK_CHECK(vkCreateSemaphore(_device, &semaphoreInfo, nullptr, &_timeline));
+
+    _stop = false;
+    _loader = std::thread(&StreamingUploader::loader_loop, this);
+    return true;
+}
+
+void StreamingUploader::destroy() {
+    if (_device == VK_NULL_HANDLE){
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_requestMutex);
+        _stop = true;
+    }
+    _requestReady.notify_one();
+    _loader.join();
+
+    // The loader submitted everything before exiting, wait for the GPU to catch up
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.pNext = nullptr;
+    waitInfo.flags = 0;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &_timeline;
+    waitInfo.pValues = &_lastSignaled;
+    VK_CHECK(vkWaitSemaphores(_device, &waitInfo, UINT64_MAX));
+
+    for (Slot &slot : _slots){
+        vkDestroyCommandPool(_device, slot._pool, nullptr);
+    }
+    _slots.clear();
+
+    vkDestroySemaphore(_device, _timeline, nullptr);
+    _allocator->destroy_buffer(_staging);
+    _device = VK_NULL_HANDLE;
+}
+
+UploadTicket StreamingUploader::upload_buffer(const BufferUpload &target, std::vector<uint8_t> data) {
+    Request request;
+    request._buffer = target;
+    request._data = std::move(data);
+    return enqueue(std::move(request));
+}
+
+UploadTicket StreamingUploader::upload_buffer(const BufferUpload &target, UploadSource source) {
+    Request request;
+    request._buffer = target;
+    request._source = std::move(source);
+    return enqueue(std::move(request));
+}
+
+UploadTicket StreamingUploader::upload_buffer(const BufferUpload &target, const void *data, VkDeviceSize size,
+                                              std::shared_ptr<const void> owner) {
+    Request request;
+    request._buffer = target;
+    request._external = (const uint8_t *)data;
+    request._externalSize = size;
+    request._owner = std::move(owner);
+    return enqueue(std::move(request));
+}
+
+UploadTicket StreamingUploader::upload_image(const ImageUpload &target, std::vector<uint8_t> data) {
+    Request request;
+    request._isImage = true;
+    request._image = target;
+    request._data = std::move(data);
+    return enqueue(std::move(request));
+}
+
+UploadTicket StreamingUploader::upload_image(const ImageUpload &target, const void *data, VkDeviceSize size,
+                                             std::shared_ptr<const void> owner) {
+    Request request;
+    request._isImage = true;
+    request._image = target;
+    request._external = (const uint8_t *)data;
+    request._externalSize = size;
+    request._owner = std::move(owner);
+    return enqueue(std::move(request));
+}
+
+UploadTicket StreamingUploader::upload_image(const ImageUpload &target, UploadSource source) {
+    Request request;
+    request._isImage = true;
+    request._image = target;
+    request._source = std::move(source);
+    return enqueue(std::move(request));
+}
+
+UploadTicket StreamingUploader::enqueue(Request request) {
+    request._requested = Clock::now();
+
+    UploadTicket ticket;
+    {
+        std::lock_guard<std::mutex> lock(_requestMutex);
+        ticket = _nextTicket++;
+        request._ticket = ticket;
+
+        // Going from idle to busy, start counting towards the throughput
+        {
+            std::lock_guard<std::mutex> completedLock(_completedMutex);
+            if (_completedTicket == _issuedTicket){
+                _busyStart = request._requested;
+            }
+            _issuedTicket = ticket;
+        }
+
+        _requests.push_back(std::move(request));
+    }
+    _requestReady.notify_one();
+    return ticket;
+}
+
+bool StreamingUploader::is_complete(UploadTicket ticket) const {
+    return ticket <= _completedTicket;
+}
+
+void StreamingUploader::loader_loop() {
+    while (true){
+        Request request;
+        {
+            std::unique_lock<std::mutex> lock(_requestMutex);
+            if (_requests.empty() && _slots[_currentSlot]._recording){
+                // Nothing left to batch with, don't hold back what's already recorded
+                lock.unlock();
+                submit_slot();
+                continue;
+            }
+
+            _requestReady.wait(lock, [this]{ return _stop || !_requests.empty(); });
+            if (_requests.empty()){
+                return;
+            }
+
+            request = std::move(_requests.front());
+            _requests.pop_front();
+        }
+
+        if (request._source && !request._source(request._data)){
+            printf("UPLOAD %llu: SOURCE FAILED, CONTENTS UNDEFINED\n", (unsigned long long)request._ticket);
+        }
+
+        if (request._isImage){
+            record_image(request);
+        } else {
+            record_buffer(request);
+        }
+    }
+}
+
+void StreamingUploader::begin_slot() {
+    Slot &slot = _slots[_currentSlot];
+    if (slot._recording){
+        return;
+    }
+
+    // The staging memory and command buffer may still be in use by this slot's last submit
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.pNext = nullptr;
+    waitInfo.flags = 0;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &_timeline;
+    waitInfo.pValues = &slot._timelineValue;
+    VK_CHECK(vkWaitSemaphores(_device, &waitInfo, UINT64_MAX));
+
+    VK_CHECK(vkResetCommandPool(_device, slot._pool, 0));
+
+    VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    VK_CHECK(vkBeginCommandBuffer(slot._cmd, &beginInfo));
+
+    slot._used = 0;
+    slot._recording = true;
+}
+
+void StreamingUploader::submit_slot() {
+    Slot &slot = _slots[_currentSlot];
+    VK_CHECK(vkEndCommandBuffer(slot._cmd));
+
+    uint64_t signalValue = ++_lastSignaled;
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.pNext = nullptr;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &signalValue;
+
+    VkSubmitInfo submit = {};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.pNext = &timelineInfo;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &slot._cmd;
+    submit.signalSemaphoreCount = 1;
+    submit.pSignalSemaphores = &_timeline;
+
+    {
+        std::unique_lock<std::mutex> queueLock;
+        if (_queueMutex){
+            queueLock = std::unique_lock<std::mutex>(*_queueMutex);
+        }
+        VK_CHECK(vkQueueSubmit(_queue, 1, &submit, VK_NULL_HANDLE));
+    }
+
+    slot._timelineValue = signalValue;
+    slot._recording = false;
+
+    {
+        std::lock_guard<std::mutex> lock(_completedMutex);
+        _submitted.push_back({signalValue, Clock::now(), std::move(slot._completions)});
+    }
+    slot._completions.clear();
+
+    _currentSlot = (_currentSlot + 1) % _slotCount;
+}
+
+VkDeviceSize StreamingUploader::reserve(VkDeviceSize size, VkDeviceSize minSize, VkDeviceSize alignment, VkDeviceSize *stagingOffset) {
+    begin_slot();
+
+    VkDeviceSize offset = align_up(_slots[_currentSlot]._used, alignment);
+    if (offset + minSize > _slotSize){
+        submit_slot();
+        begin_slot();
+        offset = 0;
+    }
+
+    Slot &slot = _slots[_currentSlot];
+    VkDeviceSize reserved = std::min(size, _slotSize - offset);
+    slot._used = offset + reserved;
+    *stagingOffset = slot._base + offset;
+    return reserved;
+}
+
+void StreamingUploader::record_buffer(Request &request) {
+    const uint8_t *bytes = request._external ? request._external : request._data.data();
+    const VkDeviceSize total = request._external ? request._externalSize : request._data.size();
+
+    VkDeviceSize done = 0;
+    while (done < total){
+        VkDeviceSize stagingOffset;
+        VkDeviceSize size = reserve(total - done, std::min<VkDeviceSize>(total - done, 4), 4, &stagingOffset);
+
+        memcpy((char *)_staging._allocation._mapped + stagingOffset, bytes + done, size);
+
+        VkBufferCopy copy = {};
+        copy.srcOffset = stagingOffset;
+        copy.dstOffset = request._buffer._offset + done;
+        copy.size = size;
+        vkCmdCopyBuffer(_slots[_currentSlot]._cmd, _staging._buffer, request._buffer._buffer, 1, &copy);
+
+        done += size;
+    }
+
+    // Empty uploads still need a slot to attach their completion to
+    if (total == 0){
+        begin_slot();
+    }
+
+    // Everything's in staging, the source can go
+    request._owner.reset();
+    request._external = nullptr;
+
+    finish_request(request, total);
+}
+
+void StreamingUploader::record_image(Request &request) {
+    const ImageUpload &target = request._image;
+    const uint32_t rowCount = (target._extent.height + target._rowTexels - 1) / target._rowTexels;
+    const uint8_t *bytes = request._external ? request._external : request._data.data();
+    const VkDeviceSize total = request._external ? request._externalSize : request._data.size();
+
+    if ((VkDeviceSize)target._rowBytes > _slotSize || total < (VkDeviceSize)rowCount * target._rowBytes){
+        printf("UPLOAD %llu: IMAGE DOES NOT FIT THE STAGING SLOTS OR DATA IS SHORT, SKIPPED\n", (unsigned long long)request._ticket);
+        begin_slot();
+        finish_request(request, 0);
+        return;
+    }
+
+    VkImageSubresourceRange range = {};
+    range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    range.baseMipLevel = target._mipLevel;
+    range.levelCount = 1;
+    range.baseArrayLayer = target._arrayLayer;
+    range.layerCount = 1;
+
+    uint32_t row = 0;
+    while (row < rowCount){
+        VkDeviceSize stagingOffset;
+        VkDeviceSize size = reserve((VkDeviceSize)(rowCount - row) * target._rowBytes, target._rowBytes, 16, &stagingOffset);
+        uint32_t rows = (uint32_t)(size / target._rowBytes);
+
+        VkCommandBuffer cmd = _slots[_currentSlot]._cmd;
+
+        // Old contents are thrown away, and the first copy has to wait for the layout change
+        if (row == 0){
+            VkImageMemoryBarrier toTransfer = {};
+            toTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            toTransfer.pNext = nullptr;
+            toTransfer.srcAccessMask = 0;
+            toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            toTransfer.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            toTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            toTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            toTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            toTransfer.image = target._image;
+            toTransfer.subresourceRange = range;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                                 0, nullptr, 0, nullptr, 1, &toTransfer);
+        }
+
+        memcpy((char *)_staging._allocation._mapped + stagingOffset,
+               bytes + (size_t)row * target._rowBytes, (size_t)rows * target._rowBytes);
+
+        uint32_t firstTexelRow = row * target._rowTexels;
+        uint32_t texelRows = std::min(rows * target._rowTexels, target._extent.height - firstTexelRow);
+
+        VkBufferImageCopy copy = {};
+        copy.bufferOffset = stagingOffset;
+        copy.bufferRowLength = 0;
+        copy.bufferImageHeight = 0;
+        copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        copy.imageSubresource.mipLevel = target._mipLevel;
+        copy.imageSubresource.baseArrayLayer = target._arrayLayer;
+        copy.imageSubresource.layerCount = 1;
+        copy.imageOffset = {0, (int32_t)firstTexelRow, 0};
+        copy.imageExtent = {target._extent.width, texelRows, 1};
+        vkCmdCopyBufferToImage(cmd, _staging._buffer, target._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+
+        row += rows;
+    }
+
+    request._owner.reset();
+    request._external = nullptr;
+
+    finish_request(request, (VkDeviceSize)rowCount * target._rowBytes);
+}
+
+void StreamingUploader::finish_request(const Request &request, VkDeviceSize bytes) {
+    Slot &slot = _slots[_currentSlot];
+
+    Completion completion = {};
+    completion._ticket = request._ticket;
+    completion._requested = request._requested;
+    completion._bytes = bytes;
+    completion._isImage = request._isImage;
+    completion._dstStage = request._isImage ? request._image._dstStage : request._buffer._dstStage;
+
+    // With separate families this is the release half of an ownership transfer, the graphics queue
+    // records the identical barrier as the acquire. On a shared queue it's an ordinary barrier.
+    uint32_t srcFamily = _separateQueue ? _uploadFamily : VK_QUEUE_FAMILY_IGNORED;
+    uint32_t dstFamily = _separateQueue ? _graphicsFamily : VK_QUEUE_FAMILY_IGNORED;
+    VkPipelineStageFlags dstStage = _separateQueue ? (VkPipelineStageFlags)VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : completion._dstStage;
+
+    if (request._isImage){
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.pNext = nullptr;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = _separateQueue ? 0 : request._image._dstAccess;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = request._image._finalLayout;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        barrier.image = request._image._image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = request._image._mipLevel;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.baseArrayLayer = request._image._arrayLayer;
+        barrier.subresourceRange.layerCount = 1;
+
+        vkCmdPipelineBarrier(slot._cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        completion._imageAcquire = barrier;
+        completion._imageAcquire.srcAccessMask = 0;
+        completion._imageAcquire.dstAccessMask = request._image._dstAccess;
+    } else {
+        VkBufferMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.pNext = nullptr;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = _separateQueue ? 0 : request._buffer._dstAccess;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        barrier.buffer = request._buffer._buffer;
+        barrier.offset = request._buffer._offset;
+        barrier.size = std::max<VkDeviceSize>(bytes, 1);
+
+        if (bytes != 0){
+            vkCmdPipelineBarrier(slot._cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+        }
+
+        completion._bufferAcquire = barrier;
+        completion._bufferAcquire.srcAccessMask = 0;
+        completion._bufferAcquire.dstAccessMask = request._buffer._dstAccess;
+    }
+
+    slot._completions.push_back(completion);
+}
+
+void StreamingUploader::process_completed(VkCommandBuffer cmd) {
+    uint64_t reached;
+    VK_CHECK(vkGetSemaphoreCounterValue(_device, _timeline, &reached));
+
+    std::vector<VkBufferMemoryBarrier> bufferAcquires;
+    std::vector<VkImageMemoryBarrier> imageAcquires;
+    VkPipelineStageFlags dstStages = 0;
+
+    Clock::time_point now = Clock::now();
+
+    std::lock_guard<std::mutex> lock(_completedMutex);
+    while (!_submitted.empty() && _submitted.front()._timelineValue <= reached){
+        Submitted &submitted = _submitted.front();
+
+        _queueTotalMs += to_ms(now - submitted._submitted);
+        _queueSamples++;
+
+        for (const Completion &completion : submitted._completions){
+            if (_separateQueue){
+                if (completion._isImage){
+                    imageAcquires.push_back(completion._imageAcquire);
+                } else if (completion._bytes != 0){
+                    bufferAcquires.push_back(completion._bufferAcquire);
+                }
+                dstStages |= completion._dstStage;
+            }
+
+            double latency = to_ms(now - completion._requested);
+            _latencyTotalMs += latency;
+            _latencyMaxMs = std::max(_latencyMaxMs, latency);
+            _bytesUploaded += completion._bytes;
+            _uploadsCompleted++;
+            _completedTicket = completion._ticket;
+        }
+
+        _submitted.pop_front();
+
+        // Caught up, the uploader is idle until the next request
+        if (_completedTicket == _issuedTicket){
+            _busySeconds += std::chrono::duration<double>(now - _busyStart).count();
+        }
+    }
+
+    // The CPU has seen the releases finish, so no semaphore wait is needed before these acquires
+    if (!bufferAcquires.empty() || !imageAcquires.empty()){
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStages, 0, 0, nullptr,
+                             (uint32_t)bufferAcquires.size(), bufferAcquires.data(),
+                             (uint32_t)imageAcquires.size(), imageAcquires.data());
+    }
+}
+
+UploadStats StreamingUploader::stats() const {
+    UploadStats stats;
+
+    std::lock_guard<std::mutex> lock(_completedMutex);
+    stats._bytesUploaded = _bytesUploaded;
+    stats._uploadsCompleted = _uploadsCompleted;
+    stats._uploadsPending = (uint32_t)(_issuedTicket - _completedTicket);
+
+    if (_uploadsCompleted != 0){
+        stats._meanLatencyMs = _latencyTotalMs / _uploadsCompleted;
+        stats._maxLatencyMs = _latencyMaxMs;
+    }
+    if (_queueSamples != 0){
+        stats._meanQueueMs = _queueTotalMs / _queueSamples;
+    }
+
+    double busySeconds = _busySeconds;
+    if (stats._uploadsPending != 0){
+        busySeconds += std::chrono::duration<double>(Clock::now() - _busyStart).count();
+    }
+    if (busySeconds > 0.0){
+        stats._bytesPerSecond = (double)_bytesUploaded / busySeconds;
+    }
+    return stats;
+}
@@ -0,0 +1,209 @@
+//
+// Created by simon on 4/10/23.
+//
+
+#ifndef VKENGINE_VK_UPLOAD_H
+#define VKENGINE_VK_UPLOAD_H
+
+#include "vk_types.h"
+#include "vk_allocator.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Increases with every upload, 0 never refers to one so it's always complete
+using UploadTicket = uint64_t;
+
+// Produces the bytes to upload, runs on the loader thread so it can read files or decode
+using UploadSource = std::function<bool(std::vector<uint8_t> &data)>;
+
+struct BufferUpload {
+    VkBuffer _buffer;
+    VkDeviceSize _offset {0};
+    // Where the graphics queue will first use the data
+    VkPipelineStageFlags _dstStage;
+    VkAccessFlags _dstAccess;
+};
+
+// One mip level of a 2D image. Data is tightly packed rows of blocks, _rowBytes per block row and
+// _rowTexels texel rows per block row (1 for plain formats, 4 for BC), so big images can be split
+// across staging slots on row boundaries.
+struct ImageUpload {
+    VkImage _image;
+    VkExtent3D _extent;
+    uint32_t _mipLevel {0};
+    uint32_t _arrayLayer {0};
+    uint32_t _rowBytes;
+    uint32_t _rowTexels {1};
+    VkImageLayout _finalLayout {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+    VkPipelineStageFlags _dstStage;
+    VkAccessFlags _dstAccess;
+};
+
+struct UploadStats {
+    uint64_t _bytesUploaded {0};
+    uint32_t _uploadsCompleted {0};
+    uint32_t _uploadsPending {0};
+    // Over the time the uploader actually had work queued
+    double _bytesPerSecond {0.0};
+    // Request to resident, includes waiting behind other uploads and loading the source
+    double _meanLatencyMs {0.0};
+    double _maxLatencyMs {0.0};
+    // Submit on the upload queue to completion seen by process_completed()
+    double _meanQueueMs {0.0};
+};
+
+// Streams data into device local resources from a background thread. Requests are copied into a
+// staging buffer split into slots, each slot is recorded and submitted on the upload queue in turn
+// and signals a timeline semaphore, so a slot is only refilled once the GPU is done reading it.
+class StreamingUploader {
+public:
+    VkDeviceSize _stagingSize {64ull * 1024 * 1024};
+    uint32_t _slotCount {4};
+
+    // True when uploads go through a queue other than the graphics queue
+    bool _separateQueue {false};
+
+    // queueMutex must be locked by anyone else submitting to uploadQueue, nullptr when the queue is ours alone
+    bool init(VkDevice device, GpuAllocator &allocator, VkQueue uploadQueue, uint32_t uploadFamily,
+              uint32_t graphicsFamily, std::mutex *queueMutex);
+
+    // Finishes every queued upload first
+    void destroy();
+
+    UploadTicket upload_buffer(const BufferUpload &target, std::vector<uint8_t> data);
+    UploadTicket upload_buffer(const BufferUpload &target, UploadSource source);
+    // Copies straight from data into staging, no intermediate vector. owner keeps data alive (a mapped
+    // file, say) and is let go on the loader thread as soon as the bytes are in staging.
+    UploadTicket upload_buffer(const BufferUpload &target, const void *data, VkDeviceSize size,
+                               std::shared_ptr<const void> owner);
+
+    // The image must have been created with TRANSFER_DST usage, its previous contents are discarded
+    UploadTicket upload_image(const ImageUpload &target, std::vector<uint8_t> data);
+    UploadTicket upload_image(const ImageUpload &target, UploadSource source);
+    // Straight from data into staging like the buffer overload, owner is let go once it's copied
+    UploadTicket upload_image(const ImageUpload &target, const void *data, VkDeviceSize size,
+                              std::shared_ptr<const void> owner);
+
+    // Call every frame with a graphics command buffer outside a render pass. Records the queue family
+    // acquire for every upload that has finished on the upload queue and marks them complete.
+    void process_completed(VkCommandBuffer cmd);
+
+    // True once process_completed() has picked the upload up, usable by anything recorded after that call
+    bool is_complete(UploadTicket ticket) const;
+
+    UploadStats stats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Request {
+        bool _isImage {false};
+        BufferUpload _buffer;
+        ImageUpload _image;
+        std::vector<uint8_t> _data;
+        UploadSource _source;
+        // Used instead of _data when set
+        const uint8_t *_external {nullptr};
+        VkDeviceSize _externalSize {0};
+        std::shared_ptr<const void> _owner;
+        UploadTicket _ticket {0};
+        Clock::time_point _requested;
+    };
+
+    // What process_completed() needs once the slot carrying a request's last bytes is done
+    struct Completion {
+        UploadTicket _ticket;
+        Clock::time_point _requested;
+        VkDeviceSize _bytes;
+        bool _isImage;
+        VkBufferMemoryBarrier _bufferAcquire;
+        VkImageMemoryBarrier _imageAcquire;
+        VkPipelineStageFlags _dstStage;
+    };
+
+    struct Slot {
+        VkCommandPool _pool {VK_NULL_HANDLE};
+        VkCommandBuffer _cmd {VK_NULL_HANDLE};
+        VkDeviceSize _base {0};
+        VkDeviceSize _used {0};
+        // Timeline value of the slot's last submit, it can be reused once the semaphore gets there
+        uint64_t _timelineValue {0};
+        bool _recording {false};
+        std::vector<Completion> _completions;
+    };
+
+    struct Submitted {
+        uint64_t _timelineValue;
+        Clock::time_point _submitted;
+        std::vector<Completion> _completions;
+    };
+
+    UploadTicket enqueue(Request request);
+
+    void loader_loop();
+
+    void record_buffer(Request &request);
+
+    void record_image(Request &request);
+
+    // Staging space for up to size bytes in the current slot, starting a fresh slot when this one is full.
+    // Returns how much was reserved, always at least minSize.
+    VkDeviceSize reserve(VkDeviceSize size, VkDeviceSize minSize, VkDeviceSize alignment, VkDeviceSize *stagingOffset);
+
+    void begin_slot();
+
+    void submit_slot();
+
+    // Release barrier (or, on a shared queue, the final barrier) plus the matching acquire for later
+    void finish_request(const Request &request, VkDeviceSize bytes);
+
+    VkDevice _device {VK_NULL_HANDLE};
+    GpuAllocator *_allocator {nullptr};
+    VkQueue _queue {VK_NULL_HANDLE};
+    uint32_t _uploadFamily {0};
+    uint32_t _graphicsFamily {0};
+    std::mutex *_queueMutex {nullptr};
+
+    AllocatedBuffer _staging;
+    VkDeviceSize _slotSize {0};
+    std::vector<Slot> _slots;
+    uint32_t _currentSlot {0};
+
+    VkSemaphore _timeline {VK_NULL_HANDLE};
+    // Only touched by the loader thread
+    uint64_t _lastSignaled {0};
+
+    std::thread _loader;
+    std::mutex _requestMutex;
+    std::condition_variable _requestReady;
+    std::deque<Request> _requests;
+    UploadTicket _nextTicket {1};
+    bool _stop {false};
+
+    mutable std::mutex _completedMutex;
+    std::deque<Submitted> _submitted;
+    std::atomic<UploadTicket> _completedTicket {0};
+    // Last ticket handed out, written under _completedMutex so idle/busy changes are seen consistently
+    std::atomic<UploadTicket> _issuedTicket {0};
+
+    // Stats, guarded by _completedMutex
+    uint64_t _bytesUploaded {0};
+    uint32_t _uploadsCompleted {0};
+    double _latencyTotalMs {0.0};
+    double _latencyMaxMs {0.0};
+    double _queueTotalMs {0.0};
+    uint32_t _queueSamples {0};
+    double _busySeconds {0.0};
+    Clock::time_point _busyStart;
+};
+
+
+#endif //VKENGINE_VK_UPLOAD_H